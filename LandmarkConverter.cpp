@@ -26,12 +26,95 @@
  *  -in_type  The type of input file from which landmarks will be read:
  *               ix_pp - Point pair file of landmarks match with Image eXplorer
  *                ireg - Registration landmarks from Caliper registration code.
+ *              lmk_db - Landmark catalog queried with -query (requires
+ *                       compiling with -DLMK_USE_SQLITE -lsqlite3)
+ *             lmk_shm - Landmarks published in shared memory with -shm_name
+ *             tfx_lmk - Transformix parameter file written by this program
+ *             slr_fid - 3D Slicer fiducial file, paired with its
+ *                       _fixed_slicer/_moving_slicer counterpart
  *  -out_dir  The path of the directory where the output file will be written
  *  -out_type The type of output file to be generated, options include:
  *               tfx_lmk  - Transformix landmark-based transform input file
  *               slr_fid  - 3D Slicer fiducial file
  *               std_txt  - Standard plain text file
+ *               vtk_vtp  - Binary VTK PolyData point cloud for large
+ *                          landmark sets
+ *               img_mhd  - Moving image resampled onto the fixed grid by
+ *                          the landmark spline (MetaImage)
  *  -keep_all Whether to keep (1) or discard (0) points marked as 'very unsure'
+ *
+ *  Optional parameters:
+ *  -in_list   A manifest listing one input file per line, converted as a
+ *             batch in place of -in_file
+ *  -threads   Number of files of a batch converted concurrently
+ *  -cache_dir Directory of a persistent conversion cache. Inputs whose
+ *             contents, MetaHeader and options are unchanged are skipped,
+ *             and deleted outputs are restored from the cache.
+ *  -journal   Append-only journal of completed conversions. A restarted
+ *             batch skips the inputs it records and re-runs all others,
+ *             including those which were in flight when it stopped.
+ *  -cohort_file Columnar file collecting the landmarks of every converted
+ *             case, one row group per case
+ *  -cohort_storage Storage of the cohort file's coordinates: float64
+ *             (default), float32, fixed (int32 multiples of
+ *             -cohort_resolution), voxel16 or voxel32 (voxel indices and
+ *             the geometry of each case)
+ *  -cohort_resolution Resolution in mm of fixed storage (default 0.001)
+ *  -catalog   SQLite landmark catalog into which every converted case is
+ *             loaded, indexed by attributes and by an R*-tree on position
+ *  -query     For input of type 'lmk_db', an SQL condition selecting the
+ *             landmarks to write
+ *  -near      For input of type 'lmk_db', "x,y,z,r": only landmarks whose
+ *             fixed position lies within r mm of (x,y,z)
+ *  -shm_name  Name of a POSIX shared-memory segment into which converted
+ *             landmarks are published; "{case}" is replaced by the name
+ *             of the input file
+ *  -vtp_zlib  For output of type vtk_vtp, whether to zlib compress (1) the
+ *             arrays or not (0, default); requires compiling with
+ *             -DLMK_USE_ZLIB -lz
+ *  -vtp_intensity For output of type vtk_vtp, whether to sample (1) the
+ *             fixed and moving images at their landmarks or not (0, default)
+ *  -write_threads Number of threads formatting the landmarks of a
+ *             Transformix or Slicer output file, or resampling an image
+ *             (default 1), at most the cores per -threads thread
+ *  -resample_mode For output of type img_mhd: warp (default), the warped
+ *             moving image; checker, a checkerboard of it and the fixed
+ *             image; or diff, it minus the fixed image
+ *  -crop_margin Crop the fixed and moving images to the bounding box of
+ *             the landmarks, padded by this many voxels, and write the
+ *             landmarks in the frame of the cropped images
+ *  -ref_image For input of type 'slr_fid', an image header (MetaImage,
+ *             NRRD or NIfTI) supplying the geometry of the landmarks
+ *  -remap_rules File of Windows path prefixes and the Linux directories
+ *             replacing them in MetaHeader paths, one "prefix => directory"
+ *             per line. Defaults to Z: => /rdo/home/cguy and
+ *             X: => /rdo/home/cguy/ix
+ *  -log_level Progress reported as JSON lines: quiet, error, warn, info
+ *             (default) or debug
+ *  -isa       Instruction set of the vector kernels: auto (default, the
+ *             best the CPU supports), scalar, sse2, avx2 or avx512.
+ *             Levels the CPU lacks are refused
+ *  -io_threads Number of threads writing the formatted output files
+ *             (default 1). With 0 each conversion writes its own files
+ *  -io_queue_mb Megabytes of formatted output which may wait to be
+ *             written before conversions wait for the disk (default 64)
+ *  -io_backend How input files are read and output files written:
+ *             threads (default), by synchronous calls, or uring, in
+ *             batches submitted to io_uring (requires compiling with
+ *             -DLMK_USE_URING)
+ *  -processes Number of worker processes converting the files, each
+ *             with the given -threads, claiming them from a shared
+ *             segment (default 0, converting in this process). A file
+ *             whose worker crashed is converted again once. The
+ *             coordinator starts each worker with -shard_segment and
+ *             -shard_worker, naming the segment and its slot. Workers
+ *             write their own outputs, without output threads
+ *
+ *  Alternatively the program is called with a single parameter:
+ *  -pipeline  A JSON file declaring the stages of a QA pipeline (convert,
+ *             filter, crop, fit, chain, residuals, write). Independent
+ *             stages run concurrently and intermediate results are
+ *             cached by content. -log_level and -isa may follow it.
  *  The files are then read, storing necessary data to be included in the
  *  output file for Transformix. The output file is then written to the
  *  directory specified.
@@ -42,18 +125,309 @@
  */
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <queue>
+#include <map>
+#include <list>
 #include <string>
 #include <sstream>
 #include <algorithm>
 #include <iterator>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <cctype>
+#include <cerrno>
+
+// Vector kernels are compiled for each instruction set and chosen at
+// startup, so x86 builds need no -m flags to use them. Products and sums
+// are rounded separately, as in the scalar code, even where the
+// instruction set has fused multiply-add.
+#if defined(__x86_64__) || defined(__i386__)
+#define LMK_X86
+#define LMK_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#include <immintrin.h>
+#endif
+
+#ifdef LMK_USE_SQLITE
+#include <sqlite3.h>
+#endif
+
+#ifdef LMK_USE_ZLIB
+#include <zlib.h>
+#endif
+
+// The io_uring backend is used through its system calls, so it needs the
+// kernel headers but no library.
+#ifdef LMK_USE_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+// The kernel headers' block size would hide the constants of that name.
+#undef BLOCK_SIZE
+#endif
 
 using namespace std;
 
+// Levels of log messages. Messages above the current level are dropped
+// before their text is built.
+enum LogLevel
+{
+    LOG_QUIET,
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+// Log message waiting to be written by the logging thread.
+struct LogRecord
+{
+    int level;
+    double time;          // Seconds since the epoch
+    double durationMs;    // Negative when the message has no duration
+    const char *phase;
+    string file;
+    string message;
+};
+
+// Buffer of one thread's log messages. Only the owning thread adds
+// messages and only the logging thread removes them, so neither locks.
+struct LogRing
+{
+    static const size_t CAPACITY = 1024;
+    LogRecord records[CAPACITY];
+    atomic<size_t> head;  // Next record to be added
+    atomic<size_t> tail;  // Next record to be written
+    int threadNumber;
+};
+
+// Current log level, checked before any message text is built.
+atomic<int> logLevel(LOG_INFO);
+
+// Instruction sets of the vector kernels, in increasing order.
+enum IsaLevel
+{
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512,         // AVX-512 F and BW
+    NUM_ISA_LEVELS
+};
+
+// Instruction set used by the vector kernels, set once at startup
+// before any thread reads it.
+int isaLevel = ISA_SCALAR;
+
+// Logs a message built with << when its level is enabled.
+#define LOG_MESSAGE(level, phase, file, message)                            \
+    do                                                                      \
+    {                                                                       \
+        if ((level) <= logLevel.load(memory_order_relaxed))                 \
+        {                                                                   \
+            ostringstream logText;                                          \
+            logText << message;                                             \
+            logWrite((level), (phase), (file), logText.str(), -1.0);        \
+        }                                                                   \
+    } while (0)
+
+void logWrite(int, const char *, const string &, const string &, double);
+
+// Logs the duration of a phase when it goes out of scope.
+struct LogTimer
+{
+    const char *phase;
+    string file;
+    bool enabled;
+    chrono::steady_clock::time_point start;
+    
+    LogTimer(const char *timedPhase, const string &timedFile)
+        : phase(timedPhase), enabled(LOG_INFO <= logLevel.load(memory_order_relaxed))
+    {
+        if (enabled)
+        {
+            file = timedFile;
+            start = chrono::steady_clock::now();
+        }
+    }
+    
+    ~LogTimer()
+    {
+        if (enabled)
+        {
+            chrono::duration<double, milli> duration =
+                                          chrono::steady_clock::now() - start;
+            logWrite(LOG_INFO, phase, file, "Complete", duration.count());
+        }
+    }
+};
+
+// Starts the logging thread for the life of main and stops it after.
+struct LogSession
+{
+    LogSession(int level);
+    ~LogSession();
+};
+
+// Trie of Windows path prefixes mapped to Linux directories. Prefixes
+// are matched ignoring case and the kind of slash.
+struct PathRemapper
+{
+    static const int FANOUT = 256;
+    vector<int> children;                    // FANOUT per node, 0 if none
+    vector<int> nodeRules;                   // Rule ending at each node or -1
+    vector<string> prefixes;
+    vector<string> targets;
+    unique_ptr<atomic<unsigned long long>[]> hits;  // Paths rewritten per rule
+    string pathRules;                        // Empty for the default rules
+};
+
+// Rules shared by all conversions, compiled before any is started.
+PathRemapper pathRemapper;
+
+// Geometry of an image volume, in LPS physical coordinates.
+struct ImageGeometry
+{
+    int numDims;
+    int dimSizes[3];
+    double offsets[3];
+    double spacings[3];
+    double directions[9];   // Row-major; columns are the voxel axes
+    string imgDims;         // Dimensions as written in the header
+    
+    // Layout of the voxel data, given by MetaImage headers.
+    string elementType;
+    string pathData;
+    bool compressed;
+    bool byteOrderMsb;
+    long long dataOffset;   // Negative if the data ends the file
+    
+    // Header file state the geometry was read from.
+    long long fileSize;
+    long long modifiedTime;
+};
+
+// Reader of the geometry of one image header format. A reader is chosen
+// by the extension of the path or, failing that, its magic bytes.
+struct GeometryReader
+{
+    const char *name;
+    const char *extensions[3];
+    bool (*matchesMagic)(const unsigned char *, size_t);
+    bool (*read)(string, ImageGeometry &);
+};
+
+// Geometries read so far, by header path.
+struct GeometryCache
+{
+    mutex lock;
+    map<string, ImageGeometry> entries;
+};
+
+GeometryCache geometryCache;
+
+// Slab of decoded voxels, shared with its readers while it is cached.
+typedef shared_ptr<const vector<char> > VolumeSlab;
+
+// Voxel data of a MetaImage volume, read one slab of slices at a time.
+// Compressed data is inflated from the checkpoint nearest to a slab, and
+// decoded slabs are kept in a least-recently-used cache of bounded size.
+struct ImageVolume
+{
+    ImageGeometry geometry;
+    int elementType;          // Index into VOLUME_ELEMENT_TYPES
+    int elementSize;
+    bool swapBytes;
+    size_t sliceBytes;
+    int slabSlices;           // Slices per slab
+    int numSlabs;
+    size_t maxSlabs;          // Slabs kept in the cache
+    
+    int fd;
+    const unsigned char *mapping;   // Compressed data file
+    size_t mappedSize;
+    
+    mutex lock;
+#ifdef LMK_USE_ZLIB
+    vector<z_stream *> checkpoints;  // Inflate state at each slab, if reached
+#endif
+    list<int> recentSlabs;           // Cached slabs, most recent first
+    map<int, pair<VolumeSlab, list<int>::iterator> > slabs;
+};
+
+// Images written by resampling the moving image onto the fixed grid.
+enum ResampleMode
+{
+    RESAMPLE_WARP,      // Moving image warped by the landmark spline
+    RESAMPLE_CHECKER,   // Checkerboard of the warped and fixed images
+    RESAMPLE_DIFF,      // Warped minus fixed image
+    NUM_RESAMPLE_MODES
+};
+
+// Resampling of a moving image onto the fixed grid, one slab of tiles at
+// a time. The spline maps the corners of each tile exactly; voxels within
+// a tile interpolate the moving voxel indices of its corners.
+struct ResampleJob
+{
+    ImageVolume *fixedVolume;
+    ImageVolume *movingVolume;
+    int mode;
+    int dims[3];              // Fixed grid, x,y,z
+    int numCorners[3];        // Tile corners along each axis
+    vector<double> corners;   // Moving voxel index x,y,z of each corner
+    int fd;                   // Resampled voxel data
+};
+
+// Flags of a landmark pair set by iX.
+const unsigned char FLAG_MANUAL = 1;        // ManuallyChosen
+const unsigned char FLAG_UNSURE = 2;        // VeryUnsure
+const unsigned char FLAG_SYSTEM_GUESS = 4;  // _SystemGuess present
+
+// Fields of an iX point pairs record, by the key after "Point_N->".
+enum IxField
+{
+    IX_DISTINCTIVENESS,
+    IX_MANUALLY_CHOSEN,
+    IX_SQ_DIFF_REGION,
+    IX_VERY_UNSURE,
+    IX_COORDINATE,      // "<dim>="
+    IX_CORRESP,         // "<dim>_Corresp="
+    IX_SYSTEM_GUESS,    // "<dim>_SystemGuess="
+    IX_UNKNOWN
+};
+
+// Fields of one point read from an iX point pairs file.
+struct IxPoint
+{
+    int id;
+    double distinctiveness;
+    bool manual;
+    bool unsure;
+    bool systemGuess;
+    int fixed[3];
+    int moving[3];
+    int fixedFound;     // Bit per dimension read
+    int movingFound;
+    
+    IxPoint() : id(-1), distinctiveness(0), manual(false), unsure(false),
+                systemGuess(false), fixedFound(0), movingFound(0) {}
+};
+
 // Landmarks structure is defined
 struct LandmarkPairs
 {
@@ -64,14 +438,620 @@ struct LandmarkPairs
 	string imgDims;
 	vector<double> fixed;
 	vector<double> moving;
+	
+	// Per-point attributes, one entry per landmark.
+	vector<int> pointIds;
+	vector<double> distinctiveness;
+	vector<unsigned char> flags;
+	
+	// Images the landmarks were placed in, when known.
+	string pathFixedImage;
+	string pathMovingImage;
+	
+	// The input, or an image header it needs, could not be read.
+	bool readFailed;
+};
+
+// Landmarks per chunk formatted by one thread of a parallel write.
+const int WRITE_CHUNK_POINTS = 16384;
+
+// Number of independently locked shards of the conversion cache index.
+const int CACHE_SHARDS = 64;
+
+// Cached outputs of one conversion: names, sizes and content hashes.
+struct CacheEntry
+{
+    vector<string> fileNames;
+    vector<uint64_t> sizes;
+    vector<uint64_t> hashes;
+};
+
+// One shard of the in-memory cache index, guarded by its own lock.
+struct CacheShard
+{
+    mutex lock;
+    map<uint64_t, CacheEntry> entries;
+};
+
+// Persistent content-addressed cache of converted outputs.
+struct ConversionCache
+{
+    string dir;
+    CacheShard shards[CACHE_SHARDS];
+};
+
+// Completed conversion recorded in the journal.
+struct JournalRecord
+{
+    uint64_t inputHash;
+    vector<string> outputPaths;
+};
+
+// Append-only journal of completed conversions. Records are buffered and
+// written with one fsync per batch by a background thread.
+struct ConversionJournal
+{
+    int fd;
+    map<string, JournalRecord> completed;
+    mutex lock;
+    condition_variable wake;
+    string pending;
+    int numPending;
+    bool stopping;
+    thread flusher;
+};
+
+// Storage of the coordinate columns of a cohort file. Each is widened to
+// physical coordinates as value * scale + origin, per dimension.
+enum CohortStorage
+{
+    STORAGE_FLOAT64,    // Physical coordinates
+    STORAGE_FLOAT32,    // Physical coordinates in single precision
+    STORAGE_FIXED,      // int32 multiples of the resolution
+    STORAGE_VOXEL16,    // int16 voxel indices with the case's geometry
+    STORAGE_VOXEL32,    // int32 voxel indices with the case's geometry
+    NUM_COHORT_STORAGES
+};
+
+// Location of one case's rows within a cohort file.
+struct CohortRowGroup
+{
+    uint32_t caseIndex;
+    uint64_t numRows;
+    vector<uint64_t> columnOffsets;
+    bool hasMoving;
+    double scales[3];     // Coordinate widening, x,y,z
+    double origins[3];
+    double maxError;      // Largest difference from the stored landmarks
+};
+
+// Columnar file of the landmarks of all cases in a batch. Row groups are
+// written at offsets reserved atomically, so cases are written in parallel.
+struct CohortWriter
+{
+    int fd;
+    int storage;          // CohortStorage of the coordinate columns
+    double resolution;    // Step of fixed storage, in mm
+    atomic<uint64_t> endOffset;
+    mutex lock;
+    vector<string> cases;
+    vector<CohortRowGroup> rowGroups;
+};
+
+#ifdef LMK_USE_SQLITE
+// SQLite landmark catalog loaded by a batch. Cases are inserted with
+// prepared statements, in transactions covering several cases each.
+struct LandmarkCatalog
+{
+    sqlite3 *db;
+    sqlite3_stmt *deleteCase;
+    sqlite3_stmt *insertCase;
+    sqlite3_stmt *insertLandmark;
+    sqlite3_stmt *insertTree;
+    int numPending;
+    mutex lock;
+};
+#else
+struct LandmarkCatalog;
+#endif
+
+// Header of a shared-memory segment of published landmarks. Readers map
+// the segment read-only and copy the columns out of it, keeping the copy
+// only if the sequence number was even and unchanged around it. The
+// columns follow the header at the given offsets from the start of the
+// segment.
+struct SharedLandmarksHeader
+{
+    char magic[8];                  // "LMKSHM1"
+    uint32_t version;               // Layout version, SHM_VERSION
+    uint32_t headerSize;
+    atomic<uint64_t> sequence;      // Odd while an update is in progress
+    atomic<uint64_t> segmentSize;   // Remap when larger than the mapping
+    int32_t numPoints;
+    int32_t numDims;
+    int32_t hasMoving;              // 0 if the moving column is all NaN
+    double offsets[3];
+    double spacings[3];
+    char imgDims[64];
+    char caseName[256];
+    uint64_t fixedOffset;           // double[numPoints * 3], z,y,x per point
+    uint64_t movingOffset;          // double[numPoints * 3], z,y,x per point
+    uint64_t pointIdOffset;         // int32[numPoints]
+    uint64_t distinctivenessOffset; // double[numPoints]
+    uint64_t flagsOffset;           // uint8[numPoints]
+};
+
+// Header of the shared-memory segment through which the worker processes
+// of a coordinator claim the files of a manifest. A file is claimed by a
+// compare-and-swap of its state that also records the claiming worker;
+// nextSlot is where workers look for the next file in the queue of file
+// numbers, and any worker moves it past a claimed file. The coordinator
+// appends the files a crashed worker had claimed. The queue, file and
+// worker records follow the header at the given offsets.
+struct ShardHeader
+{
+    char magic[8];                  // "LMKSHD1"
+    uint32_t numJobs;
+    uint32_t numWorkers;
+    atomic<uint64_t> nextSlot;      // First queue slot that may be unclaimed
+    atomic<uint64_t> queueEnd;      // Queue slots filled
+    uint64_t queueOffset;           // uint32[numJobs * SHARD_MAX_ATTEMPTS]
+    uint64_t jobsOffset;            // ShardJob[numJobs]
+    uint64_t workersOffset;         // ShardWorker[numWorkers]
+};
+
+// States of a file of a sharded batch, held in the low byte of its state
+// word; the higher bits hold the slot of the worker that claimed it.
+enum ShardJobState
+{
+    SHARD_PENDING,      // Queued, not yet claimed
+    SHARD_CLAIMED,      // Being converted by a worker
+    SHARD_DONE,         // Converted
+    SHARD_FAILED        // Conversion failed, or crashed its workers
+};
+
+// Progress of one file of a sharded batch.
+struct ShardJob
+{
+    atomic<int32_t> state;          // ShardJobState | worker slot << 8
+    atomic<int32_t> attempts;       // Claims cut short by a crash
+    atomic<int64_t> latencyUs;      // Duration of the conversion
+};
+
+// Counters of one worker slot. Only the slot's process adds to them; the
+// coordinator records the pid of each process it starts in the slot.
+struct ShardWorker
+{
+    atomic<int32_t> pid;
+    atomic<uint32_t> numConverted;
+    atomic<uint32_t> numFailed;
+    atomic<uint64_t> busyUs;
+};
+
+// Shared-memory segment of a sharded batch, as mapped by one process.
+struct ShardSegment
+{
+    ShardHeader *header;
+    uint32_t *queue;
+    ShardJob *jobs;
+    ShardWorker *workers;
+    size_t size;
+    int slot;                       // Worker slot of this process, or -1
+};
+
+// Backends reading input files and writing output files.
+enum IoBackend
+{
+    IO_THREADS,         // Synchronous calls by the conversion and output threads
+    IO_URING,           // Batches submitted to io_uring
+    NUM_IO_BACKENDS
+};
+
+#ifdef LMK_USE_URING
+// Submission and completion rings of an io_uring instance, shared with
+// the kernel through mappings of the ring's file descriptor.
+struct IoRing
+{
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+    void *sqMapping;
+    size_t sqMappingSize;
+    void *cqMapping;
+    size_t cqMappingSize;
+    size_t sqesSize;
+};
+
+// One operation of a batch submitted to an io_uring.
+struct IoRequest
+{
+    int opcode;           // IORING_OP_OPENAT, READ_FIXED, WRITE or CLOSE
+    int fd;
+    const char *path;     // File opened
+    char *data;           // Data read or written, from offset 0
+    unsigned size;
+    int flags;            // Flags of the open
+    int bufferIndex;      // Registered buffer of a fixed read
+    int result;           // Result of the operation, or -errno
+};
+
+// Input file read ahead of its conversion.
+struct PrefetchedFile
+{
+    bool ready;           // The read has completed
+    bool read;            // The data holds the whole file
+    size_t index;         // Its position in the manifest
+    vector<char> data;
+};
+
+// Input files of a batch read ahead, in batches, by a thread submitting
+// them to an io_uring. Conversions take a file's data instead of
+// reading it themselves.
+struct InputPrefetcher
+{
+    atomic<bool> active;
+    mutex lock;
+    condition_variable fileReady;
+    condition_variable fileTaken;
+    map<string, PrefetchedFile> files;
+    bool stopping;
+    thread reader;
+};
+
+// Input files of a batch read ahead through io_uring, when chosen.
+InputPrefetcher inputPrefetcher;
+#endif
+
+struct OutputQueue;
+
+// Files written for one conversion. The conversion is stored in the cache
+// and recorded in the journal once the last of its files is written.
+struct OutputCase
+{
+    OutputQueue *outputQueue;     // NULL if files are written at once
+    string pathInput;
+    uint64_t cacheKey;
+    ConversionCache *cache;       // NULL if the outputs are not cached
+    ConversionJournal *journal;
+    string pathOutput;            // Prefix the cached names are relative to
+    vector<string> outputPaths;
+    atomic<int> pending;          // Files not yet written, plus one until
+                                  // the conversion is done with the case
+    atomic<bool> failed;          // A file could not be written
+    bool complete;                // The conversion succeeded
+};
+
+// File formatted by a conversion, waiting to be written.
+struct OutputFile
+{
+    string path;
+    string data;
+    OutputCase *owner;
+};
+
+// Bounded queue of formatted files. Conversion threads add files and the
+// output threads write them in batches, so conversions only wait on the
+// disk while the files queued but not yet written exceed the bound.
+struct OutputQueue
+{
+    size_t maxBytes;
+    size_t queuedBytes;           // Data of files queued or being written
+    queue<OutputFile> files;
+    bool closing;
+    mutex lock;
+    condition_variable fileQueued;
+    condition_variable filesWritten;
+    vector<thread> threads;
+    atomic<int> numFailed;        // Completed conversions missing a file
+#ifdef LMK_USE_URING
+    vector<IoRing> rings;         // One per output thread with io_uring
+#endif
+};
+
+// Options shared by every file converted in a run.
+struct ConverterOptions
+{
+    string inputType;
+    string outputType;
+    string pathOutput;
+    string keep_all;
+    ConversionCache *cache;
+    ConversionJournal *journal;
+    CohortWriter *cohort;
+    LandmarkCatalog *catalog;
+    string query;
+    string near;
+    string shmName;
+    bool vtpZlib;
+    bool vtpIntensity;
+    int writeThreads;
+    string pathRefImage;
+    int resampleMode;
+    int cropMargin;           // Negative if images are not cropped
+    OutputQueue *outputQueue; // NULL if files are written at once
+};
+
+// Thin-plate spline mapping fixed landmarks onto moving landmarks.
+struct SplineTransform
+{
+    int numPoints;
+    double relaxation;
+    vector<double> sources;       // Fixed landmarks, in LandmarkPairs order
+    vector<double> coefficients;  // (numPoints + 4) rows of 3 columns
+    vector<double> factors;       // LU factors of the spline system matrix
+    vector<int> pivots;           // Row permutation of the LU factors
+};
+
+// Landmarks sorted into an implicit k-d tree: the landmark at the middle
+// of each range splits the rest of the range along its axis.
+struct LandmarkIndex
+{
+    vector<double> points;        // x,y,z of each landmark, in tree order
+    vector<int> ids;              // Landmark at each tree position
+    vector<unsigned char> axes;   // Split axis at each tree position
+};
+
+// Scattered-data interpolation of landmark residuals onto an image grid.
+enum ResidualMapMethod
+{
+    RESIDUAL_MAP_IDW,       // Inverse distance weights of the k nearest
+    RESIDUAL_MAP_SHEPARD    // Shepard's weights, vanishing at a radius
+};
+
+// Residual map written one slab of tiles at a time.
+struct ResidualMapJob
+{
+    const LandmarkIndex *index;
+    vector<double> values;        // Residual at each tree position
+    ImageGeometry geometry;
+    int method;
+    int numNeighbors;
+    double power;
+    double radius;
+    int fd;
+};
+
+// Types of value held by a parsed JSON document.
+enum JsonType
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+};
+
+// Parsed JSON value. Object members are held as parallel keys and items.
+struct JsonValue
+{
+    JsonType type;
+    double number;
+    string text;
+    vector<string> keys;
+    vector<JsonValue> items;
+};
+
+// Data passed in memory between the stages of a pipeline.
+struct PipelineData
+{
+    LandmarkPairs pairs;
+    bool hasTransform;
+    SplineTransform transform;
+    vector<double> residuals;
+};
+
+// One stage of a pipeline and its place in the dependency graph.
+struct PipelineStage
+{
+    string name;
+    string type;
+    JsonValue params;
+    vector<int> inputs;
+    vector<int> dependents;
 };
 
 // Function prototypes
 LandmarkPairs readLandmarksIx(string, string, string);
 LandmarkPairs readLandmarksIreg(string);
-void writeLandmarksTransformix(LandmarkPairs, string, string);
-void writeLandmarksSlicer(LandmarkPairs, string, string, bool);
-void writeLandmarksText(LandmarkPairs, string, string, bool);
+LandmarkPairs readLandmarksTransformix(string);
+LandmarkPairs readLandmarksSlicer(string, string);
+bool readFiducials(string, vector<double> &, vector<string> &);
+string getSlicerCounterpart(string);
+bool writesMovingLandmarks(string, string);
+void writeLandmarksTransformix(LandmarkPairs, string, string, int, OutputCase *);
+void writeLandmarksSlicer(LandmarkPairs, string, string, bool, int, OutputCase *);
+void formatLandmarkRange(ostream &, const vector<double> &, int, int, int, bool);
+void writeLandmarkChunks(ostream &, const vector<double> &, int, int, bool, int);
+void writeLandmarksText(LandmarkPairs, string, string, bool, OutputCase *);
+uint64_t appendVtkArray(string &, const void *, uint64_t, bool, bool &);
+bool writeLandmarksVtk(const LandmarkPairs &, string, string, bool, bool, bool,
+                       OutputCase *);
+OutputQueue *openOutputQueue(int, size_t, int);
+void submitOutputFile(OutputCase *, string, string &);
+bool writeOutputFile(string, const string &);
+void releaseOutputCase(OutputCase *);
+int closeOutputQueue(OutputQueue *);
+int parseIoBackend(string);
+#ifdef LMK_USE_URING
+bool openIoRing(IoRing &, unsigned);
+bool runIoRequests(IoRing &, vector<IoRequest> &);
+void closeIoRing(IoRing &);
+void writeOutputFilesUring(IoRing &, vector<OutputFile> &);
+bool startInputPrefetch(const vector<string> &, const atomic<size_t> &);
+void prefetchInputFiles(IoRing, const vector<string> *, const atomic<size_t> *);
+void dropClaimedPrefetches(size_t);
+bool takePrefetchedFile(string, vector<char> &);
+void stopInputPrefetch();
+#endif
+void printUsage();
+int parseLogLevel(string);
+int detectIsaLevel();
+int parseIsaLevel(string);
+bool selectIsaLevel(int);
+void startLogging(int);
+void stopLogging();
+LogRing *getLogRing();
+void drainLogRings(bool);
+void writeLogRecord(const LogRecord &, int, string &);
+bool publishLandmarks(string, string, const LandmarkPairs &);
+int runCoordinator(int, char **, const vector<string> &, int, string);
+ShardSegment *createShardSegment(string, size_t, int);
+ShardSegment *attachShardSegment(string, size_t, int);
+void closeShardSegment(ShardSegment *);
+bool spawnShardWorker(vector<string> &, int, ShardSegment &, map<pid_t, int> &);
+int requeueShardJobs(ShardSegment &, int, const vector<string> &);
+bool claimShardJob(ShardSegment &, size_t &);
+void finishShardJob(ShardSegment &, size_t, bool, int64_t);
+int reportShardRun(ShardSegment &, const vector<string> &);
+LandmarkPairs readLandmarksShm(string);
+bool shmColumnFits(uint64_t, uint64_t, uint64_t);
+bool readFileBuffer(string, vector<char> &);
+void indexLines(const char *, size_t, char, vector<uint32_t> &, vector<uint32_t> &);
+#ifdef LMK_X86
+LMK_TARGET("sse2") size_t indexLinesSse2(const char *, size_t, char,
+                                         vector<uint32_t> &, vector<uint32_t> &);
+LMK_TARGET("avx2") size_t indexLinesAvx2(const char *, size_t, char,
+                                         vector<uint32_t> &, vector<uint32_t> &);
+LMK_TARGET("avx512f,avx512bw") size_t indexLinesAvx512(const char *, size_t, char,
+                                                       vector<uint32_t> &,
+                                                       vector<uint32_t> &);
+#endif
+IxField classifyIxKey(const char *, size_t);
+int parseIxInteger(const char *);
+void storeIxPoint(const IxPoint &, const string &, vector<double> &,
+                  vector<double> &, LandmarkPairs &);
+bool convertFile(string, const ConverterOptions &);
+bool compileRemapRules(string, PathRemapper &);
+void addRemapRule(PathRemapper &, string, string);
+void reportRemapHits();
+string remapMhdPath(string);
+bool isMetaImageMagic(const unsigned char *, size_t);
+bool isNrrdMagic(const unsigned char *, size_t);
+bool isNiftiMagic(const unsigned char *, size_t);
+bool readHeaderText(string, string &);
+bool readGeometryMhd(string, ImageGeometry &);
+bool readGeometryNrrd(string, ImageGeometry &);
+short niftiShort(const unsigned char *, bool, int);
+double niftiFloat(const unsigned char *, bool, int);
+bool readGeometryNifti(string, ImageGeometry &);
+bool getImageGeometry(string, ImageGeometry &);
+ImageVolume *openImageVolume(string);
+void closeImageVolume(ImageVolume *);
+void cacheVolumeSlab(ImageVolume &, int, VolumeSlab);
+bool decodeVolumeSlabs(ImageVolume &, int, int);
+bool prefetchVolumeSlabs(ImageVolume &, const vector<int> &);
+VolumeSlab getVolumeSlab(ImageVolume &, int);
+double sampleVolume(ImageVolume &, const double *);
+int parseResampleMode(string);
+bool resampleImage(const LandmarkPairs &, const SplineTransform *, int, string,
+                   string, int);
+void mapTileCorners(ResampleJob &, const SplineTransform &, int);
+bool resampleTileSlab(ResampleJob &, int);
+void sampleRowTrilinear(const float *, const int *, int, int, const double *,
+                        const double *, int, float *);
+#ifdef LMK_X86
+LMK_TARGET("sse2") int sampleRowTrilinearSse2(const float *, const int *, int, int,
+                                              const double *, const double *, int,
+                                              float *);
+LMK_TARGET("avx2") int sampleRowTrilinearAvx2(const float *, const int *, int, int,
+                                              const double *, const double *, int,
+                                              float *);
+#endif
+bool writeMetaImageHeader(string, const ImageGeometry &, string, string);
+bool cropLandmarkImages(LandmarkPairs &, int, string, string);
+bool writeCroppedVolume(ImageVolume &, const int *, const int *, string,
+                        ImageGeometry &);
+double getVoxelValue(const char *, int);
+bool sampleLandmarkIntensities(const LandmarkPairs &, bool, vector<double> &);
+string getFileStem(string);
+vector<string> getFormatOutputPaths(string, string, string, bool, int);
+vector<string> getOutputPaths(string, const ConverterOptions &);
+uint64_t hashBytes(const char *, size_t, uint64_t);
+bool hashFile(string, uint64_t &);
+bool copyFile(string, string);
+uint64_t getCacheKey(string, const ConverterOptions &);
+bool cacheLookup(ConversionCache &, uint64_t, CacheEntry &);
+void cacheStore(ConversionCache &, uint64_t, vector<string>, string);
+bool cacheRestore(ConversionCache &, uint64_t, const CacheEntry &, string);
+ConversionJournal *openJournal(string, string);
+size_t parseJournalRecords(const string &, map<string, JournalRecord> &);
+string getJournalPartPath(string, int);
+bool mergeJournalParts(string, int);
+bool journalIsComplete(ConversionJournal &, string, uint64_t);
+void journalRecord(ConversionJournal &, string, uint64_t, const vector<string> &);
+void journalFlush(ConversionJournal &);
+void closeJournal(ConversionJournal *);
+bool parseJson(const string &, JsonValue &);
+bool parseJsonValue(const string &, size_t &, JsonValue &);
+const JsonValue *jsonMember(const JsonValue &, string);
+string jsonText(const JsonValue &);
+bool fitSplineTransform(const LandmarkPairs &, double, SplineTransform &);
+void evaluateSplineTransform(const SplineTransform &, const double *, double *);
+#ifdef LMK_X86
+LMK_TARGET("sse2") int addSplineKernelSse2(const SplineTransform &, const double *,
+                                           double *);
+LMK_TARGET("avx2") int addSplineKernelAvx2(const SplineTransform &, const double *,
+                                           double *);
+LMK_TARGET("avx512f") int addSplineKernelAvx512(const SplineTransform &,
+                                                const double *, double *);
+#endif
+bool leaveOneOutResiduals(const SplineTransform &, vector<double> &, int);
+void buildLandmarkIndex(const vector<double> &, LandmarkIndex &);
+void findNearestLandmarks(const LandmarkIndex &, int, int, const double *, int,
+                          vector<pair<double, int> > &);
+void findLandmarksWithin(const LandmarkIndex &, int, int, const double *,
+                         double, vector<int> &);
+bool writeResidualMap(const LandmarkPairs &, const vector<double> &,
+                      const JsonValue &, string, string, int);
+bool mapResidualSlab(const ResidualMapJob &, int);
+bool writeAt(int, const char *, size_t, off_t);
+bool luDecompose(vector<double> &, int, vector<int> &);
+void luSolve(const vector<double> &, int, const vector<int> &, double *);
+LandmarkPairs selectLandmarks(const LandmarkPairs &, const vector<bool> &);
+void writeResiduals(const LandmarkPairs &, const vector<double> &,
+                    const vector<double> &, string, string);
+void computeBendingEnergy(const SplineTransform &, vector<double> &,
+                          vector<double> &);
+bool writeBendingEnergy(const LandmarkPairs &, const SplineTransform &, string,
+                        string);
+bool savePipelineData(string, const PipelineData &);
+bool loadPipelineData(string, PipelineData &);
+bool runPipelineStage(const JsonValue &, const PipelineStage &,
+                      const vector<const PipelineData *> &, PipelineData &);
+int runPipeline(string);
+string getStageInput(const JsonValue &, const PipelineStage &);
+void chainLandmarks(const vector<const SplineTransform *> &,
+                    const vector<double> &, vector<double> &, int);
+CohortWriter *openCohort(string, int, double);
+bool cohortAppend(CohortWriter &, string, const LandmarkPairs &);
+int parseCohortStorage(string);
+bool quantizeCoordinates(const vector<double> &, int, double, double, char *,
+                         double &);
+void widenCoordinates(const char *, int, size_t, double, double, double *);
+#ifdef LMK_X86
+LMK_TARGET("sse2") size_t widenCoordinatesSse2(const char *, int, size_t, double,
+                                               double, double *);
+LMK_TARGET("avx2") size_t widenCoordinatesAvx2(const char *, int, size_t, double,
+                                               double, double *);
+LMK_TARGET("avx512f") size_t widenCoordinatesAvx512(const char *, int, size_t,
+                                                    double, double, double *);
+#endif
+bool closeCohort(CohortWriter *);
+#ifdef LMK_USE_SQLITE
+LandmarkCatalog *openCatalog(string);
+bool catalogAdd(LandmarkCatalog &, string, string, const LandmarkPairs &);
+bool closeCatalog(LandmarkCatalog *);
+LandmarkPairs readLandmarksCatalog(string, string, string);
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -80,22 +1060,76 @@ int main(int argc, char *argv[])
 //////////////////////////  Parse Input Arguments   ///////////////////////////
 -----------------------------------------------------------------------------*/
     
+    // A pipeline spec replaces all other arguments but the log level and
+    // instruction set.
+    if((argc >= 3) && (string(argv[1]) == "-pipeline"))
+    {
+            string logLevelName = "info";
+            string isaName = "auto";
+            bool knownArgs = ((argc % 2) == 1);
+            for(int iArg = 3; knownArgs && (iArg < argc); iArg = iArg + 2)
+            {
+                if(string(argv[iArg]) == "-log_level")
+                {
+                       logLevelName = argv[iArg+1];
+                }
+                else if(string(argv[iArg]) == "-isa")
+                {
+                       isaName = argv[iArg+1];
+                }
+                else
+                {
+                       knownArgs = false;
+                }
+            }
+            if(!knownArgs || (parseIsaLevel(isaName) < 0) ||
+               (parseLogLevel(logLevelName) < 0))
+            {
+                cout << "\nUnexpected parameters!\n";
+                printUsage();
+                return EXIT_FAILURE;
+            }
+            
+            LogSession logSession(parseLogLevel(logLevelName));
+            if (!selectIsaLevel(parseIsaLevel(isaName)))
+            {
+                return EXIT_FAILURE;
+            }
+            return runPipeline(argv[2]);
+    }
+    
     // Check is performed to assure that proper number of arguments were given.
-    if(argc != 11)
+    if((argc < 11) || ((argc % 2) == 0))
     {
             cout << "\nUnexpected number of parameters!\n";
             // Correct usage of program is displayed to the user.
-            cout << "Required arguments: -in_file <pathToInputLandmarks>";
-			cout << " -in_type <inputLandmarksFormat>";
-            cout << " -out_dir <pathToOutputDirectory>";
-            cout << " -out_type <outputLandmarksFormat>";
-			cout << " -keep_all <0 or 1>\n\n";
+            printUsage();
             return EXIT_FAILURE;
             
     }// end if
     
     // Variables to hold input arguments are declared.
     string pathInput, inputType, pathOutput, outputType, keep_all;
+    string pathList, cacheDir, pathJournal, pathCohort, pathCatalog;
+    string query, near, shmName;
+    string cohortStorage = "float64";
+    double cohortResolution = 0.001;
+    string logLevelName = "info";
+    string isaName = "auto";
+    string pathRules;
+    int ioThreads = 1;
+    int ioQueueMb = 64;
+    string ioBackendName = "threads";
+    int numProcesses = 0;
+    string shardSegment;
+    int shardWorker = -1;
+    string pathRefImage;
+    string resampleMode = "warp";
+    int cropMargin = -1;
+    string vtpZlib = "0";
+    string vtpIntensity = "0";
+    int numThreads = 1;
+    int writeThreads = 1;
     
     // Arguments are parsed.
     for(int iArg = 1; iArg < argc; iArg =iArg+2)
@@ -126,480 +1160,1441 @@ int main(int argc, char *argv[])
             {
 				       keep_all = argv[iArg+1];
             }
+            // Path to batch manifest is saved.
+            else if(string(argv[iArg])== "-in_list")
+            {
+                       pathList = argv[iArg+1];
+            }
+            // Number of concurrent conversions is saved.
+            else if(string(argv[iArg])== "-threads")
+            {
+                       numThreads = atoi(argv[iArg+1]);
+            }
+            // Path to conversion cache is saved.
+            else if(string(argv[iArg])== "-cache_dir")
+            {
+                       cacheDir = argv[iArg+1];
+            }
+            // Path to batch journal is saved.
+            else if(string(argv[iArg])== "-journal")
+            {
+                       pathJournal = argv[iArg+1];
+            }
+            // Path to cohort landmark table is saved.
+            else if(string(argv[iArg])== "-cohort_file")
+            {
+                       pathCohort = argv[iArg+1];
+            }
+            // Storage of cohort coordinates is saved.
+            else if(string(argv[iArg])== "-cohort_storage")
+            {
+                       cohortStorage = argv[iArg+1];
+            }
+            // Resolution of fixed-point cohort coordinates is saved.
+            else if(string(argv[iArg])== "-cohort_resolution")
+            {
+                       cohortResolution = atof(argv[iArg+1]);
+            }
+            // Path to landmark catalog is saved.
+            else if(string(argv[iArg])== "-catalog")
+            {
+                       pathCatalog = argv[iArg+1];
+            }
+            // Catalog query condition is saved.
+            else if(string(argv[iArg])== "-query")
+            {
+                       query = argv[iArg+1];
+            }
+            // Catalog query neighbourhood is saved.
+            else if(string(argv[iArg])== "-near")
+            {
+                       near = argv[iArg+1];
+            }
+            // Name of shared-memory segment is saved.
+            else if(string(argv[iArg])== "-shm_name")
+            {
+                       shmName = argv[iArg+1];
+            }
+            // Compression of VTK arrays is saved.
+            else if(string(argv[iArg])== "-vtp_zlib")
+            {
+                       vtpZlib = argv[iArg+1];
+            }
+            // Sampling of image intensities is saved.
+            else if(string(argv[iArg])== "-vtp_intensity")
+            {
+                       vtpIntensity = argv[iArg+1];
+            }
+            // Number of threads formatting each output file is saved.
+            else if(string(argv[iArg])== "-write_threads")
+            {
+                       writeThreads = atoi(argv[iArg+1]);
+            }
+            // Image written by resampling is saved.
+            else if(string(argv[iArg])== "-resample_mode")
+            {
+                       resampleMode = argv[iArg+1];
+            }
+            // Padding of cropped images is saved.
+            else if(string(argv[iArg])== "-crop_margin")
+            {
+                       cropMargin = atoi(argv[iArg+1]);
+                       if (cropMargin < 0)
+                       {
+                           cout << "\nUnexpected crop margin!\n";
+                           return EXIT_FAILURE;
+                       }
+            }
+            // Path to reference image of fiducials is saved.
+            else if(string(argv[iArg])== "-ref_image")
+            {
+                       pathRefImage = argv[iArg+1];
+            }
+            // Path to path-remapping rules is saved.
+            else if(string(argv[iArg])== "-remap_rules")
+            {
+                       pathRules = argv[iArg+1];
+            }
+            // Level of logged messages is saved.
+            else if(string(argv[iArg])== "-log_level")
+            {
+                       logLevelName = argv[iArg+1];
+            }
+            // Instruction set of the vector kernels is saved.
+            else if(string(argv[iArg])== "-isa")
+            {
+                       isaName = argv[iArg+1];
+            }
+            // Number of threads writing output files is saved.
+            else if(string(argv[iArg])== "-io_threads")
+            {
+                       ioThreads = atoi(argv[iArg+1]);
+            }
+            // Bound on the formatted output waiting to be written is saved.
+            else if(string(argv[iArg])== "-io_queue_mb")
+            {
+                       ioQueueMb = atoi(argv[iArg+1]);
+            }
+            // Backend of the file reads and writes is saved.
+            else if(string(argv[iArg])== "-io_backend")
+            {
+                       ioBackendName = argv[iArg+1];
+            }
+            // Number of worker processes of a coordinator is saved.
+            else if(string(argv[iArg])== "-processes")
+            {
+                       numProcesses = atoi(argv[iArg+1]);
+            }
+            // Segment and slot of a coordinator's worker are saved.
+            else if(string(argv[iArg])== "-shard_segment")
+            {
+                       shardSegment = argv[iArg+1];
+            }
+            else if(string(argv[iArg])== "-shard_worker")
+            {
+                       shardWorker = atoi(argv[iArg+1]);
+            }
             else //Otherwise, improper parameters were given.
             {
                 cout << "\nUnexpected parameters!\n";
                 // Correct usage of program is displayed to the user.
-                cout << "Required arguments: -in_file <pathToInputLandmarks>";
-                cout << " -in_type <inputLandmarksFormat>";
-                cout << " -out_dir <pathToOutputDirectory>";
-                cout << " -out_type <outputLandmarksFormat>";
-				cout << " -keep_all <0 or 1>\n\n";
+                printUsage();
                 return EXIT_FAILURE;
             } // end if/elseif/else
     
     } // end for
 	
+	// Required arguments are checked for presence.
+	if ((pathInput.empty() == pathList.empty()) || inputType.empty() ||
+	    pathOutput.empty() || outputType.empty() || keep_all.empty())
+	{
+		cout << "\nMissing or conflicting parameters!\n";
+		printUsage();
+		return EXIT_FAILURE;
+	}
+	
 	// I/O file types are checked for compatibility.
 	if ((inputType.compare("ireg") == 0)&&(outputType.compare("tfx_lmk") == 0))
 	{
 		cout << "Landmark list to Transformix parameters is not supported.\n";
 		return EXIT_FAILURE;
 	}
-    
-/*-----------------------------------------------------------------------------
-//////////////////////////   Read Input Landmarks   ///////////////////////////
------------------------------------------------------------------------------*/
-    
-    // Conversion process is started.
-    cout << "\nStarting conversion...";
 	
-	LandmarkPairs readPair;
-    
-    // The conversion function matching the input landmarks format is called.
-    if (inputType == "ix_pp") // iX point pairs specified.
-    {
-        readPair= readLandmarksIx(pathInput, outputType, keep_all);
-    }
-    else if (inputType == "ireg") // Caliper registration output specified.
-    {
-        readPair = readLandmarksIreg(pathInput);
-    }
-    else // Incorrect format was specified.
-    {
+	// Input and output formats are checked before any file is touched.
+	if ((inputType != "ix_pp") && (inputType != "ireg") &&
+	    (inputType != "lmk_db") && (inputType != "lmk_shm") &&
+	    (inputType != "tfx_lmk") && (inputType != "slr_fid"))
+	{
         cout << "\nUnexpected input format!\n";
-        cout << "Options are: ix_pp, ireg\n";
+        cout << "Options are: ix_pp, ireg, lmk_db, lmk_shm, tfx_lmk, slr_fid\n";
         return EXIT_FAILURE;     
-    }
+	}
+	if ((!query.empty() || !near.empty()) && (inputType != "lmk_db"))
+	{
+		cout << "-query and -near require input of type lmk_db.\n";
+		return EXIT_FAILURE;
+	}
+#ifndef LMK_USE_SQLITE
+	if ((inputType == "lmk_db") || !pathCatalog.empty())
+	{
+		cout << "Landmark catalogs require compiling with -DLMK_USE_SQLITE.\n";
+		return EXIT_FAILURE;
+	}
+#endif
+	if ((outputType != "tfx_lmk") && (outputType != "slr_fid") &&
+	    (outputType != "std_txt") && (outputType != "vtk_vtp") &&
+	    (outputType != "img_mhd"))
+	{
+        cout << "\nUnexpected output format!\n";
+        cout << "Options are: tfx_lmk, slr_fid, std_txt, vtk_vtp, img_mhd\n";
+        return EXIT_FAILURE;     
+	}
+	if (parseResampleMode(resampleMode) < 0)
+	{
+        cout << "\nUnexpected resample mode!\n";
+        cout << "Options are: warp, checker, diff\n";
+        return EXIT_FAILURE;
+	}
+	if (parseIsaLevel(isaName) < 0)
+	{
+        cout << "\nUnexpected instruction set!\n";
+        cout << "Options are: auto, scalar, sse2, avx2, avx512\n";
+        return EXIT_FAILURE;
+	}
+	if (parseLogLevel(logLevelName) < 0)
+	{
+        cout << "\nUnexpected log level!\n";
+        cout << "Options are: quiet, error, warn, info, debug\n";
+        return EXIT_FAILURE;
+	}
+	if ((numProcesses > 0) && (!pathCohort.empty() || !pathCatalog.empty()))
+	{
+		cout << "Worker processes cannot share a cohort file or catalog.\n";
+		return EXIT_FAILURE;
+	}
+	if (parseIoBackend(ioBackendName) < 0)
+	{
+        cout << "\nUnexpected I/O backend!\n";
+        cout << "Options are: threads, uring\n";
+        return EXIT_FAILURE;
+	}
+#ifndef LMK_USE_URING
+	if (parseIoBackend(ioBackendName) == IO_URING)
+	{
+		cout << "The io_uring backend requires compiling with -DLMK_USE_URING.\n";
+		return EXIT_FAILURE;
+	}
+#endif
+	if ((parseCohortStorage(cohortStorage) < 0) || !(cohortResolution > 0))
+	{
+        cout << "\nUnexpected cohort storage!\n";
+        cout << "Options are: float64, float32, fixed, voxel16, voxel32,";
+        cout << " with a positive -cohort_resolution\n";
+        return EXIT_FAILURE;
+	}
+#ifndef LMK_USE_ZLIB
+	if (vtpZlib == "1")
+	{
+		cout << "Compressed VTK output requires compiling with -DLMK_USE_ZLIB.\n";
+		return EXIT_FAILURE;
+	}
+#endif
+	
+	// Options shared by all conversions are gathered.
+	ConverterOptions options;
+	options.inputType = inputType;
+	options.outputType = outputType;
+	options.pathOutput = pathOutput;
+	options.keep_all = keep_all;
+	options.cache = NULL;
+	options.journal = NULL;
+	options.cohort = NULL;
+	options.catalog = NULL;
+	options.query = query;
+	options.near = near;
+	options.shmName = shmName;
+	options.vtpZlib = (vtpZlib == "1");
+	options.vtpIntensity = (vtpIntensity == "1");
+	options.writeThreads = max(1, writeThreads);
+	options.pathRefImage = pathRefImage;
+	options.resampleMode = parseResampleMode(resampleMode);
+	options.cropMargin = cropMargin;
+	options.outputQueue = NULL;
+	
+	ConversionCache *cache = NULL;
+	
+	// Progress is logged from here on.
+	LogSession logSession(parseLogLevel(logLevelName));
+	
+	// Vector kernels are chosen before any thread runs them.
+	if (!selectIsaLevel(parseIsaLevel(isaName)))
+	{
+		return EXIT_FAILURE;
+	}
 	
-	if (&readPair == NULL)
+	// MetaHeader paths of every input are remapped by the same rules.
+	if (!compileRemapRules(pathRules, pathRemapper))
 	{
-		cout << "Unsuccessful read";
+		LOG_MESSAGE(LOG_ERROR, "remap", pathRules, "Failed to read remap rules");
 		return EXIT_FAILURE;
 	}
 	
 /*-----------------------------------------------------------------------------
-/////////////////////////   Write Output Landmarks   //////////////////////////
+//////////////////////////   Gather Input Files   /////////////////////////////
 -----------------------------------------------------------------------------*/
 
-    // Write process is started.
-    cout << "Starting write...\n";
-    
-    // The write function matching the output landmarks format is called.
-    if (outputType == "tfx_lmk") // Transformix parameter file.
-    {
-        writeLandmarksTransformix(readPair, pathInput, pathOutput);
-    }
-    else if (outputType == "slr_fid") // Slicer fiducials.
-    {
-        writeLandmarksSlicer(readPair, pathInput, pathOutput, true);
-		
-		if (inputType == "ix_pp")
+	vector<string> inputFiles;
+	
+	if (!pathList.empty())
+	{
+		// Each non-blank line of the manifest names one input file.
+		ifstream manifest(pathList.c_str());
+		if (!manifest.is_open())
 		{
-		    writeLandmarksSlicer(readPair, pathInput, pathOutput, false);
+			LOG_MESSAGE(LOG_ERROR, "batch", pathList, "Failed to open input list");
+			return EXIT_FAILURE;
 		}
-    }
-	else if (outputType == "std_txt") // Plain text.
-    {
-        writeLandmarksText(readPair, pathInput, pathOutput, true);
 		
-		if (inputType == "ix_pp")
+		string currentLine;
+		while (getline(manifest, currentLine))
 		{
-		    writeLandmarksText(readPair, pathInput, pathOutput, false);
+			currentLine.erase(currentLine.find_last_not_of(" \t\r") + 1);
+			if (!currentLine.empty())
+			{
+				inputFiles.push_back(currentLine);
+			}
 		}
-    }
-    else // Incorrect format was specified.
-    {
-        cout << "\nUnexpected output format!\n";
-        cout << "Options are: tfx_lmk, slr_fid\n";
-        return EXIT_FAILURE;     
-    }
+		manifest.close();
+	}
+	else
+	{
+		inputFiles.push_back(pathInput);
+	}
+	
+	// With worker processes this process only coordinates them; they open
+	// the cache themselves and append to their own parts of the journal.
+	if (numProcesses > 0)
+	{
+		return runCoordinator(argc, argv, inputFiles, numProcesses, pathJournal);
+	}
+	
+	// The conversion cache is opened when requested.
+	if (!cacheDir.empty())
+	{
+		mkdir(cacheDir.c_str(), 0755);
+		cache = new ConversionCache;
+		cache->dir = cacheDir;
+		options.cache = cache;
+	}
+	
+	// The journal of completed conversions is opened when requested. A
+	// coordinator's worker appends to its own part, which the coordinator
+	// merges, and only reads the journal itself.
+	if (!pathJournal.empty() && shardSegment.empty())
+	{
+		options.journal = openJournal(pathJournal, "");
+	}
+	else if (!pathJournal.empty())
+	{
+		options.journal = openJournal(getJournalPartPath(pathJournal, shardWorker),
+		                              pathJournal);
+	}
+	if (!pathJournal.empty())
+	{
+		if (options.journal == NULL)
+		{
+			LOG_MESSAGE(LOG_ERROR, "journal", pathJournal, "Failed to open journal");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	// The cohort landmark table is created when requested.
+	if (!pathCohort.empty())
+	{
+		options.cohort = openCohort(pathCohort, parseCohortStorage(cohortStorage),
+		                            cohortResolution);
+		if (options.cohort == NULL)
+		{
+			LOG_MESSAGE(LOG_ERROR, "cohort", pathCohort,
+			            "Failed to create cohort file");
+			return EXIT_FAILURE;
+		}
+	}
+	
+#ifdef LMK_USE_SQLITE
+	// The landmark catalog is opened when requested.
+	if (!pathCatalog.empty())
+	{
+		options.catalog = openCatalog(pathCatalog);
+		if (options.catalog == NULL)
+		{
+			LOG_MESSAGE(LOG_ERROR, "catalog", pathCatalog, "Failed to open catalog");
+			return EXIT_FAILURE;
+		}
+	}
+#endif
+	
+/*-----------------------------------------------------------------------------
+/////////////////////////////   Convert Files   ///////////////////////////////
+-----------------------------------------------------------------------------*/
+
+	// A coordinator's worker claims its files through the shared segment.
+	ShardSegment *shard = NULL;
+	if (!shardSegment.empty())
+	{
+		shard = attachShardSegment(shardSegment, inputFiles.size(), shardWorker);
+		if (shard == NULL)
+		{
+			LOG_MESSAGE(LOG_ERROR, "shard", shardSegment,
+			            "Failed to attach shard segment");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	// Formatted files are written by their own threads, so conversions
+	// only wait on the disk once the queue's bound is reached. A worker
+	// writes its files before reporting the file converted, so a crash
+	// never loses the outputs of a file marked done.
+	int ioBackend = parseIoBackend(ioBackendName);
+	if ((ioThreads > 0) && (shard == NULL))
+	{
+		options.outputQueue = openOutputQueue(ioThreads,
+		                                      (size_t)max(1, ioQueueMb) << 20,
+		                                      ioBackend);
+	}
+	
+	if (numThreads < 1)
+	{
+		numThreads = 1;
+	}
+	if (numThreads > (int)inputFiles.size())
+	{
+		numThreads = inputFiles.size();
+	}
+	
+	// Each conversion starts its own formatting threads, so together they
+	// are kept to the cores, not multiplied by the batch threads.
+	int numCores = max(1, (int)thread::hardware_concurrency());
+	if (options.writeThreads > max(1, numCores / numThreads))
+	{
+		options.writeThreads = max(1, numCores / numThreads);
+		LOG_MESSAGE(LOG_INFO, "batch", "", "Using " << options.writeThreads <<
+		            " write threads per conversion for " << numThreads <<
+		            " batch threads on " << numCores << " cores");
+	}
+	
+	// Files are claimed one at a time by the worker threads.
+	atomic<size_t> nextFile(0);
+	atomic<size_t> numClaimed(0);
+	atomic<int> numFailed(0);
+	vector<thread> workers;
+	LogTimer batchTimer("batch", pathList.empty() ? pathInput : pathList);
+	
+#ifdef LMK_USE_URING
+	// With io_uring the input files are read ahead of the workers, unless
+	// other processes share the manifest.
+	if ((ioBackend == IO_URING) && (shard == NULL))
+	{
+		startInputPrefetch(inputFiles, nextFile);
+	}
+#endif
+	
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		workers.push_back(thread([&]()
+		{
+			size_t iFile;
+			while ((shard != NULL) ? claimShardJob(*shard, iFile)
+			                       : ((iFile = nextFile++) < inputFiles.size()))
+			{
+				numClaimed++;
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				bool converted = convertFile(inputFiles[iFile], options);
+				if (!converted)
+				{
+					numFailed++;
+				}
+				if (shard != NULL)
+				{
+					finishShardJob(*shard, iFile, converted,
+					               chrono::duration_cast<chrono::microseconds>(
+					                   chrono::steady_clock::now() - start).count());
+				}
+#ifdef LMK_USE_URING
+				// Data read ahead but not used by the conversion is dropped.
+				vector<char> unread;
+				takePrefetchedFile(inputFiles[iFile], unread);
+#endif
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+#ifdef LMK_USE_URING
+	stopInputPrefetch();
+#endif
+	if (shard != NULL)
+	{
+		closeShardSegment(shard);
+	}
+	
+	// Queued files are written, and their conversions recorded, before the
+	// cache and journal are closed.
+	if (options.outputQueue != NULL)
+	{
+		numFailed += closeOutputQueue(options.outputQueue);
+	}
+	
+	delete cache;
+	closeJournal(options.journal);
+	reportRemapHits();
+	
+	if ((options.cohort != NULL) && !closeCohort(options.cohort))
+	{
+		LOG_MESSAGE(LOG_ERROR, "cohort", pathCohort, "Failed to write cohort file");
+		numFailed++;
+	}
 	
-	cout << "Conversion complete!\n\n";
+#ifdef LMK_USE_SQLITE
+	if ((options.catalog != NULL) && !closeCatalog(options.catalog))
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathCatalog, "Failed to complete catalog");
+		numFailed++;
+	}
+#endif
+	
+	if (numFailed > 0)
+	{
+		LOG_MESSAGE(LOG_ERROR, "batch", "", numFailed << " of " <<
+		            numClaimed << " conversions failed");
+		return EXIT_FAILURE;
+	}
 	
     return EXIT_SUCCESS;
     
 } // end main
 
 
-
 //***********************************************************
-// Function readLandmarksIx is defined.                     *
-// The function reads landmark coordinates from an iX point *
-// pairs file and converts them into physical coordinates   *
-// before returning them in a vector.                       *
+// Function printUsage is defined.                          *
+// The function displays the correct usage of the program.  *
 //***********************************************************
 
-LandmarkPairs readLandmarksIx(string pathInput, string outType, string keep_all)
+void printUsage()
 {
-
-    // Output landmark pairs structure is created.
-	LandmarkPairs pairs;
-                     
-    // I/O files and string to hold read lines are declared.
-    ifstream pointPairs;
-	ifstream fixedMhd;
-    string currentLine;
+    cout << "Required arguments: -in_file <pathToInputLandmarks>";
+    cout << " -in_type <inputLandmarksFormat>";
+    cout << " -out_dir <pathToOutputDirectory>";
+    cout << " -out_type <outputLandmarksFormat>";
+    cout << " -keep_all <0 or 1>\n";
+    cout << "Optional arguments: -in_list <pathToInputManifest>";
+    cout << " (replaces -in_file)";
+    cout << " -threads <numConcurrentFiles>";
+    cout << " -cache_dir <pathToCacheDirectory>";
+    cout << " -journal <pathToJournalFile>";
+    cout << " -cohort_file <pathToCohortFile>";
+    cout << " -cohort_storage <float64, float32, fixed, voxel16 or voxel32>";
+    cout << " -cohort_resolution <fixedPointStepInMm>";
+    cout << " -catalog <pathToCatalog>";
+    cout << " -query <sqlCondition> -near <x,y,z,radius>";
+    cout << " -shm_name <sharedMemoryName>";
+    cout << " -vtp_zlib <0 or 1> -vtp_intensity <0 or 1>";
+    cout << " -write_threads <numFormattingThreads>";
+    cout << " -resample_mode <warp, checker or diff>";
+    cout << " -crop_margin <numPaddingVoxels>";
+    cout << " -ref_image <pathToReferenceImage>";
+    cout << " -remap_rules <pathToRemapRules>";
+    cout << " -log_level <quiet, error, warn, info or debug>";
+    cout << " -isa <auto, scalar, sse2, avx2 or avx512>";
+    cout << " -io_threads <numOutputThreads> -io_queue_mb <maxQueuedOutputMb>";
+    cout << " -io_backend <threads or uring>";
+    cout << " -processes <numWorkerProcesses>\n";
+    cout << "Or: -pipeline <pathToPipelineSpec> [-log_level <level>]";
+    cout << " [-isa <instructionSet>]\n\n";
     
-    // Variable holding the number of dimensions is declared and initialized.
-    const int NUM_DIMS = 3;
+} // end printUsage
+
+
+//**************************************************************
+// Function parseLogLevel is defined.                          *
+// The function returns the log level of the given name, or    *
+// -1 if unrecognized.                                         *
+//**************************************************************
+
+int parseLogLevel(string name)
+{
+	if (name == "quiet")
+	{
+		return LOG_QUIET;
+	}
+	else if (name == "error")
+	{
+		return LOG_ERROR;
+	}
+	else if (name == "warn")
+	{
+		return LOG_WARN;
+	}
+	else if (name == "info")
+	{
+		return LOG_INFO;
+	}
+	else if (name == "debug")
+	{
+		return LOG_DEBUG;
+	}
 	
-	// Vectors created to hold converted coordinates.
-	vector<double> fixedCoordsVector;
-	vector<double> movingCoordsVector;
-    
-    /*--------------------------------------------------------------------------
-    ////////////////////////  Open point pairs files  //////////////////////////
-    --------------------------------------------------------------------------*/
-    
-    // Point pairs file is opened.
-    cout << "\nOpening point pairs file: ";
-    cout << pathInput << endl;
-    pointPairs.open(pathInput.c_str());
-    
-    // Check is performed for successful file open.
-    if (!(pointPairs.is_open()))
-    {
-         cout << "Failed to open point pairs file!\n\n";
-    }
-    else
-    {
-        cout << "Successfully opened point pairs file.\n";
-    }
-    
-    /*--------------------------------------------------------------------------
-    //////////////////////////  Read point pairs file  /////////////////////////
-    --------------------------------------------------------------------------*/
+	return -1;
 	
-	//Declares strings to hold paths to fixed and moving images
-	string pathMhdFixed;
-	string pathMhdMoving;
-    
-    //Declares and initializes strings
-    //of point pair file parameters
-    string strPoint = "Point_X->";
-    string strPointDim = "Point_0->0";
-    string strManChosen = "ManuallyChosen=";
-    string strSysGuess = "_SystemGuess=";
-    string strUnsure ="VeryUnsure=";
-    string strPointCorr = "Point_0->0_Corresp=";
-
-    //Keeps track of current line
-    int lineNum = 0;
-    
-    //Reads file path lines of iX output and
-    //positions ifstream to begin reading points
-    pointPairs >> currentLine;
-	pathMhdFixed = currentLine;
+} // end parseLogLevel
+
+
+//**************************************************************
+// Function detectIsaLevel is defined.                         *
+// The function returns the best instruction set of the        *
+// vector kernels which the CPU and operating system support.  *
+//**************************************************************
+
+int detectIsaLevel()
+{
+#ifdef LMK_X86
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+	{
+		return ISA_AVX512;
+	}
+	else if (__builtin_cpu_supports("avx2"))
+	{
+		return ISA_AVX2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		return ISA_SSE2;
+	}
+#endif
+	
+	return ISA_SCALAR;
 	
-	//Checks if Windows file path is present and replaces it with Linux
-	//compatible file path. Removes leading "Scan_x=" characters, too.
-	if(pathMhdFixed[7]=='Z')
+} // end detectIsaLevel
+
+
+// Names of the instruction sets, as given to -isa.
+const char *ISA_LEVEL_NAMES[NUM_ISA_LEVELS] = {"scalar", "sse2", "avx2", "avx512"};
+
+
+//**************************************************************
+// Function parseIsaLevel is defined.                          *
+// The function returns the instruction set of the given       *
+// name, the detected one for auto, or -1 if unrecognized.     *
+//**************************************************************
+
+int parseIsaLevel(string name)
+{
+	if (name == "auto")
 	{
-	    pathMhdFixed.erase(0,9);
-		pathMhdFixed.insert(0,"/rdo/home/cguy");
-		for(int i = 0; i < pathMhdFixed.length(); i++)
-		{
-		    if(pathMhdFixed[i] == '\\')
-			    pathMhdFixed.replace(i,1,"/");
-		}
+		return detectIsaLevel();
 	}
-	else if (pathMhdFixed[7] =='X')
+	for (int iLevel = 0; iLevel < NUM_ISA_LEVELS; iLevel++)
 	{
-	    pathMhdFixed.erase(0,9);
-		pathMhdFixed.insert(0,"/rdo/home/cguy/ix");
-		for(int i = 0; i < pathMhdFixed.length(); i++)
+		if (name == ISA_LEVEL_NAMES[iLevel])
 		{
-		    if(pathMhdFixed[i] == '\\')
-			    pathMhdFixed.replace(i,1,"/");
+			return iLevel;
 		}
 	}
-	else
+	
+	return -1;
+	
+} // end parseIsaLevel
+
+
+//**************************************************************
+// Function selectIsaLevel is defined.                         *
+// The function sets the instruction set of the vector         *
+// kernels. Returns false, leaving it unchanged, if the CPU    *
+// does not support it.                                        *
+//**************************************************************
+
+bool selectIsaLevel(int level)
+{
+	if (level > detectIsaLevel())
 	{
-	    pathMhdFixed.erase(0,7);
+		LOG_MESSAGE(LOG_ERROR, "isa", "", "Instruction set " << ISA_LEVEL_NAMES[level]
+		            << " is not supported by this CPU");
+		return false;
 	}
 	
-    lineNum++;
-    pointPairs >> currentLine;
-	pathMhdMoving = currentLine;
-    lineNum++;
-    
-    //Declares SystemGuess and numPointsFound flag
-    bool systemGuessPresent;
-    bool numPointsFound = false;
-    
-    //While points remaining
-    while(!(pointPairs.eof()))
-    {
-        //Initializes SystemGuess flag
-        systemGuessPresent = false;
-                              
-        //Reads Distinctiveness
-        pointPairs >> currentLine;
-        lineNum++;
-        
-        //Corrects point numbering format to match current file
-        if(!numPointsFound)
-        {
-             //If three digits per point number
-             if(currentLine[9] == '-')
-             {                 
-                 strPoint.insert(6,"XX");
-                 strPointDim.insert(6,"00");
-                 strPointCorr.insert(6,"00");
-             }
-             //If two digits per point number
-             else if(currentLine[8] == '-')
-             {
-                 strPoint.insert(6,"X");
-                 strPointDim.insert(6,"0");
-                 strPointCorr.insert(6,"0");
-             }
-             //Else one digit per point number
-             numPointsFound = true;    
-        }//end if numPointsFound
-        
-        //Makes sure end of file not reached
-        if(!pointPairs.fail())
-        {
-            //Reads ManuallyChosen
-            pointPairs >> currentLine;
-            lineNum++;
-        
-            //Verifies ManuallyChosen is present then extracts value
-            if(currentLine.compare(strPoint.length(),
-                  strManChosen.length(), strManChosen) == 0)
-            {
-                currentLine = currentLine.erase(0,(strPoint.length()
-                                                  + strManChosen.length()));
-            }
-            else // When file structure incorrect
-            {
-                cout << "Error reading point pair file value: ManuallyChosen";
-                cout << " at line " << lineNum << endl;
-                cout << currentLine;
-            }
-        
-            //If point was not manually chosen, point
-            //coordinates will appear sequentially
-            if(currentLine.compare("0") == 0)
-            {
-               //Reads SqDiffRegion and VeryUnsure
-               //NOTE: If automatically chosen,
-               //      VeryUnsure will always be false
-               pointPairs >> currentLine;
-               lineNum++;
-               pointPairs >> currentLine;
-               lineNum++;
-           
-               //Extracts X,Y,Z coordinates of point pair
-               for(int j = 0; j < NUM_DIMS; j++)
-               {
-                   
-                    //Gets coodinate line
-                    pointPairs >> currentLine;
-                    lineNum++;
-              
-                    //Checks for SystemGuess and skips if present
-                    if(currentLine.compare(strPointDim.length(),
-                          strSysGuess.length(),strSysGuess)==0)
-                    {
-                        pointPairs >> currentLine;
-                        systemGuessPresent = true;
-                    }
-              
-                    //Gets fixed coordinate
-                    //Erases "Point_000->0=" from start of line
-                    currentLine == currentLine.erase(0,
-                                                   (strPointDim.length() + 1));
-                    fixedCoordsVector.push_back(atoi(currentLine.c_str()));
-           
-                    //Gets moving coodinate
-                    pointPairs >> currentLine;
-                    lineNum++;
-                    //Erases "Point_000->0_Corresp=" form start of line
-                    currentLine == currentLine.erase(0,strPointCorr.length());
-                    movingCoordsVector.push_back(atoi(currentLine.c_str()));
-              
-                 }//end for
-            }
-            else //If point was manually chosen
-            {
-             
-                 //Reads SqDiffRegion and VeryUnsure
-                 pointPairs >> currentLine;
-                 lineNum++;
-                 pointPairs >> currentLine;
-                 lineNum++;           
-
-                 //Verifies VeryUnsure is present then extracts value
-                 if((currentLine.compare(strPoint.length(),
-                       strUnsure.length(), strUnsure) == 0))
-                 {
-                     currentLine = currentLine.erase(0,(strPoint.length()
-                                                   +  strUnsure.length()));
-                 }
-                 else // When file structure incorrect
-                 {
-                     cout << "\nError reading point pair file value:";
-                     cout << " VeryUnsure at line " << lineNum << endl;
-                 }
-        
-                 //Checks if chosen pair is very uncertain
-                 if((currentLine.compare("0")) && !keep_all.compare("0"))
-                 {                       
-                     for (int jj = 0; jj < (2 * NUM_DIMS); jj++)
-                     {
-                         pointPairs >> currentLine;
-                         lineNum++;
-                    
-                         //Checks for SystemGuess and skips if present
-                         if(currentLine.compare(strPointDim.length(),
-                                          strSysGuess.length(),strSysGuess)==0)
-                         {
-                             pointPairs >> currentLine;
-                             lineNum++;
-                             systemGuessPresent = 1;
-                         }
-                     }//end for      
-                 }
-                 else //Keeps the pair
-                 {
-					 //Extracts X,Y,Z coordinates of point pair
-                     for(int j = 0; j < NUM_DIMS; j++)
-                     {
-                         //Gets coodinate line
-                         pointPairs >> currentLine;
-                         lineNum++;
-                   
-                         //Checks for SystemGuess and skips if present
-                         if(currentLine.compare(strPointDim.length(),
-                              strSysGuess.length(), strSysGuess)==0)
-                         {
-                             pointPairs >> currentLine;
-                             lineNum++;
-                             systemGuessPresent = 1;
-                         }
-                   
-                         //Gets fixed coordinate
-                         //Erases "Point_000->0=" from start of line
-                         currentLine == currentLine.erase(0,
-                                     (strPointDim.length() + 1));
-                         fixedCoordsVector.push_back(atoi(currentLine.c_str()));
-           
-                         //Gets moving coodinate
-                         pointPairs >> currentLine;
-                         lineNum++;
-                         //Erases "Point_000->0_Corresp=" form start of line
-                         currentLine == currentLine.erase(0,
-						                                strPointCorr.length());
-                         movingCoordsVector.push_back(atoi(currentLine.c_str()));
-              
-                    }//end for 
-                
-                 }//end VeryUnsure if/else
-           
-              } //end ManuallyChosen if/else
-        
-              //Skips last SystemGuess value if present
-              if(systemGuessPresent)
-              {
-                  pointPairs >> currentLine;
-                  lineNum++;
-              } 
-        }//end if blank line
+	isaLevel = level;
+	LOG_MESSAGE(LOG_DEBUG, "isa", "", "Vector kernels use " << ISA_LEVEL_NAMES[level]);
+	return true;
+	
+} // end selectIsaLevel
+
+
+// State of the logging thread and the buffers it drains.
+mutex logRegistryLock;
+vector<shared_ptr<LogRing> > logRings;
+mutex logOutputLock;
+mutex logWakeLock;
+condition_variable logWake;
+atomic<bool> logRunning(false);
+bool logStopping = false;
+thread logThread;
 
-    }//end while
+LogSession::LogSession(int level)
+{
+	startLogging(level);
+}
+
+LogSession::~LogSession()
+{
+	stopLogging();
+}
+
+
+//**************************************************************
+// Function startLogging is defined.                           *
+// The function sets the log level and, unless quiet, starts   *
+// the thread writing buffered messages to standard output.    *
+//**************************************************************
+
+void startLogging(int level)
+{
+	logLevel.store(level, memory_order_relaxed);
+	if (level == LOG_QUIET)
+	{
+		return;
+	}
 	
-	/*-------------------------------------------------------------------------
-    ////////////////////////  Open point pairs files  /////////////////////////
-    -------------------------------------------------------------------------*/
+	logStopping = false;
+	logRunning.store(true, memory_order_release);
+	logThread = thread([]()
+	{
+		unique_lock<mutex> guard(logWakeLock);
+		while (!logStopping)
+		{
+			logWake.wait_for(guard, chrono::milliseconds(50));
+			guard.unlock();
+			drainLogRings(false);
+			guard.lock();
+		}
+	});
 	
-	//Opens MetaHeader file
-    cout << "Opening MetaHeader file: ";
-    cout << pathMhdFixed << endl;
-    fixedMhd.open(pathMhdFixed.c_str());
+} // end startLogging
+
+
+//**************************************************************
+// Function stopLogging is defined.                            *
+// The function stops the logging thread once it has written   *
+// every buffered message. Later messages are written          *
+// directly.                                                   *
+//**************************************************************
+
+void stopLogging()
+{
+	if (!logThread.joinable())
+	{
+		return;
+	}
+	
+	{
+		lock_guard<mutex> guard(logWakeLock);
+		logStopping = true;
+	}
+	logWake.notify_one();
+	logThread.join();
+	
+	logRunning.store(false, memory_order_release);
+	drainLogRings(true);
+	
+} // end stopLogging
+
+
+//**************************************************************
+// Function getLogRing is defined.                             *
+// The function returns the message buffer of the calling      *
+// thread, registering it with the logging thread the first    *
+// time. Buffers outlive their threads until drained.          *
+//**************************************************************
+
+LogRing *getLogRing()
+{
+	static thread_local shared_ptr<LogRing> ring;
+	
+	if (!ring)
+	{
+		ring = make_shared<LogRing>();
+		ring->head.store(0, memory_order_relaxed);
+		ring->tail.store(0, memory_order_relaxed);
+		
+		static atomic<int> numThreads(0);
+		ring->threadNumber = numThreads++;
+		
+		lock_guard<mutex> guard(logRegistryLock);
+		logRings.push_back(ring);
+	}
+	
+	return ring.get();
+	
+} // end getLogRing
+
+
+//**************************************************************
+// Function logWrite is defined.                               *
+// The function adds a message to the calling thread's buffer. *
+// A full buffer waits for the logging thread; without one the *
+// message is written directly.                                *
+//**************************************************************
+
+void logWrite(int level, const char *phase, const string &file,
+              const string &message, double durationMs)
+{
+	LogRing *ring = getLogRing();
+	
+	LogRecord record;
+	record.level = level;
+	record.time = chrono::duration<double>(
+	              chrono::system_clock::now().time_since_epoch()).count();
+	record.durationMs = durationMs;
+	record.phase = phase;
+	record.file = file;
+	record.message = message;
+	
+	if (!logRunning.load(memory_order_acquire))
+	{
+		string line;
+		writeLogRecord(record, ring->threadNumber, line);
+		lock_guard<mutex> guard(logOutputLock);
+		fwrite(line.data(), 1, line.length(), stdout);
+		fflush(stdout);
+		return;
+	}
+	
+	size_t head = ring->head.load(memory_order_relaxed);
+	while (head - ring->tail.load(memory_order_acquire) >= LogRing::CAPACITY)
+	{
+		logWake.notify_one();
+		this_thread::yield();
+	}
+	
+	ring->records[head % LogRing::CAPACITY].level = record.level;
+	ring->records[head % LogRing::CAPACITY].time = record.time;
+	ring->records[head % LogRing::CAPACITY].durationMs = record.durationMs;
+	ring->records[head % LogRing::CAPACITY].phase = record.phase;
+	ring->records[head % LogRing::CAPACITY].file.swap(record.file);
+	ring->records[head % LogRing::CAPACITY].message.swap(record.message);
+	ring->head.store(head + 1, memory_order_release);
+	
+} // end logWrite
+
+
+//**************************************************************
+// Function drainLogRings is defined.                          *
+// The function writes the buffered messages of every thread   *
+// to standard output as JSON lines. Buffers of finished       *
+// threads are released once empty when final is false.        *
+//**************************************************************
+
+void drainLogRings(bool final)
+{
+	vector<shared_ptr<LogRing> > rings;
+	{
+		lock_guard<mutex> guard(logRegistryLock);
+		rings = logRings;
+	}
+	
+	string output;
+	for (size_t iRing = 0; iRing < rings.size(); iRing++)
+	{
+		LogRing &ring = *rings[iRing];
+		size_t tail = ring.tail.load(memory_order_relaxed);
+		size_t head = ring.head.load(memory_order_acquire);
+		
+		for (; tail != head; tail++)
+		{
+			writeLogRecord(ring.records[tail % LogRing::CAPACITY],
+			               ring.threadNumber, output);
+		}
+		ring.tail.store(tail, memory_order_release);
+	}
+	
+	if (!output.empty())
+	{
+		lock_guard<mutex> guard(logOutputLock);
+		fwrite(output.data(), 1, output.length(), stdout);
+		fflush(stdout);
+	}
+	
+	// Only the registry and this copy hold the buffer of a finished thread.
+	if (!final)
+	{
+		lock_guard<mutex> guard(logRegistryLock);
+		for (size_t iRing = 0; iRing < logRings.size(); )
+		{
+			if ((logRings[iRing].use_count() == 2) &&
+			    (logRings[iRing]->tail.load(memory_order_relaxed) ==
+			     logRings[iRing]->head.load(memory_order_acquire)))
+			{
+				logRings.erase(logRings.begin() + iRing);
+			}
+			else
+			{
+				iRing++;
+			}
+		}
+	}
+	
+} // end drainLogRings
+
+
+//**************************************************************
+// Function writeLogRecord is defined.                         *
+// The function appends a message to the output as one line    *
+// of JSON holding its time, level, thread, phase, file, text  *
+// and, when timed, duration in milliseconds.                  *
+//**************************************************************
+
+void writeLogRecord(const LogRecord &record, int threadNumber, string &output)
+{
+	const char *LEVEL_NAMES[] = {"quiet", "error", "warn", "info", "debug"};
+	
+	char number[64];
+	snprintf(number, sizeof(number), "{\"ts\":%.6f,\"level\":\"", record.time);
+	output += number;
+	output += LEVEL_NAMES[record.level];
+	snprintf(number, sizeof(number), "\",\"thread\":%d,\"phase\":\"", threadNumber);
+	output += number;
+	output += record.phase;
+	output += "\",\"file\":\"";
+	
+	// Paths and messages are escaped as JSON strings.
+	const string *texts[] = {&record.file, &record.message};
+	for (int iText = 0; iText < 2; iText++)
+	{
+		const string &text = *texts[iText];
+		for (size_t iChar = 0; iChar < text.length(); iChar++)
+		{
+			unsigned char c = text[iChar];
+			if ((c == '"') || (c == '\\'))
+			{
+				output += '\\';
+				output += c;
+			}
+			else if (c < 0x20)
+			{
+				snprintf(number, sizeof(number), "\\u%04x", c);
+				output += number;
+			}
+			else
+			{
+				output += c;
+			}
+		}
+		output += (iText == 0) ? "\",\"msg\":\"" : "\"";
+	}
+	
+	if (record.durationMs >= 0)
+	{
+		snprintf(number, sizeof(number), ",\"duration_ms\":%.3f", record.durationMs);
+		output += number;
+	}
+	output += "}\n";
+	
+} // end writeLogRecord
+
+
+//***********************************************************
+// Function convertFile is defined.                         *
+// The function reads the landmarks of one input file and   *
+// writes them in the requested output format, skipping the *
+// work when the conversion cache holds a matching result.  *
+//***********************************************************
+
+bool convertFile(string pathInput, const ConverterOptions &options)
+{
+	const string &inputType = options.inputType;
+	const string &outputType = options.outputType;
+	const string &pathOutput = options.pathOutput;
+	
+	// The key identifies the input contents and options of this conversion.
+	uint64_t cacheKey = 0;
+	if ((options.cache != NULL) || (options.journal != NULL))
+	{
+		cacheKey = getCacheKey(pathInput, options);
+	}
+	
+	// Inputs completed by an earlier run of the batch are skipped. The
+	// cohort file and catalog need every case's landmarks, so nothing is
+	// skipped then.
+	// Shared-memory input has no file contents to key on.
+	bool needsLandmarks = (options.cohort != NULL) || (options.catalog != NULL) ||
+	                      !options.shmName.empty() || (inputType == "lmk_shm");
+	if ((options.journal != NULL) && !needsLandmarks &&
+	    journalIsComplete(*options.journal, pathInput, cacheKey))
+	{
+		LOG_MESSAGE(LOG_INFO, "journal", pathInput, "Already converted");
+		return true;
+	}
+	
+	// Resampled and cropped images, and intensities sampled into VTK
+	// files, depend on voxel data the key does not cover; the images are
+	// also too large to be worth caching.
+	bool cacheOutputs = (options.cache != NULL) && (outputType != "img_mhd") &&
+	                    (options.cropMargin < 0) &&
+	                    !((outputType == "vtk_vtp") && options.vtpIntensity);
+	
+	// The cache is consulted before the input is parsed. A missing input
+	// is keyed on its path, so it is read, and fails, rather than having
+	// outputs restored; failed reads are never stored.
+	if (cacheOutputs && !needsLandmarks && (access(pathInput.c_str(), R_OK) == 0))
+	{
+		CacheEntry entry;
+		
+		if (cacheLookup(*options.cache, cacheKey, entry) &&
+		    cacheRestore(*options.cache, cacheKey, entry, pathOutput))
+		{
+			LOG_MESSAGE(LOG_INFO, "cache", pathInput, "Up to date");
+			if (options.journal != NULL)
+			{
+				journalRecord(*options.journal, pathInput, cacheKey,
+				              getOutputPaths(pathInput, options));
+			}
+			return true;
+		}
+	}
+	
+/*-----------------------------------------------------------------------------
+//////////////////////////   Read Input Landmarks   ///////////////////////////
+-----------------------------------------------------------------------------*/
     
-    //Checks for successful file open
-    if (!(fixedMhd.is_open()))
-    {
-        cout << "Failed to open fixed image file!\n";
-    }
-    else
+    // Conversion process is started.
+    LogTimer convertTimer("convert", pathInput);
+    LOG_MESSAGE(LOG_DEBUG, "convert", pathInput, "Starting conversion");
+	
+	LandmarkPairs readPair;
     {
-        cout << "Successfully opened fixed image file.\n";
-    }
-    
-    
-    /*-------------------------------------------------------------------------
-    /////////////////////////  Read Meta Header file  /////////////////////////
-    -------------------------------------------------------------------------*/
-    
-    //Declares variables to hold data which
-    //will be extracted from fixed image file
-    string orientation; //Holds orienation matrix
-    string imgDim;      //Holds image dimensions
-    string offset;      //Holds image offset
-    string spacing;     //Holds element spacing
+        LogTimer readTimer("read", pathInput);
     
-    //Declares and initializes strings which
-    //begin corresponding lines for extraction
-    string strOrientation = "Orientation = ";
-    string strImgDim = "DimSize = ";
-    string strOffset = "Offset = ";
-    string strSpacing = "ElementSpacing = ";
+        // The conversion function matching the input landmarks format is called.
+        if (inputType == "ix_pp") // iX point pairs specified.
+        {
+            readPair= readLandmarksIx(pathInput, outputType, options.keep_all);
+        }
+        else if (inputType == "ireg") // Caliper registration output specified.
+        {
+            readPair = readLandmarksIreg(pathInput);
+        }
+#ifdef LMK_USE_SQLITE
+        else if (inputType == "lmk_db") // Landmark catalog query specified.
+        {
+            readPair = readLandmarksCatalog(pathInput, options.query, options.near);
+        }
+#endif
+        else if (inputType == "lmk_shm") // Shared-memory landmarks specified.
+        {
+            readPair = readLandmarksShm(pathInput);
+        }
+        else if (inputType == "tfx_lmk") // Transformix parameter file specified.
+        {
+            readPair = readLandmarksTransformix(pathInput);
+        }
+        else if (inputType == "slr_fid") // Slicer fiducials specified.
+        {
+            readPair = readLandmarksSlicer(pathInput, options.pathRefImage);
+        }
+        else // Incorrect format was specified.
+        {
+            LOG_MESSAGE(LOG_ERROR, "read", pathInput, "Unexpected input format: " <<
+                        inputType << "; options are: ix_pp, ireg, lmk_db, lmk_shm, "
+                        "tfx_lmk, slr_fid");
+            return false;     
+        }
+    }
+	
+	// Nothing is written, journaled or cached for an input that failed.
+	if (readPair.readFailed)
+	{
+		return false;
+	}
+	
+	// The images are cropped to the landmarks, which are then written in
+	// the frame of the cropped images.
+	if ((options.cropMargin >= 0) &&
+	    !cropLandmarkImages(readPair, options.cropMargin, pathInput, pathOutput))
+	{
+		return false;
+	}
+	
+/*-----------------------------------------------------------------------------
+/////////////////////////   Write Output Landmarks   //////////////////////////
+-----------------------------------------------------------------------------*/
+
+    // Catalog and shared-memory cases may turn out to have no moving
+    // landmarks only once they are read.
+    bool hasMoving = writesMovingLandmarks(pathInput, inputType) &&
+                     !readPair.moving.empty();
     
-    //Reads first line
-    getline(fixedMhd, currentLine);
+    // Formatted files are written by the output threads, if there are any,
+    // and the conversion is recorded once the last of them is written.
+    OutputCase *owner = new OutputCase;
+    owner->outputQueue = options.outputQueue;
+    owner->pathInput = pathInput;
+    owner->cacheKey = cacheKey;
+    owner->cache = cacheOutputs ? options.cache : NULL;
+    owner->journal = options.journal;
+    owner->pathOutput = pathOutput;
+    owner->pending = 1;
+    owner->failed = false;
+    owner->complete = false;
     
-    //Continues reading file until end, storing necessary values
-    while(!fixedMhd.eof())
+    // Write process is started.
     {
-        //Checks for orientation tag and extracts data if present             
-        if(currentLine.compare(0, strOrientation.length(), strOrientation)==0)
+        LogTimer writeTimer("write", pathInput);
+        
+        // The write function matching the output landmarks format is called.
+        if (((outputType == "tfx_lmk") || (outputType == "img_mhd")) &&
+            !hasMoving) // Fixed landmarks only.
+        {
+            LOG_MESSAGE(LOG_ERROR, "write", pathInput,
+                        "Output of type " << outputType << " requires moving landmarks");
+            releaseOutputCase(owner);
+            return false;
+        }
+        else if (outputType == "tfx_lmk") // Transformix parameter file.
         {
-             orientation = currentLine.erase(0, strOrientation.length());
+            writeLandmarksTransformix(readPair, pathInput, pathOutput,
+                                      options.writeThreads, owner);
         }
-        //Checks for image dimensions tag and extracts data if present   
-        else if(currentLine.compare(0, strImgDim.length(), strImgDim)==0)
+        else if (outputType == "slr_fid") // Slicer fiducials.
         {
-             imgDim = currentLine.erase(0, strImgDim.length());
+            writeLandmarksSlicer(readPair, pathInput, pathOutput, true,
+                                 options.writeThreads, owner);
+		
+			if (hasMoving)
+			{
+			    writeLandmarksSlicer(readPair, pathInput, pathOutput, false,
+			                         options.writeThreads, owner);
+			}
         }
-        //Checks for offset tag and extracts data if present   
-        else if(currentLine.compare(0, strOffset.length(), strOffset)==0)
+		else if (outputType == "std_txt") // Plain text.
         {
-             offset = currentLine.erase(0, strOffset.length());
+            writeLandmarksText(readPair, pathInput, pathOutput, true, owner);
+		
+			if (hasMoving)
+			{
+			    writeLandmarksText(readPair, pathInput, pathOutput, false, owner);
+			}
         }
-        //Checks for element spacing tag and extracts data if present   
-        else if(currentLine.compare(0, strSpacing.length(), strSpacing)==0)
+		else if (outputType == "vtk_vtp") // VTK PolyData.
         {
-             spacing = currentLine.erase(0, strSpacing.length());
+            if (!writeLandmarksVtk(readPair, pathInput, pathOutput, true,
+                                   options.vtpZlib, options.vtpIntensity, owner) ||
+                (hasMoving &&
+                 !writeLandmarksVtk(readPair, pathInput, pathOutput, false,
+                                    options.vtpZlib, options.vtpIntensity, owner)))
+            {
+                releaseOutputCase(owner);
+                return false;
+            }
         }
-        
-        //Reads next line
-        getline(fixedMhd, currentLine);
-        
-    }//end while
+		else if (outputType == "img_mhd") // Resampled moving image.
+        {
+            if (!resampleImage(readPair, NULL, options.resampleMode, pathInput,
+                               pathOutput, options.writeThreads))
+            {
+                releaseOutputCase(owner);
+                return false;
+            }
+        }
+        else // Incorrect format was specified.
+        {
+            LOG_MESSAGE(LOG_ERROR, "write", pathInput, "Unexpected output format: " <<
+                        outputType << "; options are: tfx_lmk, slr_fid, std_txt, "
+                        "vtk_vtp, img_mhd");
+            releaseOutputCase(owner);
+            return false;     
+        }
+    }
+	
+	// The landmarks are added to the cohort file as one row group.
+	if ((options.cohort != NULL) &&
+	    !cohortAppend(*options.cohort, getFileStem(pathInput), readPair))
+	{
+		LOG_MESSAGE(LOG_ERROR, "cohort", pathInput,
+		            "Failed to add case to cohort file");
+		releaseOutputCase(owner);
+		return false;
+	}
+	
+#ifdef LMK_USE_SQLITE
+	// The landmarks are loaded into the catalog.
+	if ((options.catalog != NULL) &&
+	    !catalogAdd(*options.catalog, getFileStem(pathInput), pathInput, readPair))
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathInput, "Failed to add case to catalog");
+		releaseOutputCase(owner);
+		return false;
+	}
+#endif
+	
+	// The landmarks are published to co-located processes.
+	if (!options.shmName.empty())
+	{
+		string segmentName = options.shmName;
+		size_t casePos = segmentName.find("{case}");
+		if (casePos != string::npos)
+		{
+			segmentName.replace(casePos, 6, getFileStem(pathInput));
+		}
+		
+		if (!publishLandmarks(segmentName, getFileStem(pathInput), readPair))
+		{
+			LOG_MESSAGE(LOG_ERROR, "shm", pathInput,
+			            "Failed to publish landmarks to " << segmentName);
+			releaseOutputCase(owner);
+			return false;
+		}
+	}
+	
+	// The outputs are stored so an unchanged input is skipped next time,
+	// and completion recorded, once every output has been written.
+	owner->outputPaths = getOutputPaths(pathInput, options);
+	owner->complete = true;
+	
+	// Without output threads every file has been written by now; files
+	// failing later are counted by the output queue.
+	bool written = (owner->outputQueue != NULL) || !owner->failed;
+	releaseOutputCase(owner);
+
+    return written;
     
+} // end convertFile
 
-    /*-------------------------------------------------------------------------
-    ///////////////////////  Extract offset components  ///////////////////////
-    -------------------------------------------------------------------------*/
+
+
+//***********************************************************
+// Function readLandmarksIx is defined.                     *
+// The function reads landmark coordinates from an iX point *
+// pairs file and converts them into physical coordinates   *
+// before returning them in a vector.                       *
+//***********************************************************
+
+LandmarkPairs readLandmarksIx(string pathInput, string outType, string keep_all)
+{
+
+    // Output landmark pairs structure is created.
+	LandmarkPairs pairs;
+	pairs.readFailed = false;
+                     
+    // String to hold read lines is declared.
+    string currentLine;
     
-    //Initializes variables
-    //for data extraction
-    float offsets [3] = {0,0,0};  //Holds component offsets
-    std::istringstream inputOffset(offset);
-    inputOffset >> offsets[0] >> offsets[1] >> offsets[2];
-	                            
-                                    
-    /*-------------------------------------------------------------------------
-    //////////////////////  Extract spacing components  ///////////////////////
+    // Variable holding the number of dimensions is declared and initialized.
+    const int NUM_DIMS = 3;
+	
+	// Vectors created to hold converted coordinates.
+	vector<double> fixedCoordsVector;
+	vector<double> movingCoordsVector;
+    
+    /*--------------------------------------------------------------------------
+    ////////////////////////  Open point pairs files  //////////////////////////
+    --------------------------------------------------------------------------*/
+    
+    // Point pairs file is read into memory in one piece.
+    LOG_MESSAGE(LOG_DEBUG, "read", pathInput, "Opening point pairs file");
+    vector<char> buffer;
+    
+    // Check is performed for successful file open.
+    if (!readFileBuffer(pathInput, buffer))
+    {
+         LOG_MESSAGE(LOG_ERROR, "read", pathInput,
+                     "Failed to open point pairs file");
+         pairs.numPoints = 0;
+         pairs.numDims = NUM_DIMS;
+         fill(pairs.offsets, pairs.offsets + 3, 0.0);
+         fill(pairs.spacings, pairs.spacings + 3, 0.0);
+         pairs.readFailed = true;
+         return pairs;
+    }
+    
+    /*--------------------------------------------------------------------------
+    //////////////////////////  Read point pairs file  /////////////////////////
+    --------------------------------------------------------------------------*/
+	
+	//Finds every line end and '=' of the file in one vector scan
+	const char *text = &buffer[0];
+	vector<uint32_t> lineEnds;
+	vector<uint32_t> equals;
+	indexLines(text, buffer.size() - 1, '=', lineEnds, equals);
+	
+	//Declares strings to hold paths to fixed and moving images
+	string pathMhdFixed;
+	string pathMhdMoving;
+	
+	//Declares fields of the point currently being read
+	IxPoint point;
+	point.id = -1;
+	size_t iEqual = 0;
+	size_t lineStart = 0;
+	int numScans = 0;
+	
+	for (size_t iLine = 0; iLine < lineEnds.size(); iLine++)
+	{
+		size_t lineEnd = lineEnds[iLine];
+		
+		//Trims surrounding whitespace, including Windows line ends
+		size_t first = lineStart;
+		size_t last = lineEnd;
+		while ((first < last) && isspace((unsigned char)text[first]))
+		{
+			first++;
+		}
+		while ((last > first) && isspace((unsigned char)text[last - 1]))
+		{
+			last--;
+		}
+		lineStart = lineEnd + 1;
+		
+		//Finds the first '=' of the line
+		while ((iEqual < equals.size()) && (equals[iEqual] < first))
+		{
+			iEqual++;
+		}
+		size_t equal = ((iEqual < equals.size()) && (equals[iEqual] < last)) ?
+		               equals[iEqual] : last;
+		
+		if (first == last)
+		{
+			continue;
+		}
+		
+		//Reads file path lines of iX output. Replaces a Windows file path
+		//with a Linux compatible one and removes leading "Scan_x=" characters.
+		if (numScans < 2)
+		{
+			string scanLine(text + first, last - first);
+			scanLine.erase(min(scanLine.length(), scanLine.find_first_of(" \t")));
+			if (numScans == 0)
+			{
+				pathMhdFixed = remapMhdPath(scanLine);
+			}
+			else
+			{
+				pathMhdMoving = remapMhdPath(scanLine);
+			}
+			numScans++;
+			continue;
+		}
+		
+		//Splits "Point_<id>->[<dim>]<key>=<value>" into its parts
+		IxField field = IX_UNKNOWN;
+		int id = 0;
+		int dim = -1;
+		size_t pos = first + 6;
+		
+		if ((last - first > 6) && (memcmp(text + first, "Point_", 6) == 0))
+		{
+			while ((pos < equal) && isdigit((unsigned char)text[pos]))
+			{
+				id = id * 10 + (text[pos] - '0');
+				pos++;
+			}
+			
+			if ((pos + 2 <= equal) && (text[pos] == '-') && (text[pos + 1] == '>'))
+			{
+				pos = pos + 2;
+				if ((pos < equal) && (text[pos] >= '0') &&
+				    (text[pos] < '0' + NUM_DIMS))
+				{
+					dim = text[pos] - '0';
+					pos++;
+				}
+				field = classifyIxKey(text + pos, equal - pos);
+				
+				//Dimension is required by coordinate keys only
+				if ((dim < 0) != (field <= IX_VERY_UNSURE))
+				{
+					field = IX_UNKNOWN;
+				}
+			}
+		}
+		
+		if ((field == IX_UNKNOWN) || (equal == last))
+		{
+			LOG_MESSAGE(LOG_WARN, "read", pathInput,
+			            "Error reading point pair file value at line " <<
+			            (iLine + 1) << ": " << string(text + first, last - first));
+			continue;
+		}
+		
+		//Starts a new point when the point number changes
+		if (id != point.id)
+		{
+			storeIxPoint(point, keep_all, fixedCoordsVector, movingCoordsVector,
+			             pairs);
+			point = IxPoint();
+			point.id = id;
+		}
+		
+		//Stores the value of the field
+		const char *value = text + equal + 1;
+		switch (field)
+		{
+			case IX_DISTINCTIVENESS:
+				point.distinctiveness = strtod(value, NULL);
+				break;
+			case IX_MANUALLY_CHOSEN:
+				point.manual = (parseIxInteger(value) != 0);
+				break;
+			case IX_VERY_UNSURE:
+				point.unsure = (parseIxInteger(value) != 0);
+				break;
+			case IX_COORDINATE:
+				point.fixed[dim] = parseIxInteger(value);
+				point.fixedFound |= (1 << dim);
+				break;
+			case IX_CORRESP:
+				point.moving[dim] = parseIxInteger(value);
+				point.movingFound |= (1 << dim);
+				break;
+			case IX_SYSTEM_GUESS:
+				point.systemGuess = true;
+				break;
+			default:
+				break;
+		}
+		
+	}//end for
+	
+	//Stores the last point
+	storeIxPoint(point, keep_all, fixedCoordsVector, movingCoordsVector, pairs);
+	
+	/*-------------------------------------------------------------------------
+    /////////////////////////  Read fixed image header  ///////////////////////
     -------------------------------------------------------------------------*/
+	
+	//Reads the geometry of the fixed image, which may be a MetaImage, NRRD
+	//or NIfTI header
+    ImageGeometry geometry;
+    if (!getImageGeometry(pathMhdFixed, geometry))
+    {
+        LOG_MESSAGE(LOG_ERROR, "read", pathMhdFixed,
+                    "Failed to read fixed image header");
+        pairs.readFailed = true;
+        geometry.imgDims = "";
+        fill(geometry.offsets, geometry.offsets + 3, 0.0);
+        fill(geometry.spacings, geometry.spacings + 3, 0.0);
+    }
+    string imgDim = geometry.imgDims;
     
+    //Offsets and spacings are converted in single precision as before
+    float offsets [3] = {0,0,0};  //Holds component offsets
     float spacings [3] = {0,0,0};  //Holds component spacings
-    std::istringstream inputSpacing(spacing);
-    inputSpacing >> spacings[0] >> spacings[1] >> spacings[2];
+    for (int d = 0; d < NUM_DIMS; d++)
+    {
+        offsets[d] = geometry.offsets[d];
+        spacings[d] = geometry.spacings[d];
+    }
 									  
 									  
 	/*-------------------------------------------------------------------------
@@ -611,6 +2606,8 @@ LandmarkPairs readLandmarksIx(string pathInput, string outType, string keep_all)
 	
 	// The structure variables are assigned.
 	pairs.numPoints = fixedCoordsVector.size()/3;
+	pairs.pathFixedImage = pathMhdFixed;
+	pairs.pathMovingImage = pathMhdMoving;
 	pairs.numDims = NUM_DIMS;
 	pairs.imgDims = imgDim;
 	
@@ -649,10 +2646,6 @@ LandmarkPairs readLandmarksIx(string pathInput, string outType, string keep_all)
 	
 	} // end for iCoord
 	
-	// Files which were opened are closed.
-	pointPairs.close();
-	fixedMhd.close();
-	
 	// Order of landmarks is reversed, putting them back into original order.
 	reverse(pairs.fixed.begin(), pairs.fixed.end());
 	reverse(pairs.moving.begin(), pairs.moving.end());
@@ -672,6 +2665,7 @@ LandmarkPairs readLandmarksIx(string pathInput, string outType, string keep_all)
 LandmarkPairs readLandmarksIreg(string pathInput)
 {
 	LandmarkPairs pairs;
+	pairs.readFailed = false;
 	
 	// I/O file and string to hold read lines are declared.
     ifstream landmarkCoords;
@@ -688,18 +2682,19 @@ LandmarkPairs readLandmarksIreg(string pathInput)
     --------------------------------------------------------------------------*/
     
     // Point pairs file is opened.
-    cout << "\nOpening landmarks file: ";
-    cout << pathInput << endl;
+    LOG_MESSAGE(LOG_DEBUG, "read", pathInput, "Opening landmarks file");
     landmarkCoords.open(pathInput.c_str());
     
     // Check is performed for successful file open.
     if (!(landmarkCoords.is_open()))
     {
-         cout << "Failed to open point pairs file!\n";
-    }
-    else
-    {
-        cout << "Successfully opened point pairs file.\n";
+         LOG_MESSAGE(LOG_ERROR, "read", pathInput, "Failed to open landmarks file");
+         pairs.numPoints = 0;
+         pairs.numDims = NUM_DIMS;
+         fill(pairs.offsets, pairs.offsets + 3, 0.0);
+         fill(pairs.spacings, pairs.spacings + 3, 0.0);
+         pairs.readFailed = true;
+         return pairs;
     }
 	
 	
@@ -736,6 +2731,18 @@ LandmarkPairs readLandmarksIreg(string pathInput)
 	pairs.numDims = 3;
 	pairs.numPoints = (coordsVector.size()/3);
 	
+	// Landmarks are physical coordinates without an image geometry.
+	fill(pairs.offsets, pairs.offsets + 3, 0.0);
+	fill(pairs.spacings, pairs.spacings + 3, 0.0);
+	
+	// Landmarks carry no iX attributes, so they are numbered in order.
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+	    pairs.pointIds.push_back(iPoint);
+	}
+	pairs.distinctiveness.assign(pairs.numPoints, 0.0);
+	pairs.flags.assign(pairs.numPoints, 0);
+	
     // Order of landmarks is reversed.
 	reverse(pairs.fixed.begin(), pairs.fixed.end());
 	
@@ -744,6 +2751,667 @@ LandmarkPairs readLandmarksIreg(string pathInput)
 } // end readLandmarksIreg
 
 
+//**************************************************************
+// Function readLandmarksTransformix is defined.               *
+// The function reads the landmarks of a Transformix parameter *
+// file written by writeLandmarksTransformix, so outputs can   *
+// be regenerated without the original input. The moving       *
+// landmarks are the TransformParameters, the fixed landmarks  *
+// the FixedImageLandmarks, and the geometry is read from      *
+// Size, Spacing and Origin. The file is parsed in one pass.   *
+//**************************************************************
+
+LandmarkPairs readLandmarksTransformix(string pathInput)
+{
+	LandmarkPairs pairs;
+	pairs.numPoints = 0;
+	pairs.numDims = 3;
+	fill(pairs.offsets, pairs.offsets + 3, 0.0);
+	fill(pairs.spacings, pairs.spacings + 3, 0.0);
+	pairs.readFailed = false;
+	
+    LOG_MESSAGE(LOG_DEBUG, "read", pathInput, "Opening transform parameters file");
+	vector<char> buffer;
+	if (!readFileBuffer(pathInput, buffer))
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathInput,
+		            "Failed to open transform parameters file");
+		pairs.readFailed = true;
+		return pairs;
+	}
+	
+	/*--------------------------------------------------------------------------
+    /////////////////////////  Read parameter values  //////////////////////////
+    --------------------------------------------------------------------------*/
+	
+	// Landmarks as written, x,y,z per point.
+	vector<double> movingValues;
+	vector<double> fixedValues;
+	vector<double> spacings;
+	vector<double> origins;
+	
+	// Each parameter is "(Name values)"; comments run from "//" to the end
+	// of the line.
+	const char *c = &buffer[0];
+	const char *end = c + buffer.size() - 1;
+	while (c < end)
+	{
+		if ((c[0] == '/') && (c[1] == '/'))
+		{
+			const char *lineEnd = (const char *)memchr(c, '\n', end - c);
+			c = (lineEnd != NULL) ? lineEnd : end;
+			continue;
+		}
+		if (*c != '(')
+		{
+			c++;
+			continue;
+		}
+		
+		const char *name = ++c;
+		while ((c < end) && !isspace((unsigned char)*c) && (*c != ')'))
+		{
+			c++;
+		}
+		string key(name, c);
+		
+		vector<double> *values = NULL;
+		if (key == "TransformParameters")
+		{
+			values = &movingValues;
+		}
+		else if (key == "FixedImageLandmarks")
+		{
+			values = &fixedValues;
+		}
+		else if (key == "Spacing")
+		{
+			values = &spacings;
+		}
+		else if (key == "Origin")
+		{
+			values = &origins;
+		}
+		
+		// Numbers are parsed in place up to the closing parenthesis.
+		if (values != NULL)
+		{
+			while (true)
+			{
+				while ((c < end) && isspace((unsigned char)*c))
+				{
+					c++;
+				}
+				char *next;
+				double value = strtod(c, &next);
+				if ((c >= end) || (next == c))
+				{
+					break;
+				}
+				values->push_back(value);
+				c = next;
+			}
+		}
+		
+		const char *close = (const char *)memchr(c, ')', end - c);
+		if (close == NULL)
+		{
+			break;
+		}
+		
+		// Dimensions are kept as written.
+		if (key == "Size")
+		{
+			while ((c < close) && isspace((unsigned char)*c))
+			{
+				c++;
+			}
+			pairs.imgDims.assign(c, close);
+		}
+		c = close + 1;
+	}
+	
+	if ((movingValues.size() != fixedValues.size()) ||
+	    ((fixedValues.size() % 3) != 0))
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathInput, "Expected equal numbers of "
+		            "fixed and moving coordinates, found " << fixedValues.size() <<
+		            " and " << movingValues.size());
+		pairs.readFailed = true;
+		return pairs;
+	}
+	if ((spacings.size() == 3) && (origins.size() == 3))
+	{
+		copy(spacings.begin(), spacings.end(), pairs.spacings);
+		copy(origins.begin(), origins.end(), pairs.offsets);
+	}
+	else
+	{
+		LOG_MESSAGE(LOG_WARN, "read", pathInput, "Spacing or Origin missing");
+	}
+	
+	/*--------------------------------------------------------------------------
+    ///////////////////////////  Store landmarks  //////////////////////////////
+    --------------------------------------------------------------------------*/
+	
+	// Landmarks are stored z,y,x.
+	pairs.numPoints = fixedValues.size() / 3;
+	pairs.fixed.resize(fixedValues.size());
+	pairs.moving.resize(movingValues.size());
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			pairs.fixed[iPoint * 3 + d] = fixedValues[iPoint * 3 + (2 - d)];
+			pairs.moving[iPoint * 3 + d] = movingValues[iPoint * 3 + (2 - d)];
+		}
+	}
+	
+	// Landmarks carry no iX attributes, so they are numbered in order.
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+	    pairs.pointIds.push_back(iPoint);
+	}
+	pairs.distinctiveness.assign(pairs.numPoints, 0.0);
+	pairs.flags.assign(pairs.numPoints, 0);
+	
+	return pairs;
+	
+} // end readLandmarksTransformix
+
+
+//**************************************************************
+// Function readLandmarksSlicer is defined.                    *
+// The function reads 3D Slicer fiducials, such as those of    *
+// writeLandmarksSlicer after correction in Slicer. A          *
+// _fixed_slicer or _moving_slicer file is paired with its     *
+// counterpart by label; other files, or fixed files without   *
+// a counterpart, give fixed landmarks only. The geometry is   *
+// read from the reference image, if one is given.             *
+//**************************************************************
+
+LandmarkPairs readLandmarksSlicer(string pathInput, string pathRefImage)
+{
+	LandmarkPairs pairs;
+	pairs.numPoints = 0;
+	pairs.numDims = 3;
+	fill(pairs.offsets, pairs.offsets + 3, 0.0);
+	fill(pairs.spacings, pairs.spacings + 3, 0.0);
+	pairs.readFailed = false;
+	
+	// The fixed file is read first, whichever of the pair was given.
+	string pathFixed = pathInput;
+	string pathMoving = getSlicerCounterpart(pathInput);
+	if (!writesMovingLandmarks(pathInput, "slr_fid"))
+	{
+		pathMoving = "";
+	}
+	else if (getFileStem(pathInput).find("_moving_slicer") != string::npos)
+	{
+		swap(pathFixed, pathMoving);
+	}
+	
+    LOG_MESSAGE(LOG_DEBUG, "read", pathFixed, "Opening fiducial file");
+	vector<double> fixedCoords;
+	vector<string> fixedLabels;
+	if (!readFiducials(pathFixed, fixedCoords, fixedLabels))
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathFixed, "Failed to open fiducial file");
+		pairs.readFailed = true;
+		return pairs;
+	}
+	
+	vector<double> movingCoords;
+	vector<string> movingLabels;
+	if (!pathMoving.empty())
+	{
+		LOG_MESSAGE(LOG_DEBUG, "read", pathMoving, "Opening fiducial file");
+		if (!readFiducials(pathMoving, movingCoords, movingLabels))
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", pathMoving, "Failed to open fiducial file");
+			pairs.readFailed = true;
+			return pairs;
+		}
+	}
+	
+	/*--------------------------------------------------------------------------
+    ////////////////////////////  Pair landmarks  //////////////////////////////
+    --------------------------------------------------------------------------*/
+	
+	// Fixed fiducials are matched to the moving fiducials of the same label.
+	// Files written by this program list the same labels in the same order.
+	vector<int> movingMatches(fixedLabels.size(), -1);
+	if (!pathMoving.empty())
+	{
+		if (movingLabels == fixedLabels)
+		{
+			for (size_t i = 0; i < fixedLabels.size(); i++)
+			{
+				movingMatches[i] = i;
+			}
+		}
+		else
+		{
+			map<string, int> movingIndex;
+			for (size_t i = 0; i < movingLabels.size(); i++)
+			{
+				movingIndex.insert(make_pair(movingLabels[i], (int)i));
+			}
+			for (size_t i = 0; i < fixedLabels.size(); i++)
+			{
+				map<string, int>::iterator match = movingIndex.find(fixedLabels[i]);
+				if (match != movingIndex.end())
+				{
+					movingMatches[i] = match->second;
+					movingIndex.erase(match);
+				}
+			}
+		}
+	}
+	
+	int numUnmatched = 0;
+	for (size_t i = 0; i < fixedLabels.size(); i++)
+	{
+		if (!pathMoving.empty() && (movingMatches[i] < 0))
+		{
+			numUnmatched++;
+			continue;
+		}
+		
+		for (int d = 0; d < 3; d++)
+		{
+			pairs.fixed.push_back(fixedCoords[i * 3 + d]);
+			if (!pathMoving.empty())
+			{
+				pairs.moving.push_back(movingCoords[movingMatches[i] * 3 + d]);
+			}
+		}
+		
+		// Numeric labels, as written by this program, count from 1.
+		char *labelEnd;
+		long label = strtol(fixedLabels[i].c_str(), &labelEnd, 10);
+		bool numbered = !fixedLabels[i].empty() && (*labelEnd == '\0');
+		pairs.pointIds.push_back(numbered ? (int)(label - 1) : pairs.numPoints);
+		pairs.numPoints++;
+	}
+	pairs.distinctiveness.assign(pairs.numPoints, 0.0);
+	pairs.flags.assign(pairs.numPoints, 0);
+	
+	if (!pathMoving.empty() && ((numUnmatched > 0) ||
+	                            (movingLabels.size() != (size_t)pairs.numPoints)))
+	{
+		LOG_MESSAGE(LOG_WARN, "read", pathInput, "Dropped " << numUnmatched <<
+		            " fixed and " << (movingLabels.size() - pairs.numPoints) <<
+		            " moving fiducials without a counterpart");
+	}
+	
+	// Fiducials carry no geometry, so it is taken from the reference image.
+	if (!pathRefImage.empty())
+	{
+		ImageGeometry geometry;
+		if (getImageGeometry(pathRefImage, geometry))
+		{
+			copy(geometry.offsets, geometry.offsets + 3, pairs.offsets);
+			copy(geometry.spacings, geometry.spacings + 3, pairs.spacings);
+			pairs.imgDims = geometry.imgDims;
+			pairs.pathFixedImage = pathRefImage;
+		}
+		else
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", pathRefImage,
+			            "Failed to read reference image geometry");
+			pairs.readFailed = true;
+		}
+	}
+	
+	return pairs;
+	
+} // end readLandmarksSlicer
+
+
+//**************************************************************
+// Function readFiducials is defined.                          *
+// The function reads the fiducials of one .fcsv file, finding *
+// its line ends and commas with the vector scan of indexLines *
+// and parsing the label and coordinate columns in place. The  *
+// columns are located by the "# columns" header, defaulting   *
+// to label,x,y,z. RAS coordinates, which Slicer uses unless   *
+// "# CoordinateSystem" says LPS, are converted to LPS, and    *
+// landmarks are stored z,y,x. Returns false if the file could *
+// not be read.                                                *
+//**************************************************************
+
+bool readFiducials(string path, vector<double> &coords, vector<string> &labels)
+{
+	vector<char> buffer;
+	if (!readFileBuffer(path, buffer))
+	{
+		return false;
+	}
+	
+	const char *text = &buffer[0];
+	vector<uint32_t> lineEnds;
+	vector<uint32_t> commas;
+	indexLines(text, buffer.size() - 1, ',', lineEnds, commas);
+	
+	// Columns of the label and of x, y and z.
+	int columns[4] = {0, 1, 2, 3};
+	bool ras = true;
+	
+	vector<size_t> fieldStarts;
+	size_t iComma = 0;
+	size_t lineStart = 0;
+	for (size_t iLine = 0; iLine < lineEnds.size(); iLine++)
+	{
+		size_t lineEnd = lineEnds[iLine];
+		
+		// Surrounding whitespace is trimmed, including Windows line ends.
+		size_t first = lineStart;
+		size_t last = lineEnd;
+		while ((first < last) && isspace((unsigned char)text[first]))
+		{
+			first++;
+		}
+		while ((last > first) && isspace((unsigned char)text[last - 1]))
+		{
+			last--;
+		}
+		lineStart = lineEnd + 1;
+		
+		if (first == last)
+		{
+			continue;
+		}
+		
+		// Header lines are "# key = value".
+		if (text[first] == '#')
+		{
+			string header(text + first + 1, last - first - 1);
+			size_t equal = header.find('=');
+			if (equal == string::npos)
+			{
+				continue;
+			}
+			string name = header.substr(0, equal);
+			string value = header.substr(equal + 1);
+			name.erase(0, name.find_first_not_of(" \t"));
+			name.erase(name.find_last_not_of(" \t") + 1);
+			value.erase(0, value.find_first_not_of(" \t"));
+			
+			if (name == "columns")
+			{
+				const char *NAMES[4] = {"label", "x", "y", "z"};
+				istringstream names(value);
+				string column;
+				for (int iColumn = 0; getline(names, column, ','); iColumn++)
+				{
+					column.erase(0, column.find_first_not_of(" \t"));
+					column.erase(column.find_last_not_of(" \t") + 1);
+					for (int iName = 0; iName < 4; iName++)
+					{
+						if (column == NAMES[iName])
+						{
+							columns[iName] = iColumn;
+						}
+					}
+				}
+			}
+			else if (name == "CoordinateSystem")
+			{
+				ras = (value == "0") || (value == "RAS");
+			}
+			continue;
+		}
+		
+		// Fields start at the line start and after each of its commas.
+		fieldStarts.assign(1, first);
+		while ((iComma < commas.size()) && (commas[iComma] < first))
+		{
+			iComma++;
+		}
+		while ((iComma < commas.size()) && (commas[iComma] < last))
+		{
+			fieldStarts.push_back(commas[iComma] + 1);
+			iComma++;
+		}
+		fieldStarts.push_back(last + 1);
+		
+		if (*max_element(columns, columns + 4) + 1 >= (int)fieldStarts.size())
+		{
+			LOG_MESSAGE(LOG_WARN, "read", path, "Skipped fiducial line " <<
+			            (iLine + 1) << " with too few columns");
+			continue;
+		}
+		
+		double xyz[3];
+		for (int d = 0; d < 3; d++)
+		{
+			xyz[d] = strtod(text + fieldStarts[columns[d + 1]], NULL);
+		}
+		if (ras)
+		{
+			xyz[0] = -xyz[0];
+			xyz[1] = -xyz[1];
+		}
+		coords.push_back(xyz[2]);
+		coords.push_back(xyz[1]);
+		coords.push_back(xyz[0]);
+		
+		size_t labelStart = fieldStarts[columns[0]];
+		size_t labelEnd = fieldStarts[columns[0] + 1] - 1;
+		while ((labelStart < labelEnd) && isspace((unsigned char)text[labelStart]))
+		{
+			labelStart++;
+		}
+		while ((labelEnd > labelStart) && isspace((unsigned char)text[labelEnd - 1]))
+		{
+			labelEnd--;
+		}
+		labels.push_back(string(text + labelStart, labelEnd - labelStart));
+	}
+	
+	return true;
+	
+} // end readFiducials
+
+
+//**************************************************************
+// Function getSlicerCounterpart is defined.                   *
+// The function returns the path of the _moving_slicer file of *
+// a _fixed_slicer file or vice versa, or an empty string for  *
+// other files.                                                *
+//**************************************************************
+
+string getSlicerCounterpart(string path)
+{
+	const string FIXED = "_fixed_slicer";
+	const string MOVING = "_moving_slicer";
+	
+	string stem = getFileStem(path);
+	size_t stemStart = path.rfind(stem);
+	size_t stemEnd = stemStart + stem.length();
+	
+	if ((stem.length() > FIXED.length()) &&
+	    (stem.compare(stem.length() - FIXED.length(), FIXED.length(), FIXED) == 0))
+	{
+		return path.substr(0, stemEnd - FIXED.length()) + MOVING +
+		       path.substr(stemEnd);
+	}
+	if ((stem.length() > MOVING.length()) &&
+	    (stem.compare(stem.length() - MOVING.length(), MOVING.length(), MOVING) == 0))
+	{
+		return path.substr(0, stemEnd - MOVING.length()) + FIXED +
+		       path.substr(stemEnd);
+	}
+	
+	return "";
+	
+} // end getSlicerCounterpart
+
+
+//**************************************************************
+// Function writesMovingLandmarks is defined.                  *
+// The function returns whether moving landmarks are read from *
+// an input of the given type: all but landmark lists, and     *
+// fiducials only when their file has a counterpart.           *
+//**************************************************************
+
+bool writesMovingLandmarks(string pathInput, string inputType)
+{
+	if (inputType == "ireg")
+	{
+		return false;
+	}
+	if (inputType == "slr_fid")
+	{
+		string pathCounterpart = getSlicerCounterpart(pathInput);
+		return !pathCounterpart.empty() &&
+		       (access(pathCounterpart.c_str(), F_OK) == 0);
+	}
+	
+	return true;
+	
+} // end writesMovingLandmarks
+
+
+//**************************************************************
+// Function formatLandmarkRange is defined.                    *
+// The function formats landmarks first to last (exclusive) as *
+// they are written to a Transformix parameter file or, for    *
+// slicer, to a Slicer fiducial file. Serial and parallel      *
+// writes both use it, so their outputs are identical.         *
+//**************************************************************
+
+void formatLandmarkRange(ostream &out, const vector<double> &coords, int numDims,
+                         int first, int last, bool slicer)
+{
+	for (int i = first * numDims; i < (last * numDims); i = i + 3)
+	{
+		if (slicer)
+		{
+		    if (i != 0)
+		    out << "\n";
+	        out << ((i/numDims)+1);
+		    out << ", ";
+		    out << (coords.at(i + 2) * -1.0);
+		    out << ", ";
+		    out << (coords.at(i + 1) * -1.0);
+		    out << ", ";
+		    out << coords.at(i);
+		    out << ", 0, 1";
+		}
+		else
+		{
+		    out << " ";
+		    out << coords.at(i + 2);
+		    out << " ";
+		    out << coords.at(i + 1);
+		    out << " ";
+		    out << coords.at(i);
+		}
+	}
+	
+} // end formatLandmarkRange
+
+
+//**************************************************************
+// Function writeLandmarkChunks is defined.                    *
+// The function formats the landmarks of an output file. With  *
+// several threads the landmarks are split into chunks which   *
+// are formatted concurrently into separate buffers, and the   *
+// buffers are appended in order as soon as they are complete. *
+//**************************************************************
+
+void writeLandmarkChunks(ostream &out, const vector<double> &coords, int numDims,
+                         int numPoints, bool slicer, int numThreads)
+{
+	int numChunks = (numPoints + WRITE_CHUNK_POINTS - 1) / WRITE_CHUNK_POINTS;
+	numThreads = min(numThreads, numChunks);
+	
+	// Small sets are formatted straight into the file.
+	if (numThreads <= 1)
+	{
+		formatLandmarkRange(out, coords, numDims, 0, numPoints, slicer);
+		return;
+	}
+	
+	// Formatted chunks waiting to be written. Formatting stays at most a
+	// few chunks per thread ahead of writing, bounding the memory used.
+	vector<string> chunks(numChunks);
+	vector<bool> formatted(numChunks, false);
+	int numWritten = 0;
+	int nextChunk = 0;
+	int maxAhead = 2 * numThreads;
+	mutex lock;
+	condition_variable chunkFormatted;
+	condition_variable chunkWritten;
+	
+	vector<thread> formatters;
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		formatters.push_back(thread([&]()
+		{
+			ostringstream text;
+			while (true)
+			{
+				int iChunk;
+				{
+					unique_lock<mutex> guard(lock);
+					while ((nextChunk < numChunks) &&
+					       (nextChunk >= numWritten + maxAhead))
+					{
+						chunkWritten.wait(guard);
+					}
+					if (nextChunk >= numChunks)
+					{
+						break;
+					}
+					iChunk = nextChunk++;
+				}
+				
+				int first = iChunk * WRITE_CHUNK_POINTS;
+				int last = min(numPoints, first + WRITE_CHUNK_POINTS);
+				text.str("");
+				formatLandmarkRange(text, coords, numDims, first, last, slicer);
+				string chunk = text.str();
+				
+				lock_guard<mutex> guard(lock);
+				chunks[iChunk].swap(chunk);
+				formatted[iChunk] = true;
+				chunkFormatted.notify_all();
+			}
+		}));
+	}
+	
+	// Chunks are written in order, each once it has been formatted.
+	for (int iChunk = 0; iChunk < numChunks; iChunk++)
+	{
+		string chunk;
+		{
+			unique_lock<mutex> guard(lock);
+			while (!formatted[iChunk])
+			{
+				chunkFormatted.wait(guard);
+			}
+			chunks[iChunk].swap(chunk);
+		}
+		out.write(chunk.data(), chunk.size());
+		
+		lock_guard<mutex> guard(lock);
+		numWritten = iChunk + 1;
+		chunkWritten.notify_all();
+	}
+	
+	for (size_t iThread = 0; iThread < formatters.size(); iThread++)
+	{
+		formatters[iThread].join();
+	}
+	
+	return;
+	
+} // end writeLandmarkChunks
+
+
 //**************************************************************
 // Function writeLandmarksTransformix is defined.              *
 // The function write landmarks into a parameter file for      *
@@ -751,77 +3419,24 @@ LandmarkPairs readLandmarksIreg(string pathInput)
 // transformation.                                             *
 //**************************************************************
 
-void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, string outPath)
+void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, string outPath,
+                               int numThreads, OutputCase *owner)
 {
 
 /*-----------------------------------------------------------------------------
 ///////////////////////////// Creates Output File /////////////////////////////
 -----------------------------------------------------------------------------*/
     
-    //Gets path for directory of pointpair file
-    string dirName = pathPointPairs;
-    
-    //Signals position where filename begins is found
-    bool fileNameFound = false;
-    
-    //Signals extension position found
-    bool extensionFound = false;
-    
-    //Starting positions for directory and filename
-    int startFileName = 0;
-    int startParentDir = 0;
-    int startExtension = 0;
-    
-    //Searches for positions where filename begins
-    //and parent directory begins
-    for(int k = dirName.length(); k >= 0; k--)
-    {
-        //Searches for and reconds position of second backslash (Windows)
-		//or forward slash (Linux), which indicates start of parent
-		//directory of point pairs file
-        if(((fileNameFound)&&(dirName[k] == 0x5c))||
-		                               ((fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startParentDir = k+1;
-        }
-        //Searches for and records position of first backslash (Windows) or
-		//forward slash (Linux), which indicates start of filename of point
-		//pairs file
-        else if(((!fileNameFound)&&(dirName[k] == 0x5c))||
-		                              ((!fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startFileName = k+1;
-            fileNameFound= true;
-        }
-        //Searches for and records position of first period,
-        //which indicates start of file extension of point pairs file
-        if((!extensionFound)&&(dirName[k] == 0x2e))
-        {
-            startExtension = k;
-            extensionFound = true;
-        }
-    }//end for
-    
     //Extracts filename by removing file extension and filepath
-    string fileName = dirName;
-    fileName.erase(startExtension,(fileName.length() - startExtension));
-    fileName.erase(0,startFileName);
+    string fileName = getFileStem(pathPointPairs);
     
     //Creates path to output file
     string outputFilePath = outPath;
     outputFilePath += fileName;
     outputFilePath += "_transformix.txt";
     
-    //Creates and opens output file
-    cout << "Creating output file: ";
-	cout << outputFilePath << endl;
-    ofstream outputFile(outputFilePath.c_str());
-    
-    //Checks for successful file open
-    if (!(outputFile.is_open()))
-    {
-         cout << "Failed to create output file!\n";
-    }
+    //Output is formatted in memory, then handed to the output threads
+    ostringstream outputFile;
 
 /*-----------------------------------------------------------------------------
 ///////////////////////////// Writes Output File //////////////////////////////
@@ -833,15 +3448,8 @@ void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, strin
     outputFile << "(TransformParameters";
     
     //Writes moving coordinates to output file
-	for (int i = 0; i < (pairs.numDims * pairs.numPoints); i = i + 3)
-	{
-	    outputFile << " ";
-		outputFile << pairs.moving.at(i + 2);
-		outputFile << " ";
-		outputFile << pairs.moving.at(i + 1);
-		outputFile << " ";
-		outputFile << pairs.moving.at(i);
-	}
+	writeLandmarkChunks(outputFile, pairs.moving, pairs.numDims, pairs.numPoints,
+	                    false, numThreads);
     
     //Continues writing transform-specific information
     outputFile << ")\n";
@@ -874,15 +3482,8 @@ void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, strin
     outputFile << "(FixedImageLandmarks";
     
     //Writes fixed coordinates to output file
-	for (int i = 0; i < (pairs.numDims * pairs.numPoints); i = i + 3)
-	{
-	    outputFile << " ";
-		outputFile << pairs.fixed.at(i + 2);
-		outputFile << " ";
-		outputFile << pairs.fixed.at(i + 1);
-		outputFile << " ";
-		outputFile << pairs.fixed.at(i);
-	}
+	writeLandmarkChunks(outputFile, pairs.fixed, pairs.numDims, pairs.numPoints,
+	                    false, numThreads);
 	
     outputFile << ")\n\n";
     
@@ -899,8 +3500,9 @@ void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, strin
     outputFile << "(ResultImagePixelType \"short\")\n";
     outputFile << "(CompressResultImage \"false\")\n";
     
-    //Closes files
-    outputFile.close();
+    //Hands the formatted file to the output threads
+    string outputText = outputFile.str();
+    submitOutputFile(owner, outputFilePath, outputText);
 
     return;
      
@@ -914,61 +3516,16 @@ void writeLandmarksTransformix(LandmarkPairs pairs, string pathPointPairs, strin
 // respect to the patient anatomy.                             *
 //**************************************************************
 
-void writeLandmarksSlicer(LandmarkPairs pairs, string inPath, string outPath, bool writeFixed)
+void writeLandmarksSlicer(LandmarkPairs pairs, string inPath, string outPath, bool writeFixed,
+                          int numThreads, OutputCase *owner)
 {
 
 	/*-------------------------------------------------------------------------
     /////////////////////////// Creates Output File ///////////////////////////
     -------------------------------------------------------------------------*/
     
-    //Gets path for directory of pointpair file
-    string dirName = inPath;
-    
-    //Signals position where filename begins is found
-    bool fileNameFound = false;
-    
-    //Signals extension position found
-    bool extensionFound = false;
-    
-    //Starting positions for directory and filename
-    int startFileName = 0;
-    int startParentDir = 0;
-    int startExtension = 0;
-    
-    //Searches for positions where filename begins
-    //and parent directory begins
-    for(int k = dirName.length(); k >= 0; k--)
-    {
-        //Searches for and reconds position of second backslash (Windows)
-		//or forward slash (Linux), which indicates start of parent
-		//directory of point pairs file
-        if(((fileNameFound)&&(dirName[k] == 0x5c))||
-		                               ((fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startParentDir = k+1;
-        }
-        //Searches for and records position of first backslash (Windows) or
-		//forward slash (Linux), which indicates start of filename of point
-		//pairs file
-        else if(((!fileNameFound)&&(dirName[k] == 0x5c))||
-		                              ((!fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startFileName = k+1;
-            fileNameFound= true;
-        }
-        //Searches for and records position of first period,
-        //which indicates start of file extension of point pairs file
-        if((!extensionFound)&&(dirName[k] == 0x2e))
-        {
-            startExtension = k;
-            extensionFound = true;
-        }
-    }//end for
-    
-    //Extracts filename by removing file extension and filepath
-    string fileName = dirName;
-    fileName.erase(startExtension,(fileName.length() - startExtension));
-    fileName.erase(0,startFileName);
+    //Extracts filename by removing file extension and filepath
+    string fileName = getFileStem(inPath);
     
     //Creates path to output file
     string outputFilePath = outPath;
@@ -982,16 +3539,8 @@ void writeLandmarksSlicer(LandmarkPairs pairs, string inPath, string outPath, bo
 	    outputFilePath += "_moving_slicer.fcsv";
 	}
 	
-    //Creates and opens output file
-    cout << "Creating output file: ";
-	cout << outputFilePath << endl;
-    ofstream outputFile(outputFilePath.c_str());
-    
-    //Checks for successful file open
-    if (!(outputFile.is_open()))
-    {
-         cout << "Failed to create output file!\n";
-    }
+    //Output is formatted in memory, then handed to the output threads
+    ostringstream outputFile;
 	
 	/*-------------------------------------------------------------------------
     /////////////////////////// Writes Output File ////////////////////////////
@@ -1020,40 +3569,19 @@ void writeLandmarksSlicer(LandmarkPairs pairs, string inPath, string outPath, bo
 	if (writeFixed)
 	{
         //Writes fixed coordinates to output file
-	    for (int i = 0; i < (pairs.numDims * pairs.numPoints); i = i+3)
-	    {
-		    if (i != 0)
-		    outputFile << "\n";
-	        outputFile << ((i/pairs.numDims)+1);
-		    outputFile << ", ";
-		    outputFile << (pairs.fixed.at(i + 2) * -1.0);
-		    outputFile << ", ";
-		    outputFile << (pairs.fixed.at(i + 1) * -1.0);
-		    outputFile << ", ";
-		    outputFile << pairs.fixed.at(i);
-		    outputFile << ", 0, 1";
-	    }
+	    writeLandmarkChunks(outputFile, pairs.fixed, pairs.numDims,
+	                        pairs.numPoints, true, numThreads);
 	}
 	else
 	{
 	    //Writes moving coordinates to output file
-	    for (int i = 0; i < (pairs.numDims * pairs.numPoints); i = i+3)
-	    {
-		    if (i != 0)
-		    outputFile << "\n";
-	        outputFile << ((i/pairs.numDims)+1);
-		    outputFile << ", ";
-		    outputFile << (pairs.moving.at(i + 2) * -1.0);
-		    outputFile << ", ";
-		    outputFile << (pairs.moving.at(i + 1) * -1.0);
-		    outputFile << ", ";
-		    outputFile << pairs.moving.at(i);
-		    outputFile << ", 0, 1";
-	    }
+	    writeLandmarkChunks(outputFile, pairs.moving, pairs.numDims,
+	                        pairs.numPoints, true, numThreads);
 	}
 	
-	// Closes output file.
-	outputFile.close();
+	// Formatted file is handed to the output threads.
+	string outputText = outputFile.str();
+	submitOutputFile(owner, outputFilePath, outputText);
 
     return;
      
@@ -1070,61 +3598,16 @@ void writeLandmarksSlicer(LandmarkPairs pairs, string inPath, string outPath, bo
 // respect to the patient anatomy.                             *
 //**************************************************************
 
-void writeLandmarksText(LandmarkPairs pairs, string inPath, string outPath, bool writeFixed)
+void writeLandmarksText(LandmarkPairs pairs, string inPath, string outPath, bool writeFixed,
+                        OutputCase *owner)
 {
 
 	/*-------------------------------------------------------------------------
     /////////////////////////// Creates Output File ///////////////////////////
     -------------------------------------------------------------------------*/
     
-    //Gets path for directory of pointpair file
-    string dirName = inPath;
-    
-    //Signals position where filename begins is found
-    bool fileNameFound = false;
-    
-    //Signals extension position found
-    bool extensionFound = false;
-    
-    //Starting positions for directory and filename
-    int startFileName = 0;
-    int startParentDir = 0;
-    int startExtension = 0;
-    
-    //Searches for positions where filename begins
-    //and parent directory begins
-    for(int k = dirName.length(); k >= 0; k--)
-    {
-        //Searches for and reconds position of second backslash (Windows)
-		//or forward slash (Linux), which indicates start of parent
-		//directory of point pairs file
-        if(((fileNameFound)&&(dirName[k] == 0x5c))||
-		                               ((fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startParentDir = k+1;
-        }
-        //Searches for and records position of first backslash (Windows) or
-		//forward slash (Linux), which indicates start of filename of point
-		//pairs file
-        else if(((!fileNameFound)&&(dirName[k] == 0x5c))||
-		                              ((!fileNameFound)&&(dirName[k] == 0x2f)))
-        {
-            startFileName = k+1;
-            fileNameFound= true;
-        }
-        //Searches for and records position of first period,
-        //which indicates start of file extension of point pairs file
-        if((!extensionFound)&&(dirName[k] == 0x2e))
-        {
-            startExtension = k;
-            extensionFound = true;
-        }
-    }//end for
-    
     //Extracts filename by removing file extension and filepath
-    string fileName = dirName;
-    fileName.erase(startExtension,(fileName.length() - startExtension));
-    fileName.erase(0,startFileName);
+    string fileName = getFileStem(inPath);
     
     //Creates path to output file
     string outputFilePath = outPath;
@@ -1138,15 +3621,8 @@ void writeLandmarksText(LandmarkPairs pairs, string inPath, string outPath, bool
 	    outputFilePath += "_moving_landmarks.txt";
 	}
     
-    //Creates and opens output file
-    cout << "Creating output file...\n";
-    ofstream outputFile(outputFilePath.c_str());
-    
-    //Checks for successful file open
-    if (!(outputFile.is_open()))
-    {
-         cout << "Failed to create output file!\n";
-    }
+    //Output is formatted in memory, then handed to the output threads
+    ostringstream outputFile;
 	
 	/*-------------------------------------------------------------------------
     /////////////////////////// Writes Output File ////////////////////////////
@@ -1183,9 +3659,8587 @@ void writeLandmarksText(LandmarkPairs pairs, string inPath, string outPath, bool
 	    }
 	}
 	
-	// Closes output file.
-	outputFile.close();
+	// Formatted file is handed to the output threads.
+	string outputText = outputFile.str();
+	submitOutputFile(owner, outputFilePath, outputText);
 
     return;
      
 } // end writeLandmarksText
+
+
+//**************************************************************
+// Function appendVtkArray is defined.                         *
+// The function adds one data array to the appended section of *
+// a VTK XML file and returns its offset. Arrays are preceded  *
+// by their 64-bit size or, compressed, by the block header of *
+// vtkZLibDataCompressor. Sets failed if a block could not be  *
+// compressed.                                                 *
+//**************************************************************
+
+uint64_t appendVtkArray(string &appended, const void *data, uint64_t numBytes,
+                        bool compress, bool &failed)
+{
+	uint64_t offset = appended.length();
+	const char *bytes = (const char *)data;
+	
+	if (!compress)
+	{
+		appended.append((const char *)&numBytes, sizeof(numBytes));
+		appended.append(bytes, numBytes);
+		return offset;
+	}
+	
+#ifdef LMK_USE_ZLIB
+	// Header is blocks, block size, size of the last block if partial,
+	// then each block's compressed size.
+	const uint64_t BLOCK_SIZE = 1 << 16;
+	uint64_t numBlocks = (numBytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	vector<uint64_t> header(3 + numBlocks);
+	header[0] = numBlocks;
+	header[1] = BLOCK_SIZE;
+	header[2] = numBytes % BLOCK_SIZE;
+	
+	string blocks;
+	vector<Bytef> block(compressBound(BLOCK_SIZE));
+	for (uint64_t iBlock = 0; iBlock < numBlocks; iBlock++)
+	{
+		uLong blockBytes = min(BLOCK_SIZE, numBytes - iBlock * BLOCK_SIZE);
+		uLongf compressedBytes = block.size();
+		if (compress2(&block[0], &compressedBytes,
+		              (const Bytef *)bytes + iBlock * BLOCK_SIZE, blockBytes,
+		              Z_DEFAULT_COMPRESSION) != Z_OK)
+		{
+			failed = true;
+			return offset;
+		}
+		header[3 + iBlock] = compressedBytes;
+		blocks.append((const char *)&block[0], compressedBytes);
+	}
+	
+	appended.append((const char *)&header[0], header.size() * sizeof(uint64_t));
+	appended += blocks;
+#endif
+	
+	return offset;
+	
+} // end appendVtkArray
+
+
+//**************************************************************
+// Function writeLandmarksVtk is defined.                      *
+// The function writes the fixed or moving landmarks as a VTK  *
+// PolyData point cloud with the displacement to their         *
+// counterparts, the iX attributes and, optionally, the image  *
+// intensity at each landmark as point data. Arrays are stored *
+// in binary, optionally zlib compressed, in the appended      *
+// section of the file. Like the other landmark writers, it    *
+// formats the file in memory and submits it to the owner's    *
+// output threads, or writes it at once without an owner.      *
+// Returns false, submitting nothing, if an array could not be *
+// compressed.                                                 *
+//**************************************************************
+
+bool writeLandmarksVtk(const LandmarkPairs &pairs, string inPath, string outPath,
+                       bool writeFixed, bool compress, bool sampleIntensity,
+                       OutputCase *owner)
+{
+	
+	/*-------------------------------------------------------------------------
+    /////////////////////////// Creates Output File ///////////////////////////
+    -------------------------------------------------------------------------*/
+    
+    string outputFilePath = outPath + getFileStem(inPath);
+    outputFilePath += writeFixed ? "_fixed.vtp" : "_moving.vtp";
+    
+    // Output is formatted in memory, then handed to the output threads.
+    ostringstream outputFile;
+	
+	/*-------------------------------------------------------------------------
+    //////////////////////////// Gathers Arrays ///////////////////////////////
+    -------------------------------------------------------------------------*/
+	
+	const vector<double> &points = writeFixed ? pairs.fixed : pairs.moving;
+	const vector<double> &others = writeFixed ? pairs.moving : pairs.fixed;
+	size_t numPoints = pairs.numPoints;
+	bool hasOthers = (others.size() == points.size());
+	
+	// Landmarks are stored z,y,x; VTK points are x,y,z.
+	vector<double> coords(3 * numPoints);
+	vector<double> displacements(hasOthers ? 3 * numPoints : 0);
+	vector<int64_t> connectivity(numPoints);
+	vector<int64_t> offsets(numPoints);
+	for (size_t iPoint = 0; iPoint < numPoints; iPoint++)
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			coords[3 * iPoint + d] = points[3 * iPoint + 2 - d];
+			if (hasOthers)
+			{
+				displacements[3 * iPoint + d] = others[3 * iPoint + 2 - d] -
+				                                points[3 * iPoint + 2 - d];
+			}
+		}
+		connectivity[iPoint] = iPoint;
+		offsets[iPoint] = iPoint + 1;
+	}
+	
+	// Attribute columns are written as they are.
+	string appended;
+	bool failed = false;
+	ostringstream pointData;
+	if (pairs.pointIds.size() == numPoints)
+	{
+		pointData << "        <DataArray type=\"Int32\" Name=\"PointId\""
+		          << " format=\"appended\" offset=\""
+		          << appendVtkArray(appended, pairs.pointIds.data(),
+		                            numPoints * sizeof(int), compress, failed)
+		          << "\"/>\n";
+	}
+	if (pairs.distinctiveness.size() == numPoints)
+	{
+		pointData << "        <DataArray type=\"Float64\" Name=\"Distinctiveness\""
+		          << " format=\"appended\" offset=\""
+		          << appendVtkArray(appended, pairs.distinctiveness.data(),
+		                            numPoints * sizeof(double), compress, failed)
+		          << "\"/>\n";
+	}
+	if (pairs.flags.size() == numPoints)
+	{
+		pointData << "        <DataArray type=\"UInt8\" Name=\"Flags\""
+		          << " format=\"appended\" offset=\""
+		          << appendVtkArray(appended, pairs.flags.data(),
+		                            numPoints, compress, failed) << "\"/>\n";
+	}
+	vector<double> intensities;
+	if (sampleIntensity && sampleLandmarkIntensities(pairs, writeFixed, intensities))
+	{
+		pointData << "        <DataArray type=\"Float64\" Name=\"Intensity\""
+		          << " format=\"appended\" offset=\""
+		          << appendVtkArray(appended, intensities.data(),
+		                            numPoints * sizeof(double), compress, failed)
+		          << "\"/>\n";
+	}
+	if (hasOthers)
+	{
+		pointData << "        <DataArray type=\"Float64\" Name=\"Displacement\""
+		          << " NumberOfComponents=\"3\" format=\"appended\" offset=\""
+		          << appendVtkArray(appended, displacements.data(),
+		                            displacements.size() * sizeof(double), compress,
+		                            failed) << "\"/>\n";
+	}
+	uint64_t pointsOffset = appendVtkArray(appended, coords.data(),
+	                                coords.size() * sizeof(double), compress, failed);
+	uint64_t connectivityOffset = appendVtkArray(appended, connectivity.data(),
+	                                numPoints * sizeof(int64_t), compress, failed);
+	uint64_t offsetsOffset = appendVtkArray(appended, offsets.data(),
+	                                numPoints * sizeof(int64_t), compress, failed);
+	if (failed)
+	{
+		LOG_MESSAGE(LOG_ERROR, "write", outputFilePath,
+		            "Failed to compress VTK data arrays");
+		return false;
+	}
+	
+	/*-------------------------------------------------------------------------
+    /////////////////////////// Writes Output File ////////////////////////////
+    -------------------------------------------------------------------------*/
+	
+	const uint16_t ONE = 1;
+	bool littleEndian = (*(const unsigned char *)&ONE == 1);
+	
+	outputFile << "<?xml version=\"1.0\"?>\n";
+	outputFile << "<VTKFile type=\"PolyData\" version=\"1.0\" byte_order=\""
+	           << (littleEndian ? "LittleEndian" : "BigEndian")
+	           << "\" header_type=\"UInt64\"";
+	if (compress)
+	{
+		outputFile << " compressor=\"vtkZLibDataCompressor\"";
+	}
+	outputFile << ">\n";
+	outputFile << "  <PolyData>\n";
+	outputFile << "    <Piece NumberOfPoints=\"" << numPoints
+	           << "\" NumberOfVerts=\"" << numPoints
+	           << "\" NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfPolys=\"0\">\n";
+	outputFile << "      <PointData Scalars=\"Distinctiveness\""
+	           << (hasOthers ? " Vectors=\"Displacement\"" : "") << ">\n";
+	outputFile << pointData.str();
+	outputFile << "      </PointData>\n";
+	outputFile << "      <Points>\n";
+	outputFile << "        <DataArray type=\"Float64\" Name=\"Points\""
+	           << " NumberOfComponents=\"3\" format=\"appended\" offset=\""
+	           << pointsOffset << "\"/>\n";
+	outputFile << "      </Points>\n";
+	outputFile << "      <Verts>\n";
+	outputFile << "        <DataArray type=\"Int64\" Name=\"connectivity\""
+	           << " format=\"appended\" offset=\"" << connectivityOffset << "\"/>\n";
+	outputFile << "        <DataArray type=\"Int64\" Name=\"offsets\""
+	           << " format=\"appended\" offset=\"" << offsetsOffset << "\"/>\n";
+	outputFile << "      </Verts>\n";
+	outputFile << "    </Piece>\n";
+	outputFile << "  </PolyData>\n";
+	outputFile << "  <AppendedData encoding=\"raw\">\n   _";
+	outputFile.write(appended.data(), appended.length());
+	outputFile << "\n  </AppendedData>\n";
+	outputFile << "</VTKFile>\n";
+	
+	// Formatted file is handed to the output threads.
+	string outputText = outputFile.str();
+	submitOutputFile(owner, outputFilePath, outputText);
+	
+	return true;
+	
+} // end writeLandmarksVtk
+
+
+// Files taken from the output queue by an output thread at a time.
+const size_t OUTPUT_BATCH_FILES = 16;
+
+
+//**************************************************************
+// Function openOutputQueue is defined.                        *
+// The function starts the threads writing formatted files     *
+// taken from a queue holding at most maxBytes of them. Each   *
+// thread takes the queued files in batches, writes them and   *
+// then releases their conversions. With the io_uring          *
+// backend each thread submits its batches to its own ring;    *
+// if the rings cannot be set up the files are written by      *
+// synchronous calls.                                          *
+//**************************************************************
+
+OutputQueue *openOutputQueue(int numThreads, size_t maxBytes, int backend)
+{
+	OutputQueue *outputQueue = new OutputQueue;
+	outputQueue->maxBytes = maxBytes;
+	outputQueue->queuedBytes = 0;
+	outputQueue->closing = false;
+	outputQueue->numFailed = 0;
+	
+#ifndef LMK_USE_URING
+	(void)backend;    // Without io_uring every backend writes directly
+#else
+	if (backend == IO_URING)
+	{
+		outputQueue->rings.resize(numThreads);
+		for (int iThread = 0; iThread < numThreads; iThread++)
+		{
+			if (!openIoRing(outputQueue->rings[iThread], OUTPUT_BATCH_FILES))
+			{
+				LOG_MESSAGE(LOG_WARN, "write", "",
+				            "io_uring is unavailable; writing output files directly");
+				for (int iRing = 0; iRing < iThread; iRing++)
+				{
+					closeIoRing(outputQueue->rings[iRing]);
+				}
+				outputQueue->rings.clear();
+				break;
+			}
+		}
+	}
+#endif
+	
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		outputQueue->threads.push_back(thread([outputQueue, iThread]()
+		{
+			OutputQueue &q = *outputQueue;
+			vector<OutputFile> batch;
+			while (true)
+			{
+				{
+					unique_lock<mutex> guard(q.lock);
+					while (q.files.empty() && !q.closing)
+					{
+						q.fileQueued.wait(guard);
+					}
+					if (q.files.empty())
+					{
+						break;
+					}
+					while (!q.files.empty() && (batch.size() < OUTPUT_BATCH_FILES))
+					{
+						batch.push_back(OutputFile());
+						batch.back().path.swap(q.files.front().path);
+						batch.back().data.swap(q.files.front().data);
+						batch.back().owner = q.files.front().owner;
+						q.files.pop();
+					}
+				}
+				
+#ifdef LMK_USE_URING
+				if (!q.rings.empty())
+				{
+					writeOutputFilesUring(q.rings[iThread], batch);
+				}
+				else
+#endif
+				for (size_t iFile = 0; iFile < batch.size(); iFile++)
+				{
+					if (!writeOutputFile(batch[iFile].path, batch[iFile].data))
+					{
+						batch[iFile].owner->failed = true;
+					}
+				}
+				
+				size_t batchBytes = 0;
+				for (size_t iFile = 0; iFile < batch.size(); iFile++)
+				{
+					batchBytes += batch[iFile].data.size();
+				}
+				
+				// Space is freed before the conversions are released, as
+				// storing them in the cache may take a while.
+				{
+					lock_guard<mutex> guard(q.lock);
+					q.queuedBytes -= batchBytes;
+					q.filesWritten.notify_all();
+				}
+				for (size_t iFile = 0; iFile < batch.size(); iFile++)
+				{
+					releaseOutputCase(batch[iFile].owner);
+				}
+				batch.clear();
+			}
+		}));
+	}
+	
+	return outputQueue;
+	
+} // end openOutputQueue
+
+
+//**************************************************************
+// Function submitOutputFile is defined.                       *
+// The function hands a formatted file, whose data is taken,   *
+// to the output threads of its conversion, waiting only       *
+// while the queue is full. A file larger than the queue is    *
+// accepted once the queue is empty. Without output threads    *
+// the file is written at once.                                *
+//**************************************************************
+
+void submitOutputFile(OutputCase *owner, string path, string &data)
+{
+	if ((owner == NULL) || (owner->outputQueue == NULL))
+	{
+		if (!writeOutputFile(path, data) && (owner != NULL))
+		{
+			owner->failed = true;
+		}
+		return;
+	}
+	
+	OutputQueue &q = *owner->outputQueue;
+	size_t size = data.size();
+	owner->pending++;
+	
+	unique_lock<mutex> guard(q.lock);
+	if ((q.queuedBytes > 0) && (q.queuedBytes + size > q.maxBytes))
+	{
+		LOG_MESSAGE(LOG_DEBUG, "write", path, "Waiting for the output queue");
+		while ((q.queuedBytes > 0) && (q.queuedBytes + size > q.maxBytes))
+		{
+			q.filesWritten.wait(guard);
+		}
+	}
+	
+	q.files.push(OutputFile());
+	q.files.back().path = path;
+	q.files.back().data.swap(data);
+	q.files.back().owner = owner;
+	q.queuedBytes += size;
+	q.fileQueued.notify_one();
+	
+} // end submitOutputFile
+
+
+//**************************************************************
+// Function writeOutputFile is defined.                        *
+// The function creates or replaces a file with the given      *
+// data. Returns false if it could not be written.             *
+//**************************************************************
+
+bool writeOutputFile(string path, const string &data)
+{
+	LOG_MESSAGE(LOG_DEBUG, "write", path, "Creating output file");
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		LOG_MESSAGE(LOG_ERROR, "write", path, "Failed to create output file");
+		return false;
+	}
+	
+	bool success = writeAt(fd, data.data(), data.size(), 0);
+	success = (close(fd) == 0) && success;
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "write", path, "Failed to write output file");
+	}
+	
+	return success;
+	
+} // end writeOutputFile
+
+
+//**************************************************************
+// Function releaseOutputCase is defined.                      *
+// The function drops one hold on a conversion's files: the    *
+// conversion's own, or that of a file once written. When      *
+// the last is dropped, a complete conversion whose files      *
+// were all written is stored in the cache and recorded in     *
+// the journal; one missing a file is counted as failed.       *
+//**************************************************************
+
+void releaseOutputCase(OutputCase *owner)
+{
+	if (owner->pending.fetch_sub(1) != 1)
+	{
+		return;
+	}
+	
+	if (owner->complete && owner->failed && (owner->outputQueue != NULL))
+	{
+		owner->outputQueue->numFailed++;
+	}
+	else if (owner->complete && !owner->failed)
+	{
+		if (owner->cache != NULL)
+		{
+			cacheStore(*owner->cache, owner->cacheKey, owner->outputPaths,
+			           owner->pathOutput);
+		}
+		if (owner->journal != NULL)
+		{
+			journalRecord(*owner->journal, owner->pathInput, owner->cacheKey,
+			              owner->outputPaths);
+		}
+	}
+	
+	delete owner;
+	
+} // end releaseOutputCase
+
+
+//**************************************************************
+// Function closeOutputQueue is defined.                       *
+// The function waits for the queued files to be written,      *
+// stops the output threads and returns the number of          *
+// conversions whose files could not all be written.           *
+//**************************************************************
+
+int closeOutputQueue(OutputQueue *outputQueue)
+{
+	{
+		lock_guard<mutex> guard(outputQueue->lock);
+		outputQueue->closing = true;
+		outputQueue->fileQueued.notify_all();
+	}
+	for (size_t iThread = 0; iThread < outputQueue->threads.size(); iThread++)
+	{
+		outputQueue->threads[iThread].join();
+	}
+#ifdef LMK_USE_URING
+	for (size_t iRing = 0; iRing < outputQueue->rings.size(); iRing++)
+	{
+		closeIoRing(outputQueue->rings[iRing]);
+	}
+#endif
+	
+	int numFailed = outputQueue->numFailed;
+	delete outputQueue;
+	return numFailed;
+	
+} // end closeOutputQueue
+
+
+// Names of the I/O backends.
+const char *IO_BACKEND_NAMES[NUM_IO_BACKENDS] = {"threads", "uring"};
+
+
+//**************************************************************
+// Function parseIoBackend is defined.                         *
+// The function returns the I/O backend of the given name, or  *
+// -1 if the name is not recognized.                           *
+//**************************************************************
+
+int parseIoBackend(string name)
+{
+	for (int iBackend = 0; iBackend < NUM_IO_BACKENDS; iBackend++)
+	{
+		if (name == IO_BACKEND_NAMES[iBackend])
+		{
+			return iBackend;
+		}
+	}
+	
+	return -1;
+	
+} // end parseIoBackend
+
+#ifdef LMK_USE_URING
+
+// Input files read ahead per submission, bytes of the buffer each is read
+// into, files read ahead but not yet taken by a conversion at most, and
+// how often a full prefetcher checks for files claimed but never taken.
+const size_t PREFETCH_BATCH_FILES = 32;
+const size_t PREFETCH_BUFFER_BYTES = 256 << 10;
+const size_t PREFETCH_AHEAD_FILES = 128;
+const int PREFETCH_RECHECK_MS = 100;
+
+// Longest write submitted at once; the rest is written synchronously.
+const size_t URING_MAX_WRITE = 1 << 30;
+
+
+//**************************************************************
+// Function openIoRing is defined.                             *
+// The function sets up an io_uring of at least the given      *
+// number of entries and maps its rings. Returns false if the  *
+// kernel does not support it.                                 *
+//**************************************************************
+
+bool openIoRing(IoRing &ring, unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring.fd < 0)
+	{
+		return false;
+	}
+	
+	ring.entries = params.sq_entries;
+	ring.sqMappingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cqMappingSize = params.cq_off.cqes +
+	                     params.cq_entries * sizeof(io_uring_cqe);
+	ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	ring.sqMapping = mmap(NULL, ring.sqMappingSize, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cqMapping = mmap(NULL, ring.cqMappingSize, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if ((ring.sqMapping == MAP_FAILED) || (ring.cqMapping == MAP_FAILED) ||
+	    (sqes == MAP_FAILED))
+	{
+		if (ring.sqMapping != MAP_FAILED)
+		{
+			munmap(ring.sqMapping, ring.sqMappingSize);
+		}
+		if (ring.cqMapping != MAP_FAILED)
+		{
+			munmap(ring.cqMapping, ring.cqMappingSize);
+		}
+		if (sqes != MAP_FAILED)
+		{
+			munmap(sqes, ring.sqesSize);
+		}
+		close(ring.fd);
+		return false;
+	}
+	
+	char *sq = (char *)ring.sqMapping;
+	ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring.sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring.sqes = (io_uring_sqe *)sqes;
+	
+	char *cq = (char *)ring.cqMapping;
+	ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring.cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring.cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	
+	return true;
+	
+} // end openIoRing
+
+
+//**************************************************************
+// Function runIoRequests is defined.                          *
+// The function submits a batch of independent requests to a   *
+// ring, as many at a time as it has entries, and waits for    *
+// all of them to complete, storing each one's result. Returns *
+// false if the ring failed; requests it did not complete      *
+// keep their result.                                          *
+//**************************************************************
+
+bool runIoRequests(IoRing &ring, vector<IoRequest> &requests)
+{
+	for (size_t first = 0; first < requests.size(); first += ring.entries)
+	{
+		size_t count = min((size_t)ring.entries, requests.size() - first);
+		
+		// Entries are filled before the tail is published to the kernel.
+		unsigned tail = *ring.sqTail;
+		for (size_t iRequest = 0; iRequest < count; iRequest++)
+		{
+			const IoRequest &request = requests[first + iRequest];
+			unsigned index = (tail + iRequest) & ring.sqMask;
+			io_uring_sqe *sqe = &ring.sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = request.opcode;
+			sqe->user_data = first + iRequest;
+			if (request.opcode == IORING_OP_OPENAT)
+			{
+				sqe->fd = AT_FDCWD;
+				sqe->addr = (uintptr_t)request.path;
+				sqe->open_flags = request.flags;
+				sqe->len = 0644;
+			}
+			else
+			{
+				sqe->fd = request.fd;
+				sqe->addr = (uintptr_t)request.data;
+				sqe->len = request.size;
+				sqe->buf_index = request.bufferIndex;
+			}
+			ring.sqArray[index] = index;
+		}
+		__atomic_store_n(ring.sqTail, tail + count, __ATOMIC_RELEASE);
+		
+		size_t numSubmitted = 0;
+		size_t numCompleted = 0;
+		while (numCompleted < count)
+		{
+			int submitted = syscall(__NR_io_uring_enter, ring.fd,
+			                        (unsigned)(count - numSubmitted),
+			                        (unsigned)(count - numCompleted),
+			                        IORING_ENTER_GETEVENTS, NULL, 0);
+			if (submitted < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			numSubmitted += submitted;
+			
+			unsigned head = *ring.cqHead;
+			unsigned cqTail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+			for (; head != cqTail; head++)
+			{
+				const io_uring_cqe &cqe = ring.cqes[head & ring.cqMask];
+				if ((cqe.user_data >= first) && (cqe.user_data < first + count))
+				{
+					requests[cqe.user_data].result = cqe.res;
+					numCompleted++;
+				}
+			}
+			__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+		}
+	}
+	
+	return true;
+	
+} // end runIoRequests
+
+
+//**************************************************************
+// Function closeIoRing is defined.                            *
+// The function unmaps the rings of an io_uring and closes it. *
+//**************************************************************
+
+void closeIoRing(IoRing &ring)
+{
+	munmap(ring.sqes, ring.sqesSize);
+	munmap(ring.cqMapping, ring.cqMappingSize);
+	munmap(ring.sqMapping, ring.sqMappingSize);
+	close(ring.fd);
+	
+} // end closeIoRing
+
+
+//**************************************************************
+// Function writeOutputFilesUring is defined.                  *
+// The function writes a batch of formatted files through a    *
+// ring: all are opened in one submission, written in a        *
+// second and closed in a third. Writes the kernel completes   *
+// only in part are finished synchronously. Conversions with   *
+// a file that could not be written are marked failed.         *
+//**************************************************************
+
+void writeOutputFilesUring(IoRing &ring, vector<OutputFile> &batch)
+{
+	vector<IoRequest> opens;
+	for (size_t iFile = 0; iFile < batch.size(); iFile++)
+	{
+		LOG_MESSAGE(LOG_DEBUG, "write", batch[iFile].path, "Creating output file");
+		IoRequest openRequest = {IORING_OP_OPENAT, -1, batch[iFile].path.c_str(), NULL, 0,
+		                  O_WRONLY | O_CREAT | O_TRUNC, 0, -EIO};
+		opens.push_back(openRequest);
+	}
+	runIoRequests(ring, opens);
+	
+	vector<IoRequest> writes;
+	vector<OutputFile *> opened;
+	for (size_t iFile = 0; iFile < batch.size(); iFile++)
+	{
+		if (opens[iFile].result < 0)
+		{
+			LOG_MESSAGE(LOG_ERROR, "write", batch[iFile].path,
+			            "Failed to create output file");
+			batch[iFile].owner->failed = true;
+			continue;
+		}
+		IoRequest writeRequest = {IORING_OP_WRITE, opens[iFile].result, NULL,
+		                   (char *)batch[iFile].data.data(),
+		                   (unsigned)min(batch[iFile].data.size(), URING_MAX_WRITE),
+		                   0, 0, -EIO};
+		writes.push_back(writeRequest);
+		opened.push_back(&batch[iFile]);
+	}
+	runIoRequests(ring, writes);
+	
+	vector<IoRequest> closes;
+	vector<bool> written;
+	for (size_t iWrite = 0; iWrite < writes.size(); iWrite++)
+	{
+		const string &data = opened[iWrite]->data;
+		int size = writes[iWrite].result;
+		written.push_back((size >= 0) &&
+		                  writeAt(writes[iWrite].fd, data.data() + size,
+		                          data.size() - size, size));
+		IoRequest closeRequest = {IORING_OP_CLOSE, writes[iWrite].fd, NULL, NULL, 0, 0, 0,
+		                   -EIO};
+		closes.push_back(closeRequest);
+	}
+	runIoRequests(ring, closes);
+	
+	for (size_t iWrite = 0; iWrite < writes.size(); iWrite++)
+	{
+		if (!written[iWrite] || (closes[iWrite].result < 0))
+		{
+			LOG_MESSAGE(LOG_ERROR, "write", opened[iWrite]->path,
+			            "Failed to write output file");
+			opened[iWrite]->owner->failed = true;
+		}
+	}
+	
+} // end writeOutputFilesUring
+
+
+//**************************************************************
+// Function startInputPrefetch is defined.                     *
+// The function starts the thread reading the input files of   *
+// a batch ahead of the workers claiming them through          *
+// nextFile. Returns false, and the workers read their own     *
+// files, if no io_uring can be set up.                        *
+//**************************************************************
+
+bool startInputPrefetch(const vector<string> &paths, const atomic<size_t> &nextFile)
+{
+	IoRing ring;
+	if (!openIoRing(ring, PREFETCH_BATCH_FILES))
+	{
+		LOG_MESSAGE(LOG_WARN, "read", "",
+		            "io_uring is unavailable; reading input files directly");
+		return false;
+	}
+	
+	inputPrefetcher.stopping = false;
+	inputPrefetcher.active = true;
+	inputPrefetcher.reader = thread(prefetchInputFiles, ring, &paths, &nextFile);
+	return true;
+	
+} // end startInputPrefetch
+
+
+//**************************************************************
+// Function prefetchInputFiles is defined.                     *
+// The function runs the prefetch thread. Files not yet        *
+// claimed are taken in manifest order, in batches that are    *
+// opened, read into buffers registered with the ring and      *
+// closed in three submissions, while few enough are held.     *
+// A file filling its buffer, or failing to be read, is left   *
+// to its conversion.                                          *
+//**************************************************************
+
+void prefetchInputFiles(IoRing ring, const vector<string> *paths,
+                        const atomic<size_t> *nextFile)
+{
+	InputPrefetcher &p = inputPrefetcher;
+	
+	// Reads go straight into the registered buffers when the kernel lets
+	// them be pinned, and into the same buffers otherwise.
+	vector<char> buffers(PREFETCH_BATCH_FILES * PREFETCH_BUFFER_BYTES);
+	vector<iovec> bufferVectors(PREFETCH_BATCH_FILES);
+	for (size_t iBuffer = 0; iBuffer < PREFETCH_BATCH_FILES; iBuffer++)
+	{
+		bufferVectors[iBuffer].iov_base = &buffers[iBuffer * PREFETCH_BUFFER_BYTES];
+		bufferVectors[iBuffer].iov_len = PREFETCH_BUFFER_BYTES;
+	}
+	bool fixed = (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+	                      &bufferVectors[0], PREFETCH_BATCH_FILES) == 0);
+	
+	size_t iPath = 0;
+	vector<string> batch;
+	while (true)
+	{
+		batch.clear();
+		{
+			unique_lock<mutex> guard(p.lock);
+			while (!p.stopping && (p.files.size() >= PREFETCH_AHEAD_FILES))
+			{
+				// A file claimed by a conversion that already passed its
+				// take is never taken, so it is dropped instead of held
+				dropClaimedPrefetches(nextFile->load());
+				if (p.files.size() < PREFETCH_AHEAD_FILES)
+				{
+					break;
+				}
+				p.fileTaken.wait_for(guard, chrono::milliseconds(PREFETCH_RECHECK_MS));
+			}
+			if (p.stopping)
+			{
+				break;
+			}
+			
+			while (((iPath = max(iPath, nextFile->load())) < paths->size()) &&
+			       (batch.size() < PREFETCH_BATCH_FILES) &&
+			       (p.files.size() < PREFETCH_AHEAD_FILES))
+			{
+				const string &path = (*paths)[iPath];
+				if (p.files.count(path) == 0)
+				{
+					PrefetchedFile &file = p.files[path];
+					file.ready = false;
+					file.read = false;
+					file.index = iPath;
+					batch.push_back(path);
+				}
+				iPath++;
+			}
+		}
+		if (batch.empty())
+		{
+			if (iPath < paths->size())
+			{
+				continue;
+			}
+			break;
+		}
+		
+		vector<IoRequest> opens;
+		for (size_t iFile = 0; iFile < batch.size(); iFile++)
+		{
+			IoRequest openRequest = {IORING_OP_OPENAT, -1, batch[iFile].c_str(), NULL, 0,
+			                  O_RDONLY, 0, -EIO};
+			opens.push_back(openRequest);
+		}
+		runIoRequests(ring, opens);
+		
+		vector<IoRequest> reads;
+		vector<IoRequest> closes;
+		vector<size_t> opened;
+		for (size_t iFile = 0; iFile < batch.size(); iFile++)
+		{
+			if (opens[iFile].result < 0)
+			{
+				continue;
+			}
+			IoRequest readRequest = {fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+			                  opens[iFile].result, NULL,
+			                  &buffers[iFile * PREFETCH_BUFFER_BYTES],
+			                  (unsigned)PREFETCH_BUFFER_BYTES, 0, (int)iFile, -EIO};
+			IoRequest closeRequest = {IORING_OP_CLOSE, opens[iFile].result, NULL, NULL, 0, 0,
+			                   0, -EIO};
+			reads.push_back(readRequest);
+			closes.push_back(closeRequest);
+			opened.push_back(iFile);
+		}
+		runIoRequests(ring, reads);
+		runIoRequests(ring, closes);
+		
+		{
+			lock_guard<mutex> guard(p.lock);
+			for (size_t iRead = 0; iRead < reads.size(); iRead++)
+			{
+				int size = reads[iRead].result;
+				if ((size >= 0) && ((size_t)size < PREFETCH_BUFFER_BYTES))
+				{
+					PrefetchedFile &file = p.files[batch[opened[iRead]]];
+					file.read = true;
+					file.data.assign(reads[iRead].data, reads[iRead].data + size);
+					file.data.push_back('\0');
+				}
+			}
+			for (size_t iFile = 0; iFile < batch.size(); iFile++)
+			{
+				p.files[batch[iFile]].ready = true;
+			}
+			p.fileReady.notify_all();
+		}
+	}
+	
+	closeIoRing(ring);
+	
+} // end prefetchInputFiles
+
+
+//**************************************************************
+// Function dropClaimedPrefetches is defined.                  *
+// The function drops, with the prefetcher's lock held, the    *
+// files read ahead whose indexes are below claimed. Their     *
+// conversions read the files themselves if they have not      *
+// taken them yet.                                             *
+//**************************************************************
+
+
+void dropClaimedPrefetches(size_t claimed)
+{
+	map<string, PrefetchedFile> &files = inputPrefetcher.files;
+	for (map<string, PrefetchedFile>::iterator file = files.begin(); file != files.end(); )
+	{
+		if (file->second.ready && (file->second.index < claimed))
+		{
+			files.erase(file++);
+		}
+		else
+		{
+			file++;
+		}
+	}
+	
+} // end dropClaimedPrefetches
+
+
+//**************************************************************
+// Function takePrefetchedFile is defined.                     *
+// The function takes the data of a file read ahead, waiting   *
+// if its read is still in progress, followed by the           *
+// terminating zero readFileBuffer adds. Returns false if the  *
+// file was not read ahead, so the caller reads it itself.     *
+//**************************************************************
+
+bool takePrefetchedFile(string path, vector<char> &buffer)
+{
+	InputPrefetcher &p = inputPrefetcher;
+	if (!p.active)
+	{
+		return false;
+	}
+	
+	unique_lock<mutex> guard(p.lock);
+	map<string, PrefetchedFile>::iterator file = p.files.find(path);
+	while ((file != p.files.end()) && !file->second.ready)
+	{
+		p.fileReady.wait(guard);
+		file = p.files.find(path);
+	}
+	if (file == p.files.end())
+	{
+		return false;
+	}
+	
+	bool read = file->second.read;
+	if (read)
+	{
+		buffer.swap(file->second.data);
+	}
+	p.files.erase(file);
+	p.fileTaken.notify_one();
+	return read;
+	
+} // end takePrefetchedFile
+
+
+//**************************************************************
+// Function stopInputPrefetch is defined.                      *
+// The function stops the prefetch thread, once its current    *
+// batch is read, and drops the files no conversion took.      *
+//**************************************************************
+
+void stopInputPrefetch()
+{
+	InputPrefetcher &p = inputPrefetcher;
+	if (!p.active)
+	{
+		return;
+	}
+	
+	{
+		lock_guard<mutex> guard(p.lock);
+		p.stopping = true;
+		p.fileTaken.notify_all();
+	}
+	p.reader.join();
+	
+	p.active = false;
+	p.files.clear();
+	
+} // end stopInputPrefetch
+
+#endif
+
+
+// Identifies a shard segment, and the times a file is queued at most: a
+// file whose worker crashed is queued once more, in case the crash was not
+// its doing.
+const char SHARD_MAGIC[8] = "LMKSHD1";
+const int SHARD_MAX_ATTEMPTS = 2;
+
+// Bits of a file's state word below the slot of its worker.
+const int SHARD_WORKER_SHIFT = 8;
+const int32_t SHARD_STATE_MASK = 0xff;
+
+
+//**************************************************************
+// Function runCoordinator is defined.                         *
+// The function converts the files of a batch in numProcesses  *
+// worker processes, each running this program again with      *
+// the same arguments and the shared segment through which     *
+// they claim the files. When a worker crashes, the files it   *
+// had claimed are queued again and a worker is started in     *
+// its place. The workers' counters and the files' latencies   *
+// are reported once all have exited, and the workers' parts   *
+// of the journal are merged into it.                          *
+//**************************************************************
+
+int runCoordinator(int argc, char **argv, const vector<string> &inputFiles,
+                   int numProcesses, string pathJournal)
+{
+	// Journal parts left by an interrupted run are merged before workers
+	// read the journal.
+	if (!pathJournal.empty() && !mergeJournalParts(pathJournal, numProcesses))
+	{
+		LOG_MESSAGE(LOG_ERROR, "journal", pathJournal, "Failed to open journal");
+		return EXIT_FAILURE;
+	}
+	
+	string segmentName = "/lmk_shard_" + to_string(getpid());
+	ShardSegment *shard = createShardSegment(segmentName, inputFiles.size(),
+	                                         numProcesses);
+	if (shard == NULL)
+	{
+		LOG_MESSAGE(LOG_ERROR, "shard", segmentName, "Failed to create shard segment");
+		return EXIT_FAILURE;
+	}
+	
+	// Workers get every argument but -processes, then their segment and
+	// slot; the slot is filled in as each is started.
+	vector<string> args(1, argv[0]);
+	for (int iArg = 1; iArg + 1 < argc; iArg += 2)
+	{
+		if (string(argv[iArg]) != "-processes")
+		{
+			args.push_back(argv[iArg]);
+			args.push_back(argv[iArg + 1]);
+		}
+	}
+	args.push_back("-shard_segment");
+	args.push_back(segmentName);
+	args.push_back("-shard_worker");
+	args.push_back("");
+	
+	LogTimer coordinatorTimer("shard", segmentName);
+	map<pid_t, int> slots;
+	for (int iSlot = 0; iSlot < numProcesses; iSlot++)
+	{
+		spawnShardWorker(args, iSlot, *shard, slots);
+	}
+	
+	bool workerFailed = false;
+	while (!slots.empty())
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		map<pid_t, int>::iterator worker = slots.find(pid);
+		if (worker == slots.end())
+		{
+			continue;
+		}
+		int slot = worker->second;
+		slots.erase(worker);
+		
+		if (WIFEXITED(status))
+		{
+			LOG_MESSAGE(LOG_DEBUG, "shard", "", "Worker " << slot << " (pid " << pid <<
+			            ") exited with status " << WEXITSTATUS(status));
+			workerFailed = workerFailed || (WEXITSTATUS(status) != EXIT_SUCCESS);
+			continue;
+		}
+		
+		// A replacement is only started for files left unconverted, so a
+		// worker crashing before it claims any is not restarted forever.
+		int numRequeued = requeueShardJobs(*shard, slot, inputFiles);
+		LOG_MESSAGE(LOG_WARN, "shard", "", "Worker " << slot << " (pid " << pid <<
+		            ") crashed with signal " << WTERMSIG(status) << "; " <<
+		            numRequeued << " files queued again");
+		if (numRequeued > 0)
+		{
+			spawnShardWorker(args, slot, *shard, slots);
+		}
+	}
+	
+	int numFailed = reportShardRun(*shard, inputFiles);
+	closeShardSegment(shard);
+	shm_unlink(segmentName.c_str());
+	
+	if (!pathJournal.empty() && !mergeJournalParts(pathJournal, numProcesses))
+	{
+		LOG_MESSAGE(LOG_ERROR, "journal", pathJournal, "Failed to merge journal parts");
+		workerFailed = true;
+	}
+	
+	if (numFailed > 0)
+	{
+		LOG_MESSAGE(LOG_ERROR, "batch", "", numFailed << " of " <<
+		            inputFiles.size() << " conversions failed");
+		return EXIT_FAILURE;
+	}
+	if (workerFailed)
+	{
+		LOG_MESSAGE(LOG_ERROR, "shard", "", "A worker failed to complete its files");
+		return EXIT_FAILURE;
+	}
+	
+	return EXIT_SUCCESS;
+	
+} // end runCoordinator
+
+
+//**************************************************************
+// Function createShardSegment is defined.                     *
+// The function creates the shared segment of a sharded        *
+// batch, with every file queued once and unclaimed. Returns   *
+// NULL if it could not be created.                            *
+//**************************************************************
+
+ShardSegment *createShardSegment(string segmentName, size_t numJobs,
+                                 int numWorkers)
+{
+	// Records are laid out after the header, each 8-byte aligned.
+	uint64_t queueOffset = (sizeof(ShardHeader) + 7) & ~(uint64_t)7;
+	uint64_t jobsOffset = queueOffset + ((numJobs * SHARD_MAX_ATTEMPTS *
+	                                      sizeof(uint32_t) + 7) & ~(uint64_t)7);
+	uint64_t workersOffset = jobsOffset + numJobs * sizeof(ShardJob);
+	uint64_t segmentSize = workersOffset + numWorkers * sizeof(ShardWorker);
+	
+	int fd = shm_open(segmentName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (ftruncate(fd, segmentSize) != 0)
+	{
+		close(fd);
+		shm_unlink(segmentName.c_str());
+		return NULL;
+	}
+	void *mapping = mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                     fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		shm_unlink(segmentName.c_str());
+		return NULL;
+	}
+	
+	// The new segment is zero-filled: every record starts pending or zero.
+	ShardSegment *shard = new ShardSegment;
+	shard->header = (ShardHeader *)mapping;
+	shard->queue = (uint32_t *)((char *)mapping + queueOffset);
+	shard->jobs = (ShardJob *)((char *)mapping + jobsOffset);
+	shard->workers = (ShardWorker *)((char *)mapping + workersOffset);
+	shard->size = segmentSize;
+	shard->slot = -1;
+	
+	ShardHeader &header = *shard->header;
+	header.numJobs = numJobs;
+	header.numWorkers = numWorkers;
+	header.queueOffset = queueOffset;
+	header.jobsOffset = jobsOffset;
+	header.workersOffset = workersOffset;
+	for (size_t iJob = 0; iJob < numJobs; iJob++)
+	{
+		shard->queue[iJob] = iJob;
+	}
+	header.queueEnd.store(numJobs, memory_order_release);
+	memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+	
+	return shard;
+	
+} // end createShardSegment
+
+
+//**************************************************************
+// Function attachShardSegment is defined.                     *
+// The function maps a coordinator's shared segment into one   *
+// of its workers, checking it was made for a manifest of      *
+// numJobs files and has the given slot. Returns NULL if not.  *
+//**************************************************************
+
+ShardSegment *attachShardSegment(string segmentName, size_t numJobs, int slot)
+{
+	int fd = shm_open(segmentName.c_str(), O_RDWR, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	struct stat status;
+	if ((fstat(fd, &status) != 0) || ((size_t)status.st_size < sizeof(ShardHeader)))
+	{
+		close(fd);
+		return NULL;
+	}
+	void *mapping = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                     fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		return NULL;
+	}
+	
+	ShardHeader *header = (ShardHeader *)mapping;
+	if ((memcmp(header->magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0) ||
+	    (header->numJobs != numJobs) || (slot < 0) ||
+	    (slot >= (int)header->numWorkers) ||
+	    (header->workersOffset + header->numWorkers * sizeof(ShardWorker) >
+	     (uint64_t)status.st_size))
+	{
+		munmap(mapping, status.st_size);
+		return NULL;
+	}
+	
+	ShardSegment *shard = new ShardSegment;
+	shard->header = header;
+	shard->queue = (uint32_t *)((char *)mapping + header->queueOffset);
+	shard->jobs = (ShardJob *)((char *)mapping + header->jobsOffset);
+	shard->workers = (ShardWorker *)((char *)mapping + header->workersOffset);
+	shard->size = status.st_size;
+	shard->slot = slot;
+	return shard;
+	
+} // end attachShardSegment
+
+
+//**************************************************************
+// Function closeShardSegment is defined.                      *
+// The function unmaps a shard segment from this process.      *
+//**************************************************************
+
+void closeShardSegment(ShardSegment *shard)
+{
+	munmap(shard->header, shard->size);
+	delete shard;
+	
+} // end closeShardSegment
+
+
+//**************************************************************
+// Function spawnShardWorker is defined.                       *
+// The function starts a worker process in the given slot,     *
+// running this program with the coordinator's arguments.      *
+// Returns false if the process could not be started.          *
+//**************************************************************
+
+bool spawnShardWorker(vector<string> &args, int slot, ShardSegment &shard,
+                      map<pid_t, int> &slots)
+{
+	// Arguments are prepared before forking, as the child may only exec.
+	args.back() = to_string(slot);
+	vector<char *> argPointers;
+	for (size_t iArg = 0; iArg < args.size(); iArg++)
+	{
+		argPointers.push_back((char *)args[iArg].c_str());
+	}
+	argPointers.push_back(NULL);
+	
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		execv("/proc/self/exe", &argPointers[0]);
+		_exit(127);
+	}
+	if (pid < 0)
+	{
+		LOG_MESSAGE(LOG_ERROR, "shard", "", "Failed to start worker " << slot);
+		return false;
+	}
+	
+	shard.workers[slot].pid.store(pid, memory_order_relaxed);
+	slots[pid] = slot;
+	LOG_MESSAGE(LOG_DEBUG, "shard", "", "Started worker " << slot << " (pid " <<
+	            pid << ")");
+	return true;
+	
+} // end spawnShardWorker
+
+
+//**************************************************************
+// Function requeueShardJobs is defined.                       *
+// The function queues again the files a crashed worker had    *
+// claimed, or fails those that already crashed a worker       *
+// before. Returns the number queued again.                    *
+//**************************************************************
+
+int requeueShardJobs(ShardSegment &shard, int slot, const vector<string> &inputFiles)
+{
+	ShardHeader &header = *shard.header;
+	int numRequeued = 0;
+	for (size_t iJob = 0; iJob < header.numJobs; iJob++)
+	{
+		ShardJob &job = shard.jobs[iJob];
+		if (job.state.load(memory_order_acquire) !=
+		    (SHARD_CLAIMED | (slot << SHARD_WORKER_SHIFT)))
+		{
+			continue;
+		}
+		
+		if (job.attempts.fetch_add(1) + 1 >= SHARD_MAX_ATTEMPTS)
+		{
+			LOG_MESSAGE(LOG_ERROR, "shard", inputFiles[iJob],
+			            "Conversion crashed its worker " << SHARD_MAX_ATTEMPTS << " times");
+			job.state.store(SHARD_FAILED | (slot << SHARD_WORKER_SHIFT),
+			                memory_order_release);
+			continue;
+		}
+		
+		// The slot is filled before it is published to the workers.
+		uint64_t queueEnd = header.queueEnd.load(memory_order_relaxed);
+		job.state.store(SHARD_PENDING, memory_order_relaxed);
+		shard.queue[queueEnd] = iJob;
+		header.queueEnd.store(queueEnd + 1, memory_order_release);
+		numRequeued++;
+	}
+	
+	return numRequeued;
+	
+} // end requeueShardJobs
+
+
+//**************************************************************
+// Function claimShardJob is defined.                          *
+// The function claims the next queued file of a sharded       *
+// batch for this worker. The claim and the worker's slot are  *
+// stored in one compare-and-swap of the file's state, so a    *
+// worker dying at any point leaves its file either pending    *
+// or claimed by it. The shared counter is then moved past     *
+// the queue slot, by whichever worker gets there first.       *
+// Returns false once the queue is exhausted.                  *
+//**************************************************************
+
+bool claimShardJob(ShardSegment &shard, size_t &iJob)
+{
+	ShardHeader &header = *shard.header;
+	uint64_t slot = header.nextSlot.load(memory_order_acquire);
+	while (slot < header.queueEnd.load(memory_order_acquire))
+	{
+		uint32_t iQueued = shard.queue[slot];
+		int32_t pending = SHARD_PENDING;
+		bool claimed = shard.jobs[iQueued].state.compare_exchange_strong(
+		                   pending, SHARD_CLAIMED | (shard.slot << SHARD_WORKER_SHIFT));
+		
+		// The slot is passed whether this worker or another claimed its
+		// file, or the file was queued again further on.
+		header.nextSlot.compare_exchange_strong(slot, slot + 1);
+		if (claimed)
+		{
+			iJob = iQueued;
+			return true;
+		}
+		slot = header.nextSlot.load(memory_order_acquire);
+	}
+	
+	return false;
+	
+} // end claimShardJob
+
+
+//**************************************************************
+// Function finishShardJob is defined.                         *
+// The function records the outcome and latency of a file in   *
+// the shared segment and adds them to this worker's counters. *
+//**************************************************************
+
+void finishShardJob(ShardSegment &shard, size_t iJob, bool converted,
+                    int64_t latencyUs)
+{
+	ShardWorker &worker = shard.workers[shard.slot];
+	if (converted)
+	{
+		worker.numConverted.fetch_add(1, memory_order_relaxed);
+	}
+	else
+	{
+		worker.numFailed.fetch_add(1, memory_order_relaxed);
+	}
+	worker.busyUs.fetch_add(latencyUs, memory_order_relaxed);
+	
+	ShardJob &job = shard.jobs[iJob];
+	job.latencyUs.store(latencyUs, memory_order_relaxed);
+	job.state.store((converted ? SHARD_DONE : SHARD_FAILED) |
+	                (shard.slot << SHARD_WORKER_SHIFT), memory_order_release);
+	
+} // end finishShardJob
+
+
+//**************************************************************
+// Function reportShardRun is defined.                         *
+// The function logs the counters of each worker slot and the  *
+// latencies of the converted files, and returns the number    *
+// of files that failed or were never converted.               *
+//**************************************************************
+
+int reportShardRun(ShardSegment &shard, const vector<string> &inputFiles)
+{
+	ShardHeader &header = *shard.header;
+	for (uint32_t iSlot = 0; iSlot < header.numWorkers; iSlot++)
+	{
+		const ShardWorker &worker = shard.workers[iSlot];
+		LOG_MESSAGE(LOG_INFO, "shard", "", "Worker " << iSlot << " (pid " <<
+		            worker.pid.load() << "): " << worker.numConverted.load() <<
+		            " converted, " << worker.numFailed.load() << " failed, busy " <<
+		            worker.busyUs.load() / 1000.0 << " ms");
+	}
+	
+	int numConverted = 0;
+	int numFailed = 0;
+	vector<double> latencies;
+	for (size_t iJob = 0; iJob < header.numJobs; iJob++)
+	{
+		const ShardJob &job = shard.jobs[iJob];
+		int state = job.state.load(memory_order_acquire) & SHARD_STATE_MASK;
+		if (state == SHARD_DONE)
+		{
+			numConverted++;
+			latencies.push_back(job.latencyUs.load() / 1000.0);
+		}
+		else if (state == SHARD_FAILED)
+		{
+			numFailed++;
+		}
+		else
+		{
+			LOG_MESSAGE(LOG_ERROR, "shard", inputFiles[iJob], "File was not converted");
+			numFailed++;
+		}
+	}
+	
+	sort(latencies.begin(), latencies.end());
+	uint64_t numRequeued = header.queueEnd.load() - header.numJobs;
+	if (latencies.empty())
+	{
+		LOG_MESSAGE(LOG_INFO, "shard", "", numConverted << " converted, " <<
+		            numFailed << " failed, " << numRequeued << " queued again");
+	}
+	else
+	{
+		LOG_MESSAGE(LOG_INFO, "shard", "", numConverted << " converted, " <<
+		            numFailed << " failed, " << numRequeued <<
+		            " queued again; latency median " <<
+		            latencies[(latencies.size() - 1) / 2] << " ms, 95th percentile " <<
+		            latencies[(latencies.size() - 1) * 95 / 100] << " ms, max " <<
+		            latencies.back() << " ms");
+	}
+	
+	return numFailed;
+	
+} // end reportShardRun
+
+
+
+//**************************************************************
+// Function compileRemapRules is defined.                      *
+// The function builds the prefix trie of the path-remapping   *
+// rules file, or of the default drive mappings when no file   *
+// is given. Each line of the file holds one                   *
+// "prefix => directory" rule; blank and '#' lines are skipped.*
+//**************************************************************
+
+bool compileRemapRules(string pathRules, PathRemapper &remapper)
+{
+	remapper.children.assign(PathRemapper::FANOUT, 0);
+	remapper.nodeRules.assign(1, -1);
+	remapper.prefixes.clear();
+	remapper.targets.clear();
+	remapper.pathRules = pathRules;
+	
+	if (pathRules.empty())
+	{
+		addRemapRule(remapper, "Z:", "/rdo/home/cguy");
+		addRemapRule(remapper, "X:", "/rdo/home/cguy/ix");
+	}
+	else
+	{
+		ifstream rulesFile(pathRules.c_str());
+		if (!rulesFile.is_open())
+		{
+			return false;
+		}
+		
+		string currentLine;
+		int lineNumber = 0;
+		while (getline(rulesFile, currentLine))
+		{
+			lineNumber++;
+			size_t first = currentLine.find_first_not_of(" \t\r");
+			if ((first == string::npos) || (currentLine[first] == '#'))
+			{
+				continue;
+			}
+			
+			size_t arrow = currentLine.find("=>");
+			if (arrow == string::npos)
+			{
+				LOG_MESSAGE(LOG_ERROR, "remap", pathRules, "Line " << lineNumber <<
+				            " is not of the form \"prefix => directory\"");
+				return false;
+			}
+			
+			string prefix = currentLine.substr(first, arrow - first);
+			string target = currentLine.substr(arrow + 2);
+			prefix.erase(prefix.find_last_not_of(" \t") + 1);
+			target.erase(0, min(target.length(), target.find_first_not_of(" \t")));
+			target.erase(target.find_last_not_of(" \t\r") + 1);
+			addRemapRule(remapper, prefix, target);
+		}
+	}
+	
+	remapper.hits.reset(new atomic<unsigned long long>[remapper.targets.size()]());
+	
+	return true;
+	
+} // end compileRemapRules
+
+
+//**************************************************************
+// Function addRemapRule is defined.                           *
+// The function adds the path of a rule's prefix to the trie.  *
+// Trailing slashes are dropped from the prefix and target so  *
+// a rule matches whole path components. A later rule with the *
+// same prefix replaces an earlier one.                        *
+//**************************************************************
+
+void addRemapRule(PathRemapper &remapper, string prefix, string target)
+{
+	while ((prefix.length() > 1) &&
+	       ((prefix[prefix.length() - 1] == '\\') ||
+	        (prefix[prefix.length() - 1] == '/')))
+	{
+		prefix.erase(prefix.length() - 1);
+	}
+	while ((target.length() > 1) && (target[target.length() - 1] == '/'))
+	{
+		target.erase(target.length() - 1);
+	}
+	
+	int node = 0;
+	for (size_t iChar = 0; iChar < prefix.length(); iChar++)
+	{
+		unsigned char c = tolower((unsigned char)prefix[iChar]);
+		c = (c == '\\') ? '/' : c;
+		
+		if (remapper.children[node * PathRemapper::FANOUT + c] == 0)
+		{
+			remapper.children[node * PathRemapper::FANOUT + c] =
+			                                       remapper.nodeRules.size();
+			remapper.children.resize(remapper.children.size() +
+			                         PathRemapper::FANOUT, 0);
+			remapper.nodeRules.push_back(-1);
+		}
+		node = remapper.children[node * PathRemapper::FANOUT + c];
+	}
+	
+	if (remapper.nodeRules[node] >= 0)
+	{
+		remapper.targets[remapper.nodeRules[node]] = target;
+		return;
+	}
+	
+	remapper.nodeRules[node] = remapper.targets.size();
+	remapper.prefixes.push_back(prefix);
+	remapper.targets.push_back(target);
+	
+} // end addRemapRule
+
+
+//**************************************************************
+// Function reportRemapHits is defined.                        *
+// The function logs how many MetaHeader paths each rule       *
+// rewrote, so unused rules of a rules file stand out.         *
+//**************************************************************
+
+void reportRemapHits()
+{
+	int level = pathRemapper.pathRules.empty() ? LOG_DEBUG : LOG_INFO;
+	
+	for (size_t iRule = 0; iRule < pathRemapper.targets.size(); iRule++)
+	{
+		LOG_MESSAGE(level, "remap", pathRemapper.pathRules,
+		            pathRemapper.prefixes[iRule] << " => " <<
+		            pathRemapper.targets[iRule] << " was applied " <<
+		            pathRemapper.hits[iRule].load() << " times");
+	}
+	
+} // end reportRemapHits
+
+
+//**************************************************************
+// Function remapMhdPath is defined.                           *
+// The function converts a "Scan_x=" line of an iX point pairs *
+// file into the path of the MetaHeader file it refers to. The *
+// longest rule prefix matching whole path components is found *
+// and replaced, and backslashes flipped, in one pass.         *
+//**************************************************************
+
+string remapMhdPath(string pathMhd)
+{
+	const PathRemapper &remapper = pathRemapper;
+	
+	//Removes leading "Scan_x=" characters.
+	size_t start = min(pathMhd.length(), (size_t)7);
+	
+	int node = 0;
+	int rule = -1;
+	size_t matchEnd = start;
+	for (size_t iChar = start; iChar < pathMhd.length(); iChar++)
+	{
+		unsigned char c = tolower((unsigned char)pathMhd[iChar]);
+		c = (c == '\\') ? '/' : c;
+		
+		node = remapper.children[node * PathRemapper::FANOUT + c];
+		if (node == 0)
+		{
+			break;
+		}
+		
+		// A prefix must end at a drive or between path components.
+		char next = (iChar + 1 < pathMhd.length()) ? pathMhd[iChar + 1] : '/';
+		if ((remapper.nodeRules[node] >= 0) &&
+		    ((c == ':') || (next == '\\') || (next == '/')))
+		{
+			rule = remapper.nodeRules[node];
+			matchEnd = iChar + 1;
+		}
+	}
+	
+	if (rule < 0)
+	{
+		return pathMhd.substr(start);
+	}
+	remapper.hits[rule]++;
+	
+	//Replaces the Windows prefix with the Linux directory
+	string pathLinux;
+	pathLinux.reserve(remapper.targets[rule].length() + pathMhd.length() - matchEnd);
+	pathLinux = remapper.targets[rule];
+	for (size_t iChar = matchEnd; iChar < pathMhd.length(); iChar++)
+	{
+		pathLinux += (pathMhd[iChar] == '\\') ? '/' : pathMhd[iChar];
+	}
+	
+	return pathLinux;
+	
+} // end remapMhdPath
+
+
+//**************************************************************
+// Function isMetaImageMagic is defined.                       *
+// The function checks whether the start of a file looks like  *
+// a MetaImage header.                                         *
+//**************************************************************
+
+bool isMetaImageMagic(const unsigned char *bytes, size_t numBytes)
+{
+	string start((const char *)bytes, numBytes);
+	return (start.compare(0, 10, "ObjectType") == 0) ||
+	       (start.compare(0, 5, "NDims") == 0);
+	
+} // end isMetaImageMagic
+
+
+//**************************************************************
+// Function isNrrdMagic is defined.                            *
+// The function checks for the "NRRD000x" magic of a NRRD      *
+// header.                                                     *
+//**************************************************************
+
+bool isNrrdMagic(const unsigned char *bytes, size_t numBytes)
+{
+	return (numBytes >= 4) && (memcmp(bytes, "NRRD", 4) == 0);
+	
+} // end isNrrdMagic
+
+
+//**************************************************************
+// Function isNiftiMagic is defined.                           *
+// The function checks for a NIfTI-1 header, whose first field *
+// is its size of 348 in either byte order, or for the gzip    *
+// magic of a compressed one.                                  *
+//**************************************************************
+
+bool isNiftiMagic(const unsigned char *bytes, size_t numBytes)
+{
+	if ((numBytes >= 2) && (bytes[0] == 0x1f) && (bytes[1] == 0x8b))
+	{
+		return true;
+	}
+	
+	return (numBytes >= 4) &&
+	       (((bytes[0] == 92) && (bytes[1] == 1) && !bytes[2] && !bytes[3]) ||
+	        (!bytes[0] && !bytes[1] && (bytes[2] == 1) && (bytes[3] == 92)));
+	
+} // end isNiftiMagic
+
+
+//**************************************************************
+// Function readHeaderText is defined.                         *
+// The function reads the start of a text image header. Only   *
+// the first 64 KB are read, as headers of single-file images  *
+// are followed by the voxel data.                             *
+//**************************************************************
+
+bool readHeaderText(string path, string &text)
+{
+	const size_t MAX_HEADER = 1 << 16;
+	
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	
+	text.resize(MAX_HEADER);
+	ssize_t numRead = read(fd, &text[0], MAX_HEADER);
+	close(fd);
+	
+	text.resize(max((ssize_t)0, numRead));
+	return numRead >= 0;
+	
+} // end readHeaderText
+
+
+//**************************************************************
+// Function readGeometryMhd is defined.                        *
+// The function reads the geometry fields of a MetaImage       *
+// header, stopping at ElementDataFile which ends the header.  *
+//**************************************************************
+
+bool readGeometryMhd(string path, ImageGeometry &geometry)
+{
+	string text;
+	if (!readHeaderText(path, text))
+	{
+		return false;
+	}
+	
+	size_t lineStart = 0;
+	while (lineStart < text.length())
+	{
+		size_t lineEnd = text.find('\n', lineStart);
+		lineEnd = (lineEnd == string::npos) ? text.length() : lineEnd;
+		
+		// Lines are of the form "Key = Value".
+		size_t equal = text.find('=', lineStart);
+		if (equal < lineEnd)
+		{
+			string key = text.substr(lineStart, equal - lineStart);
+			key.erase(key.find_last_not_of(" \t") + 1);
+			string value = text.substr(equal + 1, lineEnd - equal - 1);
+			value.erase(0, min(value.length(), value.find_first_not_of(" \t")));
+			value.erase(value.find_last_not_of(" \t\r") + 1);
+			istringstream values(value);
+			
+			if (key == "NDims")
+			{
+				values >> geometry.numDims;
+			}
+			else if (key == "DimSize")
+			{
+				geometry.imgDims = value;
+				values >> geometry.dimSizes[0] >> geometry.dimSizes[1]
+				       >> geometry.dimSizes[2];
+			}
+			else if ((key == "Offset") || (key == "Origin") || (key == "Position"))
+			{
+				values >> geometry.offsets[0] >> geometry.offsets[1]
+				       >> geometry.offsets[2];
+			}
+			else if (key == "ElementSpacing")
+			{
+				values >> geometry.spacings[0] >> geometry.spacings[1]
+				       >> geometry.spacings[2];
+			}
+			else if ((key == "TransformMatrix") || (key == "Orientation") ||
+			         (key == "Rotation"))
+			{
+				// Matrix is stored column by column.
+				for (int iEntry = 0; iEntry < 9; iEntry++)
+				{
+					values >> geometry.directions[(iEntry % 3) * 3 + iEntry / 3];
+				}
+			}
+			else if (key == "ElementType")
+			{
+				geometry.elementType = value;
+			}
+			else if (key == "CompressedData")
+			{
+				geometry.compressed = (value == "True");
+			}
+			else if ((key == "BinaryDataByteOrderMSB") ||
+			         (key == "ElementByteOrderMSB"))
+			{
+				geometry.byteOrderMsb = (value == "True");
+			}
+			else if (key == "HeaderSize")
+			{
+				values >> geometry.dataOffset;
+			}
+			else if (key == "ElementDataFile")
+			{
+				// Data follows the header or lies beside it.
+				if (value == "LOCAL")
+				{
+					geometry.pathData = path;
+					geometry.dataOffset = min(lineEnd + 1, text.length());
+				}
+				else if ((value.find(' ') == string::npos) && (value != "LIST"))
+				{
+					size_t slash = path.find_last_of('/');
+					bool relative = (value[0] != '/') && (slash != string::npos);
+					geometry.pathData = relative ?
+					                    path.substr(0, slash + 1) + value : value;
+				}
+				break;
+			}
+		}
+		
+		lineStart = lineEnd + 1;
+	}
+	
+	return true;
+	
+} // end readGeometryMhd
+
+
+//**************************************************************
+// Function readGeometryNrrd is defined.                       *
+// The function reads the geometry fields of a NRRD header     *
+// (.nrrd or detached .nhdr). Space directions give both the   *
+// spacing and orientation; RAS spaces are flipped to LPS.     *
+//**************************************************************
+
+bool readGeometryNrrd(string path, ImageGeometry &geometry)
+{
+	string text;
+	if (!readHeaderText(path, text) ||
+	    !isNrrdMagic((const unsigned char *)text.data(), text.length()))
+	{
+		return false;
+	}
+	
+	bool isRas = false;
+	size_t lineStart = text.find('\n') + 1;
+	while ((lineStart != 0) && (lineStart < text.length()))
+	{
+		size_t lineEnd = text.find('\n', lineStart);
+		lineEnd = (lineEnd == string::npos) ? text.length() : lineEnd;
+		string line = text.substr(lineStart, lineEnd - lineStart);
+		line.erase(line.find_last_not_of("\r") + 1);
+		lineStart = lineEnd + 1;
+		
+		// A blank line ends the header.
+		if (line.empty())
+		{
+			break;
+		}
+		
+		// Fields are "field: value"; key/value pairs "key:=value" are skipped.
+		size_t colon = line.find(": ");
+		if ((line[0] == '#') || (colon == string::npos))
+		{
+			continue;
+		}
+		string field = line.substr(0, colon);
+		string value = line.substr(colon + 2);
+		
+		// Vectors are written "(x,y,z)".
+		replace(value.begin(), value.end(), '(', ' ');
+		replace(value.begin(), value.end(), ')', ' ');
+		replace(value.begin(), value.end(), ',', ' ');
+		istringstream values(value);
+		
+		if (field == "dimension")
+		{
+			values >> geometry.numDims;
+		}
+		else if (field == "sizes")
+		{
+			values >> geometry.dimSizes[0] >> geometry.dimSizes[1]
+			       >> geometry.dimSizes[2];
+		}
+		else if (field == "space")
+		{
+			isRas = (value.compare(0, 11, "right-anter") == 0) ||
+			        (value.compare(0, 3, "RAS") == 0);
+		}
+		else if (field == "space origin")
+		{
+			values >> geometry.offsets[0] >> geometry.offsets[1]
+			       >> geometry.offsets[2];
+		}
+		else if (field == "spacings")
+		{
+			values >> geometry.spacings[0] >> geometry.spacings[1]
+			       >> geometry.spacings[2];
+		}
+		else if (field == "space directions")
+		{
+			// Each vector is one voxel axis, scaled by its spacing.
+			for (int iAxis = 0; iAxis < 3; iAxis++)
+			{
+				double axis[3] = {0, 0, 0};
+				values >> axis[0] >> axis[1] >> axis[2];
+				double length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] +
+				                     axis[2] * axis[2]);
+				geometry.spacings[iAxis] = length;
+				for (int d = 0; d < 3; d++)
+				{
+					geometry.directions[d * 3 + iAxis] =
+					                        (length > 0) ? axis[d] / length : 0;
+				}
+			}
+		}
+	}
+	
+	if (isRas)
+	{
+		for (int d = 0; d < 2; d++)
+		{
+			geometry.offsets[d] = -geometry.offsets[d];
+			for (int iAxis = 0; iAxis < 3; iAxis++)
+			{
+				geometry.directions[d * 3 + iAxis] *= -1;
+			}
+		}
+	}
+	
+	ostringstream dims;
+	dims << geometry.dimSizes[0] << " " << geometry.dimSizes[1] << " "
+	     << geometry.dimSizes[2];
+	geometry.imgDims = dims.str();
+	
+	return true;
+	
+} // end readGeometryNrrd
+
+
+//**************************************************************
+// Functions niftiShort and niftiFloat are defined.            *
+// The functions return a 16-bit integer or 32-bit float field *
+// of a NIfTI-1 header, swapping its bytes when the header was *
+// written in the other byte order.                            *
+//**************************************************************
+
+short niftiShort(const unsigned char *header, bool swapped, int offset)
+{
+	unsigned char bytes[2];
+	for (int iByte = 0; iByte < 2; iByte++)
+	{
+		bytes[iByte] = header[offset + (swapped ? 1 - iByte : iByte)];
+	}
+	
+	short value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+	
+} // end niftiShort
+
+double niftiFloat(const unsigned char *header, bool swapped, int offset)
+{
+	unsigned char bytes[4];
+	for (int iByte = 0; iByte < 4; iByte++)
+	{
+		bytes[iByte] = header[offset + (swapped ? 3 - iByte : iByte)];
+	}
+	
+	float value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+	
+} // end niftiFloat
+
+
+//**************************************************************
+// Function readGeometryNifti is defined.                      *
+// The function reads the geometry of a NIfTI-1 image from its *
+// 348-byte header alone, so the voxel data of a .nii file is  *
+// never read. The sform is used when set, else the qform. The *
+// RAS coordinates of NIfTI are flipped to LPS.                *
+//**************************************************************
+
+bool readGeometryNifti(string path, ImageGeometry &geometry)
+{
+	const int HEADER_SIZE = 348;
+	unsigned char header[HEADER_SIZE];
+	int numRead = 0;
+	
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	numRead = read(fd, header, 2);
+	
+	// Compressed headers are inflated only as far as the header.
+	if ((numRead == 2) && (header[0] == 0x1f) && (header[1] == 0x8b))
+	{
+#ifdef LMK_USE_ZLIB
+		lseek(fd, 0, SEEK_SET);
+		gzFile compressed = gzdopen(fd, "rb");
+		numRead = (compressed != NULL) ? gzread(compressed, header, HEADER_SIZE) : 0;
+		if (compressed != NULL)
+		{
+			gzclose(compressed);
+		}
+		fd = -1;
+#else
+		LOG_MESSAGE(LOG_ERROR, "read", path,
+		            "Compressed NIfTI requires compiling with -DLMK_USE_ZLIB");
+		numRead = 0;
+#endif
+	}
+	else if (numRead == 2)
+	{
+		numRead += read(fd, header + 2, HEADER_SIZE - 2);
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	
+	if ((numRead != HEADER_SIZE) || !isNiftiMagic(header, HEADER_SIZE))
+	{
+		return false;
+	}
+	
+	// Fields are swapped when the header was written in the other byte order.
+	bool swapped = (header[0] == 0);
+	
+	geometry.numDims = niftiShort(header, swapped, 40);
+	for (int iAxis = 0; iAxis < 3; iAxis++)
+	{
+		int dimSize = niftiShort(header, swapped, 42 + 2 * iAxis);
+		geometry.dimSizes[iAxis] = max(1, dimSize);
+		geometry.spacings[iAxis] = fabs(niftiFloat(header, swapped,
+		                                           80 + 4 * iAxis));
+	}
+	
+	// Matrix maps voxel indices to RAS coordinates.
+	double matrix[3][4];
+	if (niftiShort(header, swapped, 254) > 0) // sform_code
+	{
+		for (int iRow = 0; iRow < 3; iRow++)
+		{
+			for (int iCol = 0; iCol < 4; iCol++)
+			{
+				matrix[iRow][iCol] = niftiFloat(header, swapped,
+				                                280 + 16 * iRow + 4 * iCol);
+			}
+		}
+	}
+	else
+	{
+		// Rotation is given by the quaternion (a,b,c,d) with a implied.
+		double b = niftiFloat(header, swapped, 256);
+		double c = niftiFloat(header, swapped, 260);
+		double d = niftiFloat(header, swapped, 264);
+		double a = sqrt(max(0.0, 1.0 - (b * b + c * c + d * d)));
+		double qfac = (niftiFloat(header, swapped, 76) < 0) ? -1.0 : 1.0;
+		double rotation[3][3] =
+		{
+			{a*a + b*b - c*c - d*d, 2 * (b*c - a*d), 2 * (b*d + a*c)},
+			{2 * (b*c + a*d), a*a + c*c - b*b - d*d, 2 * (c*d - a*b)},
+			{2 * (b*d - a*c), 2 * (c*d + a*b), a*a + d*d - c*c - b*b}
+		};
+		
+		// Legacy headers without a qform only scale.
+		bool hasQform = (niftiShort(header, swapped, 252) > 0);
+		for (int iRow = 0; iRow < 3; iRow++)
+		{
+			for (int iCol = 0; iCol < 3; iCol++)
+			{
+				double entry = hasQform ? rotation[iRow][iCol] : (iRow == iCol);
+				matrix[iRow][iCol] = entry * geometry.spacings[iCol] *
+				                     ((iCol == 2) ? qfac : 1.0);
+			}
+			matrix[iRow][3] = hasQform ?
+			                  niftiFloat(header, swapped, 268 + 4 * iRow) : 0;
+		}
+	}
+	
+	for (int iCol = 0; iCol < 3; iCol++)
+	{
+		double length = sqrt(matrix[0][iCol] * matrix[0][iCol] +
+		                     matrix[1][iCol] * matrix[1][iCol] +
+		                     matrix[2][iCol] * matrix[2][iCol]);
+		geometry.spacings[iCol] = length;
+		for (int iRow = 0; iRow < 3; iRow++)
+		{
+			double sign = (iRow < 2) ? -1.0 : 1.0;
+			geometry.directions[iRow * 3 + iCol] = (length > 0) ?
+			                           sign * matrix[iRow][iCol] / length : 0;
+		}
+	}
+	geometry.offsets[0] = -matrix[0][3];
+	geometry.offsets[1] = -matrix[1][3];
+	geometry.offsets[2] = matrix[2][3];
+	
+	ostringstream dims;
+	dims << geometry.dimSizes[0] << " " << geometry.dimSizes[1] << " "
+	     << geometry.dimSizes[2];
+	geometry.imgDims = dims.str();
+	
+	return true;
+	
+} // end readGeometryNifti
+
+
+// Readers of the supported image header formats.
+const GeometryReader GEOMETRY_READERS[] =
+{
+	{"MetaImage", {".mhd", ".mha", NULL}, isMetaImageMagic, readGeometryMhd},
+	{"NRRD", {".nrrd", ".nhdr", NULL}, isNrrdMagic, readGeometryNrrd},
+	{"NIfTI", {".nii", ".nii.gz", ".hdr"}, isNiftiMagic, readGeometryNifti}
+};
+const int NUM_GEOMETRY_READERS = 3;
+
+
+//**************************************************************
+// Function getImageGeometry is defined.                       *
+// The function returns the geometry of an image header,       *
+// picking the reader by extension or else by magic bytes.     *
+// Geometries are cached by path and read again only when the  *
+// header's size or modification time changes.                 *
+//**************************************************************
+
+bool getImageGeometry(string path, ImageGeometry &geometry)
+{
+	struct stat status;
+	if (stat(path.c_str(), &status) != 0)
+	{
+		return false;
+	}
+	
+	{
+		lock_guard<mutex> guard(geometryCache.lock);
+		map<string, ImageGeometry>::const_iterator cached =
+		                                        geometryCache.entries.find(path);
+		if ((cached != geometryCache.entries.end()) &&
+		    (cached->second.fileSize == (long long)status.st_size) &&
+		    (cached->second.modifiedTime == (long long)status.st_mtime))
+		{
+			geometry = cached->second;
+			return true;
+		}
+	}
+	
+	// Extensions are compared ignoring case.
+	string lowerPath = path;
+	transform(lowerPath.begin(), lowerPath.end(), lowerPath.begin(), ::tolower);
+	
+	const GeometryReader *reader = NULL;
+	for (int iReader = 0; (iReader < NUM_GEOMETRY_READERS) && !reader; iReader++)
+	{
+		for (int iExt = 0; iExt < 3; iExt++)
+		{
+			const char *extension = GEOMETRY_READERS[iReader].extensions[iExt];
+			if ((extension != NULL) && (lowerPath.length() > strlen(extension)) &&
+			    (lowerPath.compare(lowerPath.length() - strlen(extension),
+			                       string::npos, extension) == 0))
+			{
+				reader = &GEOMETRY_READERS[iReader];
+				break;
+			}
+		}
+	}
+	
+	if (reader == NULL)
+	{
+		unsigned char magic[16];
+		ssize_t numRead = 0;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd >= 0)
+		{
+			numRead = max((ssize_t)0, read(fd, magic, sizeof(magic)));
+			close(fd);
+		}
+		for (int iReader = 0; (iReader < NUM_GEOMETRY_READERS) && !reader; iReader++)
+		{
+			if (GEOMETRY_READERS[iReader].matchesMagic(magic, numRead))
+			{
+				reader = &GEOMETRY_READERS[iReader];
+			}
+		}
+	}
+	
+	if (reader == NULL)
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", path, "Unrecognized image header format");
+		return false;
+	}
+	
+	// Fields missing from the header stay zero, the identity direction aside.
+	ImageGeometry read;
+	read.numDims = 3;
+	fill(read.dimSizes, read.dimSizes + 3, 0);
+	fill(read.offsets, read.offsets + 3, 0.0);
+	fill(read.spacings, read.spacings + 3, 0.0);
+	for (int iEntry = 0; iEntry < 9; iEntry++)
+	{
+		read.directions[iEntry] = (iEntry % 4 == 0) ? 1.0 : 0.0;
+	}
+	read.compressed = false;
+	read.byteOrderMsb = false;
+	read.dataOffset = 0;
+	read.fileSize = status.st_size;
+	read.modifiedTime = status.st_mtime;
+	
+	LOG_MESSAGE(LOG_DEBUG, "read", path, "Reading " << reader->name << " header");
+	if (!reader->read(path, read))
+	{
+		return false;
+	}
+	
+	lock_guard<mutex> guard(geometryCache.lock);
+	geometryCache.entries[path] = read;
+	geometry = read;
+	
+	return true;
+	
+} // end getImageGeometry
+
+
+// Element types of MetaImage voxel data and their sizes in bytes.
+const char *VOLUME_ELEMENT_TYPES[] = {"MET_UCHAR", "MET_CHAR", "MET_USHORT",
+                                      "MET_SHORT", "MET_UINT", "MET_INT",
+                                      "MET_FLOAT", "MET_DOUBLE"};
+const int VOLUME_ELEMENT_SIZES[] = {1, 1, 2, 2, 4, 4, 4, 8};
+const int NUM_VOLUME_ELEMENT_TYPES = 8;
+
+// Decoded bytes aimed for per slab and kept per volume.
+const size_t VOLUME_SLAB_BYTES = 4 << 20;
+const size_t VOLUME_CACHE_BYTES = 256 << 20;
+
+
+//**************************************************************
+// Function openImageVolume is defined.                        *
+// The function prepares the voxel data of a MetaImage volume  *
+// for reading by slab. Nothing is decoded until a slab is     *
+// requested. Returns NULL if the data cannot be read.         *
+//**************************************************************
+
+ImageVolume *openImageVolume(string pathHeader)
+{
+	ImageGeometry geometry;
+	if (!getImageGeometry(pathHeader, geometry))
+	{
+		return NULL;
+	}
+	
+	int elementType = -1;
+	for (int iType = 0; iType < NUM_VOLUME_ELEMENT_TYPES; iType++)
+	{
+		if (geometry.elementType == VOLUME_ELEMENT_TYPES[iType])
+		{
+			elementType = iType;
+		}
+	}
+	if ((elementType < 0) || geometry.pathData.empty() ||
+	    (geometry.dimSizes[0] <= 0) || (geometry.dimSizes[1] <= 0))
+	{
+		LOG_MESSAGE(LOG_ERROR, "volume", pathHeader,
+		            "Voxel data of this header cannot be read");
+		return NULL;
+	}
+#ifndef LMK_USE_ZLIB
+	if (geometry.compressed)
+	{
+		LOG_MESSAGE(LOG_ERROR, "volume", pathHeader,
+		            "Compressed voxel data requires compiling with -DLMK_USE_ZLIB");
+		return NULL;
+	}
+#endif
+	
+	int fd = open(geometry.pathData.c_str(), O_RDONLY);
+	struct stat status;
+	if ((fd < 0) || (fstat(fd, &status) != 0))
+	{
+		LOG_MESSAGE(LOG_ERROR, "volume", geometry.pathData,
+		            "Failed to open voxel data");
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return NULL;
+	}
+	
+	ImageVolume *volume = new ImageVolume;
+	volume->geometry = geometry;
+	volume->elementType = elementType;
+	volume->elementSize = VOLUME_ELEMENT_SIZES[elementType];
+	volume->sliceBytes = (size_t)geometry.dimSizes[0] * geometry.dimSizes[1] *
+	                     volume->elementSize;
+	volume->slabSlices = max((size_t)1, VOLUME_SLAB_BYTES / volume->sliceBytes);
+	volume->numSlabs = (max(1, geometry.dimSizes[2]) + volume->slabSlices - 1) /
+	                   volume->slabSlices;
+	volume->maxSlabs = max((size_t)2, VOLUME_CACHE_BYTES /
+	                                  (volume->sliceBytes * volume->slabSlices));
+	volume->fd = fd;
+	volume->mapping = NULL;
+	volume->mappedSize = 0;
+	
+	const uint16_t ONE = 1;
+	bool littleEndian = (*(const unsigned char *)&ONE == 1);
+	volume->swapBytes = (geometry.byteOrderMsb == littleEndian) &&
+	                    (volume->elementSize > 1);
+	
+	// Raw data is read in place; a negative header size puts it at the end.
+	if (!geometry.compressed)
+	{
+		if (geometry.dataOffset < 0)
+		{
+			volume->geometry.dataOffset = status.st_size - (long long)
+			            volume->sliceBytes * max(1, geometry.dimSizes[2]);
+		}
+		return volume;
+	}
+	
+#ifdef LMK_USE_ZLIB
+	// Compressed data is mapped so every checkpoint can point into it.
+	void *mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if ((mapping == MAP_FAILED) || (geometry.dataOffset > status.st_size))
+	{
+		LOG_MESSAGE(LOG_ERROR, "volume", geometry.pathData,
+		            "Failed to map compressed voxel data");
+		closeImageVolume(volume);
+		return NULL;
+	}
+	volume->mapping = (const unsigned char *)mapping;
+	volume->mappedSize = status.st_size;
+	
+	// The first checkpoint is the start of the stream, zlib or gzip.
+	z_stream *start = new z_stream;
+	memset(start, 0, sizeof(z_stream));
+	start->next_in = (Bytef *)volume->mapping + max(0LL, geometry.dataOffset);
+	start->avail_in = status.st_size - max(0LL, geometry.dataOffset);
+	if (inflateInit2(start, 15 + 32) != Z_OK)
+	{
+		delete start;
+		closeImageVolume(volume);
+		return NULL;
+	}
+	volume->checkpoints.assign(volume->numSlabs, NULL);
+	volume->checkpoints[0] = start;
+#endif
+	
+	return volume;
+	
+} // end openImageVolume
+
+
+//**************************************************************
+// Function closeImageVolume is defined.                       *
+// The function releases a volume, its checkpoints and its     *
+// cached slabs. Slabs still held by readers stay valid.       *
+//**************************************************************
+
+void closeImageVolume(ImageVolume *volume)
+{
+	if (volume == NULL)
+	{
+		return;
+	}
+	
+#ifdef LMK_USE_ZLIB
+	for (size_t iSlab = 0; iSlab < volume->checkpoints.size(); iSlab++)
+	{
+		if (volume->checkpoints[iSlab] != NULL)
+		{
+			inflateEnd(volume->checkpoints[iSlab]);
+			delete volume->checkpoints[iSlab];
+		}
+	}
+#endif
+	if (volume->mapping != NULL)
+	{
+		munmap((void *)volume->mapping, volume->mappedSize);
+	}
+	close(volume->fd);
+	delete volume;
+	
+} // end closeImageVolume
+
+
+//**************************************************************
+// Function cacheVolumeSlab is defined.                        *
+// The function adds a decoded slab to the volume's cache,     *
+// evicting the least recently used slabs beyond its bound.    *
+// The volume must be locked.                                  *
+//**************************************************************
+
+void cacheVolumeSlab(ImageVolume &volume, int slab, VolumeSlab data)
+{
+	if (volume.slabs.count(slab) != 0)
+	{
+		return;
+	}
+	
+	volume.recentSlabs.push_front(slab);
+	volume.slabs[slab] = make_pair(data, volume.recentSlabs.begin());
+	
+	while (volume.slabs.size() > volume.maxSlabs)
+	{
+		volume.slabs.erase(volume.recentSlabs.back());
+		volume.recentSlabs.pop_back();
+	}
+	
+} // end cacheVolumeSlab
+
+
+//**************************************************************
+// Function decodeVolumeSlabs is defined.                      *
+// The function decodes a run of slabs into the cache. Raw     *
+// data is read directly. Compressed data is inflated from the *
+// latest checkpoint at or before the run, leaving a new       *
+// checkpoint at each slab passed, so later runs never start   *
+// further back than one slab.                                 *
+//**************************************************************
+
+bool decodeVolumeSlabs(ImageVolume &volume, int firstSlab, int lastSlab)
+{
+	size_t slabBytes = volume.sliceBytes * volume.slabSlices;
+	size_t totalBytes = volume.sliceBytes * max(1, volume.geometry.dimSizes[2]);
+	int slab = firstSlab;
+	
+#ifdef LMK_USE_ZLIB
+	z_stream stream;
+	if (volume.geometry.compressed)
+	{
+		lock_guard<mutex> guard(volume.lock);
+		while (volume.checkpoints[slab] == NULL)
+		{
+			slab--;
+		}
+		if (inflateCopy(&stream, volume.checkpoints[slab]) != Z_OK)
+		{
+			return false;
+		}
+	}
+#endif
+	
+	bool success = true;
+	for (; success && (slab <= lastSlab); slab++)
+	{
+		size_t numBytes = min(slabBytes, totalBytes - slab * slabBytes);
+		shared_ptr<vector<char> > data = make_shared<vector<char> >(numBytes);
+		
+		if (!volume.geometry.compressed)
+		{
+			off_t position = volume.geometry.dataOffset + slab * slabBytes;
+			success = (pread(volume.fd, &(*data)[0], numBytes, position) ==
+			           (ssize_t)numBytes);
+		}
+#ifdef LMK_USE_ZLIB
+		else
+		{
+			stream.next_out = (Bytef *)&(*data)[0];
+			stream.avail_out = numBytes;
+			while (success && (stream.avail_out > 0))
+			{
+				int status = inflate(&stream, Z_NO_FLUSH);
+				success = (status == Z_OK) ||
+				          ((status == Z_STREAM_END) && (stream.avail_out == 0));
+			}
+			
+			lock_guard<mutex> guard(volume.lock);
+			if (success && (slab + 1 < volume.numSlabs) &&
+			    (volume.checkpoints[slab + 1] == NULL))
+			{
+				z_stream *checkpoint = new z_stream;
+				if (inflateCopy(checkpoint, &stream) == Z_OK)
+				{
+					volume.checkpoints[slab + 1] = checkpoint;
+				}
+				else
+				{
+					delete checkpoint;
+				}
+			}
+		}
+#endif
+		
+		// Slabs before the run were only passed through.
+		if (!success || (slab < firstSlab))
+		{
+			continue;
+		}
+		
+		if (volume.swapBytes)
+		{
+			for (size_t iByte = 0; iByte < numBytes; iByte += volume.elementSize)
+			{
+				reverse(data->begin() + iByte,
+				        data->begin() + iByte + volume.elementSize);
+			}
+		}
+		
+		lock_guard<mutex> guard(volume.lock);
+		cacheVolumeSlab(volume, slab, data);
+	}
+	
+#ifdef LMK_USE_ZLIB
+	if (volume.geometry.compressed)
+	{
+		inflateEnd(&stream);
+	}
+#endif
+	
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "volume", volume.geometry.pathData,
+		            "Failed to decode voxel data of slab " << (slab - 1));
+	}
+	else
+	{
+		LOG_MESSAGE(LOG_DEBUG, "volume", volume.geometry.pathData,
+		            "Decoded slabs " << firstSlab << " to " << lastSlab);
+	}
+	
+	return success;
+	
+} // end decodeVolumeSlabs
+
+
+//**************************************************************
+// Function prefetchVolumeSlabs is defined.                    *
+// The function decodes the uncached slabs holding the given   *
+// slices. Runs of slabs which can be decoded independently,   *
+// raw slabs or those after separate checkpoints, are decoded  *
+// in parallel. A compressed slab without a checkpoint joins   *
+// the run it would otherwise have to inflate through again.   *
+//**************************************************************
+
+bool prefetchVolumeSlabs(ImageVolume &volume, const vector<int> &slices)
+{
+	vector<int> wanted;
+	for (size_t iSlice = 0; iSlice < slices.size(); iSlice++)
+	{
+		wanted.push_back(max(0, min(volume.numSlabs - 1,
+		                            slices[iSlice] / volume.slabSlices)));
+	}
+	sort(wanted.begin(), wanted.end());
+	wanted.erase(unique(wanted.begin(), wanted.end()), wanted.end());
+	
+	vector<pair<int, int> > runs;
+	{
+		lock_guard<mutex> guard(volume.lock);
+		for (size_t iSlab = 0; iSlab < wanted.size(); iSlab++)
+		{
+			int slab = wanted[iSlab];
+			if (volume.slabs.count(slab) != 0)
+			{
+				continue;
+			}
+			
+			// Decoding starts from the latest checkpoint at or before the slab.
+			int start = slab;
+#ifdef LMK_USE_ZLIB
+			while (volume.geometry.compressed && (volume.checkpoints[start] == NULL))
+			{
+				start--;
+			}
+#endif
+			if (!runs.empty() && (start < slab) && (runs.back().second >= start - 1))
+			{
+				runs.back().second = slab;
+			}
+			else
+			{
+				runs.push_back(make_pair(slab, slab));
+			}
+		}
+	}
+	
+	atomic<size_t> nextRun(0);
+	atomic<bool> success(true);
+	vector<thread> workers;
+	int numThreads = min((int)runs.size(),
+	                     max(1, (int)thread::hardware_concurrency()));
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		workers.push_back(thread([&]()
+		{
+			size_t iRun;
+			while ((iRun = nextRun++) < runs.size())
+			{
+				if (!decodeVolumeSlabs(volume, runs[iRun].first, runs[iRun].second))
+				{
+					success = false;
+				}
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+	
+	return success;
+	
+} // end prefetchVolumeSlabs
+
+
+//**************************************************************
+// Function getVolumeSlab is defined.                          *
+// The function returns the slab holding a slice, decoding it  *
+// when it is not cached. Returns an empty slab on failure.    *
+//**************************************************************
+
+VolumeSlab getVolumeSlab(ImageVolume &volume, int slice)
+{
+	int slab = slice / volume.slabSlices;
+	
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		{
+			lock_guard<mutex> guard(volume.lock);
+			map<int, pair<VolumeSlab, list<int>::iterator> >::iterator cached =
+			                                            volume.slabs.find(slab);
+			if (cached != volume.slabs.end())
+			{
+				volume.recentSlabs.splice(volume.recentSlabs.begin(),
+				                          volume.recentSlabs, cached->second.second);
+				return cached->second.first;
+			}
+		}
+		
+		if (!decodeVolumeSlabs(volume, slab, slab))
+		{
+			break;
+		}
+	}
+	
+	return VolumeSlab();
+	
+} // end getVolumeSlab
+
+
+//**************************************************************
+// Function sampleVolume is defined.                           *
+// The function returns the intensity at a continuous voxel    *
+// index (x,y,z) by trilinear interpolation, clamping to the   *
+// volume's edges. Returns NaN if the data cannot be read.     *
+//**************************************************************
+
+double sampleVolume(ImageVolume &volume, const double *index)
+{
+	const int *dims = volume.geometry.dimSizes;
+	int corner[3];
+	double weight[3];
+	
+	for (int d = 0; d < 3; d++)
+	{
+		double position = max(0.0, min((double)max(1, dims[d]) - 1, index[d]));
+		corner[d] = min((int)position, max(1, dims[d]) - 2);
+		corner[d] = max(0, corner[d]);
+		weight[d] = position - corner[d];
+	}
+	
+	double value = 0;
+	for (int dz = 0; dz < 2; dz++)
+	{
+		int z = min(corner[2] + dz, max(1, dims[2]) - 1);
+		VolumeSlab slab = getVolumeSlab(volume, z);
+		if (!slab)
+		{
+			return NAN;
+		}
+		const char *slice = &(*slab)[0] +
+		                    (z % volume.slabSlices) * volume.sliceBytes;
+		
+		for (int dy = 0; dy < 2; dy++)
+		{
+			for (int dx = 0; dx < 2; dx++)
+			{
+				int y = min(corner[1] + dy, dims[1] - 1);
+				int x = min(corner[0] + dx, dims[0] - 1);
+				double w = (dz ? weight[2] : 1 - weight[2]) *
+				           (dy ? weight[1] : 1 - weight[1]) *
+				           (dx ? weight[0] : 1 - weight[0]);
+				if (w != 0)
+				{
+					w *= getVoxelValue(slice + ((size_t)y * dims[0] + x) *
+					                   volume.elementSize, volume.elementType);
+				}
+				value += w;
+			}
+		}
+	}
+	
+	return value;
+	
+} // end sampleVolume
+
+
+//**************************************************************
+// Function getVoxelValue is defined.                          *
+// The function converts one voxel of the given element type   *
+// to a double.                                                *
+//**************************************************************
+
+double getVoxelValue(const char *voxel, int elementType)
+{
+	switch (elementType)
+	{
+		case 0: { uint8_t v; memcpy(&v, voxel, 1); return v; }
+		case 1: { int8_t v; memcpy(&v, voxel, 1); return v; }
+		case 2: { uint16_t v; memcpy(&v, voxel, 2); return v; }
+		case 3: { int16_t v; memcpy(&v, voxel, 2); return v; }
+		case 4: { uint32_t v; memcpy(&v, voxel, 4); return v; }
+		case 5: { int32_t v; memcpy(&v, voxel, 4); return v; }
+		case 6: { float v; memcpy(&v, voxel, 4); return v; }
+		default: { double v; memcpy(&v, voxel, 8); return v; }
+	}
+	
+} // end getVoxelValue
+
+
+//**************************************************************
+// Function sampleLandmarkIntensities is defined.              *
+// The function samples the fixed or moving image at each of   *
+// its landmarks. The slabs holding landmarks are decoded      *
+// first, in parallel where possible; slabs without landmarks  *
+// are never decoded. Returns false if the image cannot be     *
+// read.                                                       *
+//**************************************************************
+
+bool sampleLandmarkIntensities(const LandmarkPairs &pairs, bool sampleFixed,
+                               vector<double> &intensities)
+{
+	const string &pathImage = sampleFixed ? pairs.pathFixedImage :
+	                                        pairs.pathMovingImage;
+	const vector<double> &points = sampleFixed ? pairs.fixed : pairs.moving;
+	
+	LogTimer timer("volume", pathImage);
+	ImageVolume *volume = openImageVolume(pathImage);
+	if (volume == NULL)
+	{
+		return false;
+	}
+	
+	// Landmarks are converted back to the voxel indices they were given in.
+	vector<double> indices(points.size());
+	vector<int> slices;
+	for (size_t iPoint = 0; 3 * iPoint < points.size(); iPoint++)
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			double position = points[3 * iPoint + 2 - d] - pairs.offsets[d];
+			indices[3 * iPoint + d] = (pairs.spacings[d] == 0) ? 0 :
+			                          position / pairs.spacings[d];
+		}
+		int slice = max(0.0, indices[3 * iPoint + 2]);
+		slices.push_back(slice);
+		slices.push_back(slice + 1);
+	}
+	
+	bool success = prefetchVolumeSlabs(*volume, slices);
+	
+	intensities.resize(points.size() / 3);
+	for (size_t iPoint = 0; success && (iPoint < intensities.size()); iPoint++)
+	{
+		intensities[iPoint] = sampleVolume(*volume, &indices[3 * iPoint]);
+	}
+	
+	closeImageVolume(volume);
+	
+	return success;
+	
+} // end sampleLandmarkIntensities
+
+
+// Names of the images written by resampling.
+const char *RESAMPLE_MODE_NAMES[NUM_RESAMPLE_MODES] = {"warp", "checker", "diff"};
+
+// Voxels along each edge of a resampling tile and a checkerboard square.
+const int RESAMPLE_TILE = 8;
+const int RESAMPLE_CHECKER_SIZE = 32;
+
+// Largest landmark set the resampling spline is fitted to in full.
+const int RESAMPLE_MAX_LANDMARKS = 2000;
+
+// Voxels mapped this far outside the moving image, as by rounding, are
+// still sampled at its edge.
+const float RESAMPLE_EDGE = 0.01f;
+
+
+//**************************************************************
+// Function parseResampleMode is defined.                      *
+// The function returns the resample mode of the given name,   *
+// or -1 if the name is not recognized.                        *
+//**************************************************************
+
+int parseResampleMode(string name)
+{
+	for (int iMode = 0; iMode < NUM_RESAMPLE_MODES; iMode++)
+	{
+		if (name == RESAMPLE_MODE_NAMES[iMode])
+		{
+			return iMode;
+		}
+	}
+	
+	return -1;
+	
+} // end parseResampleMode
+
+
+//**************************************************************
+// Function resampleImage is defined.                          *
+// The function resamples the moving image onto the grid of    *
+// the fixed image through the landmark spline, writing        *
+// <name>_warp, _checker or _diff .mhd/.raw as float voxels.   *
+// The spline of a pipeline's fit stage is used when given;    *
+// otherwise it is fitted here, for large landmark sets to an  *
+// even subset of them. Tile corners are mapped first, then    *
+// slabs of tiles are resampled and written by each thread in  *
+// turn, so only the slices a slab reaches are decoded.        *
+// Returns false if the images or spline are unavailable.      *
+//**************************************************************
+
+bool resampleImage(const LandmarkPairs &pairs, const SplineTransform *fitted,
+                   int mode, string inPath, string outPath, int numThreads)
+{
+	const int T = RESAMPLE_TILE;
+	string base = outPath + getFileStem(inPath) + "_" + RESAMPLE_MODE_NAMES[mode];
+	LogTimer timer("resample", base + ".mhd");
+	
+	if (pairs.pathFixedImage.empty() || pairs.pathMovingImage.empty() ||
+	    pairs.moving.empty())
+	{
+		LOG_MESSAGE(LOG_ERROR, "resample", inPath,
+		            "Resampling requires moving landmarks and both images");
+		return false;
+	}
+	
+	SplineTransform transform;
+	if (fitted == NULL)
+	{
+		bool success;
+		if (pairs.numPoints > RESAMPLE_MAX_LANDMARKS)
+		{
+			vector<bool> keep(pairs.numPoints, false);
+			for (int i = 0; i < RESAMPLE_MAX_LANDMARKS; i++)
+			{
+				keep[(long long)i * pairs.numPoints / RESAMPLE_MAX_LANDMARKS] = true;
+			}
+			LOG_MESSAGE(LOG_WARN, "resample", inPath, "Spline fitted to "
+			            << RESAMPLE_MAX_LANDMARKS << " of " << pairs.numPoints
+			            << " landmarks");
+			success = fitSplineTransform(selectLandmarks(pairs, keep), 0.0,
+			                             transform);
+		}
+		else
+		{
+			success = fitSplineTransform(pairs, 0.0, transform);
+		}
+		if (!success)
+		{
+			LOG_MESSAGE(LOG_ERROR, "resample", inPath,
+			            "Landmarks do not determine a spline transform");
+			return false;
+		}
+		fitted = &transform;
+	}
+	
+	ResampleJob job;
+	job.mode = mode;
+	job.fixedVolume = openImageVolume(pairs.pathFixedImage);
+	job.movingVolume = openImageVolume(pairs.pathMovingImage);
+	if ((job.fixedVolume == NULL) || (job.movingVolume == NULL))
+	{
+		closeImageVolume(job.fixedVolume);
+		closeImageVolume(job.movingVolume);
+		return false;
+	}
+	bool usable = true;
+	for (int d = 0; d < 3; d++)
+	{
+		usable = usable && (job.fixedVolume->geometry.dimSizes[d] >= 2) &&
+		         (job.movingVolume->geometry.dimSizes[d] >= 2) &&
+		         (job.movingVolume->geometry.spacings[d] != 0);
+	}
+	if (!usable)
+	{
+		LOG_MESSAGE(LOG_ERROR, "resample", inPath,
+		            "Images cannot be resampled; both need at least 2 voxels "
+		            "along each axis");
+		closeImageVolume(job.fixedVolume);
+		closeImageVolume(job.movingVolume);
+		return false;
+	}
+	
+	size_t numCorners = 1;
+	for (int d = 0; d < 3; d++)
+	{
+		job.dims[d] = job.fixedVolume->geometry.dimSizes[d];
+		job.numCorners[d] = (job.dims[d] - 1) / T + 2;
+		numCorners *= job.numCorners[d];
+	}
+	job.corners.resize(numCorners * 3);
+	
+	// Header is written first; voxels are written by slab at their offsets.
+	string pathData = base + ".raw";
+	job.fd = open(pathData.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((job.fd < 0) ||
+	    !writeMetaImageHeader(base + ".mhd", job.fixedVolume->geometry,
+	                          "MET_FLOAT", getFileStem(pathData) + ".raw"))
+	{
+		LOG_MESSAGE(LOG_ERROR, "resample", base + ".mhd",
+		            "Failed to create output file");
+		if (job.fd >= 0)
+		{
+			close(job.fd);
+		}
+		closeImageVolume(job.fixedVolume);
+		closeImageVolume(job.movingVolume);
+		return false;
+	}
+	
+	// Planes of tile corners, then slabs of tiles, are shared out in turn.
+	int numSlabs = (job.dims[2] + T - 1) / T;
+	numThreads = max(1, min(numThreads, numSlabs));
+	atomic<int> nextPlane(0);
+	atomic<int> nextSlab(0);
+	atomic<bool> failed(false);
+	
+	for (int phase = 0; phase < 2; phase++)
+	{
+		vector<thread> workers;
+		for (int iThread = 0; iThread < numThreads; iThread++)
+		{
+			workers.push_back(thread([&]()
+			{
+				if (phase == 0)
+				{
+					int plane;
+					while ((plane = nextPlane++) < job.numCorners[2])
+					{
+						mapTileCorners(job, *fitted, plane);
+					}
+				}
+				else
+				{
+					int slab;
+					while (!failed && ((slab = nextSlab++) < numSlabs))
+					{
+						if (!resampleTileSlab(job, slab))
+						{
+							failed = true;
+						}
+					}
+				}
+			}));
+		}
+		for (size_t iThread = 0; iThread < workers.size(); iThread++)
+		{
+			workers[iThread].join();
+		}
+	}
+	
+	bool success = !failed && (close(job.fd) == 0);
+	closeImageVolume(job.fixedVolume);
+	closeImageVolume(job.movingVolume);
+	
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "resample", pathData, "Failed to write resampled image");
+	}
+	
+	return success;
+	
+} // end resampleImage
+
+
+//**************************************************************
+// Function mapTileCorners is defined.                         *
+// The function maps one plane of tile corners of the fixed    *
+// grid through the spline, storing the moving voxel indices   *
+// they fall on.                                               *
+//**************************************************************
+
+void mapTileCorners(ResampleJob &job, const SplineTransform &transform, int plane)
+{
+	const ImageGeometry &fixed = job.fixedVolume->geometry;
+	const ImageGeometry &moving = job.movingVolume->geometry;
+	int nx = job.numCorners[0];
+	int ny = job.numCorners[1];
+	
+	for (int cy = 0; cy < ny; cy++)
+	{
+		for (int cx = 0; cx < nx; cx++)
+		{
+			// Landmarks, and so the spline, are ordered z,y,x.
+			int index[3] = {cx * RESAMPLE_TILE, cy * RESAMPLE_TILE,
+			                plane * RESAMPLE_TILE};
+			double point[3];
+			double mapped[3];
+			for (int d = 0; d < 3; d++)
+			{
+				point[2 - d] = index[d] * fixed.spacings[d] + fixed.offsets[d];
+			}
+			evaluateSplineTransform(transform, point, mapped);
+			
+			double *corner = &job.corners[3 * (((size_t)plane * ny + cy) * nx + cx)];
+			for (int d = 0; d < 3; d++)
+			{
+				corner[d] = (mapped[2 - d] - moving.offsets[d]) / moving.spacings[d];
+			}
+		}
+	}
+	
+} // end mapTileCorners
+
+
+//**************************************************************
+// Function resampleTileSlab is defined.                       *
+// The function resamples one slab of tiles. The moving slices *
+// its corners reach are converted to float once, each row of  *
+// a tile is sampled along the straight line its corners       *
+// interpolate, and for checker and diff images the fixed      *
+// slices are combined in. The slab is written at its offset.  *
+// Returns false if a slice cannot be read or written.         *
+//**************************************************************
+
+bool resampleTileSlab(ResampleJob &job, int slab)
+{
+	const int T = RESAMPLE_TILE;
+	const int *movingDims = job.movingVolume->geometry.dimSizes;
+	int nx = job.numCorners[0];
+	int ny = job.numCorners[1];
+	int dimX = job.dims[0];
+	int dimY = job.dims[1];
+	int zStart = slab * T;
+	int zEnd = min(job.dims[2], zStart + T);
+	const double *corners = &job.corners[3 * (size_t)slab * nx * ny];
+	
+	// Tiles interpolate their corners, so stay within the slices they span.
+	double zMin = HUGE_VAL;
+	double zMax = -HUGE_VAL;
+	for (int i = 0; i < 2 * nx * ny; i++)
+	{
+		zMin = min(zMin, corners[3 * i + 2]);
+		zMax = max(zMax, corners[3 * i + 2]);
+	}
+	int zFirst = (int)floor(max(0.0, min(zMin, movingDims[2] - 2.0)));
+	int zLast = (int)floor(max(zFirst + 1.0, min(zMax + 1, movingDims[2] - 1.0)));
+	int numSlices = zLast - zFirst + 1;
+	
+	size_t sliceVoxels = (size_t)movingDims[0] * movingDims[1];
+	vector<float> moving(sliceVoxels * numSlices);
+	for (int z = zFirst; z <= zLast; z++)
+	{
+		VolumeSlab movingSlab = getVolumeSlab(*job.movingVolume, z);
+		if (!movingSlab)
+		{
+			return false;
+		}
+		const char *voxels = &(*movingSlab)[0] + (z % job.movingVolume->slabSlices) *
+		                     job.movingVolume->sliceBytes;
+		float *slice = &moving[(z - zFirst) * sliceVoxels];
+		for (size_t i = 0; i < sliceVoxels; i++)
+		{
+			slice[i] = getVoxelValue(voxels + i * job.movingVolume->elementSize,
+			                         job.movingVolume->elementType);
+		}
+	}
+	
+	vector<float> output((size_t)dimX * dimY * (zEnd - zStart));
+	for (int z = zStart; z < zEnd; z++)
+	{
+		double wz = (double)(z - zStart) / T;
+		
+		const char *fixedSlice = NULL;
+		VolumeSlab fixedSlab;
+		if (job.mode != RESAMPLE_WARP)
+		{
+			fixedSlab = getVolumeSlab(*job.fixedVolume, z);
+			if (!fixedSlab)
+			{
+				return false;
+			}
+			fixedSlice = &(*fixedSlab)[0] + (z % job.fixedVolume->slabSlices) *
+			             job.fixedVolume->sliceBytes;
+		}
+		
+		for (int y = 0; y < dimY; y++)
+		{
+			int cy = y / T;
+			double wy = (double)(y - cy * T) / T;
+			float *row = &output[((size_t)(z - zStart) * dimY + y) * dimX];
+			
+			for (int cx = 0; cx * T < dimX; cx++)
+			{
+				// Indices at this tile's first voxel and the next tile's,
+				// each bilinear in y and z between four corners.
+				double ends[2][3];
+				for (int end = 0; end < 2; end++)
+				{
+					const double *c00 = corners + 3 * ((size_t)cy * nx + cx + end);
+					const double *c10 = c00 + 3 * nx;
+					const double *c01 = c00 + 3 * (size_t)nx * ny;
+					const double *c11 = c01 + 3 * nx;
+					for (int d = 0; d < 3; d++)
+					{
+						ends[end][d] = (1 - wz) * ((1 - wy) * c00[d] + wy * c10[d]) +
+						               wz * ((1 - wy) * c01[d] + wy * c11[d]);
+					}
+				}
+				double step[3];
+				for (int d = 0; d < 3; d++)
+				{
+					step[d] = (ends[1][d] - ends[0][d]) / T;
+				}
+				sampleRowTrilinear(&moving[0], movingDims, zFirst, numSlices,
+				                   ends[0], step, min(T, dimX - cx * T),
+				                   row + cx * T);
+			}
+			
+			if (fixedSlice == NULL)
+			{
+				continue;
+			}
+			const char *fixedRow = fixedSlice + (size_t)y * dimX *
+			                       job.fixedVolume->elementSize;
+			for (int x = 0; x < dimX; x++)
+			{
+				float fixedValue = getVoxelValue(fixedRow +
+				                       x * job.fixedVolume->elementSize,
+				                       job.fixedVolume->elementType);
+				if (job.mode == RESAMPLE_DIFF)
+				{
+					row[x] -= fixedValue;
+				}
+				else if (((x / RESAMPLE_CHECKER_SIZE + y / RESAMPLE_CHECKER_SIZE +
+				           z / RESAMPLE_CHECKER_SIZE) & 1) == 0)
+				{
+					row[x] = fixedValue;
+				}
+			}
+		}
+	}
+	
+	// Slabs are disjoint, so each is written without coordination.
+	return writeAt(job.fd, (const char *)&output[0], output.size() * sizeof(float),
+	               (off_t)zStart * dimX * dimY * sizeof(float));
+	
+} // end resampleTileSlab
+
+
+//**************************************************************
+// Function sampleRowTrilinear is defined.                     *
+// The function interpolates count voxels trilinearly at the   *
+// moving voxel indices start + i * step. The float slices from*
+// zFirst hold every slice the indices reach. Indices outside  *
+// the volume give 0, as Transformix's default pixel value.    *
+// Eight (AVX2 and AVX-512) or four (SSE2) voxels are sampled  *
+// at a time, as the instruction set allows.                   *
+//**************************************************************
+
+void sampleRowTrilinear(const float *slices, const int *dims, int zFirst,
+                        int numSlices, const double *start, const double *step,
+                        int count, float *sampled)
+{
+	const int strideY = dims[0];
+	const size_t strideZ = (size_t)dims[0] * dims[1];
+	int i = 0;
+	
+#ifdef LMK_X86
+	// Offsets are gathered as 32-bit integers.
+	if (strideZ * numSlices < 0x7fffffff)
+	{
+		if (isaLevel >= ISA_AVX2)
+		{
+			i = sampleRowTrilinearAvx2(slices, dims, zFirst, numSlices, start, step,
+			                           count, sampled);
+		}
+		else if (isaLevel >= ISA_SSE2)
+		{
+			i = sampleRowTrilinearSse2(slices, dims, zFirst, numSlices, start, step,
+			                           count, sampled);
+		}
+	}
+#endif
+	
+	// Remaining voxels are sampled one at a time, in single precision
+	// from the index of every fourth voxel as the vector kernels do, so
+	// every level samples the same values.
+	for (; i < count; i++)
+	{
+		int lane = i % 4;
+		float position[3];
+		bool inside = true;
+		for (int d = 0; d < 3; d++)
+		{
+			position[d] = (float)(start[d] + (i - lane) * step[d]) +
+			              (float)lane * (float)step[d];
+			inside = inside && (position[d] >= -RESAMPLE_EDGE) &&
+			         (position[d] <= (float)(dims[d] - 1 + RESAMPLE_EDGE));
+		}
+		if (!inside)
+		{
+			sampled[i] = 0;
+			continue;
+		}
+		position[2] -= (float)zFirst;
+		
+		float x = max(0.0f, min(position[0], (float)(dims[0] - 1)));
+		float y = max(0.0f, min(position[1], (float)(dims[1] - 1)));
+		float z = max(0.0f, min(position[2], (float)(numSlices - 1)));
+		int x0 = (int)min(x, (float)(dims[0] - 2));
+		int y0 = (int)min(y, (float)(dims[1] - 2));
+		int z0 = (int)min(z, (float)(numSlices - 2));
+		float wx = x - (float)x0;
+		float wy = y - (float)y0;
+		float wz = z - (float)z0;
+		
+		const float *c = slices + (z0 * strideZ + (size_t)y0 * strideY + x0);
+		float v00 = c[0] + wx * (c[1] - c[0]);
+		float v10 = c[strideY] + wx * (c[strideY + 1] - c[strideY]);
+		float v01 = c[strideZ] + wx * (c[strideZ + 1] - c[strideZ]);
+		float v11 = c[strideZ + strideY] +
+		            wx * (c[strideZ + strideY + 1] - c[strideZ + strideY]);
+		float lowerZ = v00 + wy * (v10 - v00);
+		float upperZ = v01 + wy * (v11 - v01);
+		sampled[i] = lowerZ + wz * (upperZ - lowerZ);
+	}
+	
+} // end sampleRowTrilinear
+
+
+#ifdef LMK_X86
+//**************************************************************
+// Function sampleRowTrilinearAvx2 is defined.                 *
+// The function samples voxels as sampleRowTrilinear, eight    *
+// at a time with AVX2 gathers. Returns the number sampled.    *
+//**************************************************************
+
+LMK_TARGET("avx2")
+int sampleRowTrilinearAvx2(const float *slices, const int *dims, int zFirst,
+                           int numSlices, const double *start, const double *step,
+                           int count, float *sampled)
+{
+	const int strideY = dims[0];
+	const size_t strideZ = (size_t)dims[0] * dims[1];
+	int i = 0;
+	
+	const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 0, 1, 2, 3);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 edge = _mm256_set1_ps(-RESAMPLE_EDGE);
+	const __m256 limits[3] = {_mm256_set1_ps(dims[0] - 1 + RESAMPLE_EDGE),
+	                          _mm256_set1_ps(dims[1] - 1 + RESAMPLE_EDGE),
+	                          _mm256_set1_ps(dims[2] - 1 + RESAMPLE_EDGE)};
+	const __m256 clamps[3] = {_mm256_set1_ps(dims[0] - 1), _mm256_set1_ps(dims[1] - 1),
+	                          _mm256_set1_ps(numSlices - 1)};
+	const __m256 lasts[3] = {_mm256_set1_ps(dims[0] - 2), _mm256_set1_ps(dims[1] - 2),
+	                         _mm256_set1_ps(numSlices - 2)};
+	
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 position[3];
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int d = 0; d < 3; d++)
+		{
+			// Each half steps from its own first index, as SSE2 does.
+			float low = start[d] + i * step[d];
+			float high = start[d] + (i + 4) * step[d];
+			position[d] = _mm256_add_ps(_mm256_setr_ps(low, low, low, low,
+			                                           high, high, high, high),
+			                  _mm256_mul_ps(lanes, _mm256_set1_ps(step[d])));
+			inside = _mm256_and_ps(inside, _mm256_and_ps(
+			             _mm256_cmp_ps(position[d], edge, _CMP_GE_OQ),
+			             _mm256_cmp_ps(position[d], limits[d], _CMP_LE_OQ)));
+		}
+		if (_mm256_movemask_ps(inside) == 0)
+		{
+			_mm256_storeu_ps(sampled + i, zero);
+			continue;
+		}
+		position[2] = _mm256_sub_ps(position[2], _mm256_set1_ps(zFirst));
+		
+		// Lower corners and weights, clamped so every gather is in bounds.
+		__m256 weight[3];
+		__m256i corner[3];
+		for (int d = 0; d < 3; d++)
+		{
+			__m256 clamped = _mm256_min_ps(_mm256_max_ps(position[d], zero), clamps[d]);
+			__m256 lower = _mm256_floor_ps(_mm256_min_ps(clamped, lasts[d]));
+			weight[d] = _mm256_sub_ps(clamped, lower);
+			corner[d] = _mm256_cvttps_epi32(lower);
+		}
+		__m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(
+		                     _mm256_mullo_epi32(corner[2], _mm256_set1_epi32(dims[1])),
+		                     corner[1]), _mm256_set1_epi32(dims[0])), corner[0]);
+		
+		__m256 values[4];
+		for (int iCorner = 0; iCorner < 4; iCorner++)
+		{
+			const float *base = slices + ((iCorner & 1) ? strideY : 0) +
+			                    ((iCorner & 2) ? strideZ : 0);
+			__m256 v0 = _mm256_i32gather_ps(base, offset, 4);
+			__m256 v1 = _mm256_i32gather_ps(base + 1, offset, 4);
+			values[iCorner] = _mm256_add_ps(v0, _mm256_mul_ps(weight[0],
+			                                    _mm256_sub_ps(v1, v0)));
+		}
+		__m256 lowerZ = _mm256_add_ps(values[0], _mm256_mul_ps(weight[1],
+		                    _mm256_sub_ps(values[1], values[0])));
+		__m256 upperZ = _mm256_add_ps(values[2], _mm256_mul_ps(weight[1],
+		                    _mm256_sub_ps(values[3], values[2])));
+		__m256 value = _mm256_add_ps(lowerZ, _mm256_mul_ps(weight[2],
+		                   _mm256_sub_ps(upperZ, lowerZ)));
+		_mm256_storeu_ps(sampled + i, _mm256_and_ps(value, inside));
+	}
+	
+	return i;
+	
+} // end sampleRowTrilinearAvx2
+
+
+//**************************************************************
+// Function sampleRowTrilinearSse2 is defined.                 *
+// The function samples voxels as sampleRowTrilinear, four     *
+// at a time with SSE2. Returns the number sampled.            *
+//**************************************************************
+
+LMK_TARGET("sse2")
+int sampleRowTrilinearSse2(const float *slices, const int *dims, int zFirst,
+                           int numSlices, const double *start, const double *step,
+                           int count, float *sampled)
+{
+	const int strideY = dims[0];
+	const size_t strideZ = (size_t)dims[0] * dims[1];
+	int i = 0;
+	
+	const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 edge = _mm_set1_ps(-RESAMPLE_EDGE);
+	const __m128 limits[3] = {_mm_set1_ps(dims[0] - 1 + RESAMPLE_EDGE),
+	                          _mm_set1_ps(dims[1] - 1 + RESAMPLE_EDGE),
+	                          _mm_set1_ps(dims[2] - 1 + RESAMPLE_EDGE)};
+	const __m128 clamps[3] = {_mm_set1_ps(dims[0] - 1), _mm_set1_ps(dims[1] - 1),
+	                          _mm_set1_ps(numSlices - 1)};
+	const __m128 lasts[3] = {_mm_set1_ps(dims[0] - 2), _mm_set1_ps(dims[1] - 2),
+	                         _mm_set1_ps(numSlices - 2)};
+	
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 position[3];
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int d = 0; d < 3; d++)
+		{
+			position[d] = _mm_add_ps(_mm_set1_ps(start[d] + i * step[d]),
+			                  _mm_mul_ps(lanes, _mm_set1_ps(step[d])));
+			inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(position[d], edge),
+			                        _mm_cmple_ps(position[d], limits[d])));
+		}
+		if (_mm_movemask_ps(inside) == 0)
+		{
+			_mm_storeu_ps(sampled + i, zero);
+			continue;
+		}
+		position[2] = _mm_sub_ps(position[2], _mm_set1_ps(zFirst));
+		
+		// Lower corners and weights, clamped so every load is in bounds.
+		// Clamped positions are not negative, so truncation is flooring.
+		__m128 weight[3];
+		int32_t corner[3][4];
+		for (int d = 0; d < 3; d++)
+		{
+			__m128 clamped = _mm_min_ps(_mm_max_ps(position[d], zero), clamps[d]);
+			__m128i lower = _mm_cvttps_epi32(_mm_min_ps(clamped, lasts[d]));
+			weight[d] = _mm_sub_ps(clamped, _mm_cvtepi32_ps(lower));
+			_mm_storeu_si128((__m128i *)corner[d], lower);
+		}
+		
+		// Corners are loaded one lane at a time and blended four at a time.
+		float gathered[8][4];
+		for (int lane = 0; lane < 4; lane++)
+		{
+			const float *c = slices + (corner[2][lane] * strideZ +
+			                 (size_t)corner[1][lane] * strideY + corner[0][lane]);
+			for (int iCorner = 0; iCorner < 4; iCorner++)
+			{
+				const float *base = c + ((iCorner & 1) ? strideY : 0) +
+				                    ((iCorner & 2) ? strideZ : 0);
+				gathered[2 * iCorner][lane] = base[0];
+				gathered[2 * iCorner + 1][lane] = base[1];
+			}
+		}
+		__m128 values[4];
+		for (int iCorner = 0; iCorner < 4; iCorner++)
+		{
+			__m128 v0 = _mm_loadu_ps(gathered[2 * iCorner]);
+			__m128 v1 = _mm_loadu_ps(gathered[2 * iCorner + 1]);
+			values[iCorner] = _mm_add_ps(v0, _mm_mul_ps(weight[0], _mm_sub_ps(v1, v0)));
+		}
+		__m128 lowerZ = _mm_add_ps(values[0], _mm_mul_ps(weight[1],
+		                    _mm_sub_ps(values[1], values[0])));
+		__m128 upperZ = _mm_add_ps(values[2], _mm_mul_ps(weight[1],
+		                    _mm_sub_ps(values[3], values[2])));
+		__m128 value = _mm_add_ps(lowerZ, _mm_mul_ps(weight[2],
+		                   _mm_sub_ps(upperZ, lowerZ)));
+		_mm_storeu_ps(sampled + i, _mm_and_ps(value, inside));
+	}
+	
+	return i;
+	
+} // end sampleRowTrilinearSse2
+#endif
+
+
+//**************************************************************
+// Function writeMetaImageHeader is defined.                   *
+// The function writes the MetaImage header of voxels of the   *
+// given element type and geometry, stored in host byte order  *
+// in dataFile beside the header.                              *
+// Returns false if the header could not be written.           *
+//**************************************************************
+
+bool writeMetaImageHeader(string pathHeader, const ImageGeometry &geometry,
+                          string elementType, string dataFile)
+{
+	const uint16_t ONE = 1;
+	bool littleEndian = (*(const unsigned char *)&ONE == 1);
+	
+	ofstream header(pathHeader.c_str());
+	header.precision(17);
+	header << "ObjectType = Image\n";
+	header << "NDims = 3\n";
+	header << "BinaryData = True\n";
+	header << "BinaryDataByteOrderMSB = " << (littleEndian ? "False" : "True") << "\n";
+	header << "CompressedData = False\n";
+	
+	// Matrix is stored column by column.
+	header << "TransformMatrix =";
+	for (int iEntry = 0; iEntry < 9; iEntry++)
+	{
+		header << " " << geometry.directions[(iEntry % 3) * 3 + iEntry / 3];
+	}
+	header << "\n";
+	header << "Offset = " << geometry.offsets[0] << " " << geometry.offsets[1]
+	       << " " << geometry.offsets[2] << "\n";
+	header << "CenterOfRotation = 0 0 0\n";
+	header << "ElementSpacing = " << geometry.spacings[0] << " "
+	       << geometry.spacings[1] << " " << geometry.spacings[2] << "\n";
+	header << "DimSize = " << geometry.dimSizes[0] << " " << geometry.dimSizes[1]
+	       << " " << geometry.dimSizes[2] << "\n";
+	header << "ElementType = " << elementType << "\n";
+	header << "ElementDataFile = " << dataFile << "\n";
+	header.close();
+	
+	return !header.fail();
+	
+} // end writeMetaImageHeader
+
+
+//**************************************************************
+// Function cropLandmarkImages is defined.                     *
+// The function crops the fixed image, and the moving image    *
+// when there are moving landmarks, to the bounding box of all *
+// landmarks in voxel space padded by margin voxels. Both      *
+// images are cut to the same box, as landmarks share one      *
+// geometry, and written as <name>_fixed_crop and              *
+// <name>_moving_crop .mhd/.raw. The landmarks keep their      *
+// physical positions; their origin, size and images become    *
+// those of the cropped images.                                *
+// Returns false if the images are unavailable or the box lies *
+// outside them.                                               *
+//**************************************************************
+
+bool cropLandmarkImages(LandmarkPairs &pairs, int margin, string inPath,
+                        string outPath)
+{
+	string base = outPath + getFileStem(inPath);
+	LogTimer timer("crop", inPath);
+	
+	bool cropMoving = !pairs.moving.empty() && !pairs.pathMovingImage.empty();
+	if (pairs.pathFixedImage.empty() || (pairs.numPoints == 0))
+	{
+		LOG_MESSAGE(LOG_ERROR, "crop", inPath,
+		            "Cropping requires landmarks and their fixed image");
+		return false;
+	}
+	
+	// Box of the landmarks in voxel indices, ordered x,y,z.
+	double lower[3] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+	double upper[3] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+	for (int iSet = 0; iSet < (cropMoving ? 2 : 1); iSet++)
+	{
+		const vector<double> &points = (iSet == 0) ? pairs.fixed : pairs.moving;
+		for (size_t iPoint = 0; 3 * iPoint < points.size(); iPoint++)
+		{
+			for (int d = 0; d < 3; d++)
+			{
+				double index = (pairs.spacings[d] == 0) ? 0 :
+				               (points[3 * iPoint + 2 - d] - pairs.offsets[d]) /
+				               pairs.spacings[d];
+				lower[d] = min(lower[d], index);
+				upper[d] = max(upper[d], index);
+			}
+		}
+	}
+	
+	ImageVolume *volumes[2] = {openImageVolume(pairs.pathFixedImage), NULL};
+	if (cropMoving)
+	{
+		volumes[1] = openImageVolume(pairs.pathMovingImage);
+	}
+	if ((volumes[0] == NULL) || (cropMoving && (volumes[1] == NULL)))
+	{
+		closeImageVolume(volumes[0]);
+		closeImageVolume(volumes[1]);
+		return false;
+	}
+	
+	int first[3];
+	int last[3];
+	bool inside = true;
+	for (int d = 0; d < 3; d++)
+	{
+		int dimSize = volumes[0]->geometry.dimSizes[d];
+		if (cropMoving)
+		{
+			dimSize = min(dimSize, volumes[1]->geometry.dimSizes[d]);
+		}
+		first[d] = (int)max(0.0, floor(lower[d]) - margin);
+		last[d] = (int)min(dimSize - 1.0, ceil(upper[d]) + margin);
+		inside = inside && (first[d] <= last[d]);
+	}
+	if (!inside)
+	{
+		LOG_MESSAGE(LOG_ERROR, "crop", inPath,
+		            "Landmarks lie outside the image");
+		closeImageVolume(volumes[0]);
+		closeImageVolume(volumes[1]);
+		return false;
+	}
+	
+	ImageGeometry cropped;
+	bool success = writeCroppedVolume(*volumes[0], first, last,
+	                                  base + "_fixed_crop.mhd", cropped);
+	if (success && cropMoving)
+	{
+		ImageGeometry croppedMoving;
+		success = writeCroppedVolume(*volumes[1], first, last,
+		                             base + "_moving_crop.mhd", croppedMoving);
+		pairs.pathMovingImage = base + "_moving_crop.mhd";
+	}
+	closeImageVolume(volumes[0]);
+	closeImageVolume(volumes[1]);
+	
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "crop", inPath, "Failed to write cropped images");
+		return false;
+	}
+	
+	// Outputs are written against the cropped fixed image.
+	pairs.pathFixedImage = base + "_fixed_crop.mhd";
+	pairs.imgDims = cropped.imgDims;
+	for (int d = 0; d < 3; d++)
+	{
+		pairs.offsets[d] = cropped.offsets[d];
+	}
+	LOG_MESSAGE(LOG_DEBUG, "crop", inPath, "Cropped to " << cropped.imgDims
+	            << " voxels from " << first[0] << " " << first[1] << " "
+	            << first[2]);
+	
+	return true;
+	
+} // end cropLandmarkImages
+
+
+//**************************************************************
+// Function writeCroppedVolume is defined.                     *
+// The function writes voxels first to last (x,y,z, inclusive) *
+// of the volume as a MetaImage of the same element type, its  *
+// Offset moved to the first voxel. Only the slices of the box *
+// are decoded, and only its rows are copied from each.        *
+// Returns false if a slice cannot be read or written.         *
+//**************************************************************
+
+bool writeCroppedVolume(ImageVolume &volume, const int *first, const int *last,
+                        string pathHeader, ImageGeometry &cropped)
+{
+	cropped = volume.geometry;
+	for (int d = 0; d < 3; d++)
+	{
+		cropped.dimSizes[d] = last[d] - first[d] + 1;
+		for (int iAxis = 0; iAxis < 3; iAxis++)
+		{
+			cropped.offsets[d] += cropped.directions[d * 3 + iAxis] *
+			                      first[iAxis] * cropped.spacings[iAxis];
+		}
+	}
+	ostringstream dims;
+	dims << cropped.dimSizes[0] << " " << cropped.dimSizes[1] << " "
+	     << cropped.dimSizes[2];
+	cropped.imgDims = dims.str();
+	
+	string pathData = pathHeader.substr(0, pathHeader.rfind('.')) + ".raw";
+	if (!writeMetaImageHeader(pathHeader, cropped,
+	                          VOLUME_ELEMENT_TYPES[volume.elementType],
+	                          getFileStem(pathData) + ".raw"))
+	{
+		return false;
+	}
+	
+	ofstream data(pathData.c_str(), ios::binary);
+	size_t rowBytes = (size_t)cropped.dimSizes[0] * volume.elementSize;
+	vector<char> slice(rowBytes * cropped.dimSizes[1]);
+	
+	for (int z = first[2]; data && (z <= last[2]); z++)
+	{
+		VolumeSlab slab = getVolumeSlab(volume, z);
+		if (!slab)
+		{
+			return false;
+		}
+		const char *voxels = &(*slab)[0] + (z % volume.slabSlices) * volume.sliceBytes;
+		for (int y = first[1]; y <= last[1]; y++)
+		{
+			memcpy(&slice[(y - first[1]) * rowBytes], voxels +
+			       ((size_t)y * volume.geometry.dimSizes[0] + first[0]) *
+			       volume.elementSize, rowBytes);
+		}
+		data.write(&slice[0], slice.size());
+	}
+	data.close();
+	
+	return !data.fail();
+	
+} // end writeCroppedVolume
+
+
+//**************************************************************
+// Function getFileStem is defined.                            *
+// The function returns the filename of the input file with    *
+// its directory and extension removed, from which the names   *
+// of the output files are built.                              *
+//**************************************************************
+
+string getFileStem(string path)
+{
+    //Filename starts after the last backslash (Windows) or
+    //forward slash (Linux)
+    size_t startFileName = path.find_last_of("\\/");
+    startFileName = (startFileName == string::npos) ? 0 : startFileName + 1;
+    
+    //Extension starts at the last period of the filename, if any
+    size_t startExtension = path.find_last_of('.');
+    if ((startExtension == string::npos) || (startExtension < startFileName))
+    {
+        startExtension = path.length();
+    }
+    
+    return path.substr(startFileName, startExtension - startFileName);
+    
+} // end getFileStem
+
+
+//**************************************************************
+// Function getFormatOutputPaths is defined.                   *
+// The function returns the paths of the files written for the *
+// given input in the given format, with or without moving     *
+// landmarks. Conversions and pipeline write stages share it.  *
+//**************************************************************
+
+vector<string> getFormatOutputPaths(string pathInput, string pathOutput,
+                                    string format, bool hasMoving, int resampleMode)
+{
+	vector<string> outputPaths;
+	string base = pathOutput + getFileStem(pathInput);
+	
+	if (format == "tfx_lmk")
+	{
+		outputPaths.push_back(base + "_transformix.txt");
+	}
+	else if (format == "slr_fid")
+	{
+		outputPaths.push_back(base + "_fixed_slicer.fcsv");
+		if (hasMoving)
+		{
+			outputPaths.push_back(base + "_moving_slicer.fcsv");
+		}
+	}
+	else if (format == "std_txt")
+	{
+		outputPaths.push_back(base + "_fixed_landmarks.txt");
+		if (hasMoving)
+		{
+			outputPaths.push_back(base + "_moving_landmarks.txt");
+		}
+	}
+	else if (format == "vtk_vtp")
+	{
+		outputPaths.push_back(base + "_fixed.vtp");
+		if (hasMoving)
+		{
+			outputPaths.push_back(base + "_moving.vtp");
+		}
+	}
+	else if (format == "img_mhd")
+	{
+		string image = base + "_" + RESAMPLE_MODE_NAMES[resampleMode];
+		outputPaths.push_back(image + ".mhd");
+		outputPaths.push_back(image + ".raw");
+	}
+	else if (format == "res_txt")
+	{
+		outputPaths.push_back(base + "_residuals.txt");
+	}
+	else if (format == "energy_json")
+	{
+		outputPaths.push_back(base + "_bending_energy.json");
+	}
+	
+	return outputPaths;
+	
+} // end getFormatOutputPaths
+
+
+//**************************************************************
+// Function getOutputPaths is defined.                         *
+// The function returns the paths of all files written when    *
+// the given input is converted with the given options.        *
+//**************************************************************
+
+vector<string> getOutputPaths(string pathInput, const ConverterOptions &options)
+{
+	// Moving landmarks are written for all but landmark lists.
+	bool writesMoving = writesMovingLandmarks(pathInput, options.inputType);
+	vector<string> outputPaths = getFormatOutputPaths(pathInput, options.pathOutput,
+	                                                  options.outputType, writesMoving,
+	                                                  options.resampleMode);
+	
+	if (options.cropMargin >= 0)
+	{
+		string base = options.pathOutput + getFileStem(pathInput);
+		outputPaths.push_back(base + "_fixed_crop.mhd");
+		outputPaths.push_back(base + "_fixed_crop.raw");
+		if (writesMoving)
+		{
+			outputPaths.push_back(base + "_moving_crop.mhd");
+			outputPaths.push_back(base + "_moving_crop.raw");
+		}
+	}
+	
+	return outputPaths;
+	
+} // end getOutputPaths
+
+
+//**************************************************************
+// Function hashBytes is defined.                              *
+// The function computes a fast non-cryptographic 64-bit hash  *
+// of a block of bytes, eight bytes at a time. Passing the     *
+// previous hash as seed chains the hash across blocks.        *
+//**************************************************************
+
+uint64_t hashBytes(const char *data, size_t length, uint64_t seed)
+{
+	const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+	
+	uint64_t hash = seed ^ (length * PRIME_3);
+	uint64_t word;
+	size_t i = 0;
+	
+	// Whole words are mixed into the hash.
+	for (; (i + 8) <= length; i = i + 8)
+	{
+		memcpy(&word, data + i, 8);
+		word *= PRIME_2;
+		word = (word << 31) | (word >> 33);
+		word *= PRIME_1;
+		hash ^= word;
+		hash = ((hash << 27) | (hash >> 37)) * PRIME_1 + PRIME_3;
+	}
+	
+	// Remaining bytes are mixed in as one final word.
+	word = 0;
+	memcpy(&word, data + i, length - i);
+	hash ^= word * PRIME_1;
+	
+	// Bits are avalanched so similar inputs give unrelated hashes.
+	hash ^= hash >> 33;
+	hash *= PRIME_2;
+	hash ^= hash >> 29;
+	hash *= PRIME_3;
+	hash ^= hash >> 32;
+	
+	return hash;
+	
+} // end hashBytes
+
+
+//**************************************************************
+// Function hashFile is defined.                               *
+// The function hashes the contents of a file in fixed blocks. *
+// Returns false if the file could not be opened.              *
+//**************************************************************
+
+bool hashFile(string path, uint64_t &hash)
+{
+	const size_t BLOCK_SIZE = 65536;
+	
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
+	
+	vector<char> block(BLOCK_SIZE);
+	size_t numRead;
+	hash = 0;
+	
+	while ((numRead = fread(&block[0], 1, BLOCK_SIZE, file)) > 0)
+	{
+		hash = hashBytes(&block[0], numRead, hash);
+	}
+	
+	fclose(file);
+	
+	return true;
+	
+} // end hashFile
+
+
+//**************************************************************
+// Function copyFile is defined.                               *
+// The function copies a file through a temporary file which   *
+// is renamed into place, so readers never see partial files.  *
+//**************************************************************
+
+bool copyFile(string pathFrom, string pathTo)
+{
+	const size_t BLOCK_SIZE = 65536;
+	
+	FILE *source = fopen(pathFrom.c_str(), "rb");
+	if (source == NULL)
+	{
+		return false;
+	}
+	
+	// Temporary name is made unique to this process and thread.
+	ostringstream pathTemp;
+	pathTemp << pathTo << ".tmp." << getpid() << "." << this_thread::get_id();
+	
+	FILE *target = fopen(pathTemp.str().c_str(), "wb");
+	if (target == NULL)
+	{
+		fclose(source);
+		return false;
+	}
+	
+	vector<char> block(BLOCK_SIZE);
+	size_t numRead;
+	bool success = true;
+	
+	while ((numRead = fread(&block[0], 1, BLOCK_SIZE, source)) > 0)
+	{
+		if (fwrite(&block[0], 1, numRead, target) != numRead)
+		{
+			success = false;
+			break;
+		}
+	}
+	
+	fclose(source);
+	success = (fclose(target) == 0) && success;
+	
+	if (!success || (rename(pathTemp.str().c_str(), pathTo.c_str()) != 0))
+	{
+		remove(pathTemp.str().c_str());
+		return false;
+	}
+	
+	return true;
+	
+} // end copyFile
+
+
+//**************************************************************
+// Function getCacheKey is defined.                            *
+// The function hashes everything a conversion depends on: the *
+// input file, its referenced MetaHeader, the output filename  *
+// and the conversion options.                                 *
+//**************************************************************
+
+uint64_t getCacheKey(string pathInput, const ConverterOptions &options)
+{
+	// Bumped whenever the format of any output changes.
+	const string CACHE_VERSION = "5";
+	
+	uint64_t key = 0;
+	uint64_t fileHash = 0;
+	
+	// Settings are hashed first, separated so fields cannot run together.
+	string settings = CACHE_VERSION + "|" + options.inputType + "|" +
+	                  options.outputType + "|" + options.keep_all + "|" +
+	                  getFileStem(pathInput) + "|" + options.query + "|" +
+	                  options.near + "|" + (options.vtpZlib ? "zlib" : "raw") +
+	                  (options.vtpIntensity ? "|intensity" : "") + "|" +
+	                  options.pathRefImage;
+	key = hashBytes(settings.data(), settings.length(), key);
+	key = hashBytes((const char *)&options.cropMargin, sizeof(int), key);
+	
+	// Missing files hash as their path, so a later appearance misses.
+	if (!hashFile(pathInput, fileHash))
+	{
+		fileHash = hashBytes(pathInput.data(), pathInput.length(), 1);
+	}
+	key = hashBytes((const char *)&fileHash, sizeof(fileHash), key);
+	
+	// Fiducials are read with their counterpart file.
+	string pathCounterpart = getSlicerCounterpart(pathInput);
+	if ((options.inputType == "slr_fid") && !pathCounterpart.empty() &&
+	    hashFile(pathCounterpart, fileHash))
+	{
+		key = hashBytes((const char *)&fileHash, sizeof(fileHash), key);
+	}
+	
+	// The fixed image header supplies the geometry of point pairs, and
+	// the reference image that of fiducials. Only the geometry is hashed,
+	// so images with large headers are not read.
+	string pathMhd;
+	if (options.inputType == "ix_pp")
+	{
+		ifstream pointPairs(pathInput.c_str());
+		string scanLine;
+		pointPairs >> scanLine;
+		if (scanLine.length() > 7)
+		{
+			pathMhd = remapMhdPath(scanLine);
+		}
+	}
+	else if (options.inputType == "slr_fid")
+	{
+		pathMhd = options.pathRefImage;
+	}
+	
+	if (!pathMhd.empty())
+	{
+		ImageGeometry geometry;
+		if (getImageGeometry(pathMhd, geometry))
+		{
+			ostringstream fields;
+			fields.precision(17);
+			fields << geometry.imgDims << "|" << geometry.offsets[0] << " "
+			       << geometry.offsets[1] << " " << geometry.offsets[2] << "|"
+			       << geometry.spacings[0] << " " << geometry.spacings[1]
+			       << " " << geometry.spacings[2];
+			fileHash = hashBytes(fields.str().data(), fields.str().length(), 0);
+		}
+		else
+		{
+			fileHash = hashBytes(pathMhd.data(), pathMhd.length(), 1);
+		}
+		key = hashBytes((const char *)&fileHash, sizeof(fileHash), key);
+	}
+	
+	return key;
+	
+} // end getCacheKey
+
+
+//**************************************************************
+// Function cacheLookup is defined.                            *
+// The function finds the cached outputs for a key. The index  *
+// is split into shards with separate locks, so concurrent     *
+// conversions rarely contend, and misses fall back to the     *
+// entry's manifest on disk.                                   *
+//**************************************************************
+
+bool cacheLookup(ConversionCache &cache, uint64_t key, CacheEntry &entry)
+{
+	CacheShard &shard = cache.shards[key % CACHE_SHARDS];
+	
+	{
+		lock_guard<mutex> guard(shard.lock);
+		map<uint64_t, CacheEntry>::iterator found = shard.entries.find(key);
+		if (found != shard.entries.end())
+		{
+			entry = found->second;
+			return true;
+		}
+	}
+	
+	// Entry is read from disk without holding the shard lock.
+	char keyName[17];
+	snprintf(keyName, sizeof(keyName), "%016llx", (unsigned long long)key);
+	string pathManifest = cache.dir + "/" + keyName + "/manifest";
+	
+	ifstream manifest(pathManifest.c_str());
+	if (!manifest.is_open())
+	{
+		return false;
+	}
+	
+	// Names are length-prefixed, so they may hold spaces.
+	size_t nameLength;
+	unsigned long long size, hash;
+	entry = CacheEntry();
+	while ((manifest >> nameLength) && (manifest.get() == ' '))
+	{
+		string fileName(nameLength, ' ');
+		if (!manifest.read(&fileName[0], nameLength) ||
+		    !(manifest >> size >> hex >> hash >> dec))
+		{
+			entry = CacheEntry();
+			break;
+		}
+		entry.fileNames.push_back(fileName);
+		entry.sizes.push_back(size);
+		entry.hashes.push_back(hash);
+	}
+	
+	if (entry.fileNames.empty())
+	{
+		return false;
+	}
+	
+	lock_guard<mutex> guard(shard.lock);
+	shard.entries[key] = entry;
+	
+	return true;
+	
+} // end cacheLookup
+
+
+//**************************************************************
+// Function cacheStore is defined.                             *
+// The function copies the outputs of a conversion into a new  *
+// cache entry, named relative to the output prefix outPath.   *
+// The entry is assembled in a temporary directory which is    *
+// renamed into place once complete.                           *
+//**************************************************************
+
+void cacheStore(ConversionCache &cache, uint64_t key, vector<string> outputPaths,
+                string outPath)
+{
+	char keyName[17];
+	snprintf(keyName, sizeof(keyName), "%016llx", (unsigned long long)key);
+	string pathEntry = cache.dir + "/" + keyName;
+	
+	ostringstream pathTemp;
+	pathTemp << pathEntry << ".tmp." << getpid() << "." << this_thread::get_id();
+	
+	if (mkdir(pathTemp.str().c_str(), 0755) != 0)
+	{
+		LOG_MESSAGE(LOG_WARN, "cache", pathTemp.str(),
+		            "Failed to create cache entry");
+		return;
+	}
+	
+	CacheEntry entry;
+	string manifestText;
+	bool success = true;
+	
+	for (size_t iFile = 0; iFile < outputPaths.size(); iFile++)
+	{
+		// The output prefix need not end in a separator, so it is cut
+		// off whole rather than up to the last one.
+		string fileName = outputPaths[iFile];
+		fileName.erase(0, outPath.length());
+		
+		uint64_t hash;
+		struct stat status;
+		if ((outputPaths[iFile].compare(0, outPath.length(), outPath) != 0) ||
+		    !hashFile(outputPaths[iFile], hash) ||
+		    (stat(outputPaths[iFile].c_str(), &status) != 0) ||
+		    !copyFile(outputPaths[iFile], pathTemp.str() + "/" + fileName))
+		{
+			success = false;
+			break;
+		}
+		
+		entry.fileNames.push_back(fileName);
+		entry.sizes.push_back(status.st_size);
+		entry.hashes.push_back(hash);
+		
+		char line[64];
+		snprintf(line, sizeof(line), " %llu %016llx\n",
+		         (unsigned long long)status.st_size, (unsigned long long)hash);
+		manifestText += to_string(fileName.length()) + " " + fileName + line;
+	}
+	
+	if (success)
+	{
+		ofstream manifest((pathTemp.str() + "/manifest").c_str());
+		manifest << manifestText;
+		manifest.close();
+		success = !manifest.fail();
+	}
+	
+	// Another process may have stored the same entry first.
+	if (!success || (rename(pathTemp.str().c_str(), pathEntry.c_str()) != 0))
+	{
+		for (size_t iFile = 0; iFile < entry.fileNames.size(); iFile++)
+		{
+			remove((pathTemp.str() + "/" + entry.fileNames[iFile]).c_str());
+		}
+		remove((pathTemp.str() + "/manifest").c_str());
+		rmdir(pathTemp.str().c_str());
+		
+		if (!success)
+		{
+			return;
+		}
+	}
+	
+	CacheShard &shard = cache.shards[key % CACHE_SHARDS];
+	lock_guard<mutex> guard(shard.lock);
+	shard.entries[key] = entry;
+	
+} // end cacheStore
+
+
+//**************************************************************
+// Function cacheRestore is defined.                           *
+// The function checks the outputs recorded in a cache entry   *
+// against those under the output prefix, copying back any     *
+// that were deleted or changed. Returns false if the outputs  *
+// could not be brought up to date from the cache.             *
+//**************************************************************
+
+bool cacheRestore(ConversionCache &cache, uint64_t key, const CacheEntry &entry,
+                  string outPath)
+{
+	char keyName[17];
+	snprintf(keyName, sizeof(keyName), "%016llx", (unsigned long long)key);
+	string pathEntry = cache.dir + "/" + keyName + "/";
+	
+	for (size_t iFile = 0; iFile < entry.fileNames.size(); iFile++)
+	{
+		string pathTarget = outPath + entry.fileNames[iFile];
+		
+		// Size is compared first so most stale files are found by stat alone.
+		struct stat status;
+		uint64_t hash;
+		if ((stat(pathTarget.c_str(), &status) == 0) &&
+		    ((uint64_t)status.st_size == entry.sizes[iFile]) &&
+		    hashFile(pathTarget, hash) && (hash == entry.hashes[iFile]))
+		{
+			continue;
+		}
+		
+		LOG_MESSAGE(LOG_DEBUG, "cache", pathTarget, "Restoring from cache");
+		if (!copyFile(pathEntry + entry.fileNames[iFile], pathTarget))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+	
+} // end cacheRestore
+
+
+//**************************************************************
+// Function openJournal is defined.                            *
+// The function opens the journal of completed conversions,    *
+// loading the records of earlier runs, and those of a shared  *
+// journal that is only read when pathShared is given. A       *
+// record torn by a crash fails its checksum and is cut off,   *
+// so new records always start on a fresh line. Returns NULL   *
+// on failure.                                                 *
+//**************************************************************
+
+ConversionJournal *openJournal(string pathJournal, string pathShared)
+{
+	// Records of the shared journal are loaded first, so this journal's
+	// own, newer records replace them.
+	map<string, JournalRecord> completed;
+	vector<char> sharedContents;
+	if (!pathShared.empty() && readFileBuffer(pathShared, sharedContents))
+	{
+		parseJournalRecords(string(sharedContents.begin(), sharedContents.end() - 1),
+		                    completed);
+	}
+	
+	int fd = open(pathJournal.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	
+	ConversionJournal *journal = new ConversionJournal;
+	journal->fd = fd;
+	journal->numPending = 0;
+	journal->stopping = false;
+	journal->completed.swap(completed);
+	
+	// Whole journal is read so records can be checked line by line.
+	string contents;
+	char block[65536];
+	ssize_t numRead;
+	while ((numRead = read(fd, block, sizeof(block))) > 0)
+	{
+		contents.append(block, numRead);
+	}
+	
+	size_t validLength = parseJournalRecords(contents, journal->completed);
+	
+	if (validLength < contents.length())
+	{
+		LOG_MESSAGE(LOG_WARN, "journal", pathJournal,
+		            "Discarding incomplete journal record at byte " << validLength);
+		if (ftruncate(fd, validLength) != 0)
+		{
+			close(fd);
+			delete journal;
+			return NULL;
+		}
+	}
+	
+	if (!journal->completed.empty())
+	{
+		LOG_MESSAGE(LOG_INFO, "journal", pathJournal, "Resuming batch: " <<
+		            journal->completed.size() << " conversions already journaled");
+	}
+	
+	// Pending records are written by a background thread in batches.
+	journal->flusher = thread([journal]()
+	{
+		unique_lock<mutex> guard(journal->lock);
+		while (!journal->stopping)
+		{
+			journal->wake.wait_for(guard, chrono::milliseconds(200));
+			guard.unlock();
+			journalFlush(*journal);
+			guard.lock();
+		}
+	});
+	
+	return journal;
+	
+} // end openJournal
+
+
+//**************************************************************
+// Function parseJournalRecords is defined.                    *
+// The function loads the records of journal contents into     *
+// completed, stopping at the first torn record. Returns the   *
+// length of the valid records.                                *
+//**************************************************************
+
+size_t parseJournalRecords(const string &contents,
+                           map<string, JournalRecord> &completed)
+{
+	// Each record is: hash, input, outputs..., checksum, tab separated.
+	size_t validLength = 0;
+	size_t lineStart = 0;
+	size_t lineEnd;
+	while ((lineEnd = contents.find('\n', lineStart)) != string::npos)
+	{
+		string line = contents.substr(lineStart, lineEnd - lineStart);
+		size_t lastTab = line.rfind('\t');
+		if (lastTab == string::npos)
+		{
+			break;
+		}
+		
+		uint64_t checksum = strtoull(line.c_str() + lastTab + 1, NULL, 16);
+		if (checksum != hashBytes(line.data(), lastTab, 0))
+		{
+			break;
+		}
+		
+		vector<string> fields;
+		istringstream lineStream(line.substr(0, lastTab));
+		string field;
+		while (getline(lineStream, field, '\t'))
+		{
+			fields.push_back(field);
+		}
+		
+		if (fields.size() >= 2)
+		{
+			JournalRecord &record = completed[fields[1]];
+			record.inputHash = strtoull(fields[0].c_str(), NULL, 16);
+			record.outputPaths.assign(fields.begin() + 2, fields.end());
+		}
+		
+		lineStart = lineEnd + 1;
+		validLength = lineStart;
+	}
+	
+	return validLength;
+	
+} // end parseJournalRecords
+
+
+//**************************************************************
+// Function getJournalPartPath is defined.                     *
+// The function returns the path of the journal part appended  *
+// to by the worker process in the given slot.                 *
+//**************************************************************
+
+string getJournalPartPath(string pathJournal, int slot)
+{
+	return pathJournal + ".part" + to_string(slot);
+	
+} // end getJournalPartPath
+
+
+//**************************************************************
+// Function mergeJournalParts is defined.                      *
+// The function appends the valid records of the workers'      *
+// journal parts to the journal and removes the parts once     *
+// the journal is synced. Parts of every slot of this run,     *
+// and of consecutive slots past them left by an earlier run,  *
+// are merged. Returns false if the journal cannot be opened.  *
+//**************************************************************
+
+bool mergeJournalParts(string pathJournal, int numProcesses)
+{
+	ConversionJournal *journal = openJournal(pathJournal, "");
+	if (journal == NULL)
+	{
+		return false;
+	}
+	
+	vector<string> merged;
+	vector<char> contents;
+	for (int iPart = 0; ; iPart++)
+	{
+		string pathPart = getJournalPartPath(pathJournal, iPart);
+		if (!readFileBuffer(pathPart, contents))
+		{
+			if (iPart >= numProcesses)
+			{
+				break;
+			}
+			continue;
+		}
+		
+		map<string, JournalRecord> records;
+		string partText(contents.begin(), contents.end() - 1);
+		size_t validLength = parseJournalRecords(partText, records);
+		{
+			lock_guard<mutex> guard(journal->lock);
+			journal->pending.append(partText, 0, validLength);
+		}
+		merged.push_back(pathPart);
+	}
+	
+	// A part is only removed once its records are durable in the journal.
+	closeJournal(journal);
+	for (size_t iPart = 0; iPart < merged.size(); iPart++)
+	{
+		unlink(merged[iPart].c_str());
+	}
+	
+	return true;
+	
+} // end mergeJournalParts
+
+
+//**************************************************************
+// Function journalIsComplete is defined.                      *
+// The function checks whether an earlier run converted the    *
+// same input contents and all its outputs are still present.  *
+//**************************************************************
+
+bool journalIsComplete(ConversionJournal &journal, string pathInput,
+                       uint64_t inputHash)
+{
+	// Records of earlier runs are only read, so no lock is needed.
+	map<string, JournalRecord>::const_iterator found =
+	                                       journal.completed.find(pathInput);
+	if ((found == journal.completed.end()) ||
+	    (found->second.inputHash != inputHash))
+	{
+		return false;
+	}
+	
+	struct stat status;
+	for (size_t iFile = 0; iFile < found->second.outputPaths.size(); iFile++)
+	{
+		if (stat(found->second.outputPaths[iFile].c_str(), &status) != 0)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+	
+} // end journalIsComplete
+
+
+//**************************************************************
+// Function journalRecord is defined.                          *
+// The function queues the record of a completed conversion.   *
+// The background thread is only woken early once enough       *
+// records are pending, so a record costs one buffer append.   *
+//**************************************************************
+
+void journalRecord(ConversionJournal &journal, string pathInput,
+                   uint64_t inputHash, const vector<string> &outputPaths)
+{
+	// Records pending before an early flush is requested.
+	const int FLUSH_BATCH = 256;
+	
+	char hashText[17];
+	snprintf(hashText, sizeof(hashText), "%016llx",
+	         (unsigned long long)inputHash);
+	
+	string line = string(hashText) + "\t" + pathInput;
+	for (size_t iFile = 0; iFile < outputPaths.size(); iFile++)
+	{
+		line += "\t" + outputPaths[iFile];
+	}
+	
+	char checksumText[19];
+	snprintf(checksumText, sizeof(checksumText), "\t%016llx\n",
+	         (unsigned long long)hashBytes(line.data(), line.length(), 0));
+	line += checksumText;
+	
+	lock_guard<mutex> guard(journal.lock);
+	journal.pending += line;
+	journal.numPending++;
+	if (journal.numPending >= FLUSH_BATCH)
+	{
+		journal.wake.notify_one();
+	}
+	
+} // end journalRecord
+
+
+//**************************************************************
+// Function journalFlush is defined.                           *
+// The function appends all pending records to the journal     *
+// and makes them durable with a single fsync.                 *
+//**************************************************************
+
+void journalFlush(ConversionJournal &journal)
+{
+	string records;
+	{
+		lock_guard<mutex> guard(journal.lock);
+		records.swap(journal.pending);
+		journal.numPending = 0;
+	}
+	
+	if (records.empty())
+	{
+		return;
+	}
+	
+	size_t written = 0;
+	while (written < records.length())
+	{
+		ssize_t numWritten = write(journal.fd, records.data() + written,
+		                           records.length() - written);
+		if (numWritten <= 0)
+		{
+			LOG_MESSAGE(LOG_ERROR, "journal", "", "Failed to write journal");
+			return;
+		}
+		written += numWritten;
+	}
+	
+	fsync(journal.fd);
+	
+} // end journalFlush
+
+
+//**************************************************************
+// Function closeJournal is defined.                           *
+// The function stops the background thread, writes any        *
+// remaining records and closes the journal.                   *
+//**************************************************************
+
+void closeJournal(ConversionJournal *journal)
+{
+	if (journal == NULL)
+	{
+		return;
+	}
+	
+	{
+		lock_guard<mutex> guard(journal->lock);
+		journal->stopping = true;
+	}
+	journal->wake.notify_one();
+	journal->flusher.join();
+	
+	journalFlush(*journal);
+	close(journal->fd);
+	delete journal;
+	
+} // end closeJournal
+
+
+//**************************************************************
+// Function parseJson is defined.                              *
+// The function parses a complete JSON document. Returns false *
+// if the text is not valid JSON.                              *
+//**************************************************************
+
+bool parseJson(const string &text, JsonValue &value)
+{
+	size_t pos = 0;
+	if (!parseJsonValue(text, pos, value))
+	{
+		return false;
+	}
+	
+	// Only whitespace may follow the document.
+	pos = text.find_first_not_of(" \t\r\n", pos);
+	return (pos == string::npos);
+	
+} // end parseJson
+
+
+//**************************************************************
+// Function parseJsonValue is defined.                         *
+// The function parses one JSON value starting at pos, which   *
+// is advanced past it. Returns false on malformed input.      *
+//**************************************************************
+
+bool parseJsonValue(const string &text, size_t &pos, JsonValue &value)
+{
+	value = JsonValue();
+	value.type = JSON_NULL;
+	value.number = 0;
+	
+	pos = text.find_first_not_of(" \t\r\n", pos);
+	if (pos == string::npos)
+	{
+		return false;
+	}
+	
+	char first = text[pos];
+	
+	// Objects and arrays are parsed member by member.
+	if ((first == '{') || (first == '['))
+	{
+		char last = (first == '{') ? '}' : ']';
+		value.type = (first == '{') ? JSON_OBJECT : JSON_ARRAY;
+		pos++;
+		
+		pos = text.find_first_not_of(" \t\r\n", pos);
+		if ((pos != string::npos) && (text[pos] == last))
+		{
+			pos++;
+			return true;
+		}
+		
+		while (true)
+		{
+			if (value.type == JSON_OBJECT)
+			{
+				JsonValue key;
+				if (!parseJsonValue(text, pos, key) || (key.type != JSON_STRING))
+				{
+					return false;
+				}
+				pos = text.find_first_not_of(" \t\r\n", pos);
+				if ((pos == string::npos) || (text[pos] != ':'))
+				{
+					return false;
+				}
+				pos++;
+				value.keys.push_back(key.text);
+			}
+			
+			value.items.push_back(JsonValue());
+			if (!parseJsonValue(text, pos, value.items.back()))
+			{
+				return false;
+			}
+			
+			pos = text.find_first_not_of(" \t\r\n", pos);
+			if (pos == string::npos)
+			{
+				return false;
+			}
+			if (text[pos] == last)
+			{
+				pos++;
+				return true;
+			}
+			if (text[pos] != ',')
+			{
+				return false;
+			}
+			pos++;
+		}
+	}
+	
+	// Strings are unescaped; \u escapes are kept to the ASCII range.
+	if (first == '"')
+	{
+		value.type = JSON_STRING;
+		pos++;
+		while ((pos < text.length()) && (text[pos] != '"'))
+		{
+			if ((text[pos] == '\\') && ((pos + 1) < text.length()))
+			{
+				pos++;
+				switch (text[pos])
+				{
+					case 'n': value.text += '\n'; break;
+					case 't': value.text += '\t'; break;
+					case 'r': value.text += '\r'; break;
+					case 'b': value.text += '\b'; break;
+					case 'f': value.text += '\f'; break;
+					case 'u':
+						if ((pos + 4) >= text.length())
+						{
+							return false;
+						}
+						value.text += (char)strtol(text.substr(pos + 1, 4).c_str(),
+						                           NULL, 16);
+						pos += 4;
+						break;
+					default: value.text += text[pos]; break;
+				}
+			}
+			else
+			{
+				value.text += text[pos];
+			}
+			pos++;
+		}
+		if (pos >= text.length())
+		{
+			return false;
+		}
+		pos++;
+		return true;
+	}
+	
+	// Literals are matched exactly.
+	if (text.compare(pos, 4, "true") == 0)
+	{
+		value.type = JSON_BOOL;
+		value.number = 1;
+		pos += 4;
+		return true;
+	}
+	if (text.compare(pos, 5, "false") == 0)
+	{
+		value.type = JSON_BOOL;
+		pos += 5;
+		return true;
+	}
+	if (text.compare(pos, 4, "null") == 0)
+	{
+		pos += 4;
+		return true;
+	}
+	
+	// Anything else must be a number.
+	const char *start = text.c_str() + pos;
+	char *end;
+	value.type = JSON_NUMBER;
+	value.number = strtod(start, &end);
+	if (end == start)
+	{
+		return false;
+	}
+	pos += (end - start);
+	
+	return true;
+	
+} // end parseJsonValue
+
+
+//**************************************************************
+// Function jsonMember is defined.                             *
+// The function returns the member of a JSON object with the   *
+// given key, or NULL if there is none.                        *
+//**************************************************************
+
+const JsonValue *jsonMember(const JsonValue &object, string key)
+{
+	for (size_t iKey = 0; iKey < object.keys.size(); iKey++)
+	{
+		if (object.keys[iKey] == key)
+		{
+			return &object.items[iKey];
+		}
+	}
+	
+	return NULL;
+	
+} // end jsonMember
+
+
+//**************************************************************
+// Function jsonText is defined.                               *
+// The function writes a JSON value back out as compact text.  *
+// Equal values always give equal text, so it is used to hash  *
+// the parameters of pipeline stages.                          *
+//**************************************************************
+
+string jsonText(const JsonValue &value)
+{
+	ostringstream text;
+	text.precision(17);
+	
+	switch (value.type)
+	{
+		case JSON_NULL:
+			text << "null";
+			break;
+		case JSON_BOOL:
+			text << ((value.number != 0) ? "true" : "false");
+			break;
+		case JSON_NUMBER:
+			text << value.number;
+			break;
+		case JSON_STRING:
+			text << '"';
+			for (size_t i = 0; i < value.text.length(); i++)
+			{
+				if ((value.text[i] == '"') || (value.text[i] == '\\'))
+				{
+					text << '\\';
+				}
+				text << value.text[i];
+			}
+			text << '"';
+			break;
+		case JSON_ARRAY:
+		case JSON_OBJECT:
+			text << ((value.type == JSON_ARRAY) ? '[' : '{');
+			for (size_t iItem = 0; iItem < value.items.size(); iItem++)
+			{
+				if (iItem != 0)
+				{
+					text << ',';
+				}
+				if (value.type == JSON_OBJECT)
+				{
+					JsonValue key;
+					key.type = JSON_STRING;
+					key.text = value.keys[iItem];
+					text << jsonText(key) << ':';
+				}
+				text << jsonText(value.items[iItem]);
+			}
+			text << ((value.type == JSON_ARRAY) ? ']' : '}');
+			break;
+	}
+	
+	return text.str();
+	
+} // end jsonText
+
+
+//**************************************************************
+// Function luDecompose is defined.                            *
+// The function factors a dense n x n row-major matrix in      *
+// place into LU form with partial pivoting. Returns false if  *
+// the matrix is singular.                                     *
+//**************************************************************
+
+bool luDecompose(vector<double> &matrix, int n, vector<int> &pivots)
+{
+	pivots.resize(n);
+	
+	for (int iCol = 0; iCol < n; iCol++)
+	{
+		// Row with the largest magnitude in this column becomes the pivot.
+		int iPivot = iCol;
+		for (int iRow = iCol + 1; iRow < n; iRow++)
+		{
+			if (fabs(matrix[iRow * n + iCol]) > fabs(matrix[iPivot * n + iCol]))
+			{
+				iPivot = iRow;
+			}
+		}
+		pivots[iCol] = iPivot;
+		
+		if (matrix[iPivot * n + iCol] == 0.0)
+		{
+			return false;
+		}
+		
+		if (iPivot != iCol)
+		{
+			swap_ranges(matrix.begin() + iPivot * n,
+			            matrix.begin() + (iPivot + 1) * n,
+			            matrix.begin() + iCol * n);
+		}
+		
+		// Rows below are eliminated.
+		double pivot = matrix[iCol * n + iCol];
+		for (int iRow = iCol + 1; iRow < n; iRow++)
+		{
+			double factor = matrix[iRow * n + iCol] / pivot;
+			matrix[iRow * n + iCol] = factor;
+			
+			if (factor != 0.0)
+			{
+				double *row = &matrix[iRow * n];
+				const double *pivotRow = &matrix[iCol * n];
+				for (int k = iCol + 1; k < n; k++)
+				{
+					row[k] -= factor * pivotRow[k];
+				}
+			}
+		}
+	}
+	
+	return true;
+	
+} // end luDecompose
+
+
+//**************************************************************
+// Function luSolve is defined.                                *
+// The function solves the factored system for one right-hand  *
+// side, which is overwritten with the solution.               *
+//**************************************************************
+
+void luSolve(const vector<double> &factors, int n, const vector<int> &pivots,
+             double *values)
+{
+	// Row interchanges are applied in the order they were made.
+	for (int i = 0; i < n; i++)
+	{
+		swap(values[i], values[pivots[i]]);
+	}
+	
+	// Forward substitution with the unit lower factor.
+	for (int i = 0; i < n; i++)
+	{
+		double sum = values[i];
+		for (int k = 0; k < i; k++)
+		{
+			sum -= factors[i * n + k] * values[k];
+		}
+		values[i] = sum;
+	}
+	
+	// Back substitution with the upper factor.
+	for (int i = n - 1; i >= 0; i--)
+	{
+		double sum = values[i];
+		for (int k = i + 1; k < n; k++)
+		{
+			sum -= factors[i * n + k] * values[k];
+		}
+		values[i] = sum / factors[i * n + i];
+	}
+	
+} // end luSolve
+
+
+//**************************************************************
+// Function fitSplineTransform is defined.                     *
+// The function fits the 3D thin-plate spline (kernel r, as    *
+// used by Transformix) which maps each fixed landmark onto    *
+// its moving landmark. A non-zero relaxation approximates     *
+// rather than interpolates the landmarks. Returns false if    *
+// the landmarks do not determine a transform.                 *
+//**************************************************************
+
+bool fitSplineTransform(const LandmarkPairs &pairs, double relaxation,
+                        SplineTransform &transform)
+{
+	const int NUM_DIMS = 3;
+	int numPoints = pairs.numPoints;
+	int n = numPoints + NUM_DIMS + 1;
+	
+	if ((numPoints < NUM_DIMS + 1) ||
+	    ((int)pairs.moving.size() < numPoints * NUM_DIMS))
+	{
+		return false;
+	}
+	
+	transform.numPoints = numPoints;
+	transform.relaxation = relaxation;
+	transform.sources.assign(pairs.fixed.begin(),
+	                         pairs.fixed.begin() + numPoints * NUM_DIMS);
+	
+	// System matrix is [K P; P' 0], with K the kernel between landmarks
+	// and P the affine terms of each landmark.
+	vector<double> &matrix = transform.factors;
+	matrix.assign(n * n, 0.0);
+	
+	for (int i = 0; i < numPoints; i++)
+	{
+		const double *pointI = &pairs.fixed[i * NUM_DIMS];
+		
+		for (int j = 0; j < numPoints; j++)
+		{
+			const double *pointJ = &pairs.fixed[j * NUM_DIMS];
+			double dx = pointI[0] - pointJ[0];
+			double dy = pointI[1] - pointJ[1];
+			double dz = pointI[2] - pointJ[2];
+			matrix[i * n + j] = sqrt(dx * dx + dy * dy + dz * dz);
+		}
+		matrix[i * n + i] += relaxation;
+		
+		matrix[i * n + numPoints] = 1.0;
+		matrix[numPoints * n + i] = 1.0;
+		for (int d = 0; d < NUM_DIMS; d++)
+		{
+			matrix[i * n + numPoints + 1 + d] = pointI[d];
+			matrix[(numPoints + 1 + d) * n + i] = pointI[d];
+		}
+	}
+	
+	if (!luDecompose(matrix, n, transform.pivots))
+	{
+		return false;
+	}
+	
+	// Each coordinate of the moving landmarks is solved for separately.
+	transform.coefficients.assign(n * NUM_DIMS, 0.0);
+	vector<double> column(n);
+	
+	for (int d = 0; d < NUM_DIMS; d++)
+	{
+		fill(column.begin(), column.end(), 0.0);
+		for (int i = 0; i < numPoints; i++)
+		{
+			column[i] = pairs.moving[i * NUM_DIMS + d];
+		}
+		
+		luSolve(matrix, n, transform.pivots, &column[0]);
+		
+		for (int i = 0; i < n; i++)
+		{
+			transform.coefficients[i * NUM_DIMS + d] = column[i];
+		}
+	}
+	
+	return true;
+	
+} // end fitSplineTransform
+
+
+// Fewest landmarks whose kernel terms are summed by the vector kernels.
+const int SPLINE_VECTOR_POINTS = 16;
+
+
+//**************************************************************
+// Function evaluateSplineTransform is defined.                *
+// The function maps a point in fixed space into moving space. *
+// Vector instruction sets sum the kernel terms of several     *
+// landmarks in separate lanes, so mapped points may differ    *
+// from scalar ones by rounding, up to about 1e-11 of their    *
+// size for thousands of landmarks.                            *
+//**************************************************************
+
+void evaluateSplineTransform(const SplineTransform &transform,
+                             const double *point, double *mapped)
+{
+	const int NUM_DIMS = 3;
+	int numPoints = transform.numPoints;
+	const double *coeffs = &transform.coefficients[0];
+	
+	// Affine part.
+	const double *affine = coeffs + numPoints * NUM_DIMS;
+	for (int d = 0; d < NUM_DIMS; d++)
+	{
+		mapped[d] = affine[d] + point[0] * affine[NUM_DIMS + d] +
+		            point[1] * affine[2 * NUM_DIMS + d] +
+		            point[2] * affine[3 * NUM_DIMS + d];
+	}
+	
+	// Kernel part, several landmarks at a time and the rest one at a time.
+	// A few landmarks are summed faster one at a time.
+	int i = 0;
+#ifdef LMK_X86
+	if (numPoints >= SPLINE_VECTOR_POINTS)
+	{
+		if (isaLevel >= ISA_AVX512)
+		{
+			i = addSplineKernelAvx512(transform, point, mapped);
+		}
+		else if (isaLevel >= ISA_AVX2)
+		{
+			i = addSplineKernelAvx2(transform, point, mapped);
+		}
+		else if (isaLevel >= ISA_SSE2)
+		{
+			i = addSplineKernelSse2(transform, point, mapped);
+		}
+	}
+#endif
+	for (; i < numPoints; i++)
+	{
+		const double *source = &transform.sources[i * NUM_DIMS];
+		double dx = point[0] - source[0];
+		double dy = point[1] - source[1];
+		double dz = point[2] - source[2];
+		double r = sqrt(dx * dx + dy * dy + dz * dz);
+		
+		mapped[0] += r * coeffs[i * NUM_DIMS];
+		mapped[1] += r * coeffs[i * NUM_DIMS + 1];
+		mapped[2] += r * coeffs[i * NUM_DIMS + 2];
+	}
+	
+} // end evaluateSplineTransform
+
+
+#ifdef LMK_X86
+//**************************************************************
+// Function addSplineKernelAvx512 is defined.                  *
+// The function adds the kernel terms of whole groups of       *
+// eight landmarks to a mapped point with AVX-512. Each lane   *
+// sums every eighth landmark. Returns the number added.       *
+//**************************************************************
+
+LMK_TARGET("avx512f")
+int addSplineKernelAvx512(const SplineTransform &transform, const double *point,
+                          double *mapped)
+{
+	const int numPoints = transform.numPoints;
+	const double *sources = &transform.sources[0];
+	const double *coeffs = &transform.coefficients[0];
+	
+	// Lanes of the first two of three vectors holding the x,y,z triples
+	// of eight landmarks, then of the third, which give each column.
+	const __m512i firstLanes[3] = {_mm512_setr_epi64(0, 3, 6, 9, 12, 15, 0, 0),
+	                               _mm512_setr_epi64(1, 4, 7, 10, 13, 0, 0, 0),
+	                               _mm512_setr_epi64(2, 5, 8, 11, 14, 0, 0, 0)};
+	const __m512i lastLanes[3] = {_mm512_setr_epi64(0, 1, 2, 3, 4, 5, 10, 13),
+	                              _mm512_setr_epi64(0, 1, 2, 3, 4, 8, 11, 14),
+	                              _mm512_setr_epi64(0, 1, 2, 3, 4, 9, 12, 15)};
+	__m512d target[3];
+	__m512d sums[3];
+	for (int d = 0; d < 3; d++)
+	{
+		target[d] = _mm512_set1_pd(point[d]);
+		sums[d] = _mm512_setzero_pd();
+	}
+	
+	int i = 0;
+	for (; i + 8 <= numPoints; i += 8)
+	{
+		// The x,y,z triples of eight landmarks and of their coefficients
+		// are loaded as three vectors and permuted into columns.
+		const double *rows[2] = {sources + i * 3, coeffs + i * 3};
+		__m512d columns[2][3];
+		for (int iRows = 0; iRows < 2; iRows++)
+		{
+			__m512d v0 = _mm512_loadu_pd(rows[iRows]);
+			__m512d v1 = _mm512_loadu_pd(rows[iRows] + 8);
+			__m512d v2 = _mm512_loadu_pd(rows[iRows] + 16);
+			for (int d = 0; d < 3; d++)
+			{
+				columns[iRows][d] = _mm512_permutex2var_pd(
+				    _mm512_permutex2var_pd(v0, firstLanes[d], v1), lastLanes[d], v2);
+			}
+		}
+		
+		__m512d squared = _mm512_setzero_pd();
+		for (int d = 0; d < 3; d++)
+		{
+			__m512d delta = _mm512_sub_pd(target[d], columns[0][d]);
+			squared = _mm512_add_pd(squared, _mm512_mul_pd(delta, delta));
+		}
+		__m512d r = _mm512_sqrt_pd(squared);
+		for (int d = 0; d < 3; d++)
+		{
+			sums[d] = _mm512_add_pd(sums[d], _mm512_mul_pd(r, columns[1][d]));
+		}
+	}
+	
+	// Lanes are added in a fixed order.
+	double lanes[8];
+	for (int d = 0; d < 3; d++)
+	{
+		_mm512_storeu_pd(lanes, sums[d]);
+		mapped[d] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+		             ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+	}
+	
+	return i;
+	
+} // end addSplineKernelAvx512
+
+
+//**************************************************************
+// Function addSplineKernelAvx2 is defined.                    *
+// The function adds the kernel terms of whole groups of four  *
+// landmarks to a mapped point with AVX2. Returns the number   *
+// added.                                                      *
+//**************************************************************
+
+LMK_TARGET("avx2")
+int addSplineKernelAvx2(const SplineTransform &transform, const double *point,
+                        double *mapped)
+{
+	const int numPoints = transform.numPoints;
+	const double *sources = &transform.sources[0];
+	const double *coeffs = &transform.coefficients[0];
+	
+	__m256d target[3];
+	__m256d sums[3];
+	for (int d = 0; d < 3; d++)
+	{
+		target[d] = _mm256_set1_pd(point[d]);
+		sums[d] = _mm256_setzero_pd();
+	}
+	
+	int i = 0;
+	for (; i + 4 <= numPoints; i += 4)
+	{
+		// The x,y,z triples of four landmarks and of their coefficients
+		// are loaded as three vectors and transposed into columns.
+		const double *rows[2] = {sources + i * 3, coeffs + i * 3};
+		__m256d columns[2][3];
+		for (int iRows = 0; iRows < 2; iRows++)
+		{
+			__m256d v0 = _mm256_loadu_pd(rows[iRows]);
+			__m256d v1 = _mm256_loadu_pd(rows[iRows] + 4);
+			__m256d v2 = _mm256_loadu_pd(rows[iRows] + 8);
+			columns[iRows][0] = _mm256_permute4x64_pd(_mm256_blend_pd(
+			                        _mm256_blend_pd(v0, v1, 0x4), v2, 0x2), 0x6c);
+			columns[iRows][1] = _mm256_permute4x64_pd(_mm256_blend_pd(
+			                        _mm256_blend_pd(v0, v1, 0x9), v2, 0x4), 0xb1);
+			columns[iRows][2] = _mm256_permute4x64_pd(_mm256_blend_pd(
+			                        _mm256_blend_pd(v0, v1, 0x2), v2, 0x9), 0xc6);
+		}
+		
+		__m256d squared = _mm256_setzero_pd();
+		for (int d = 0; d < 3; d++)
+		{
+			__m256d delta = _mm256_sub_pd(target[d], columns[0][d]);
+			squared = _mm256_add_pd(squared, _mm256_mul_pd(delta, delta));
+		}
+		__m256d r = _mm256_sqrt_pd(squared);
+		for (int d = 0; d < 3; d++)
+		{
+			sums[d] = _mm256_add_pd(sums[d], _mm256_mul_pd(r, columns[1][d]));
+		}
+	}
+	
+	// Lanes are added in a fixed order.
+	double lanes[4];
+	for (int d = 0; d < 3; d++)
+	{
+		_mm256_storeu_pd(lanes, sums[d]);
+		mapped[d] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+	
+	return i;
+	
+} // end addSplineKernelAvx2
+
+
+//**************************************************************
+// Function addSplineKernelSse2 is defined.                    *
+// The function adds the kernel terms of whole pairs of        *
+// landmarks to a mapped point with SSE2. Returns the number   *
+// added.                                                      *
+//**************************************************************
+
+LMK_TARGET("sse2")
+int addSplineKernelSse2(const SplineTransform &transform, const double *point,
+                        double *mapped)
+{
+	const int numPoints = transform.numPoints;
+	const double *sources = &transform.sources[0];
+	const double *coeffs = &transform.coefficients[0];
+	
+	__m128d target[3];
+	__m128d sums[3];
+	for (int d = 0; d < 3; d++)
+	{
+		target[d] = _mm_set1_pd(point[d]);
+		sums[d] = _mm_setzero_pd();
+	}
+	
+	int i = 0;
+	for (; i + 2 <= numPoints; i += 2)
+	{
+		// The x,y,z triples of two landmarks and of their coefficients
+		// are loaded as three vectors and shuffled into columns.
+		const double *rows[2] = {sources + i * 3, coeffs + i * 3};
+		__m128d columns[2][3];
+		for (int iRows = 0; iRows < 2; iRows++)
+		{
+			__m128d v0 = _mm_loadu_pd(rows[iRows]);
+			__m128d v1 = _mm_loadu_pd(rows[iRows] + 2);
+			__m128d v2 = _mm_loadu_pd(rows[iRows] + 4);
+			columns[iRows][0] = _mm_shuffle_pd(v0, v1, 0x2);
+			columns[iRows][1] = _mm_shuffle_pd(v0, v2, 0x1);
+			columns[iRows][2] = _mm_shuffle_pd(v1, v2, 0x2);
+		}
+		
+		__m128d squared = _mm_setzero_pd();
+		for (int d = 0; d < 3; d++)
+		{
+			__m128d delta = _mm_sub_pd(target[d], columns[0][d]);
+			squared = _mm_add_pd(squared, _mm_mul_pd(delta, delta));
+		}
+		__m128d r = _mm_sqrt_pd(squared);
+		for (int d = 0; d < 3; d++)
+		{
+			sums[d] = _mm_add_pd(sums[d], _mm_mul_pd(r, columns[1][d]));
+		}
+	}
+	
+	double lanes[2];
+	for (int d = 0; d < 3; d++)
+	{
+		_mm_storeu_pd(lanes, sums[d]);
+		mapped[d] += lanes[0] + lanes[1];
+	}
+	
+	return i;
+	
+} // end addSplineKernelSse2
+#endif
+
+
+//**************************************************************
+// Function leaveOneOutResiduals is defined.                   *
+// The function computes the residual of each landmark under   *
+// the spline fitted to all the other landmarks, without       *
+// refitting: by Rippa's formula the error is the landmark's   *
+// coefficient over the matching diagonal entry of the inverse *
+// system matrix. The columns of the inverse are solved for by *
+// the given number of threads.                                *
+// Returns false if a landmark is needed to fit the spline.    *
+//**************************************************************
+
+bool leaveOneOutResiduals(const SplineTransform &transform,
+                          vector<double> &residuals, int numThreads)
+{
+	const int NUM_DIMS = 3;
+	int numPoints = transform.numPoints;
+	int n = numPoints + NUM_DIMS + 1;
+	numThreads = max(1, min(numThreads, numPoints));
+	residuals.assign(numPoints, 0.0);
+	atomic<bool> singular(false);
+	
+	vector<thread> workers;
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		workers.push_back(thread([&, iThread]()
+		{
+			vector<double> column(n);
+			for (int i = iThread; i < numPoints; i += numThreads)
+			{
+				fill(column.begin(), column.end(), 0.0);
+				column[i] = 1.0;
+				luSolve(transform.factors, n, transform.pivots, &column[0]);
+				if (column[i] == 0)
+				{
+					singular = true;
+					continue;
+				}
+				
+				double squared = 0.0;
+				for (int d = 0; d < NUM_DIMS; d++)
+				{
+					double error = transform.coefficients[i * NUM_DIMS + d] /
+					               column[i];
+					squared += error * error;
+				}
+				residuals[i] = sqrt(squared);
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+	
+	return !singular;
+	
+} // end leaveOneOutResiduals
+
+
+//**************************************************************
+// Function selectLandmarks is defined.                        *
+// The function returns the landmark pairs whose entry in keep *
+// is set, along with their attributes.                        *
+//**************************************************************
+
+LandmarkPairs selectLandmarks(const LandmarkPairs &pairs, const vector<bool> &keep)
+{
+	LandmarkPairs selected = pairs;
+	int numDims = pairs.numDims;
+	bool hasMoving = !pairs.moving.empty();
+	
+	selected.fixed.clear();
+	selected.moving.clear();
+	selected.pointIds.clear();
+	selected.distinctiveness.clear();
+	selected.flags.clear();
+	
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+		if (!keep[iPoint])
+		{
+			continue;
+		}
+		
+		selected.fixed.insert(selected.fixed.end(),
+		                      pairs.fixed.begin() + iPoint * numDims,
+		                      pairs.fixed.begin() + (iPoint + 1) * numDims);
+		if (hasMoving)
+		{
+			selected.moving.insert(selected.moving.end(),
+			                       pairs.moving.begin() + iPoint * numDims,
+			                       pairs.moving.begin() + (iPoint + 1) * numDims);
+		}
+		selected.pointIds.push_back(pairs.pointIds[iPoint]);
+		selected.distinctiveness.push_back(pairs.distinctiveness[iPoint]);
+		selected.flags.push_back(pairs.flags[iPoint]);
+	}
+	
+	selected.numPoints = selected.pointIds.size();
+	
+	return selected;
+	
+} // end selectLandmarks
+
+
+// Voxels along each edge of a tile of a residual map.
+const int RESIDUAL_MAP_TILE = 8;
+
+
+//**************************************************************
+// Function writeResiduals is defined.                         *
+// The function writes the residual of each landmark under the *
+// fitted transform, one "point residual" line per landmark.   *
+// When given, the landmark's share of the bending energy is   *
+// written as a third column.                                  *
+//**************************************************************
+
+void writeResiduals(const LandmarkPairs &pairs, const vector<double> &residuals,
+                    const vector<double> &energies, string inPath, string outPath)
+{
+    //Creates path to output file
+    string outputFilePath = outPath + getFileStem(inPath) + "_residuals.txt";
+    
+    //Creates and opens output file
+    LOG_MESSAGE(LOG_DEBUG, "write", outputFilePath, "Creating output file");
+    ofstream outputFile(outputFilePath.c_str());
+    
+    //Checks for successful file open
+    if (!(outputFile.is_open()))
+    {
+         LOG_MESSAGE(LOG_ERROR, "write", outputFilePath,
+                     "Failed to create output file");
+    }
+	
+	bool hasEnergies = ((int)energies.size() == pairs.numPoints);
+	outputFile << (hasEnergies ? "point residual bending_energy\n" :
+	                             "point residual\n");
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+		outputFile << pairs.pointIds[iPoint] << " " << residuals[iPoint];
+		if (hasEnergies)
+		{
+			outputFile << " " << energies[iPoint];
+		}
+		outputFile << "\n";
+	}
+	
+	// Closes output file.
+	outputFile.close();
+	
+} // end writeResiduals
+
+
+//**************************************************************
+// Function computeBendingEnergy is defined.                   *
+// The function splits the bending energy of the spline, the   *
+// integral of its squared second derivatives, -8 pi c'Kc for  *
+// kernel matrix K and coefficients c, into the share          *
+// -8 pi c_i.(Kc)_i of each landmark. Its leverage is the      *
+// energy gained per mm its moving landmark is displaced,      *
+// 16 pi |c_i|. Both come from the fitted coefficients alone.  *
+//**************************************************************
+
+void computeBendingEnergy(const SplineTransform &transform,
+                          vector<double> &energies, vector<double> &leverages)
+{
+	const int NUM_DIMS = 3;
+	const double SCALE = 8 * M_PI;
+	int numPoints = transform.numPoints;
+	const double *coeffs = &transform.coefficients[0];
+	energies.assign(numPoints, 0.0);
+	leverages.assign(numPoints, 0.0);
+	
+	for (int i = 0; i < numPoints; i++)
+	{
+		const double *pointI = &transform.sources[i * NUM_DIMS];
+		double kernel[NUM_DIMS] = {0.0, 0.0, 0.0};
+		for (int j = 0; j < numPoints; j++)
+		{
+			const double *pointJ = &transform.sources[j * NUM_DIMS];
+			double dx = pointI[0] - pointJ[0];
+			double dy = pointI[1] - pointJ[1];
+			double dz = pointI[2] - pointJ[2];
+			double r = sqrt(dx * dx + dy * dy + dz * dz);
+			for (int d = 0; d < NUM_DIMS; d++)
+			{
+				kernel[d] += r * coeffs[j * NUM_DIMS + d];
+			}
+		}
+		
+		double squared = 0.0;
+		for (int d = 0; d < NUM_DIMS; d++)
+		{
+			energies[i] -= SCALE * coeffs[i * NUM_DIMS + d] * kernel[d];
+			squared += coeffs[i * NUM_DIMS + d] * coeffs[i * NUM_DIMS + d];
+		}
+		leverages[i] = 2 * SCALE * sqrt(squared);
+	}
+	
+} // end computeBendingEnergy
+
+
+//**************************************************************
+// Function writeBendingEnergy is defined.                     *
+// The function writes the bending energy of the spline and    *
+// each landmark's share of it to <name>_bending_energy.json,  *
+// the landmarks ranked by their leverage on the energy.       *
+// Returns false if the file could not be written.             *
+//**************************************************************
+
+bool writeBendingEnergy(const LandmarkPairs &pairs, const SplineTransform &transform,
+                        string inPath, string outPath)
+{
+	string outputFilePath = outPath + getFileStem(inPath) + "_bending_energy.json";
+	LOG_MESSAGE(LOG_DEBUG, "write", outputFilePath, "Creating output file");
+	
+	vector<double> energies;
+	vector<double> leverages;
+	computeBendingEnergy(transform, energies, leverages);
+	double total = 0.0;
+	vector<int> ranked(pairs.numPoints);
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+		total += energies[iPoint];
+		ranked[iPoint] = iPoint;
+	}
+	stable_sort(ranked.begin(), ranked.end(), [&](int a, int b)
+	            {
+	                return leverages[a] > leverages[b];
+	            });
+	
+	ostringstream text;
+	text.precision(17);
+	text << "{\n  \"bending_energy\": " << total << ",\n";
+	text << "  \"relaxation\": " << transform.relaxation << ",\n";
+	text << "  \"landmarks\": [";
+	for (int iRank = 0; iRank < pairs.numPoints; iRank++)
+	{
+		int iPoint = ranked[iRank];
+		text << (iRank ? ",\n" : "\n") << "    {\"rank\": " << iRank + 1
+		     << ", \"point\": " << pairs.pointIds[iPoint]
+		     << ", \"energy\": " << energies[iPoint]
+		     << ", \"share\": " << ((total != 0) ? energies[iPoint] / total : 0.0)
+		     << ", \"leverage\": " << leverages[iPoint] << "}";
+	}
+	text << "\n  ]\n}\n";
+	
+	ofstream outputFile(outputFilePath.c_str());
+	outputFile << text.str();
+	outputFile.close();
+	if (outputFile.fail())
+	{
+		LOG_MESSAGE(LOG_ERROR, "write", outputFilePath, "Failed to create output file");
+		return false;
+	}
+	
+	return true;
+	
+} // end writeBendingEnergy
+
+
+//**************************************************************
+// Function buildLandmarkIndex is defined.                     *
+// The function sorts landmarks (z,y,x, as stored in landmark  *
+// pairs) into a k-d tree of their x,y,z positions. Each range *
+// is split at its median along the axis of largest spread.    *
+//**************************************************************
+
+void buildLandmarkIndex(const vector<double> &landmarks, LandmarkIndex &index)
+{
+	int numPoints = landmarks.size() / 3;
+	vector<int> order(numPoints);
+	for (int iPoint = 0; iPoint < numPoints; iPoint++)
+	{
+		order[iPoint] = iPoint;
+	}
+	index.axes.assign(numPoints, 0);
+	
+	// Ranges are split in turn, without recursion.
+	vector<pair<int, int> > ranges(1, make_pair(0, numPoints));
+	while (!ranges.empty())
+	{
+		int first = ranges.back().first;
+		int last = ranges.back().second;
+		ranges.pop_back();
+		if (last - first < 2)
+		{
+			continue;
+		}
+		
+		double lower[3] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+		double upper[3] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+		for (int i = first; i < last; i++)
+		{
+			for (int d = 0; d < 3; d++)
+			{
+				lower[d] = min(lower[d], landmarks[3 * order[i] + 2 - d]);
+				upper[d] = max(upper[d], landmarks[3 * order[i] + 2 - d]);
+			}
+		}
+		int axis = 0;
+		for (int d = 1; d < 3; d++)
+		{
+			if (upper[d] - lower[d] > upper[axis] - lower[axis])
+			{
+				axis = d;
+			}
+		}
+		
+		int middle = (first + last) / 2;
+		nth_element(order.begin() + first, order.begin() + middle,
+		            order.begin() + last, [&](int a, int b)
+		            {
+		                return landmarks[3 * a + 2 - axis] <
+		                       landmarks[3 * b + 2 - axis];
+		            });
+		index.axes[middle] = axis;
+		ranges.push_back(make_pair(first, middle));
+		ranges.push_back(make_pair(middle + 1, last));
+	}
+	
+	index.ids = order;
+	index.points.resize(3 * numPoints);
+	for (int iPoint = 0; iPoint < numPoints; iPoint++)
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			index.points[3 * iPoint + d] = landmarks[3 * order[iPoint] + 2 - d];
+		}
+	}
+	
+} // end buildLandmarkIndex
+
+
+//**************************************************************
+// Function findNearestLandmarks is defined.                   *
+// The function adds the landmarks of tree positions first to  *
+// last that are among the k nearest to a point to a max-heap  *
+// of squared distances and tree positions.                    *
+//**************************************************************
+
+void findNearestLandmarks(const LandmarkIndex &index, int first, int last,
+                          const double *point, int k,
+                          vector<pair<double, int> > &nearest)
+{
+	if (first >= last)
+	{
+		return;
+	}
+	
+	int middle = (first + last) / 2;
+	const double *landmark = &index.points[3 * middle];
+	double squared = 0.0;
+	for (int d = 0; d < 3; d++)
+	{
+		squared += (point[d] - landmark[d]) * (point[d] - landmark[d]);
+	}
+	if ((int)nearest.size() < k)
+	{
+		nearest.push_back(make_pair(squared, middle));
+		push_heap(nearest.begin(), nearest.end());
+	}
+	else if (squared < nearest.front().first)
+	{
+		pop_heap(nearest.begin(), nearest.end());
+		nearest.back() = make_pair(squared, middle);
+		push_heap(nearest.begin(), nearest.end());
+	}
+	
+	// The side of the point is searched first, the other only if it
+	// may still hold a nearer landmark.
+	double offset = point[index.axes[middle]] - landmark[index.axes[middle]];
+	bool below = (offset < 0);
+	findNearestLandmarks(index, below ? first : middle + 1,
+	                     below ? middle : last, point, k, nearest);
+	if (((int)nearest.size() < k) || (offset * offset < nearest.front().first))
+	{
+		findNearestLandmarks(index, below ? middle + 1 : first,
+		                     below ? last : middle, point, k, nearest);
+	}
+	
+} // end findNearestLandmarks
+
+
+//**************************************************************
+// Function findLandmarksWithin is defined.                    *
+// The function adds the tree positions among first to last of *
+// the landmarks within radius of a point to a list.           *
+//**************************************************************
+
+void findLandmarksWithin(const LandmarkIndex &index, int first, int last,
+                         const double *point, double radius, vector<int> &found)
+{
+	if (first >= last)
+	{
+		return;
+	}
+	
+	int middle = (first + last) / 2;
+	const double *landmark = &index.points[3 * middle];
+	double squared = 0.0;
+	for (int d = 0; d < 3; d++)
+	{
+		squared += (point[d] - landmark[d]) * (point[d] - landmark[d]);
+	}
+	if (squared <= radius * radius)
+	{
+		found.push_back(middle);
+	}
+	
+	double offset = point[index.axes[middle]] - landmark[index.axes[middle]];
+	if (offset - radius <= 0)
+	{
+		findLandmarksWithin(index, first, middle, point, radius, found);
+	}
+	if (offset + radius >= 0)
+	{
+		findLandmarksWithin(index, middle + 1, last, point, radius, found);
+	}
+	
+} // end findLandmarksWithin
+
+
+//**************************************************************
+// Function writeResidualMap is defined.                       *
+// The function interpolates the residual of each landmark     *
+// onto the grid of the fixed image, as an overlay written to  *
+// <name>_residual_map.mhd/.raw with float voxels. Parameters  *
+// are "method" (idw, default, or shepard), "k" nearest        *
+// landmarks (default 8) and their weighting "power" (default  *
+// 2) for idw, and the "radius" in mm of shepard's weights.    *
+// Slabs of tiles are mapped by each thread in turn.           *
+// Returns false if the parameters or image are unusable.      *
+//**************************************************************
+
+bool writeResidualMap(const LandmarkPairs &pairs, const vector<double> &residuals,
+                      const JsonValue &params, string inPath, string outPath,
+                      int numThreads)
+{
+	const int T = RESIDUAL_MAP_TILE;
+	string base = outPath + getFileStem(inPath) + "_residual_map";
+	LogTimer timer("residual map", base + ".mhd");
+	
+	ResidualMapJob job;
+	job.method = RESIDUAL_MAP_IDW;
+	job.numNeighbors = 8;
+	job.power = 2.0;
+	job.radius = 0.0;
+	
+	const JsonValue *param;
+	if ((param = jsonMember(params, "method")) != NULL)
+	{
+		job.method = (param->text == "shepard") ? RESIDUAL_MAP_SHEPARD :
+		             (param->text == "idw") ? RESIDUAL_MAP_IDW : -1;
+	}
+	if ((param = jsonMember(params, "k")) != NULL)
+	{
+		job.numNeighbors = (int)param->number;
+	}
+	if ((param = jsonMember(params, "power")) != NULL)
+	{
+		job.power = param->number;
+	}
+	if ((param = jsonMember(params, "radius")) != NULL)
+	{
+		job.radius = param->number;
+	}
+	if ((job.method < 0) || (job.numNeighbors < 1) || (job.power < 0) ||
+	    ((job.method == RESIDUAL_MAP_SHEPARD) && !(job.radius > 0)) ||
+	    (pairs.numPoints == 0))
+	{
+		LOG_MESSAGE(LOG_ERROR, "residual map", inPath, "Residual maps need "
+		            "landmarks, method idw with k >= 1 and power >= 0, or "
+		            "method shepard with a radius > 0");
+		return false;
+	}
+	
+	if (pairs.pathFixedImage.empty() ||
+	    !getImageGeometry(pairs.pathFixedImage, job.geometry))
+	{
+		LOG_MESSAGE(LOG_ERROR, "residual map", inPath,
+		            "Residual maps require the fixed image");
+		return false;
+	}
+	
+	LandmarkIndex index;
+	buildLandmarkIndex(pairs.fixed, index);
+	job.index = &index;
+	job.numNeighbors = min(job.numNeighbors, pairs.numPoints);
+	job.values.resize(pairs.numPoints);
+	for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+	{
+		job.values[iPoint] = residuals[index.ids[iPoint]];
+	}
+	
+	string pathData = base + ".raw";
+	job.fd = open(pathData.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((job.fd < 0) ||
+	    !writeMetaImageHeader(base + ".mhd", job.geometry, "MET_FLOAT",
+	                          getFileStem(pathData) + ".raw"))
+	{
+		LOG_MESSAGE(LOG_ERROR, "residual map", base + ".mhd",
+		            "Failed to create output file");
+		if (job.fd >= 0)
+		{
+			close(job.fd);
+		}
+		return false;
+	}
+	
+	int numSlabs = (job.geometry.dimSizes[2] + T - 1) / T;
+	numThreads = max(1, min(numThreads, numSlabs));
+	atomic<int> nextSlab(0);
+	atomic<bool> failed(false);
+	
+	vector<thread> workers;
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		workers.push_back(thread([&]()
+		{
+			int slab;
+			while (!failed && ((slab = nextSlab++) < numSlabs))
+			{
+				if (!mapResidualSlab(job, slab))
+				{
+					failed = true;
+				}
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+	
+	bool success = !failed && (close(job.fd) == 0);
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "residual map", pathData,
+		            "Failed to write residual map");
+	}
+	
+	return success;
+	
+} // end writeResidualMap
+
+
+//**************************************************************
+// Function mapResidualSlab is defined.                        *
+// The function interpolates the residuals over one slab of    *
+// tiles. The landmarks which can weigh on any voxel of a tile *
+// are found once from the index: those within the k-th      *
+// nearest distance to its centre, or the radius, widened by   *
+// the tile's extent. Each voxel then weighs only those.       *
+// Returns false if the slab cannot be written.                *
+//**************************************************************
+
+bool mapResidualSlab(const ResidualMapJob &job, int slab)
+{
+	const int T = RESIDUAL_MAP_TILE;
+	const ImageGeometry &geometry = job.geometry;
+	const int *dims = geometry.dimSizes;
+	int numPoints = job.index->ids.size();
+	int k = job.numNeighbors;
+	int zStart = slab * T;
+	int zEnd = min(dims[2], zStart + T);
+	vector<float> output((size_t)dims[0] * dims[1] * (zEnd - zStart));
+	
+	vector<pair<double, int> > nearest;
+	vector<int> candidates;
+	vector<double> best(k);
+	vector<int> bestPoints(k);
+	
+	for (int yStart = 0; yStart < dims[1]; yStart += T)
+	{
+		for (int xStart = 0; xStart < dims[0]; xStart += T)
+		{
+			int starts[3] = {xStart, yStart, zStart};
+			int ends[3] = {min(dims[0], xStart + T), min(dims[1], yStart + T), zEnd};
+			double centre[3];
+			double extent = 0.0;
+			for (int d = 0; d < 3; d++)
+			{
+				centre[d] = 0.5 * (starts[d] + ends[d] - 1) * geometry.spacings[d] +
+				            geometry.offsets[d];
+				double half = 0.5 * (ends[d] - 1 - starts[d]) * fabs(geometry.spacings[d]);
+				extent += half * half;
+			}
+			extent = sqrt(extent);
+			
+			// Any voxel's k nearest lie within the centre's k-th nearest
+			// distance plus twice the distance from the centre to it.
+			double reach;
+			if (job.method == RESIDUAL_MAP_IDW)
+			{
+				nearest.clear();
+				findNearestLandmarks(*job.index, 0, numPoints, centre, k, nearest);
+				reach = sqrt(nearest.front().first) + 2 * extent;
+			}
+			else
+			{
+				reach = job.radius + extent;
+			}
+			candidates.clear();
+			findLandmarksWithin(*job.index, 0, numPoints, centre, reach, candidates);
+			
+			for (int z = zStart; z < zEnd; z++)
+			{
+				for (int y = starts[1]; y < ends[1]; y++)
+				{
+					float *row = &output[((size_t)(z - zStart) * dims[1] + y) * dims[0]];
+					for (int x = starts[0]; x < ends[0]; x++)
+					{
+						double position[3] = {x * geometry.spacings[0] + geometry.offsets[0],
+						                      y * geometry.spacings[1] + geometry.offsets[1],
+						                      z * geometry.spacings[2] + geometry.offsets[2]};
+						row[x] = 0;
+						int numBest = 0;
+						double sumWeights = 0.0;
+						double sumValues = 0.0;
+						bool exact = false;
+						
+						for (size_t i = 0; !exact && (i < candidates.size()); i++)
+						{
+							const double *landmark = &job.index->points[3 * candidates[i]];
+							double squared = 0.0;
+							for (int d = 0; d < 3; d++)
+							{
+								squared += (position[d] - landmark[d]) *
+								           (position[d] - landmark[d]);
+							}
+							if (squared == 0)
+							{
+								row[x] = job.values[candidates[i]];
+								exact = true;
+							}
+							else if (job.method == RESIDUAL_MAP_SHEPARD)
+							{
+								double distance = sqrt(squared);
+								if (distance < job.radius)
+								{
+									double weight = (job.radius - distance) /
+									                (job.radius * distance);
+									sumWeights += weight * weight;
+									sumValues += weight * weight *
+									             job.values[candidates[i]];
+								}
+							}
+							else if ((numBest < k) || (squared < best[numBest - 1]))
+							{
+								// The k nearest are kept in order.
+								int slot = min(numBest, k - 1);
+								while ((slot > 0) && (best[slot - 1] > squared))
+								{
+									best[slot] = best[slot - 1];
+									bestPoints[slot] = bestPoints[slot - 1];
+									slot--;
+								}
+								best[slot] = squared;
+								bestPoints[slot] = candidates[i];
+								numBest = min(numBest + 1, k);
+							}
+						}
+						if (exact)
+						{
+							continue;
+						}
+						
+						for (int i = 0; i < numBest; i++)
+						{
+							double weight = (job.power == 2) ? 1 / best[i] :
+							                pow(best[i], -0.5 * job.power);
+							sumWeights += weight;
+							sumValues += weight * job.values[bestPoints[i]];
+						}
+						if (sumWeights > 0)
+						{
+							row[x] = sumValues / sumWeights;
+						}
+					}
+				}
+			}
+		}
+	}
+	
+	return writeAt(job.fd, (const char *)&output[0], output.size() * sizeof(float),
+	               (off_t)zStart * dims[0] * dims[1] * sizeof(float));
+	
+} // end mapResidualSlab
+
+
+//**************************************************************
+// Function writeAt is defined.                                *
+// The function writes size bytes at the offset of a file,     *
+// retrying short writes. Returns false if they failed.        *
+//**************************************************************
+
+bool writeAt(int fd, const char *data, size_t size, off_t offset)
+{
+	size_t written = 0;
+	while (written < size)
+	{
+		ssize_t numWritten = pwrite(fd, data + written, size - written,
+		                            offset + written);
+		if (numWritten <= 0)
+		{
+			return false;
+		}
+		written += numWritten;
+	}
+	
+	return true;
+	
+} // end writeAt
+
+
+//**************************************************************
+// Function savePipelineData is defined.                       *
+// The function stores the result of a pipeline stage in a    *
+// binary file so later runs can reuse it.                     *
+//**************************************************************
+
+// Appends the raw bytes of a vector to a buffer, preceded by its length.
+template <typename T>
+void appendVector(string &buffer, const vector<T> &values)
+{
+	uint64_t size = values.size();
+	buffer.append((const char *)&size, sizeof(size));
+	if (size > 0)
+	{
+		buffer.append((const char *)&values[0], size * sizeof(T));
+	}
+}
+
+// Reads a vector written by appendVector. Returns false past the end.
+template <typename T>
+bool extractVector(const string &buffer, size_t &pos, vector<T> &values)
+{
+	uint64_t size;
+	if ((pos + sizeof(size)) > buffer.length())
+	{
+		return false;
+	}
+	memcpy(&size, buffer.data() + pos, sizeof(size));
+	pos += sizeof(size);
+	
+	if ((size > (buffer.length() - pos) / sizeof(T)))
+	{
+		return false;
+	}
+	values.resize(size);
+	if (size > 0)
+	{
+		memcpy(&values[0], buffer.data() + pos, size * sizeof(T));
+	}
+	pos += size * sizeof(T);
+	
+	return true;
+}
+
+bool savePipelineData(string path, const PipelineData &data)
+{
+	const LandmarkPairs &pairs = data.pairs;
+	
+	// Scalars are packed into one vector ahead of the columns.
+	vector<double> header(10);
+	header[0] = pairs.numPoints;
+	header[1] = pairs.numDims;
+	copy(pairs.offsets, pairs.offsets + 3, header.begin() + 2);
+	copy(pairs.spacings, pairs.spacings + 3, header.begin() + 5);
+	header[8] = data.hasTransform;
+	header[9] = data.transform.relaxation;
+	
+	string buffer = "LMKSTAGE2";
+	appendVector(buffer, header);
+	appendVector(buffer, vector<char>(pairs.imgDims.begin(), pairs.imgDims.end()));
+	appendVector(buffer, vector<char>(pairs.pathFixedImage.begin(),
+	                                  pairs.pathFixedImage.end()));
+	appendVector(buffer, vector<char>(pairs.pathMovingImage.begin(),
+	                                  pairs.pathMovingImage.end()));
+	appendVector(buffer, pairs.fixed);
+	appendVector(buffer, pairs.moving);
+	appendVector(buffer, pairs.pointIds);
+	appendVector(buffer, pairs.distinctiveness);
+	appendVector(buffer, pairs.flags);
+	appendVector(buffer, data.transform.sources);
+	appendVector(buffer, data.transform.coefficients);
+	appendVector(buffer, data.transform.factors);
+	appendVector(buffer, data.transform.pivots);
+	appendVector(buffer, data.residuals);
+	
+	// Written under a temporary name so readers never see partial files.
+	ostringstream pathTemp;
+	pathTemp << path << ".tmp." << getpid() << "." << this_thread::get_id();
+	
+	ofstream file(pathTemp.str().c_str(), ios::binary);
+	file.write(buffer.data(), buffer.length());
+	file.close();
+	
+	if (file.fail() || (rename(pathTemp.str().c_str(), path.c_str()) != 0))
+	{
+		remove(pathTemp.str().c_str());
+		return false;
+	}
+	
+	return true;
+	
+} // end savePipelineData
+
+
+//**************************************************************
+// Function loadPipelineData is defined.                       *
+// The function reads a stage result stored by                 *
+// savePipelineData. Returns false if it is missing or bad.    *
+//**************************************************************
+
+bool loadPipelineData(string path, PipelineData &data)
+{
+	ifstream file(path.c_str(), ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	
+	string buffer((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (buffer.compare(0, 9, "LMKSTAGE2") != 0)
+	{
+		return false;
+	}
+	
+	LandmarkPairs &pairs = data.pairs;
+	vector<double> header;
+	vector<char> imgDims;
+	vector<char> pathFixedImage;
+	vector<char> pathMovingImage;
+	size_t pos = 9;
+	
+	if (!extractVector(buffer, pos, header) || (header.size() != 10) ||
+	    !extractVector(buffer, pos, imgDims) ||
+	    !extractVector(buffer, pos, pathFixedImage) ||
+	    !extractVector(buffer, pos, pathMovingImage) ||
+	    !extractVector(buffer, pos, pairs.fixed) ||
+	    !extractVector(buffer, pos, pairs.moving) ||
+	    !extractVector(buffer, pos, pairs.pointIds) ||
+	    !extractVector(buffer, pos, pairs.distinctiveness) ||
+	    !extractVector(buffer, pos, pairs.flags) ||
+	    !extractVector(buffer, pos, data.transform.sources) ||
+	    !extractVector(buffer, pos, data.transform.coefficients) ||
+	    !extractVector(buffer, pos, data.transform.factors) ||
+	    !extractVector(buffer, pos, data.transform.pivots) ||
+	    !extractVector(buffer, pos, data.residuals))
+	{
+		return false;
+	}
+	
+	pairs.numPoints = (int)header[0];
+	pairs.numDims = (int)header[1];
+	copy(header.begin() + 2, header.begin() + 5, pairs.offsets);
+	copy(header.begin() + 5, header.begin() + 8, pairs.spacings);
+	pairs.imgDims.assign(imgDims.begin(), imgDims.end());
+	pairs.pathFixedImage.assign(pathFixedImage.begin(), pathFixedImage.end());
+	pairs.pathMovingImage.assign(pathMovingImage.begin(), pathMovingImage.end());
+	data.hasTransform = (header[8] != 0);
+	data.transform.relaxation = header[9];
+	data.transform.numPoints = data.transform.sources.size() / 3;
+	
+	return true;
+	
+} // end loadPipelineData
+
+
+//**************************************************************
+// Function runPipelineStage is defined.                       *
+// The function computes the result of one pipeline stage from *
+// the results of its inputs. Returns false on failure.        *
+//**************************************************************
+
+bool runPipelineStage(const JsonValue &spec, const PipelineStage &stage,
+                      const vector<const PipelineData *> &inputs,
+                      PipelineData &result)
+{
+	const JsonValue *param;
+	result.hasTransform = false;
+	
+	// Reads the input landmarks named by the spec.
+	if (stage.type == "convert")
+	{
+		string pathInput = getStageInput(spec, stage);
+		string inputType = jsonMember(spec, "in_type")->text;
+		string keep_all = "1";
+		
+		if ((param = jsonMember(stage.params, "keep_all")) != NULL)
+		{
+			keep_all = (param->number != 0) ? "1" : "0";
+		}
+		
+		if (inputType == "ix_pp")
+		{
+			result.pairs = readLandmarksIx(pathInput, "", keep_all);
+		}
+		else if (inputType == "ireg")
+		{
+			result.pairs = readLandmarksIreg(pathInput);
+		}
+		else if (inputType == "tfx_lmk")
+		{
+			result.pairs = readLandmarksTransformix(pathInput);
+		}
+		else if (inputType == "slr_fid")
+		{
+			string pathRefImage;
+			if (jsonMember(spec, "ref_image") != NULL)
+			{
+				pathRefImage = jsonMember(spec, "ref_image")->text;
+			}
+			result.pairs = readLandmarksSlicer(pathInput, pathRefImage);
+		}
+		else
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", pathInput,
+			            "Unexpected input format: " << inputType);
+			return false;
+		}
+		return !result.pairs.readFailed;
+	}
+	
+	if (inputs.empty())
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", "",
+		            "Stage " << stage.name << " requires an input");
+		return false;
+	}
+	const LandmarkPairs &pairs = inputs[0]->pairs;
+	
+	// Drops landmarks by their iX flags or distinctiveness.
+	if (stage.type == "filter")
+	{
+		unsigned char dropFlags = 0;
+		bool dropAutomatic = false;
+		double minDistinctiveness = -HUGE_VAL;
+		
+		vector<string> dropNames;
+		if ((param = jsonMember(stage.params, "drop")) != NULL)
+		{
+			if (param->type == JSON_STRING)
+			{
+				dropNames.push_back(param->text);
+			}
+			for (size_t iItem = 0; iItem < param->items.size(); iItem++)
+			{
+				dropNames.push_back(param->items[iItem].text);
+			}
+		}
+		for (size_t iName = 0; iName < dropNames.size(); iName++)
+		{
+			if (dropNames[iName] == "VeryUnsure")
+				dropFlags |= FLAG_UNSURE;
+			else if (dropNames[iName] == "SystemGuess")
+				dropFlags |= FLAG_SYSTEM_GUESS;
+			else if (dropNames[iName] == "ManuallyChosen")
+				dropFlags |= FLAG_MANUAL;
+			else if (dropNames[iName] == "Automatic")
+				dropAutomatic = true;
+			else
+			{
+				LOG_MESSAGE(LOG_ERROR, "pipeline", "",
+				            "Unexpected filter: " << dropNames[iName]);
+				return false;
+			}
+		}
+		if ((param = jsonMember(stage.params, "min_distinctiveness")) != NULL)
+		{
+			minDistinctiveness = param->number;
+		}
+		
+		vector<bool> keep(pairs.numPoints);
+		for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+		{
+			keep[iPoint] = ((pairs.flags[iPoint] & dropFlags) == 0) &&
+			     !(dropAutomatic && !(pairs.flags[iPoint] & FLAG_MANUAL)) &&
+			     (pairs.distinctiveness[iPoint] >= minDistinctiveness);
+		}
+		
+		result.pairs = selectLandmarks(pairs, keep);
+		return true;
+	}
+	
+	// Crops the images to the landmarks, expressing them in the cropped frame.
+	if (stage.type == "crop")
+	{
+		int margin = 0;
+		if ((param = jsonMember(stage.params, "margin")) != NULL)
+		{
+			margin = max(0, (int)param->number);
+		}
+		
+		result.pairs = pairs;
+		return cropLandmarkImages(result.pairs, margin, getStageInput(spec, stage),
+		                          jsonMember(spec, "out_dir")->text);
+	}
+	
+	// Fits the landmark spline.
+	if (stage.type == "fit")
+	{
+		double relaxation = 0.0;
+		if ((param = jsonMember(stage.params, "relaxation")) != NULL)
+		{
+			relaxation = param->number;
+		}
+		
+		result.pairs = pairs;
+		result.hasTransform = fitSplineTransform(pairs, relaxation,
+		                                         result.transform);
+		if (!result.hasTransform)
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+			            ": landmarks do not determine a spline transform");
+		}
+		return result.hasTransform;
+	}
+	
+	// Maps landmarks through the fitted transforms of its inputs in turn,
+	// e.g. of consecutive intervals of a follow-up study. A last input
+	// without a transform holds direct annotations of the whole chain,
+	// whose fixed landmarks are mapped and compared with their moving ones.
+	if (stage.type == "chain")
+	{
+		vector<const SplineTransform *> transforms;
+		while ((transforms.size() < inputs.size()) &&
+		       inputs[transforms.size()]->hasTransform)
+		{
+			transforms.push_back(&inputs[transforms.size()]->transform);
+		}
+		bool hasDirect = (transforms.size() + 1 == inputs.size());
+		if (transforms.empty() || (transforms.size() + 1 < inputs.size()) ||
+		    (hasDirect && inputs.back()->pairs.moving.empty()))
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+			            " requires fitted inputs in time order, optionally"
+			            " followed by directly annotated landmark pairs");
+			return false;
+		}
+		int numThreads = thread::hardware_concurrency();
+		if ((param = jsonMember(stage.params, "threads")) != NULL)
+		{
+			numThreads = (int)param->number;
+		}
+		
+		const LandmarkPairs &start = inputs[hasDirect ? inputs.size() - 1 : 0]->pairs;
+		result.pairs = start;
+		chainLandmarks(transforms, start.fixed, result.pairs.moving,
+		               max(1, numThreads));
+		if (!hasDirect)
+		{
+			return true;
+		}
+		
+		// Drift of the chain from the direct annotations.
+		double sum = 0.0;
+		double sumSquares = 0.0;
+		double maxDrift = 0.0;
+		result.residuals.resize(start.numPoints);
+		for (int iPoint = 0; iPoint < start.numPoints; iPoint++)
+		{
+			double squared = 0.0;
+			for (int d = 0; d < 3; d++)
+			{
+				double diff = result.pairs.moving[3 * iPoint + d] -
+				              start.moving[3 * iPoint + d];
+				squared += diff * diff;
+			}
+			result.residuals[iPoint] = sqrt(squared);
+			sum += result.residuals[iPoint];
+			sumSquares += squared;
+			maxDrift = max(maxDrift, result.residuals[iPoint]);
+		}
+		if (start.numPoints > 0)
+		{
+			LOG_MESSAGE(LOG_INFO, "pipeline", stage.name, "Drift over " <<
+			            transforms.size() << " intervals and " << start.numPoints <<
+			            " landmarks: mean " << sum / start.numPoints << ", RMS " <<
+			            sqrt(sumSquares / start.numPoints) << ", max " << maxDrift);
+		}
+		return true;
+	}
+	
+	// Residual of each landmark under the transform of the last input.
+	if (stage.type == "residuals")
+	{
+		const PipelineData &fitted = *inputs.back();
+		if (!fitted.hasTransform || pairs.moving.empty())
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+			            " requires landmark pairs and a fitted transform");
+			return false;
+		}
+		
+		result.pairs = pairs;
+		
+		// The transform is passed on, so its bending energy can be reported.
+		result.hasTransform = true;
+		result.transform = fitted.transform;
+		
+		// Leave-one-out residuals need the spline of these very landmarks.
+		if (((param = jsonMember(stage.params, "mode")) != NULL) &&
+		    (param->text == "loo"))
+		{
+			if ((fitted.transform.numPoints != pairs.numPoints) ||
+			    !equal(pairs.fixed.begin(), pairs.fixed.end(),
+			           fitted.transform.sources.begin()))
+			{
+				LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+				            ": leave-one-out residuals require the transform"
+				            " fitted to its landmarks");
+				return false;
+			}
+			if (!leaveOneOutResiduals(fitted.transform, result.residuals,
+			                          thread::hardware_concurrency()))
+			{
+				LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+				            ": landmarks cannot be left out of the spline");
+				return false;
+			}
+			return true;
+		}
+		
+		result.residuals.resize(pairs.numPoints);
+		for (int iPoint = 0; iPoint < pairs.numPoints; iPoint++)
+		{
+			double mapped[3];
+			evaluateSplineTransform(fitted.transform, &pairs.fixed[iPoint * 3],
+			                        mapped);
+			double dx = mapped[0] - pairs.moving[iPoint * 3];
+			double dy = mapped[1] - pairs.moving[iPoint * 3 + 1];
+			double dz = mapped[2] - pairs.moving[iPoint * 3 + 2];
+			result.residuals[iPoint] = sqrt(dx * dx + dy * dy + dz * dz);
+		}
+		return true;
+	}
+	
+	// Writes the input with one of the existing writers.
+	if (stage.type == "write")
+	{
+		string pathInput = getStageInput(spec, stage);
+		string pathOutput = jsonMember(spec, "out_dir")->text;
+		string format;
+		if ((param = jsonMember(stage.params, "format")) != NULL)
+		{
+			format = param->text;
+		}
+		bool hasMoving = !pairs.moving.empty();
+		int writeThreads = 1;
+		if ((param = jsonMember(stage.params, "write_threads")) != NULL)
+		{
+			writeThreads = max(1, (int)param->number);
+		}
+		
+		if (format == "tfx_lmk" && hasMoving)
+		{
+			writeLandmarksTransformix(pairs, pathInput, pathOutput, writeThreads,
+			                          NULL);
+		}
+		else if (format == "slr_fid")
+		{
+			writeLandmarksSlicer(pairs, pathInput, pathOutput, true, writeThreads,
+			                     NULL);
+			if (hasMoving)
+			{
+				writeLandmarksSlicer(pairs, pathInput, pathOutput, false,
+				                     writeThreads, NULL);
+			}
+		}
+		else if (format == "std_txt")
+		{
+			// The files are elastix point sets, which take no extra column,
+			// so energies of a fitted input go to res_txt and energy_json.
+			writeLandmarksText(pairs, pathInput, pathOutput, true, NULL);
+			if (hasMoving)
+			{
+				writeLandmarksText(pairs, pathInput, pathOutput, false, NULL);
+			}
+		}
+		else if (format == "vtk_vtp")
+		{
+			bool compress = false;
+#ifdef LMK_USE_ZLIB
+			compress = ((param = jsonMember(stage.params, "zlib")) != NULL) &&
+			           (param->number != 0);
+#endif
+			bool sampleIntensity =
+			         ((param = jsonMember(stage.params, "intensity")) != NULL) &&
+			         (param->number != 0);
+			if (!writeLandmarksVtk(pairs, pathInput, pathOutput, true, compress,
+			                       sampleIntensity, NULL) ||
+			    (hasMoving &&
+			     !writeLandmarksVtk(pairs, pathInput, pathOutput, false, compress,
+			                        sampleIntensity, NULL)))
+			{
+				return false;
+			}
+		}
+		else if ((format == "img_mhd") && hasMoving)
+		{
+			int mode = RESAMPLE_WARP;
+			if ((param = jsonMember(stage.params, "mode")) != NULL)
+			{
+				mode = parseResampleMode(param->text);
+			}
+			if (mode < 0)
+			{
+				LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+				            ": unexpected resample mode '" << param->text << "'");
+				return false;
+			}
+			
+			// A spline fitted by the input stage is used as it is.
+			const SplineTransform *fitted = inputs[0]->hasTransform ?
+			                                &inputs[0]->transform : NULL;
+			if (!resampleImage(pairs, fitted, mode, pathInput, pathOutput,
+			                   writeThreads))
+			{
+				return false;
+			}
+		}
+		else if ((format == "res_txt") &&
+		         ((int)inputs[0]->residuals.size() == pairs.numPoints))
+		{
+			// Energies are written when the transform is of these landmarks.
+			vector<double> energies;
+			vector<double> leverages;
+			if (inputs[0]->hasTransform &&
+			    (inputs[0]->transform.numPoints == pairs.numPoints))
+			{
+				computeBendingEnergy(inputs[0]->transform, energies, leverages);
+			}
+			writeResiduals(pairs, inputs[0]->residuals, energies, pathInput,
+			               pathOutput);
+		}
+		else if ((format == "energy_json") && inputs[0]->hasTransform &&
+		         (inputs[0]->transform.numPoints == pairs.numPoints))
+		{
+			if (!writeBendingEnergy(pairs, inputs[0]->transform, pathInput,
+			                        pathOutput))
+			{
+				return false;
+			}
+		}
+		else if ((format == "res_mhd") &&
+		         ((int)inputs[0]->residuals.size() == pairs.numPoints))
+		{
+			if (!writeResidualMap(pairs, inputs[0]->residuals, stage.params,
+			                      pathInput, pathOutput, writeThreads))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Stage " << stage.name <<
+			            ": cannot write format '" << format << "' from its input");
+			return false;
+		}
+		
+		result.pairs = pairs;
+		return true;
+	}
+	
+	LOG_MESSAGE(LOG_ERROR, "pipeline", "", "Unexpected stage type: " << stage.type);
+	return false;
+	
+} // end runPipelineStage
+
+
+//**************************************************************
+// Function getStageInput is defined.                          *
+// The function returns the input file of a pipeline stage:    *
+// its own "input" if given, or else the spec's. Convert       *
+// stages read it; write stages name their outputs after it.   *
+//**************************************************************
+
+string getStageInput(const JsonValue &spec, const PipelineStage &stage)
+{
+	const JsonValue *input = jsonMember(stage.params, "input");
+	if ((input != NULL) && (input->type == JSON_STRING))
+	{
+		return input->text;
+	}
+	
+	return jsonMember(spec, "input")->text;
+	
+} // end getStageInput
+
+
+//**************************************************************
+// Function chainLandmarks is defined.                         *
+// The function maps each point through every transform in     *
+// turn. The points are split into a range per thread, each    *
+// range passing through all the transforms.                   *
+//**************************************************************
+
+void chainLandmarks(const vector<const SplineTransform *> &transforms,
+                    const vector<double> &points, vector<double> &mapped,
+                    int numThreads)
+{
+	int numPoints = points.size() / 3;
+	numThreads = max(1, min(numThreads, numPoints));
+	mapped.resize(points.size());
+	
+	vector<thread> workers;
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		int first = (long long)numPoints * iThread / numThreads;
+		int last = (long long)numPoints * (iThread + 1) / numThreads;
+		workers.push_back(thread([&transforms, &points, &mapped, first, last]()
+		{
+			for (int iPoint = first; iPoint < last; iPoint++)
+			{
+				double point[3] = {points[3 * iPoint], points[3 * iPoint + 1],
+				                   points[3 * iPoint + 2]};
+				for (size_t iTransform = 0; iTransform < transforms.size();
+				     iTransform++)
+				{
+					double next[3];
+					evaluateSplineTransform(*transforms[iTransform], point, next);
+					copy(next, next + 3, point);
+				}
+				copy(point, point + 3, &mapped[3 * iPoint]);
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+	
+} // end chainLandmarks
+
+
+//**************************************************************
+// Function runPipeline is defined.                            *
+// The function reads a pipeline spec and runs its stages as a *
+// dependency graph. Stages whose inputs are complete run      *
+// concurrently, passing their results in memory. Each result  *
+// is keyed by a hash of the stage and its inputs' keys, so    *
+// with a cache directory only stages that changed, or depend  *
+// on one that did, are run again.                             *
+//**************************************************************
+
+int runPipeline(string pathSpec)
+{
+	
+/*-----------------------------------------------------------------------------
+////////////////////////////   Read Pipeline Spec   ///////////////////////////
+-----------------------------------------------------------------------------*/
+
+	LogTimer pipelineTimer("pipeline", pathSpec);
+	
+	ifstream specFile(pathSpec.c_str());
+	if (!specFile.is_open())
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec, "Failed to open pipeline spec");
+		return EXIT_FAILURE;
+	}
+	string specText((istreambuf_iterator<char>(specFile)),
+	                istreambuf_iterator<char>());
+	specFile.close();
+	
+	JsonValue spec;
+	if (!parseJson(specText, spec) || (spec.type != JSON_OBJECT))
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+		            "Pipeline spec is not a valid JSON object");
+		return EXIT_FAILURE;
+	}
+	
+	// The spec may set its own log level.
+	const JsonValue *levelName = jsonMember(spec, "log_level");
+	if ((levelName != NULL) &&
+	    ((levelName->type != JSON_STRING) || (parseLogLevel(levelName->text) < 0)))
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+		            "Unexpected log level; options are quiet, error, warn, info, debug");
+		return EXIT_FAILURE;
+	}
+	if ((levelName != NULL) && (logLevel.load() != LOG_QUIET))
+	{
+		logLevel.store(parseLogLevel(levelName->text));
+	}
+	
+	const char *REQUIRED[] = {"input", "in_type", "out_dir"};
+	for (int iKey = 0; iKey < 3; iKey++)
+	{
+		const JsonValue *value = jsonMember(spec, REQUIRED[iKey]);
+		if ((value == NULL) || (value->type != JSON_STRING))
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+			            "Pipeline spec requires \"" << REQUIRED[iKey] << "\"");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	const JsonValue *stageList = jsonMember(spec, "stages");
+	if ((stageList == NULL) || (stageList->type != JSON_ARRAY))
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+		            "Pipeline spec requires a \"stages\" array");
+		return EXIT_FAILURE;
+	}
+	
+	// Stages are gathered and their inputs resolved by name.
+	vector<PipelineStage> stages(stageList->items.size());
+	map<string, int> stageIndex;
+	
+	for (size_t iStage = 0; iStage < stages.size(); iStage++)
+	{
+		const JsonValue &item = stageList->items[iStage];
+		const JsonValue *name = jsonMember(item, "name");
+		const JsonValue *type = jsonMember(item, "type");
+		
+		if ((name == NULL) || (type == NULL) || stageIndex.count(name->text))
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+			            "Each stage requires a unique \"name\" and a \"type\"");
+			return EXIT_FAILURE;
+		}
+		
+		stages[iStage].name = name->text;
+		stages[iStage].type = type->text;
+		stageIndex[name->text] = iStage;
+		
+		// Parameters exclude the stage name and wiring.
+		stages[iStage].params.type = JSON_OBJECT;
+		for (size_t iKey = 0; iKey < item.keys.size(); iKey++)
+		{
+			if ((item.keys[iKey] != "name") && (item.keys[iKey] != "inputs"))
+			{
+				stages[iStage].params.keys.push_back(item.keys[iKey]);
+				stages[iStage].params.items.push_back(item.items[iKey]);
+			}
+		}
+	}
+	
+	for (size_t iStage = 0; iStage < stages.size(); iStage++)
+	{
+		const JsonValue *inputs = jsonMember(stageList->items[iStage], "inputs");
+		if (inputs == NULL)
+		{
+			continue;
+		}
+		
+		for (size_t iInput = 0; iInput < inputs->items.size(); iInput++)
+		{
+			map<string, int>::iterator found =
+			                        stageIndex.find(inputs->items[iInput].text);
+			if (found == stageIndex.end())
+			{
+				LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec, "Stage " <<
+				            stages[iStage].name << " has unknown input: " <<
+				            inputs->items[iInput].text);
+				return EXIT_FAILURE;
+			}
+			stages[iStage].inputs.push_back(found->second);
+			stages[found->second].dependents.push_back(iStage);
+		}
+	}
+	
+	// Graph is checked for cycles by removing stages in dependency order.
+	vector<int> numWaiting(stages.size());
+	queue<int> ready;
+	for (size_t iStage = 0; iStage < stages.size(); iStage++)
+	{
+		numWaiting[iStage] = stages[iStage].inputs.size();
+		if (numWaiting[iStage] == 0)
+		{
+			ready.push(iStage);
+		}
+	}
+	{
+		vector<int> numLeft = numWaiting;
+		queue<int> order = ready;
+		size_t numOrdered = 0;
+		while (!order.empty())
+		{
+			int iStage = order.front();
+			order.pop();
+			numOrdered++;
+			for (size_t iDep = 0; iDep < stages[iStage].dependents.size(); iDep++)
+			{
+				if (--numLeft[stages[iStage].dependents[iDep]] == 0)
+				{
+					order.push(stages[iStage].dependents[iDep]);
+				}
+			}
+		}
+		if (numOrdered != stages.size())
+		{
+			LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec,
+			            "Pipeline stages contain a cycle");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	string pathRules;
+	if (jsonMember(spec, "remap_rules") != NULL)
+	{
+		pathRules = jsonMember(spec, "remap_rules")->text;
+	}
+	if (!compileRemapRules(pathRules, pathRemapper))
+	{
+		LOG_MESSAGE(LOG_ERROR, "remap", pathRules, "Failed to read remap rules");
+		return EXIT_FAILURE;
+	}
+	
+	// Results are cached on disk when a cache directory is given.
+	string cacheDir;
+	ConversionCache *cache = NULL;
+	if (jsonMember(spec, "cache_dir") != NULL)
+	{
+		cacheDir = jsonMember(spec, "cache_dir")->text;
+		mkdir(cacheDir.c_str(), 0755);
+		cache = new ConversionCache;
+		cache->dir = cacheDir;
+	}
+	
+	int numThreads = thread::hardware_concurrency();
+	if (jsonMember(spec, "threads") != NULL)
+	{
+		numThreads = (int)jsonMember(spec, "threads")->number;
+	}
+	numThreads = max(1, min(numThreads, (int)stages.size()));
+	
+/*-----------------------------------------------------------------------------
+//////////////////////////////   Run Stages   /////////////////////////////////
+-----------------------------------------------------------------------------*/
+
+	vector<PipelineData> results(stages.size());
+	vector<uint64_t> keys(stages.size());
+	size_t numRemaining = stages.size();
+	bool failed = false;
+	mutex lock;
+	condition_variable stageDone;
+	
+	// Key of the input file, shared by every convert stage.
+	ConverterOptions options;
+	options.inputType = jsonMember(spec, "in_type")->text;
+	options.pathOutput = jsonMember(spec, "out_dir")->text;
+	options.cache = NULL;
+	options.journal = NULL;
+	options.cohort = NULL;
+	options.catalog = NULL;
+	options.vtpZlib = false;
+	options.vtpIntensity = false;
+	options.writeThreads = 1;
+	options.resampleMode = RESAMPLE_WARP;
+	options.cropMargin = -1;
+	options.outputQueue = NULL;
+	if (jsonMember(spec, "ref_image") != NULL)
+	{
+		options.pathRefImage = jsonMember(spec, "ref_image")->text;
+	}
+	uint64_t inputKey = getCacheKey(jsonMember(spec, "input")->text, options);
+	
+	// Convert stages naming their own input are keyed on that file.
+	vector<uint64_t> inputKeys(stages.size(), inputKey);
+	for (size_t iStage = 0; iStage < stages.size(); iStage++)
+	{
+		if ((stages[iStage].type == "convert") &&
+		    (jsonMember(stages[iStage].params, "input") != NULL))
+		{
+			inputKeys[iStage] = getCacheKey(getStageInput(spec, stages[iStage]),
+			                                options);
+		}
+	}
+	
+	vector<thread> workers;
+	for (int iThread = 0; iThread < numThreads; iThread++)
+	{
+		workers.push_back(thread([&]()
+		{
+			unique_lock<mutex> guard(lock);
+			while (true)
+			{
+				while (ready.empty() && (numRemaining > 0) && !failed)
+				{
+					stageDone.wait(guard);
+				}
+				if (ready.empty() || failed)
+				{
+					break;
+				}
+				
+				int iStage = ready.front();
+				ready.pop();
+				const PipelineStage &stage = stages[iStage];
+				
+				// Key covers the stage's parameters and its inputs' keys.
+				string keyText = stage.type + "|" + jsonText(stage.params);
+				vector<const PipelineData *> inputs;
+				uint64_t key = hashBytes(keyText.data(), keyText.length(), 0);
+				if (stage.type == "convert")
+				{
+					key = hashBytes((const char *)&inputKeys[iStage],
+					                sizeof(uint64_t), key);
+				}
+				for (size_t iInput = 0; iInput < stage.inputs.size(); iInput++)
+				{
+					key = hashBytes((const char *)&keys[stage.inputs[iInput]],
+					                sizeof(uint64_t), key);
+					inputs.push_back(&results[stage.inputs[iInput]]);
+				}
+				keys[iStage] = key;
+				guard.unlock();
+				
+				char keyName[17];
+				snprintf(keyName, sizeof(keyName), "%016llx",
+				         (unsigned long long)key);
+				string pathResult = cacheDir + "/" + keyName + ".stage";
+				
+				bool success = true;
+				CacheEntry entry;
+				
+				// Resampled, cropped and residual images, and sampled
+				// intensities, are not cached, as for conversions.
+				ConversionCache *stageCache = cache;
+				const JsonValue *format = jsonMember(stage.params, "format");
+				const JsonValue *intensity = jsonMember(stage.params, "intensity");
+				if (((format != NULL) && ((format->text == "img_mhd") ||
+				                          (format->text == "res_mhd"))) ||
+				    ((intensity != NULL) && (intensity->number != 0)) ||
+				    (stage.type == "crop"))
+				{
+					stageCache = NULL;
+				}
+				
+				if ((stageCache != NULL) && (stage.type == "write") &&
+				    cacheLookup(*cache, key, entry) &&
+				    cacheRestore(*cache, key, entry, options.pathOutput))
+				{
+					LOG_MESSAGE(LOG_INFO, "pipeline", stage.name, "Up to date");
+				}
+				else if ((stageCache != NULL) && (stage.type != "write") &&
+				         loadPipelineData(pathResult, results[iStage]))
+				{
+					LOG_MESSAGE(LOG_INFO, "pipeline", stage.name,
+					            "Loaded from cache");
+				}
+				else
+				{
+					LogTimer stageTimer("pipeline", stage.name);
+					
+					success = runPipelineStage(spec, stage, inputs,
+					                           results[iStage]);
+					
+					if (success && (stageCache != NULL) && (stage.type != "write"))
+					{
+						savePipelineData(pathResult, results[iStage]);
+					}
+					else if (success && (stageCache != NULL))
+					{
+						// Resampled images are not cached, so their mode
+						// does not matter here.
+						vector<string> outputPaths = getFormatOutputPaths(
+						    getStageInput(spec, stage), options.pathOutput,
+						    format->text, !results[iStage].pairs.moving.empty(),
+						    RESAMPLE_WARP);
+						cacheStore(*cache, key, outputPaths, options.pathOutput);
+					}
+				}
+				
+				guard.lock();
+				if (!success)
+				{
+					failed = true;
+				}
+				for (size_t iDep = 0; iDep < stage.dependents.size(); iDep++)
+				{
+					if (--numWaiting[stage.dependents[iDep]] == 0)
+					{
+						ready.push(stage.dependents[iDep]);
+					}
+				}
+				numRemaining--;
+				stageDone.notify_all();
+			}
+		}));
+	}
+	for (size_t iThread = 0; iThread < workers.size(); iThread++)
+	{
+		workers[iThread].join();
+	}
+	
+	delete cache;
+	reportRemapHits();
+	
+	if (failed)
+	{
+		LOG_MESSAGE(LOG_ERROR, "pipeline", pathSpec, "Pipeline failed");
+		return EXIT_FAILURE;
+	}
+	
+	return EXIT_SUCCESS;
+	
+} // end runPipeline
+
+
+//**************************************************************
+// Function openCohort is defined.                             *
+// The function creates a cohort landmark file. The file is a  *
+// magic string, one row group per case, a JSON footer which   *
+// describes the columns and row groups, the footer's offset   *
+// and the magic string again. Each column of a row group is   *
+// stored contiguously, little-endian and 8-byte aligned, so   *
+// readers can memory-map the file and scan single columns.    *
+// Returns NULL on failure.                                    *
+//**************************************************************
+
+// Magic string at both ends of a cohort file.
+const char COHORT_MAGIC[] = "LMKCOL01";
+const int COHORT_NUM_COLUMNS = 9;
+
+// Names, column types and byte widths of the coordinate storages.
+const char *COHORT_STORAGE_NAMES[NUM_COHORT_STORAGES] = {"float64", "float32",
+    "fixed", "voxel16", "voxel32"};
+const char *COHORT_STORAGE_TYPES[NUM_COHORT_STORAGES] = {"float64", "float32",
+    "int32", "int16", "int32"};
+const size_t COHORT_STORAGE_WIDTHS[NUM_COHORT_STORAGES] = {8, 4, 4, 2, 4};
+
+CohortWriter *openCohort(string pathCohort, int storage, double resolution)
+{
+	int fd = open(pathCohort.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	
+	if (pwrite(fd, COHORT_MAGIC, 8, 0) != 8)
+	{
+		close(fd);
+		return NULL;
+	}
+	
+	CohortWriter *cohort = new CohortWriter;
+	cohort->fd = fd;
+	cohort->storage = storage;
+	cohort->resolution = resolution;
+	cohort->endOffset = 8;
+	
+	return cohort;
+	
+} // end openCohort
+
+
+//**************************************************************
+// Function cohortAppend is defined.                           *
+// The function writes the landmarks of one case as a row      *
+// group. Its columns are laid out in a private buffer and     *
+// written at an offset reserved atomically, so concurrent     *
+// cases only share a lock to register their metadata. The     *
+// case is named in the dictionary only once its row group is  *
+// written. Returns false if the coordinates cannot be stored  *
+// within the error bound of the cohort's storage.             *
+//**************************************************************
+
+bool cohortAppend(CohortWriter &cohort, string caseName, const LandmarkPairs &pairs)
+{
+	uint64_t numRows = pairs.numPoints;
+	bool hasMoving = !pairs.moving.empty();
+	
+	// Byte widths of the columns: case, point, fixed xyz, moving xyz, flags.
+	const size_t COORD = COHORT_STORAGE_WIDTHS[cohort.storage];
+	const size_t WIDTHS[COHORT_NUM_COLUMNS] = {4, 4, COORD, COORD, COORD,
+	                                           COORD, COORD, COORD, 1};
+	
+	// Voxel indices need the voxel spacing of the case's image.
+	bool voxels = (cohort.storage == STORAGE_VOXEL16) ||
+	              (cohort.storage == STORAGE_VOXEL32);
+	if (voxels && ((pairs.spacings[0] <= 0) || (pairs.spacings[1] <= 0) ||
+	               (pairs.spacings[2] <= 0)))
+	{
+		LOG_MESSAGE(LOG_ERROR, "cohort", caseName, "Landmarks without an image "
+		            "geometry cannot be stored as " <<
+		            COHORT_STORAGE_NAMES[cohort.storage]);
+		return false;
+	}
+	
+	CohortRowGroup rowGroup;
+	rowGroup.numRows = numRows;
+	rowGroup.hasMoving = hasMoving;
+	rowGroup.maxError = 0;
+	
+	// Coordinates are widened back as value * scale + origin.
+	for (int d = 0; d < 3; d++)
+	{
+		rowGroup.scales[d] = voxels ? pairs.spacings[d] :
+		    ((cohort.storage == STORAGE_FIXED) ? cohort.resolution : 1.0);
+		rowGroup.origins[d] = voxels ? pairs.offsets[d] : 0.0;
+	}
+	
+	vector<uint64_t> localOffsets(COHORT_NUM_COLUMNS);
+	uint64_t size = 0;
+	for (int iCol = 0; iCol < COHORT_NUM_COLUMNS; iCol++)
+	{
+		localOffsets[iCol] = size;
+		size += (WIDTHS[iCol] * numRows + 7) & ~(uint64_t)7;
+	}
+	
+	vector<char> buffer(size, 0);
+	int32_t *pointColumn = (int32_t *)&buffer[localOffsets[1]];
+	unsigned char *flagColumn = (unsigned char *)&buffer[localOffsets[8]];
+	
+	for (uint64_t iRow = 0; iRow < numRows; iRow++)
+	{
+		pointColumn[iRow] = pairs.pointIds[iRow];
+		flagColumn[iRow] = pairs.flags[iRow];
+	}
+	
+	// Landmarks are stored z,y,x; columns are x,y,z. Missing moving
+	// landmarks are NaN, or 0 in integer storage.
+	vector<double> values(numRows);
+	for (int iCol = 2; iCol < 8; iCol++)
+	{
+		int d = (iCol - 2) % 3;
+		const vector<double> &coords = (iCol < 5) ? pairs.fixed : pairs.moving;
+		if ((iCol >= 5) && !hasMoving)
+		{
+			if (cohort.storage == STORAGE_FLOAT64)
+			{
+				fill((double *)&buffer[localOffsets[iCol]],
+				     (double *)&buffer[localOffsets[iCol]] + numRows, NAN);
+			}
+			else if (cohort.storage == STORAGE_FLOAT32)
+			{
+				fill((float *)&buffer[localOffsets[iCol]],
+				     (float *)&buffer[localOffsets[iCol]] + numRows, NAN);
+			}
+			continue;
+		}
+		
+		for (uint64_t iRow = 0; iRow < numRows; iRow++)
+		{
+			values[iRow] = coords[iRow * 3 + (2 - d)];
+		}
+		double maxError = 0;
+		if (!quantizeCoordinates(values, cohort.storage, rowGroup.scales[d],
+		                         rowGroup.origins[d], &buffer[localOffsets[iCol]],
+		                         maxError))
+		{
+			LOG_MESSAGE(LOG_ERROR, "cohort", caseName, "Landmarks cannot be "
+			            "stored as " << COHORT_STORAGE_NAMES[cohort.storage] <<
+			            " within their error bound");
+			return false;
+		}
+		rowGroup.maxError = max(rowGroup.maxError, maxError);
+	}
+	
+	// Space is reserved without locking and written independently,
+	// all but the case column, which needs the case's index.
+	uint64_t offset = cohort.endOffset.fetch_add(size);
+	if (!writeAt(cohort.fd, &buffer[localOffsets[1]], size - localOffsets[1],
+	             offset + localOffsets[1]))
+	{
+		return false;
+	}
+	
+	for (int iCol = 0; iCol < COHORT_NUM_COLUMNS; iCol++)
+	{
+		rowGroup.columnOffsets.push_back(offset + localOffsets[iCol]);
+	}
+	
+	// Case is registered in the dictionary of case names, with its row
+	// group, once its case column is written too.
+	lock_guard<mutex> guard(cohort.lock);
+	rowGroup.caseIndex = cohort.cases.size();
+	uint32_t *caseColumn = (uint32_t *)&buffer[localOffsets[0]];
+	fill(caseColumn, caseColumn + numRows, rowGroup.caseIndex);
+	if (!writeAt(cohort.fd, &buffer[localOffsets[0]], localOffsets[1],
+	             offset + localOffsets[0]))
+	{
+		return false;
+	}
+	cohort.cases.push_back(caseName);
+	cohort.rowGroups.push_back(rowGroup);
+	
+	return true;
+	
+} // end cohortAppend
+
+
+//**************************************************************
+// Function parseCohortStorage is defined.                     *
+// The function returns the cohort storage of the given name,  *
+// or -1 if the name is not recognized.                        *
+//**************************************************************
+
+int parseCohortStorage(string name)
+{
+	for (int iStorage = 0; iStorage < NUM_COHORT_STORAGES; iStorage++)
+	{
+		if (name == COHORT_STORAGE_NAMES[iStorage])
+		{
+			return iStorage;
+		}
+	}
+	
+	return -1;
+	
+} // end parseCohortStorage
+
+
+//**************************************************************
+// Function quantizeCoordinates is defined.                    *
+// The function stores one column of coordinates in the given  *
+// storage as (value - origin) / scale, then widens the stored *
+// column again and checks every coordinate against its bound: *
+// half a ulp of float for float32, half the resolution for    *
+// fixed and rounding only for voxel indices, which must lie   *
+// on the grid of the case. Returns false if a coordinate is   *
+// out of range or beyond its bound, else sets maxError.       *
+//**************************************************************
+
+bool quantizeCoordinates(const vector<double> &values, int storage, double scale,
+                         double origin, char *column, double &maxError)
+{
+	size_t count = values.size();
+	for (size_t i = 0; i < count; i++)
+	{
+		double quotient = (values[i] - origin) / scale;
+		
+		if (storage == STORAGE_FLOAT64)
+		{
+			memcpy(column + i * 8, &values[i], 8);
+		}
+		else if (storage == STORAGE_FLOAT32)
+		{
+			float value = (float)values[i];
+			memcpy(column + i * 4, &value, 4);
+		}
+		else if (storage == STORAGE_VOXEL16)
+		{
+			quotient = floor(quotient + 0.5);
+			if (!(fabs(quotient) <= 32767))
+			{
+				return false;
+			}
+			int16_t value = (int16_t)quotient;
+			memcpy(column + i * 2, &value, 2);
+		}
+		else
+		{
+			quotient = floor(quotient + 0.5);
+			if (!(fabs(quotient) <= 2147483647.0))
+			{
+				return false;
+			}
+			int32_t value = (int32_t)quotient;
+			memcpy(column + i * 4, &value, 4);
+		}
+	}
+	
+	// Stored values are checked as readers will see them.
+	vector<double> widened(count);
+	widenCoordinates(column, storage, count, scale, origin, widened.data());
+	
+	maxError = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (isnan(values[i]) && isnan(widened[i]))
+		{
+			continue;
+		}
+		
+		double error = fabs(widened[i] - values[i]);
+		double bound = ldexp(fabs(values[i]) + fabs(origin), -50);
+		if (storage == STORAGE_FLOAT32)
+		{
+			bound = ldexp(fabs(values[i]), -24) + ldexp(1.0, -149);
+		}
+		else if (storage == STORAGE_FIXED)
+		{
+			bound += 0.5 * scale;
+		}
+		
+		if (!(error <= bound))
+		{
+			return false;
+		}
+		maxError = max(maxError, error);
+	}
+	
+	return true;
+	
+} // end quantizeCoordinates
+
+
+//**************************************************************
+// Function widenCoordinates is defined.                       *
+// The function widens count stored coordinates to physical    *
+// coordinates, value * scale + origin, several at a time      *
+// with the selected instruction set. Every instruction set    *
+// rounds the product and the sum separately, giving the same  *
+// coordinates.                                                *
+//**************************************************************
+
+void widenCoordinates(const char *column, int storage, size_t count, double scale,
+                      double origin, double *widened)
+{
+	size_t i = 0;
+	
+#ifdef LMK_X86
+	if (isaLevel >= ISA_AVX512)
+	{
+		i = widenCoordinatesAvx512(column, storage, count, scale, origin, widened);
+	}
+	else if (isaLevel >= ISA_AVX2)
+	{
+		i = widenCoordinatesAvx2(column, storage, count, scale, origin, widened);
+	}
+	else if (isaLevel >= ISA_SSE2)
+	{
+		i = widenCoordinatesSse2(column, storage, count, scale, origin, widened);
+	}
+#endif
+	
+	// Remaining coordinates are widened one at a time.
+	for (; i < count; i++)
+	{
+		double value;
+		if (storage == STORAGE_FLOAT64)
+		{
+			memcpy(&value, column + i * 8, 8);
+		}
+		else if (storage == STORAGE_FLOAT32)
+		{
+			float single;
+			memcpy(&single, column + i * 4, 4);
+			value = single;
+		}
+		else if (storage == STORAGE_VOXEL16)
+		{
+			int16_t index;
+			memcpy(&index, column + i * 2, 2);
+			value = index;
+		}
+		else
+		{
+			int32_t index;
+			memcpy(&index, column + i * 4, 4);
+			value = index;
+		}
+		widened[i] = value * scale + origin;
+	}
+	
+} // end widenCoordinates
+
+
+#ifdef LMK_X86
+//**************************************************************
+// Function widenCoordinatesAvx512 is defined.                 *
+// The function widens coordinates as widenCoordinates, eight  *
+// at a time with AVX-512. Returns the number widened.         *
+//**************************************************************
+
+LMK_TARGET("avx512f")
+size_t widenCoordinatesAvx512(const char *column, int storage, size_t count,
+                              double scale, double origin, double *widened)
+{
+	size_t i = 0;
+	
+	const __m512d scales = _mm512_set1_pd(scale);
+	const __m512d origins = _mm512_set1_pd(origin);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m512d values;
+		if (storage == STORAGE_FLOAT64)
+		{
+			values = _mm512_loadu_pd((const double *)(column + i * 8));
+		}
+		else if (storage == STORAGE_FLOAT32)
+		{
+			values = _mm512_cvtps_pd(_mm256_loadu_ps((const float *)(column + i * 4)));
+		}
+		else if (storage == STORAGE_VOXEL16)
+		{
+			__m128i shorts = _mm_loadu_si128((const __m128i *)(column + i * 2));
+			values = _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(shorts));
+		}
+		else
+		{
+			values = _mm512_cvtepi32_pd(
+			             _mm256_loadu_si256((const __m256i *)(column + i * 4)));
+		}
+		_mm512_storeu_pd(widened + i,
+		                 _mm512_add_pd(_mm512_mul_pd(values, scales), origins));
+	}
+	
+	return i;
+	
+} // end widenCoordinatesAvx512
+
+
+//**************************************************************
+// Function widenCoordinatesAvx2 is defined.                   *
+// The function widens coordinates as widenCoordinates, four   *
+// at a time with AVX2. Returns the number widened.            *
+//**************************************************************
+
+LMK_TARGET("avx2")
+size_t widenCoordinatesAvx2(const char *column, int storage, size_t count,
+                            double scale, double origin, double *widened)
+{
+	size_t i = 0;
+	
+	const __m256d scales = _mm256_set1_pd(scale);
+	const __m256d origins = _mm256_set1_pd(origin);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256d values;
+		if (storage == STORAGE_FLOAT64)
+		{
+			values = _mm256_loadu_pd((const double *)(column + i * 8));
+		}
+		else if (storage == STORAGE_FLOAT32)
+		{
+			values = _mm256_cvtps_pd(_mm_loadu_ps((const float *)(column + i * 4)));
+		}
+		else if (storage == STORAGE_VOXEL16)
+		{
+			__m128i shorts = _mm_loadl_epi64((const __m128i *)(column + i * 2));
+			values = _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(shorts));
+		}
+		else
+		{
+			values = _mm256_cvtepi32_pd(
+			             _mm_loadu_si128((const __m128i *)(column + i * 4)));
+		}
+		_mm256_storeu_pd(widened + i,
+		                 _mm256_add_pd(_mm256_mul_pd(values, scales), origins));
+	}
+	
+	return i;
+	
+} // end widenCoordinatesAvx2
+
+
+//**************************************************************
+// Function widenCoordinatesSse2 is defined.                   *
+// The function widens coordinates as widenCoordinates, two    *
+// at a time with SSE2. Returns the number widened.            *
+//**************************************************************
+
+LMK_TARGET("sse2")
+size_t widenCoordinatesSse2(const char *column, int storage, size_t count,
+                            double scale, double origin, double *widened)
+{
+	size_t i = 0;
+	
+	const __m128d scales = _mm_set1_pd(scale);
+	const __m128d origins = _mm_set1_pd(origin);
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128d values;
+		if (storage == STORAGE_FLOAT64)
+		{
+			values = _mm_loadu_pd((const double *)(column + i * 8));
+		}
+		else if (storage == STORAGE_FLOAT32)
+		{
+			values = _mm_cvtps_pd(_mm_castsi128_ps(
+			             _mm_loadl_epi64((const __m128i *)(column + i * 4))));
+		}
+		else if (storage == STORAGE_VOXEL16)
+		{
+			int32_t shortPair;
+			memcpy(&shortPair, column + i * 2, 4);
+			__m128i shorts = _mm_cvtsi32_si128(shortPair);
+			values = _mm_cvtepi32_pd(_mm_srai_epi32(
+			             _mm_unpacklo_epi16(shorts, shorts), 16));
+		}
+		else
+		{
+			values = _mm_cvtepi32_pd(
+			             _mm_loadl_epi64((const __m128i *)(column + i * 4)));
+		}
+		_mm_storeu_pd(widened + i, _mm_add_pd(_mm_mul_pd(values, scales), origins));
+	}
+	
+	return i;
+	
+} // end widenCoordinatesSse2
+#endif
+
+
+//**************************************************************
+// Function closeCohort is defined.                            *
+// The function writes the footer of a cohort file and closes  *
+// it. Returns false if the footer could not be written.       *
+//**************************************************************
+
+bool closeCohort(CohortWriter *cohort)
+{
+	const char *NAMES[COHORT_NUM_COLUMNS] = {"case", "point", "fixed_x",
+	    "fixed_y", "fixed_z", "moving_x", "moving_y", "moving_z", "flags"};
+	const char *COORD = COHORT_STORAGE_TYPES[cohort->storage];
+	const char *TYPES[COHORT_NUM_COLUMNS] = {"uint32", "int32", COORD, COORD,
+	    COORD, COORD, COORD, COORD, "uint8"};
+	bool quantized = (cohort->storage != STORAGE_FLOAT64);
+	
+	// Footer describes the layout so the file can be read without this code.
+	// Files of quantized coordinates also give their widening and errors.
+	ostringstream footer;
+	footer.precision(17);
+	footer << "{\"version\":" << (quantized ? 2 : 1);
+	footer << ",\"byte_order\":\"little\"";
+	if (quantized)
+	{
+		footer << ",\"storage\":\"" << COHORT_STORAGE_NAMES[cohort->storage] << "\"";
+		if (cohort->storage == STORAGE_FIXED)
+		{
+			footer << ",\"resolution\":" << cohort->resolution;
+		}
+	}
+	footer << ",\"columns\":[";
+	for (int iCol = 0; iCol < COHORT_NUM_COLUMNS; iCol++)
+	{
+		footer << ((iCol != 0) ? "," : "") << "{\"name\":\"" << NAMES[iCol];
+		footer << "\",\"type\":\"" << TYPES[iCol] << "\"";
+		if (iCol == 0)
+		{
+			footer << ",\"dictionary\":\"cases\"";
+		}
+		footer << "}";
+	}
+	footer << "],\"flags\":{\"ManuallyChosen\":" << (int)FLAG_MANUAL;
+	footer << ",\"VeryUnsure\":" << (int)FLAG_UNSURE;
+	footer << ",\"SystemGuess\":" << (int)FLAG_SYSTEM_GUESS << "},\"cases\":[";
+	for (size_t iCase = 0; iCase < cohort->cases.size(); iCase++)
+	{
+		JsonValue name;
+		name.type = JSON_STRING;
+		name.text = cohort->cases[iCase];
+		footer << ((iCase != 0) ? "," : "") << jsonText(name);
+	}
+	footer << "],\"row_groups\":[";
+	for (size_t iGroup = 0; iGroup < cohort->rowGroups.size(); iGroup++)
+	{
+		const CohortRowGroup &rowGroup = cohort->rowGroups[iGroup];
+		footer << ((iGroup != 0) ? "," : "") << "{\"case\":" << rowGroup.caseIndex;
+		footer << ",\"rows\":" << rowGroup.numRows << ",\"offsets\":[";
+		for (int iCol = 0; iCol < COHORT_NUM_COLUMNS; iCol++)
+		{
+			footer << ((iCol != 0) ? "," : "") << rowGroup.columnOffsets[iCol];
+		}
+		footer << "]";
+		if (quantized)
+		{
+			footer << ",\"has_moving\":" << (rowGroup.hasMoving ? "true" : "false");
+			footer << ",\"scale\":[" << rowGroup.scales[0] << "," <<
+			          rowGroup.scales[1] << "," << rowGroup.scales[2] << "]";
+			footer << ",\"origin\":[" << rowGroup.origins[0] << "," <<
+			          rowGroup.origins[1] << "," << rowGroup.origins[2] << "]";
+			footer << ",\"max_error\":" << rowGroup.maxError;
+		}
+		footer << "}";
+	}
+	footer << "]}";
+	
+	string tail = footer.str();
+	uint64_t footerOffset = cohort->endOffset;
+	tail.append((const char *)&footerOffset, sizeof(footerOffset));
+	tail.append(COHORT_MAGIC, 8);
+	
+	bool success = (pwrite(cohort->fd, tail.data(), tail.length(), footerOffset)
+	                == (ssize_t)tail.length());
+	success = (close(cohort->fd) == 0) && success;
+	delete cohort;
+	
+	return success;
+	
+} // end closeCohort
+
+
+#ifdef LMK_USE_SQLITE
+
+//**************************************************************
+// Function openCatalog is defined.                            *
+// The function opens or creates a SQLite landmark catalog in  *
+// WAL mode and prepares the statements used to load cases.   *
+// Returns NULL on failure.                                    *
+//**************************************************************
+
+// Schema of the landmark catalog. Deleting a case removes its landmarks
+// and their R*-tree entries, so reloading a case replaces it.
+const char CATALOG_SCHEMA[] =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS cases("
+    "  id INTEGER PRIMARY KEY, name TEXT UNIQUE, path TEXT, img_dims TEXT,"
+    "  offset_x REAL, offset_y REAL, offset_z REAL,"
+    "  spacing_x REAL, spacing_y REAL, spacing_z REAL);"
+    "CREATE TABLE IF NOT EXISTS landmarks("
+    "  id INTEGER PRIMARY KEY, case_id INTEGER, point INTEGER,"
+    "  fixed_x REAL, fixed_y REAL, fixed_z REAL,"
+    "  moving_x REAL, moving_y REAL, moving_z REAL,"
+    "  distinctiveness REAL, manual INTEGER, unsure INTEGER,"
+    "  system_guess INTEGER);"
+    "CREATE INDEX IF NOT EXISTS landmarks_case ON landmarks(case_id);"
+    "CREATE INDEX IF NOT EXISTS landmarks_flags"
+    "  ON landmarks(unsure, manual, system_guess);"
+    "CREATE INDEX IF NOT EXISTS landmarks_distinctiveness"
+    "  ON landmarks(distinctiveness);"
+    "CREATE VIRTUAL TABLE IF NOT EXISTS landmarks_rtree USING rtree("
+    "  id, min_x, max_x, min_y, max_y, min_z, max_z);"
+    "CREATE TRIGGER IF NOT EXISTS cases_delete AFTER DELETE ON cases BEGIN"
+    "  DELETE FROM landmarks_rtree WHERE id IN"
+    "    (SELECT id FROM landmarks WHERE case_id = old.id);"
+    "  DELETE FROM landmarks WHERE case_id = old.id;"
+    "END;"
+    "CREATE VIEW IF NOT EXISTS catalog AS SELECT l.id AS id,"
+    "  c.name AS case_name, l.point AS point,"
+    "  l.fixed_x AS fixed_x, l.fixed_y AS fixed_y, l.fixed_z AS fixed_z,"
+    "  l.moving_x AS moving_x, l.moving_y AS moving_y, l.moving_z AS moving_z,"
+    "  l.distinctiveness AS distinctiveness, l.manual AS manual,"
+    "  l.unsure AS unsure, l.system_guess AS system_guess, c.img_dims,"
+    "  c.offset_x, c.offset_y, c.offset_z, c.spacing_x, c.spacing_y,"
+    "  c.spacing_z FROM landmarks l JOIN cases c ON c.id = l.case_id;";
+
+LandmarkCatalog *openCatalog(string pathCatalog)
+{
+	sqlite3 *db;
+	if (sqlite3_open(pathCatalog.c_str(), &db) != SQLITE_OK)
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathCatalog, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	
+	LandmarkCatalog *catalog = new LandmarkCatalog;
+	catalog->db = db;
+	catalog->numPending = 0;
+	
+	bool success =
+	    (sqlite3_exec(db, CATALOG_SCHEMA, NULL, NULL, NULL) == SQLITE_OK) &&
+	    (sqlite3_prepare_v2(db, "DELETE FROM cases WHERE name = ?", -1,
+	                        &catalog->deleteCase, NULL) == SQLITE_OK) &&
+	    (sqlite3_prepare_v2(db, "INSERT INTO cases(name, path, img_dims,"
+	        " offset_x, offset_y, offset_z, spacing_x, spacing_y, spacing_z)"
+	        " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?)", -1,
+	                        &catalog->insertCase, NULL) == SQLITE_OK) &&
+	    (sqlite3_prepare_v2(db, "INSERT INTO landmarks(case_id, point,"
+	        " fixed_x, fixed_y, fixed_z, moving_x, moving_y, moving_z,"
+	        " distinctiveness, manual, unsure, system_guess)"
+	        " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", -1,
+	                        &catalog->insertLandmark, NULL) == SQLITE_OK) &&
+	    (sqlite3_prepare_v2(db, "INSERT INTO landmarks_rtree"
+	        " VALUES(?, ?, ?, ?, ?, ?, ?)", -1,
+	                        &catalog->insertTree, NULL) == SQLITE_OK) &&
+	    (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK);
+	
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathCatalog, sqlite3_errmsg(db));
+		sqlite3_close_v2(db);
+		delete catalog;
+		return NULL;
+	}
+	
+	return catalog;
+	
+} // end openCatalog
+
+
+//**************************************************************
+// Function catalogAdd is defined.                             *
+// The function loads the landmarks of one case into the       *
+// catalog, replacing any earlier load of the same case. The   *
+// transaction is committed every few cases, so a batch costs  *
+// few disk syncs; a case that fails is rolled back alone.     *
+//**************************************************************
+
+bool catalogAdd(LandmarkCatalog &catalog, string caseName, string pathInput,
+                const LandmarkPairs &pairs)
+{
+	// Cases loaded per transaction.
+	const int CATALOG_BATCH = 64;
+	
+	bool hasMoving = !pairs.moving.empty();
+	lock_guard<mutex> guard(catalog.lock);
+	
+	// Each case is loaded under its own savepoint, so a case failing
+	// partway leaves nothing behind for the next commit.
+	bool success = (sqlite3_exec(catalog.db, "SAVEPOINT catalog_case", NULL, NULL,
+	                             NULL) == SQLITE_OK);
+	
+	sqlite3_bind_text(catalog.deleteCase, 1, caseName.c_str(), -1,
+	                  SQLITE_TRANSIENT);
+	success = success && (sqlite3_step(catalog.deleteCase) == SQLITE_DONE);
+	sqlite3_reset(catalog.deleteCase);
+	
+	sqlite3_stmt *insert = catalog.insertCase;
+	sqlite3_bind_text(insert, 1, caseName.c_str(), -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(insert, 2, pathInput.c_str(), -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(insert, 3, pairs.imgDims.c_str(), -1, SQLITE_TRANSIENT);
+	for (int d = 0; d < 3; d++)
+	{
+		sqlite3_bind_double(insert, 4 + d, pairs.offsets[d]);
+		sqlite3_bind_double(insert, 7 + d, pairs.spacings[d]);
+	}
+	success = success && (sqlite3_step(insert) == SQLITE_DONE);
+	sqlite3_reset(insert);
+	sqlite3_int64 caseId = sqlite3_last_insert_rowid(catalog.db);
+	
+	insert = catalog.insertLandmark;
+	for (int iPoint = 0; success && (iPoint < pairs.numPoints); iPoint++)
+	{
+		// Landmarks are stored z,y,x; columns are x,y,z.
+		const double *fixed = &pairs.fixed[iPoint * 3];
+		
+		sqlite3_bind_int64(insert, 1, caseId);
+		sqlite3_bind_int(insert, 2, pairs.pointIds[iPoint]);
+		for (int d = 0; d < 3; d++)
+		{
+			sqlite3_bind_double(insert, 3 + d, fixed[2 - d]);
+			if (hasMoving)
+			{
+				sqlite3_bind_double(insert, 6 + d, pairs.moving[iPoint * 3 + 2 - d]);
+			}
+			else
+			{
+				sqlite3_bind_null(insert, 6 + d);
+			}
+		}
+		sqlite3_bind_double(insert, 9, pairs.distinctiveness[iPoint]);
+		sqlite3_bind_int(insert, 10, (pairs.flags[iPoint] & FLAG_MANUAL) != 0);
+		sqlite3_bind_int(insert, 11, (pairs.flags[iPoint] & FLAG_UNSURE) != 0);
+		sqlite3_bind_int(insert, 12,
+		                 (pairs.flags[iPoint] & FLAG_SYSTEM_GUESS) != 0);
+		success = (sqlite3_step(insert) == SQLITE_DONE);
+		sqlite3_reset(insert);
+		
+		// Fixed position is indexed as a degenerate box.
+		sqlite3_bind_int64(catalog.insertTree, 1, sqlite3_last_insert_rowid(catalog.db));
+		for (int d = 0; d < 3; d++)
+		{
+			sqlite3_bind_double(catalog.insertTree, 2 + 2 * d, fixed[2 - d]);
+			sqlite3_bind_double(catalog.insertTree, 3 + 2 * d, fixed[2 - d]);
+		}
+		success = success && (sqlite3_step(catalog.insertTree) == SQLITE_DONE);
+		sqlite3_reset(catalog.insertTree);
+	}
+	
+	if (!success)
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathInput, sqlite3_errmsg(catalog.db));
+		sqlite3_exec(catalog.db, "ROLLBACK TO catalog_case; RELEASE catalog_case",
+		             NULL, NULL, NULL);
+		return false;
+	}
+	if (sqlite3_exec(catalog.db, "RELEASE catalog_case", NULL, NULL, NULL)
+	    != SQLITE_OK)
+	{
+		LOG_MESSAGE(LOG_ERROR, "catalog", pathInput, sqlite3_errmsg(catalog.db));
+		return false;
+	}
+	
+	if (++catalog.numPending >= CATALOG_BATCH)
+	{
+		catalog.numPending = 0;
+		return (sqlite3_exec(catalog.db, "COMMIT; BEGIN", NULL, NULL, NULL)
+		        == SQLITE_OK);
+	}
+	
+	return true;
+	
+} // end catalogAdd
+
+
+//**************************************************************
+// Function closeCatalog is defined.                           *
+// The function commits the cases still pending and closes the *
+// catalog. Returns false if the commit failed.                *
+//**************************************************************
+
+bool closeCatalog(LandmarkCatalog *catalog)
+{
+	bool success = (sqlite3_exec(catalog->db, "COMMIT", NULL, NULL, NULL)
+	                == SQLITE_OK);
+	
+	sqlite3_finalize(catalog->deleteCase);
+	sqlite3_finalize(catalog->insertCase);
+	sqlite3_finalize(catalog->insertLandmark);
+	sqlite3_finalize(catalog->insertTree);
+	sqlite3_close(catalog->db);
+	delete catalog;
+	
+	return success;
+	
+} // end closeCatalog
+
+
+//**************************************************************
+// Function readLandmarksCatalog is defined.                   *
+// The function reads the landmarks matching a query from a    *
+// landmark catalog. The query is an SQL condition over the    *
+// columns of the catalog view; a neighbourhood "x,y,z,r" is   *
+// looked up through the R*-tree before the exact distance is  *
+// checked. The image geometry is taken from the first case.   *
+// A selection of cases with and without moving landmarks is   *
+// refused.                                                    *
+//**************************************************************
+
+LandmarkPairs readLandmarksCatalog(string pathCatalog, string query, string near)
+{
+	LandmarkPairs pairs;
+	pairs.numPoints = 0;
+	pairs.numDims = 3;
+	fill(pairs.offsets, pairs.offsets + 3, 0.0);
+	fill(pairs.spacings, pairs.spacings + 3, 0.0);
+	pairs.readFailed = true;
+	
+    LOG_MESSAGE(LOG_DEBUG, "read", pathCatalog, "Opening landmark catalog");
+    
+	sqlite3 *db;
+	if (sqlite3_open_v2(pathCatalog.c_str(), &db, SQLITE_OPEN_READONLY, NULL)
+	    != SQLITE_OK)
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathCatalog, "Failed to open landmark catalog");
+		sqlite3_close(db);
+		return pairs;
+	}
+	
+	// Neighbourhood is given as centre and radius.
+	double centre[3] = {0, 0, 0};
+	double radius = 0;
+	if (!near.empty() && (sscanf(near.c_str(), "%lf,%lf,%lf,%lf", &centre[0],
+	                             &centre[1], &centre[2], &radius) != 4))
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathCatalog,
+		            "Unexpected -near value, expected x,y,z,r: " << near);
+		sqlite3_close(db);
+		return pairs;
+	}
+	
+	string sql = "SELECT point, fixed_x, fixed_y, fixed_z, moving_x, moving_y,"
+	             " moving_z, distinctiveness, manual, unsure, system_guess,"
+	             " img_dims, offset_x, offset_y, offset_z, spacing_x, spacing_y,"
+	             " spacing_z FROM catalog WHERE 1";
+	if (!query.empty())
+	{
+		sql += " AND (" + query + ")";
+	}
+	if (!near.empty())
+	{
+		sql += " AND id IN (SELECT id FROM landmarks_rtree"
+		       " WHERE min_x <= ?1 + ?4 AND max_x >= ?1 - ?4"
+		       " AND min_y <= ?2 + ?4 AND max_y >= ?2 - ?4"
+		       " AND min_z <= ?3 + ?4 AND max_z >= ?3 - ?4)"
+		       " AND (fixed_x - ?1) * (fixed_x - ?1) + (fixed_y - ?2) *"
+		       " (fixed_y - ?2) + (fixed_z - ?3) * (fixed_z - ?3) <= ?4 * ?4";
+	}
+	sql += " ORDER BY case_name, point";
+	
+	sqlite3_stmt *select;
+	if (sqlite3_prepare_v2(db, sql.c_str(), -1, &select, NULL) != SQLITE_OK)
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathCatalog,
+		            "Failed to query landmark catalog: " << sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return pairs;
+	}
+	
+	if (!near.empty())
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			sqlite3_bind_double(select, 1 + d, centre[d]);
+		}
+		sqlite3_bind_double(select, 4, radius);
+	}
+	
+	int stepResult;
+	bool hasMoving = false;
+	bool mixed = false;
+	while ((stepResult = sqlite3_step(select)) == SQLITE_ROW)
+	{
+		if (pairs.numPoints == 0)
+		{
+			const unsigned char *imgDims = sqlite3_column_text(select, 11);
+			pairs.imgDims = (imgDims != NULL) ? (const char *)imgDims : "";
+			for (int d = 0; d < 3; d++)
+			{
+				pairs.offsets[d] = sqlite3_column_double(select, 12 + d);
+				pairs.spacings[d] = sqlite3_column_double(select, 15 + d);
+			}
+		}
+		
+		// Cases without moving landmarks store them as NULL. A selection
+		// mixing such cases with others has no moving landmarks to write.
+		bool rowHasMoving = (sqlite3_column_type(select, 4) != SQLITE_NULL);
+		if (pairs.numPoints == 0)
+		{
+			hasMoving = rowHasMoving;
+		}
+		else if (rowHasMoving != hasMoving)
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", pathCatalog, "Query selects landmarks "
+			            "of cases both with and without moving landmarks");
+			mixed = true;
+			break;
+		}
+		
+		// Columns are x,y,z; landmarks are stored z,y,x.
+		for (int d = 2; d >= 0; d--)
+		{
+			pairs.fixed.push_back(sqlite3_column_double(select, 1 + d));
+			if (hasMoving)
+			{
+				pairs.moving.push_back(sqlite3_column_double(select, 4 + d));
+			}
+		}
+		
+		pairs.pointIds.push_back(sqlite3_column_int(select, 0));
+		pairs.distinctiveness.push_back(sqlite3_column_double(select, 7));
+		pairs.flags.push_back(
+		    (sqlite3_column_int(select, 8) ? FLAG_MANUAL : 0) |
+		    (sqlite3_column_int(select, 9) ? FLAG_UNSURE : 0) |
+		    (sqlite3_column_int(select, 10) ? FLAG_SYSTEM_GUESS : 0));
+		pairs.numPoints++;
+	}
+	
+	if (mixed)
+	{
+		// Already logged; the landmarks read so far are not used.
+	}
+	else if (stepResult != SQLITE_DONE)
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", pathCatalog,
+		            "Failed to query landmark catalog: " << sqlite3_errmsg(db));
+	}
+	else
+	{
+		LOG_MESSAGE(LOG_INFO, "read", pathCatalog,
+		            "Selected " << pairs.numPoints << " landmarks");
+		pairs.readFailed = false;
+	}
+	
+	sqlite3_finalize(select);
+	sqlite3_close(db);
+	
+	return pairs;
+	
+} // end readLandmarksCatalog
+
+#endif
+
+
+//**************************************************************
+// Function readFileBuffer is defined.                         *
+// The function reads a whole file into memory, followed by a  *
+// terminating zero so values can be parsed in place. Returns  *
+// false if the file could not be read.                        *
+//**************************************************************
+
+bool readFileBuffer(string path, vector<char> &buffer)
+{
+#ifdef LMK_USE_URING
+	// A file read ahead of its conversion is taken as it is.
+	if (takePrefetchedFile(path, buffer))
+	{
+		return true;
+	}
+#endif
+	
+	buffer.assign(1, '\0');
+	
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
+	
+	struct stat status;
+	if (fstat(fileno(file), &status) == 0)
+	{
+		buffer.reserve(status.st_size + 1);
+	}
+	buffer.clear();
+	
+	char block[65536];
+	size_t numRead;
+	while ((numRead = fread(block, 1, sizeof(block), file)) > 0)
+	{
+		buffer.insert(buffer.end(), block, block + numRead);
+	}
+	buffer.push_back('\0');
+	
+	bool success = !ferror(file);
+	fclose(file);
+	
+	return success;
+	
+} // end readFileBuffer
+
+
+//**************************************************************
+// Function indexLines is defined.                             *
+// The function records the position of every line end and     *
+// every separator ('=' or ',') in a buffer, comparing 64      *
+// (AVX-512), 32 (AVX2) or 16 (SSE2) bytes at a time. A final  *
+// line without a newline is given a line end at the end of    *
+// the buffer. Buffers are limited to 4 GB.                    *
+//**************************************************************
+
+void indexLines(const char *data, size_t length, char separator,
+                vector<uint32_t> &lineEnds, vector<uint32_t> &equals)
+{
+	lineEnds.reserve(length / 16);
+	equals.reserve(length / 16);
+	size_t i = 0;
+	
+#ifdef LMK_X86
+	if (isaLevel >= ISA_AVX512)
+	{
+		i = indexLinesAvx512(data, length, separator, lineEnds, equals);
+	}
+	else if (isaLevel >= ISA_AVX2)
+	{
+		i = indexLinesAvx2(data, length, separator, lineEnds, equals);
+	}
+	else if (isaLevel >= ISA_SSE2)
+	{
+		i = indexLinesSse2(data, length, separator, lineEnds, equals);
+	}
+#endif
+	
+	// Remaining bytes are checked one at a time.
+	for (; i < length; i++)
+	{
+		if (data[i] == '\n')
+		{
+			lineEnds.push_back(i);
+		}
+		else if (data[i] == separator)
+		{
+			equals.push_back(i);
+		}
+	}
+	
+	if ((length > 0) && (data[length - 1] != '\n'))
+	{
+		lineEnds.push_back(length);
+	}
+	
+} // end indexLines
+
+
+#ifdef LMK_X86
+//**************************************************************
+// Function indexLinesAvx512 is defined.                       *
+// The function indexes whole 64-byte blocks as indexLines     *
+// with AVX-512. Returns the number of bytes indexed.          *
+//**************************************************************
+
+LMK_TARGET("avx512f,avx512bw")
+size_t indexLinesAvx512(const char *data, size_t length, char separator,
+                        vector<uint32_t> &lineEnds, vector<uint32_t> &equals)
+{
+	size_t i = 0;
+	
+	const __m512i newline = _mm512_set1_epi8('\n');
+	const __m512i equal = _mm512_set1_epi8(separator);
+	
+	for (; (i + 64) <= length; i = i + 64)
+	{
+		__m512i block = _mm512_loadu_si512((const void *)(data + i));
+		uint64_t lineMask = _mm512_cmpeq_epi8_mask(block, newline);
+		uint64_t equalMask = _mm512_cmpeq_epi8_mask(block, equal);
+		
+		// Set bits are visited lowest first, giving positions in order.
+		for (; lineMask != 0; lineMask &= lineMask - 1)
+		{
+			lineEnds.push_back(i + __builtin_ctzll(lineMask));
+		}
+		for (; equalMask != 0; equalMask &= equalMask - 1)
+		{
+			equals.push_back(i + __builtin_ctzll(equalMask));
+		}
+	}
+	
+	return i;
+	
+} // end indexLinesAvx512
+
+
+//**************************************************************
+// Function indexLinesAvx2 is defined.                         *
+// The function indexes whole 32-byte blocks as indexLines     *
+// with AVX2. Returns the number of bytes indexed.             *
+//**************************************************************
+
+LMK_TARGET("avx2")
+size_t indexLinesAvx2(const char *data, size_t length, char separator,
+                      vector<uint32_t> &lineEnds, vector<uint32_t> &equals)
+{
+	size_t i = 0;
+	
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i equal = _mm256_set1_epi8(separator);
+	
+	for (; (i + 32) <= length; i = i + 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+		uint32_t lineMask =
+		    (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+		uint32_t equalMask =
+		    (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, equal));
+		
+		// Set bits are visited lowest first, giving positions in order.
+		for (; lineMask != 0; lineMask &= lineMask - 1)
+		{
+			lineEnds.push_back(i + __builtin_ctz(lineMask));
+		}
+		for (; equalMask != 0; equalMask &= equalMask - 1)
+		{
+			equals.push_back(i + __builtin_ctz(equalMask));
+		}
+	}
+	
+	return i;
+	
+} // end indexLinesAvx2
+
+
+//**************************************************************
+// Function indexLinesSse2 is defined.                         *
+// The function indexes whole 16-byte blocks as indexLines     *
+// with SSE2. Returns the number of bytes indexed.             *
+//**************************************************************
+
+LMK_TARGET("sse2")
+size_t indexLinesSse2(const char *data, size_t length, char separator,
+                      vector<uint32_t> &lineEnds, vector<uint32_t> &equals)
+{
+	size_t i = 0;
+	
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i equal = _mm_set1_epi8(separator);
+	
+	for (; (i + 16) <= length; i = i + 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+		uint32_t lineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+		uint32_t equalMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, equal));
+		
+		// Set bits are visited lowest first, giving positions in order.
+		for (; lineMask != 0; lineMask &= lineMask - 1)
+		{
+			lineEnds.push_back(i + __builtin_ctz(lineMask));
+		}
+		for (; equalMask != 0; equalMask &= equalMask - 1)
+		{
+			equals.push_back(i + __builtin_ctz(equalMask));
+		}
+	}
+	
+	return i;
+	
+} // end indexLinesSse2
+#endif
+
+
+//**************************************************************
+// Function classifyIxKey is defined.                          *
+// The function identifies the key of an iX point field, the   *
+// text after "Point_N->" and any dimension digit. Keys are    *
+// found by a perfect hash on their length and first letter    *
+// and confirmed with a single comparison.                     *
+//**************************************************************
+
+IxField classifyIxKey(const char *key, size_t length)
+{
+	struct IxKey
+	{
+		const char *name;
+		size_t length;
+		IxField field;
+	};
+	
+	// Slot of each key is (2 * length + first letter) % 16.
+	static const IxKey IX_KEYS[16] =
+	{
+		{"", 0, IX_COORDINATE},                  //  0
+		{NULL, 0, IX_UNKNOWN},
+		{"Distinctiveness", 15, IX_DISTINCTIVENESS},  //  2
+		{NULL, 0, IX_UNKNOWN},
+		{NULL, 0, IX_UNKNOWN},
+		{NULL, 0, IX_UNKNOWN},
+		{NULL, 0, IX_UNKNOWN},
+		{"_SystemGuess", 12, IX_SYSTEM_GUESS},   //  7
+		{NULL, 0, IX_UNKNOWN},
+		{"ManuallyChosen", 14, IX_MANUALLY_CHOSEN},   //  9
+		{"VeryUnsure", 10, IX_VERY_UNSURE},      // 10
+		{"SqDiffRegion", 12, IX_SQ_DIFF_REGION}, // 11
+		{NULL, 0, IX_UNKNOWN},
+		{NULL, 0, IX_UNKNOWN},
+		{NULL, 0, IX_UNKNOWN},
+		{"_Corresp", 8, IX_CORRESP}              // 15
+	};
+	
+	unsigned char firstLetter = (length > 0) ? key[0] : 0;
+	const IxKey &candidate = IX_KEYS[(2 * length + firstLetter) & 15];
+	
+	if ((candidate.name != NULL) && (candidate.length == length) &&
+	    (memcmp(candidate.name, key, length) == 0))
+	{
+		return candidate.field;
+	}
+	
+	return IX_UNKNOWN;
+	
+} // end classifyIxKey
+
+
+//**************************************************************
+// Function parseIxInteger is defined.                         *
+// The function parses a signed integer the way atoi does,     *
+// stopping at the first character which is not a digit.       *
+//**************************************************************
+
+int parseIxInteger(const char *text)
+{
+	while ((*text == ' ') || (*text == '\t'))
+	{
+		text++;
+	}
+	
+	bool negative = (*text == '-');
+	if ((*text == '-') || (*text == '+'))
+	{
+		text++;
+	}
+	
+	int value = 0;
+	while ((*text >= '0') && (*text <= '9'))
+	{
+		value = value * 10 + (*text - '0');
+		text++;
+	}
+	
+	return negative ? -value : value;
+	
+} // end parseIxInteger
+
+
+//**************************************************************
+// Function storeIxPoint is defined.                           *
+// The function appends the voxel coordinates and attributes   *
+// of a completely read point, unless it is a very unsure      *
+// manual point and only certain points are kept.              *
+//**************************************************************
+
+void storeIxPoint(const IxPoint &point, const string &keep_all,
+                  vector<double> &fixedCoordsVector,
+                  vector<double> &movingCoordsVector, LandmarkPairs &pairs)
+{
+	if (point.id < 0)
+	{
+		return;
+	}
+	
+	if ((point.fixedFound != 7) || (point.movingFound != 7))
+	{
+		LOG_MESSAGE(LOG_WARN, "read", "", "Error reading point pair file: point " <<
+		            point.id << " is missing coordinates");
+		return;
+	}
+	
+	//Checks if chosen pair is very uncertain
+	if (point.manual && point.unsure && !keep_all.compare("0"))
+	{
+		return;
+	}
+	
+	for (int j = 0; j < 3; j++)
+	{
+		fixedCoordsVector.push_back(point.fixed[j]);
+		movingCoordsVector.push_back(point.moving[j]);
+	}
+	
+	pairs.pointIds.push_back(point.id);
+	pairs.distinctiveness.push_back(point.distinctiveness);
+	pairs.flags.push_back((point.manual ? FLAG_MANUAL : 0) |
+	                      (point.unsure ? FLAG_UNSURE : 0) |
+	                      (point.systemGuess ? FLAG_SYSTEM_GUESS : 0));
+	
+} // end storeIxPoint
+
+
+//**************************************************************
+// Function publishLandmarks is defined.                       *
+// The function copies landmark pairs into a named POSIX       *
+// shared-memory segment. The update is guarded by a seqlock:  *
+// the sequence number is odd while the columns are written,   *
+// so readers retry rather than see a half-written set. The    *
+// segment is grown in place when the landmarks outgrow it.    *
+//**************************************************************
+
+// Identification of shared-memory landmark segments.
+const char SHM_MAGIC[8] = "LMKSHM1";
+const uint32_t SHM_VERSION = 2;
+
+// Longest wait for an update of a segment to finish. A publisher that
+// died mid-update leaves the sequence number odd for good.
+const int SHM_WAIT_MS = 5000;
+
+bool publishLandmarks(string segmentName, string caseName, const LandmarkPairs &pairs)
+{
+	const int NUM_DIMS = 3;
+	uint64_t numPoints = pairs.numPoints;
+	bool hasMoving = !pairs.moving.empty();
+	
+	// Columns are laid out after the header, each 8-byte aligned.
+	uint64_t headerSize = (sizeof(SharedLandmarksHeader) + 7) & ~(uint64_t)7;
+	uint64_t fixedOffset = headerSize;
+	uint64_t movingOffset = fixedOffset + numPoints * NUM_DIMS * sizeof(double);
+	uint64_t distinctivenessOffset = movingOffset +
+	                                 numPoints * NUM_DIMS * sizeof(double);
+	uint64_t pointIdOffset = distinctivenessOffset + numPoints * sizeof(double);
+	uint64_t flagsOffset = pointIdOffset + ((numPoints * sizeof(int32_t) + 7) &
+	                                        ~(uint64_t)7);
+	uint64_t requiredSize = flagsOffset + numPoints;
+	
+	int fd = shm_open(segmentName.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		return false;
+	}
+	
+	// Segment only ever grows, so existing readers' mappings stay valid.
+	struct stat status;
+	uint64_t segmentSize = 0;
+	if (fstat(fd, &status) == 0)
+	{
+		segmentSize = status.st_size;
+	}
+	if (segmentSize < requiredSize)
+	{
+		segmentSize = max(requiredSize, 2 * segmentSize);
+		if (ftruncate(fd, segmentSize) != 0)
+		{
+			close(fd);
+			return false;
+		}
+	}
+	
+	void *mapping = mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                     fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+	
+	char *segment = (char *)mapping;
+	SharedLandmarksHeader *header = (SharedLandmarksHeader *)segment;
+	
+	// A new segment is zero-filled; its header is set up once.
+	if (memcmp(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0)
+	{
+		header->version = SHM_VERSION;
+		header->headerSize = headerSize;
+		memcpy(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+	}
+	else if (header->version != SHM_VERSION)
+	{
+		LOG_MESSAGE(LOG_ERROR, "shm", segmentName,
+		            "Shared-memory segment has unsupported version " <<
+		            header->version);
+		munmap(mapping, segmentSize);
+		return false;
+	}
+	
+	// Sequence is made odd, which also excludes other publishers.
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+	                                            chrono::milliseconds(SHM_WAIT_MS);
+	uint64_t sequence = header->sequence.load(memory_order_relaxed);
+	while ((sequence & 1) ||
+	       !header->sequence.compare_exchange_weak(sequence, sequence + 1,
+	                                               memory_order_acquire))
+	{
+		if (chrono::steady_clock::now() > deadline)
+		{
+			LOG_MESSAGE(LOG_ERROR, "shm", segmentName,
+			            "Segment is still being updated by another publisher");
+			munmap(mapping, segmentSize);
+			return false;
+		}
+		this_thread::yield();
+		sequence = header->sequence.load(memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_release);
+	
+	header->segmentSize.store(segmentSize, memory_order_relaxed);
+	header->numPoints = numPoints;
+	header->numDims = pairs.numDims;
+	header->hasMoving = hasMoving;
+	copy(pairs.offsets, pairs.offsets + 3, header->offsets);
+	copy(pairs.spacings, pairs.spacings + 3, header->spacings);
+	snprintf(header->imgDims, sizeof(header->imgDims), "%s", pairs.imgDims.c_str());
+	snprintf(header->caseName, sizeof(header->caseName), "%s", caseName.c_str());
+	header->fixedOffset = fixedOffset;
+	header->movingOffset = movingOffset;
+	header->pointIdOffset = pointIdOffset;
+	header->distinctivenessOffset = distinctivenessOffset;
+	header->flagsOffset = flagsOffset;
+	
+	if (numPoints > 0)
+	{
+		memcpy(segment + fixedOffset, &pairs.fixed[0],
+		       numPoints * NUM_DIMS * sizeof(double));
+		if (hasMoving)
+		{
+			memcpy(segment + movingOffset, &pairs.moving[0],
+			       numPoints * NUM_DIMS * sizeof(double));
+		}
+		else
+		{
+			fill((double *)(segment + movingOffset),
+			     (double *)(segment + movingOffset) + numPoints * NUM_DIMS, NAN);
+		}
+		memcpy(segment + distinctivenessOffset, &pairs.distinctiveness[0],
+		       numPoints * sizeof(double));
+		for (uint64_t iPoint = 0; iPoint < numPoints; iPoint++)
+		{
+			((int32_t *)(segment + pointIdOffset))[iPoint] = pairs.pointIds[iPoint];
+		}
+		memcpy(segment + flagsOffset, &pairs.flags[0], numPoints);
+	}
+	
+	// Even sequence publishes the update.
+	header->sequence.store(sequence + 2, memory_order_release);
+	
+	munmap(mapping, segmentSize);
+	
+	LOG_MESSAGE(LOG_DEBUG, "shm", segmentName,
+	            "Published " << numPoints << " landmarks");
+	
+	return true;
+	
+} // end publishLandmarks
+
+
+//**************************************************************
+// Function readLandmarksShm is defined.                       *
+// The function reads landmark pairs published in a shared-    *
+// memory segment. The segment is mapped read-only and read    *
+// between two loads of the sequence number, retrying until    *
+// it was not updated during the read, for at most             *
+// SHM_WAIT_MS. Every column is checked to lie within the      *
+// mapping before it is copied, as a torn header may pair a    *
+// new number of points with old offsets.                      *
+//**************************************************************
+
+LandmarkPairs readLandmarksShm(string segmentName)
+{
+	LandmarkPairs pairs;
+	pairs.numPoints = 0;
+	pairs.numDims = 3;
+	fill(pairs.offsets, pairs.offsets + 3, 0.0);
+	fill(pairs.spacings, pairs.spacings + 3, 0.0);
+	pairs.readFailed = true;
+	
+    LOG_MESSAGE(LOG_DEBUG, "read", segmentName, "Opening shared-memory landmarks");
+    
+	int fd = shm_open(segmentName.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+	{
+		LOG_MESSAGE(LOG_ERROR, "read", segmentName,
+		            "Failed to open shared-memory landmarks");
+		return pairs;
+	}
+	
+	size_t mappedSize = 0;
+	void *mapping = MAP_FAILED;
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+	                                            chrono::milliseconds(SHM_WAIT_MS);
+	
+	while (true)
+	{
+		if (chrono::steady_clock::now() > deadline)
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", segmentName,
+			            "Timed out waiting for an update of the segment to finish");
+			pairs = LandmarkPairs();
+			pairs.numPoints = 0;
+			pairs.numDims = 3;
+			fill(pairs.offsets, pairs.offsets + 3, 0.0);
+			fill(pairs.spacings, pairs.spacings + 3, 0.0);
+			pairs.readFailed = true;
+			break;
+		}
+		
+		// Mapping follows the segment as it grows.
+		struct stat status;
+		if ((fstat(fd, &status) != 0) ||
+		    (status.st_size < (off_t)sizeof(SharedLandmarksHeader)))
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", segmentName,
+			            "Segment is too small to hold landmarks");
+			break;
+		}
+		if ((size_t)status.st_size != mappedSize)
+		{
+			if (mapping != MAP_FAILED)
+			{
+				munmap(mapping, mappedSize);
+			}
+			mappedSize = status.st_size;
+			mapping = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping == MAP_FAILED)
+			{
+				LOG_MESSAGE(LOG_ERROR, "read", segmentName,
+				            "Failed to map shared-memory landmarks");
+				break;
+			}
+		}
+		
+		const char *segment = (const char *)mapping;
+		const SharedLandmarksHeader *header = (const SharedLandmarksHeader *)segment;
+		
+		if ((memcmp(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0) ||
+		    (header->version != SHM_VERSION))
+		{
+			LOG_MESSAGE(LOG_ERROR, "read", segmentName,
+			            "Segment does not hold landmarks of a supported version");
+			break;
+		}
+		
+		uint64_t sequence = header->sequence.load(memory_order_acquire);
+		if (sequence & 1)
+		{
+			this_thread::yield();
+			continue;
+		}
+		if (header->segmentSize.load(memory_order_relaxed) > mappedSize)
+		{
+			continue;
+		}
+		
+		// Fields may be torn by an update, so each column is bounded on its
+		// own, in terms that cannot overflow.
+		uint64_t numPoints = header->numPoints;
+		if ((numPoints > mappedSize) ||
+		    !shmColumnFits(header->fixedOffset, numPoints * 3 * sizeof(double),
+		                   mappedSize) ||
+		    !shmColumnFits(header->movingOffset, numPoints * 3 * sizeof(double),
+		                   mappedSize) ||
+		    !shmColumnFits(header->distinctivenessOffset, numPoints * sizeof(double),
+		                   mappedSize) ||
+		    !shmColumnFits(header->pointIdOffset, numPoints * sizeof(int32_t),
+		                   mappedSize) ||
+		    !shmColumnFits(header->flagsOffset, numPoints, mappedSize))
+		{
+			this_thread::yield();
+			continue;
+		}
+		
+		const double *fixed = (const double *)(segment + header->fixedOffset);
+		const double *moving = (const double *)(segment + header->movingOffset);
+		const double *distinctiveness =
+		              (const double *)(segment + header->distinctivenessOffset);
+		const int32_t *pointIds = (const int32_t *)(segment + header->pointIdOffset);
+		const unsigned char *flags =
+		              (const unsigned char *)(segment + header->flagsOffset);
+		
+		pairs.numPoints = numPoints;
+		pairs.numDims = header->numDims;
+		copy(header->offsets, header->offsets + 3, pairs.offsets);
+		copy(header->spacings, header->spacings + 3, pairs.spacings);
+		pairs.imgDims.assign(header->imgDims,
+		                     strnlen(header->imgDims, sizeof(header->imgDims)));
+		pairs.fixed.assign(fixed, fixed + numPoints * 3);
+		if (header->hasMoving)
+		{
+			pairs.moving.assign(moving, moving + numPoints * 3);
+		}
+		else
+		{
+			pairs.moving.clear();
+		}
+		pairs.distinctiveness.assign(distinctiveness, distinctiveness + numPoints);
+		pairs.pointIds.assign(pointIds, pointIds + numPoints);
+		pairs.flags.assign(flags, flags + numPoints);
+		
+		// Copy is only kept if no update started while it was taken.
+		atomic_thread_fence(memory_order_acquire);
+		if (header->sequence.load(memory_order_relaxed) == sequence)
+		{
+			LOG_MESSAGE(LOG_DEBUG, "read", segmentName, "Read " << numPoints <<
+			            " landmarks of case " << header->caseName);
+			pairs.readFailed = false;
+			break;
+		}
+	}
+	
+	if (mapping != MAP_FAILED)
+	{
+		munmap(mapping, mappedSize);
+	}
+	close(fd);
+	
+	return pairs;
+	
+} // end readLandmarksShm
+
+
+//**************************************************************
+// Function shmColumnFits is defined.                          *
+// The function checks that a column of the given width at     *
+// the given offset lies within a mapping of mappedSize.       *
+//**************************************************************
+
+bool shmColumnFits(uint64_t offset, uint64_t width, uint64_t mappedSize)
+{
+	return (offset <= mappedSize) && (width <= mappedSize - offset);
+	
+} // end shmColumnFits